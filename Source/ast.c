@@ -0,0 +1,32 @@
+#include <string.h>
+#include "ast.h"
+#include "mem.h"
+
+// Adds a zeroed node of kind, returning its index. Earlier node pointers are invalid afterwards
+uint32_t ast_add(ast *T, unsigned kind, unsigned line)
+{
+    if (T->count == 0)
+        T->count = 1;
+    if (T->count >= T->capacity)
+    {
+        T->capacity = T->capacity ? T->capacity * 2 : 256;
+        T->nodes = mem_realloc(MEM_IR, T->nodes, T->capacity * sizeof(ast_node));
+    }
+    uint32_t id = T->count++;
+    ast_node *n = &T->nodes[id];
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->line = line;
+    return id;
+}
+
+void ast_reset(ast *T)
+{
+    T->count = 1;
+}
+
+void ast_free(ast *T)
+{
+    mem_free(T->nodes);
+    memset(T, 0, sizeof(*T));
+}
@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stddef.h>
+#ifndef AST_H
+#define AST_H
+
+/*
+Syntax tree of one function body, built by the parser when it is asked for
+IR. Nodes live in one array and refer to each other by index, 0 meaning no
+node, so the tree is a single allocation that is reused from one function
+to the next. The fields a node uses depend on its kind, as listed below.
+*/
+enum {
+    AST_NONE,
+    // Expressions. op is the token of the operator where there is one
+    AST_INT,         // Integer or character literal, value.i
+    AST_FLOAT,       // value.d
+    AST_STRING,      // String literal, name is its interned text with escapes decoded
+    AST_NAME,        // Variable, name
+    AST_UNARY,       // op a, for -, ! and ~
+    AST_PREFIX,      // ++a or --a
+    AST_POSTFIX,     // a++ or a--
+    AST_BINARY,      // a op b, && and || included
+    AST_ASSIGN,      // a op b, for = and the compound assignments
+    AST_CONDITIONAL, // a ? b : c
+    AST_CALL,        // Call of the function name, arguments from a linked by next
+    AST_INDEX,       // a[b]
+    AST_MEMBER,      // a.name
+    AST_CAST,        // (type) a
+    // Statements, linked by next within a block
+    AST_EXPRESSION,  // a;
+    AST_DECL,        // Variable or parameter name of type, initialized to a. value.i is the
+                     // array length, 0 for a scalar and -1 for an array parameter
+    AST_BLOCK,       // Statements from a
+    AST_IF,          // if (a) b else c
+    AST_WHILE,       // while (a) b
+    AST_DO,          // do b while (a);
+    AST_FOR,         // for (a; b; c) d
+    AST_BREAK,
+    AST_CONTINUE,
+    AST_RETURN,      // return a;
+    AST_SWITCH,      // switch (a) b
+    AST_CASE,        // case a: b, b being 0 for a label right before a closing brace. Labels
+                     // stacked before the same statement are one node, the rest from c linked by next
+    AST_DEFAULT      // default: b, likewise
+};
+
+// Base types of declarations and casts
+enum {
+    AST_TYPE_VOID,
+    AST_TYPE_CHAR,
+    AST_TYPE_INT,
+    AST_TYPE_FLOAT,
+    AST_TYPE_STRUCT
+};
+
+// A declared type: its base, and the interned name of the struct when it is one
+typedef struct {
+    unsigned base;
+    uint32_t name;
+} ast_type;
+
+typedef struct {
+    uint16_t kind;
+    uint16_t op;
+    unsigned line;
+    uint32_t a, b, c, d;
+    uint32_t next;
+    uint32_t name;
+    ast_type type; // Of AST_DECL and AST_CAST
+    union {
+        int64_t i;
+        double d;
+    } value;
+} ast_node;
+
+typedef struct {
+    ast_node *nodes; // nodes[0] is never used
+    uint32_t count;
+    uint32_t capacity;
+} ast;
+
+uint32_t ast_add(ast *T, unsigned kind, unsigned line);
+
+// Drops every node, keeping the storage for the next function
+void ast_reset(ast *T);
+
+void ast_free(ast *T);
+
+static inline ast_node *ast_at(const ast *T, uint32_t id)
+{
+    return &T->nodes[id];
+}
+
+#endif
@@ -0,0 +1,213 @@
+#!/bin/sh
+# Speed of the programs mycc -2 --asm compiles, run by "make bench-asm".
+#
+# Every kernel is compiled to assembly twice, with linear scan register
+# allocation (--asm) and with every value in the stack frame
+# (--asm=naive), then assembled and linked by cc and run. cc -O0 and -O2
+# builds of the same source are timed for reference, with int as long and
+# float as double so that they compute what mycc's code does. A kernel
+# fails if any of the builds prints something else than the others.
+# Times are the best of ASM_REPEAT runs (default 3).
+#
+# Usage: bench/asm.sh [kernel...]
+
+cd "$(dirname "$0")/.."
+MYCC="$(pwd)/mycc"
+CC=${CC:-cc}
+DATA=bench/data/asm
+REPEAT=${ASM_REPEAT:-3}
+SELECTED=" $* "
+mkdir -p "$DATA"
+rm -f "$DATA/failures"
+
+# Writes kernel $1 to $2
+generate() {
+    case $1 in
+    fib) cat <<'EOF'
+int fib(int n) {
+    if (n < 2)
+        return n;
+    return fib(n - 1) + fib(n - 2);
+}
+int main() {
+    printf("%ld\n", fib(32));
+    return 0;
+}
+EOF
+    ;;
+    sieve) cat <<'EOF'
+int composite[2000000];
+int sieve(int n) {
+    int i;
+    int j;
+    int count = 0;
+    for (i = 0; i < n; i = i + 1)
+        composite[i] = 0;
+    for (i = 2; i < n; i = i + 1) {
+        if (composite[i] == 0) {
+            count = count + 1;
+            for (j = i + i; j < n; j = j + i)
+                composite[j] = 1;
+        }
+    }
+    return count;
+}
+int main() {
+    int round;
+    int total = 0;
+    for (round = 0; round < 10; round = round + 1)
+        total = total + sieve(2000000);
+    printf("%ld\n", total);
+    return 0;
+}
+EOF
+    ;;
+    matmul) cat <<'EOF'
+float a[40000];
+float b[40000];
+float c[40000];
+int main() {
+    int n = 200;
+    int i;
+    int j;
+    int k;
+    for (i = 0; i < n * n; i = i + 1) {
+        a[i] = i % 7 - 3;
+        b[i] = i % 5 * 0.5;
+    }
+    for (i = 0; i < n; i = i + 1) {
+        for (j = 0; j < n; j = j + 1) {
+            float sum = 0.0;
+            for (k = 0; k < n; k = k + 1)
+                sum = sum + a[i * n + k] * b[k * n + j];
+            c[i * n + j] = sum;
+        }
+    }
+    float trace = 0.0;
+    for (i = 0; i < n; i = i + 1)
+        trace = trace + c[i * n + i];
+    printf("%f\n", trace);
+    return 0;
+}
+EOF
+    ;;
+    particles) cat <<'EOF'
+struct particle {
+    float x;
+    float v;
+    int bounces;
+};
+struct particle ps[1000];
+void step(struct particle p[], int n, float dt) {
+    int i;
+    for (i = 0; i < n; i = i + 1) {
+        p[i].x = p[i].x + p[i].v * dt;
+        if (p[i].x < 0.0 || p[i].x > 100.0) {
+            p[i].v = -p[i].v;
+            p[i].bounces = p[i].bounces + 1;
+        }
+    }
+}
+int main() {
+    int i;
+    int bounces = 0;
+    for (i = 0; i < 1000; i = i + 1) {
+        ps[i].x = i % 100;
+        ps[i].v = (i % 13 - 6) * 0.75;
+        ps[i].bounces = 0;
+    }
+    for (i = 0; i < 20000; i = i + 1)
+        step(ps, 1000, 0.125);
+    for (i = 0; i < 1000; i = i + 1)
+        bounces = bounces + ps[i].bounces;
+    printf("%ld\n", bounces);
+    return 0;
+}
+EOF
+    ;;
+    collatz) cat <<'EOF'
+int steps(int n) {
+    int count = 0;
+    while (n != 1) {
+        if (n % 2 == 0)
+            n = n / 2;
+        else
+            n = 3 * n + 1;
+        count = count + 1;
+    }
+    return count;
+}
+int main() {
+    int i;
+    int best = 0;
+    int longest = 0;
+    for (i = 1; i < 1000000; i = i + 1) {
+        int s = steps(i);
+        if (s > longest) {
+            longest = s;
+            best = i;
+        }
+    }
+    printf("%ld %ld\n", best, longest);
+    return 0;
+}
+EOF
+    ;;
+    esac >"$2"
+}
+
+# Best wall time in seconds of $REPEAT runs of $1
+best_time() {
+    i=0
+    best=""
+    while [ $i -lt "$REPEAT" ]; do
+        start=$(date +%s%N)
+        "$1" >/dev/null 2>&1
+        end=$(date +%s%N)
+        best=$(echo "$start $end $best" | awk '{ t = ($2 - $1) / 1e9; if ($3 == "" || t < $3) t = t; else t = $3; printf "%.6f\n", t }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+printf '#include <stdio.h>\n#define int long\n#define float double\n' >"$DATA/reference.h"
+printf "%-10s %10s %10s %8s %10s %10s  %s\n" kernel "naive (s)" "scan (s)" speedup "cc -O0" "cc -O2" result
+for name in fib sieve matmul particles collatz; do
+    if [ "$SELECTED" != "  " ] && ! echo "$SELECTED" | grep -q " $name "; then
+        continue
+    fi
+    file=$DATA/$name.c
+    generate $name "$file"
+    result=ok
+    for build in naive scan; do
+        option=--asm
+        [ $build = naive ] && option=--asm=naive
+        if ! "$MYCC" -2 $option "$file" >/dev/null 2>&1 || ! $CC -o "$DATA/$name.$build" "$DATA/$name.s"; then
+            result="FAIL: $build build"
+        fi
+    done
+    $CC -w -O0 -include "$DATA/reference.h" -o "$DATA/$name.O0" "$file" || result="FAIL: cc -O0 build"
+    $CC -w -O2 -include "$DATA/reference.h" -o "$DATA/$name.O2" "$file" || result="FAIL: cc -O2 build"
+    if [ "$result" = ok ]; then
+        expected=$("$DATA/$name.O0")
+        for build in naive scan O2; do
+            [ "$("$DATA/$name.$build")" = "$expected" ] || result="FAIL: $build printed something else than cc -O0"
+        done
+    fi
+    if [ "$result" != ok ]; then
+        printf "%-10s %10s %10s %8s %10s %10s  %s\n" "$name" - - - - - "$result"
+        echo "$name" >>"$DATA/failures"
+        continue
+    fi
+    naive=$(best_time "$DATA/$name.naive")
+    scan=$(best_time "$DATA/$name.scan")
+    O0=$(best_time "$DATA/$name.O0")
+    O2=$(best_time "$DATA/$name.O2")
+    speedup=$(echo "$naive $scan" | awk '{ printf "%.2fx", $1 / ($2 > 0 ? $2 : 1e-6) }')
+    printf "%-10s %10s %10s %8s %10s %10s  %s\n" "$name" "$naive" "$scan" "$speedup" "$O0" "$O2" "$result"
+done
+
+if [ -s "$DATA/failures" ]; then
+    echo "Failed: $(tr '\n' ' ' <"$DATA/failures")"
+    exit 1
+fi
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Throughput benchmark for mycc, run by "make bench".
+#
+# Usage: bench/bench.sh [size...]     (default sizes: 1K 64K 1M 16M)
+# Environment:
+#   BENCH_REPEAT  runs per measurement (default 5)
+#   BENCH_MODES   any of lex parse e2e (default all three)
+#   BENCH_OUT     JSON results file (default bench/results/<commit>.json)
+#   BENCH_SEED    generator seed (default 1)
+#
+# Modes:
+#   lex    mycc -1 --binary bench.c   lexing, with includes expanded, to a .tokbin
+#   parse  mycc -2 bench.tokbin       parsing already lexed tokens
+#   e2e    mycc -2 bench.c            lexing and parsing a source file
+#
+# The -1 --binary and -2 .tokbin modes keep every token in memory, so use
+# BENCH_MODES=e2e for inputs in the gigabyte range.
+
+set -e
+cd "$(dirname "$0")/.."
+MYCC="$(pwd)/mycc"
+GEN="$(pwd)/bench/gen"
+REPEAT=${BENCH_REPEAT:-5}
+MODES=${BENCH_MODES:-"lex parse e2e"}
+SEED=${BENCH_SEED:-1}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=${BENCH_OUT:-bench/results/$COMMIT.json}
+SIZES=${*:-"1K 64K 1M 16M"}
+
+mkdir -p "$(dirname "$OUT")"
+RAW=$(mktemp)
+trap 'rm -f "$RAW"' EXIT
+
+# Seconds taken by a command, with its output discarded
+elapsed() {
+    start=$(date +%s%N)
+    "$@" >/dev/null 2>&1
+    end=$(date +%s%N)
+    echo "$start $end" | awk '{ printf "%.6f\n", ($2 - $1) / 1e9 }'
+}
+
+for size in $SIZES; do
+    dir=bench/data/$size
+    mkdir -p "$dir"
+    "$GEN" "$size" "$dir" "$SEED"
+    cd "$dir"
+    # Bytes and tokens, headers included, as counted by the lexer itself
+    counts=$("$MYCC" -1 bench.c --stats=json 2>&1 >/dev/null | tail -n 1)
+    bytes=$(echo "$counts" | sed 's/.*"bytes_read": \([0-9]*\).*/\1/')
+    tokens=$(echo "$counts" | sed 's/.*"tokens": \([0-9]*\).*/\1/')
+    "$MYCC" -1 --binary bench.c >/dev/null
+    for mode in $MODES; do
+        case $mode in
+            lex) set -- "$MYCC" -1 --binary bench.c ;;
+            parse) set -- "$MYCC" -2 bench.tokbin ;;
+            e2e) set -- "$MYCC" -2 bench.c ;;
+            *) echo "Unknown mode $mode" >&2; exit 1 ;;
+        esac
+        "$@" >/dev/null 2>&1 # Warm up the page cache
+        runs=""
+        i=0
+        while [ $i -lt "$REPEAT" ]; do
+            runs="$runs $(elapsed "$@")"
+            i=$((i + 1))
+        done
+        echo "$size $mode $bytes $tokens$runs" >>"$RAW"
+    done
+    cd - >/dev/null
+done
+
+awk -v commit="$COMMIT" -v out="$OUT" '
+BEGIN {
+    printf "%-6s %-6s %10s %10s %10s %9s %12s\n", "size", "mode", "mean (s)", "stddev", "min (s)", "MB/s", "tokens/s"
+    printf "{\"commit\": \"%s\", \"results\": [", commit > out
+}
+{
+    n = NF - 4; sum = 0; min = $5
+    for (i = 5; i <= NF; i++) { sum += $i; if ($i < min) min = $i }
+    mean = sum / n; var = 0
+    for (i = 5; i <= NF; i++) var += ($i - mean) ^ 2
+    stddev = n > 1 ? sqrt(var / (n - 1)) : 0
+    mbps = mean > 0 ? $3 / mean / 1e6 : 0
+    tps = mean > 0 ? $4 / mean : 0
+    printf "%-6s %-6s %10.4f %10.4f %10.4f %9.1f %12.0f\n", $1, $2, mean, stddev, min, mbps, tps
+    runs = $5
+    for (i = 6; i <= NF; i++) runs = runs ", " $i
+    printf "%s\n  {\"size\": \"%s\", \"mode\": \"%s\", \"bytes\": %d, \"tokens\": %d, \"runs\": [%s], \"mean\": %.6f, \"stddev\": %.6f, \"min\": %.6f, \"mb_per_s\": %.2f, \"tokens_per_s\": %.0f}", (NR > 1 ? "," : ""), $1, $2, $3, $4, runs, mean, stddev, min, mbps, tps > out
+}
+END {
+    printf "\n]}\n" > out
+    print "Results written to " out
+}' "$RAW"
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+/*
+Deterministic generator of benchmark inputs in the C subset parser.c
+accepts. The same size and seed always give the same files.
+
+Usage: gen SIZE OUTDIR [SEED]
+SIZE takes K, M and G suffixes. Writes OUTDIR/bench.c of about SIZE bytes,
+plus the headers it includes, OUTDIR/bench_h0.h to bench_h7.h. Includes
+are opened relative to the working directory, so mycc must be run there.
+*/
+
+#define NHEADERS 8
+#define MAX_STRING 400   // Well below the 1023 byte limit of the lexer
+#define DEEP_NESTING 60  // Parentheses in a deeply nested expression
+
+typedef struct
+{
+    FILE *out;
+    uint64_t state;
+    long long written;
+    unsigned next_id;
+} generator;
+
+static uint64_t next_random(generator *G)
+{
+    // xorshift64*
+    G->state ^= G->state >> 12;
+    G->state ^= G->state << 25;
+    G->state ^= G->state >> 27;
+    return G->state * 2685821657736338717ULL;
+}
+
+static unsigned pick(generator *G, unsigned n)
+{
+    return (unsigned)((next_random(G) >> 32) % n);
+}
+
+static void emit(generator *G, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n = vfprintf(G->out, format, args);
+    va_end(args);
+    if (n > 0)
+        G->written += n;
+}
+
+static const char *types[] = {"int", "char", "float", "void"};
+static const char *binary_ops[] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "||", "&", "|"};
+static const char *assign_ops[] = {"=", "+=", "-=", "*=", "/="};
+static const char *words[] = {"the", "lexer", "reads", "one", "character", "at", "a", "time", "and", "builds",
+                              "tokens", "for", "parser", "which", "checks", "declarations", "statements", "expressions"};
+
+static void gen_term(generator *G)
+{
+    switch (pick(G, 8))
+    {
+    case 0:
+        emit(G, "%u", pick(G, 100000));
+        break;
+    case 1:
+        emit(G, "0x%X", pick(G, 65536));
+        break;
+    case 2:
+        emit(G, "%u.%ue%d", pick(G, 100), pick(G, 1000), (int)pick(G, 20) - 10);
+        break;
+    case 3:
+        emit(G, "'%c'", 'a' + pick(G, 26));
+        break;
+    case 4:
+        emit(G, "p.m%u", pick(G, 4));
+        break;
+    default:
+        emit(G, "v%u", pick(G, 8));
+        break;
+    }
+}
+
+static void gen_expr(generator *G, int depth)
+{
+    if (depth <= 0 || pick(G, 3) == 0)
+    {
+        gen_term(G);
+        return;
+    }
+    switch (pick(G, 7))
+    {
+    case 0:
+    case 1:
+        gen_expr(G, depth - 1);
+        emit(G, " %s ", binary_ops[pick(G, sizeof(binary_ops) / sizeof(binary_ops[0]))]);
+        gen_expr(G, depth - 1);
+        break;
+    case 2:
+        emit(G, "(");
+        gen_expr(G, depth - 1);
+        emit(G, ")");
+        break;
+    case 3:
+        emit(G, "%c", "-!~"[pick(G, 3)]);
+        gen_expr(G, depth - 1);
+        break;
+    case 4:
+        gen_expr(G, depth - 1);
+        emit(G, " ? ");
+        gen_expr(G, depth - 1);
+        emit(G, " : ");
+        gen_expr(G, depth - 1);
+        break;
+    case 5:
+        emit(G, "f%u(", pick(G, G->next_id + 1));
+        gen_expr(G, depth - 1);
+        emit(G, ", ");
+        gen_expr(G, depth - 1);
+        emit(G, ")");
+        break;
+    default:
+        emit(G, "g%u[", pick(G, G->next_id + 1));
+        gen_expr(G, depth - 1);
+        emit(G, "]");
+        break;
+    }
+}
+
+static void gen_deep_expr(generator *G)
+{
+    unsigned depth = DEEP_NESTING / 2 + pick(G, DEEP_NESTING);
+    for (unsigned i = 0; i < depth; i++)
+        emit(G, "(v%u + ", pick(G, 8));
+    gen_term(G);
+    for (unsigned i = 0; i < depth; i++)
+        emit(G, ")");
+}
+
+static void gen_string(generator *G)
+{
+    unsigned length = pick(G, 8) == 0 ? MAX_STRING / 2 + pick(G, MAX_STRING / 2) : pick(G, 40);
+    emit(G, "\"");
+    for (unsigned i = 0; i < length; i++)
+    {
+        unsigned r = pick(G, 40);
+        if (r == 0)
+            emit(G, "\\n");
+        else if (r == 1)
+            emit(G, "\\\"");
+        else if (r < 8)
+            emit(G, " ");
+        else
+            emit(G, "%c", 'a' + r % 26);
+    }
+    emit(G, "\"");
+}
+
+static void gen_comment(generator *G)
+{
+    unsigned lines = 2 + pick(G, 40);
+    int block = pick(G, 2);
+    if (block)
+        emit(G, "/*\n");
+    for (unsigned i = 0; i < lines; i++)
+    {
+        emit(G, block ? " *" : "//");
+        unsigned n = 4 + pick(G, 12);
+        for (unsigned j = 0; j < n; j++)
+            emit(G, " %s", words[pick(G, sizeof(words) / sizeof(words[0]))]);
+        emit(G, "\n");
+    }
+    if (block)
+        emit(G, " */\n");
+}
+
+static void gen_statement(generator *G, int depth, int indent)
+{
+    emit(G, "%*s", indent, "");
+    unsigned kind = depth <= 0 ? 0 : pick(G, 20);
+    switch (kind)
+    {
+    case 1:
+        emit(G, "if (");
+        gen_expr(G, 3);
+        emit(G, ")\n");
+        gen_statement(G, depth - 1, indent + 2);
+        if (pick(G, 2))
+        {
+            emit(G, "%*selse\n", indent, "");
+            gen_statement(G, depth - 1, indent + 2);
+        }
+        return;
+    case 2:
+        emit(G, "for (v0 = 0; v0 < %u; v0++)\n", pick(G, 100));
+        gen_statement(G, depth - 1, indent + 2);
+        return;
+    case 3:
+        emit(G, "while (");
+        gen_expr(G, 2);
+        emit(G, ")\n");
+        gen_statement(G, depth - 1, indent + 2);
+        return;
+    case 4:
+        emit(G, "do\n");
+        gen_statement(G, depth - 1, indent + 2);
+        emit(G, "%*swhile (", indent, "");
+        gen_expr(G, 2);
+        emit(G, ");\n");
+        return;
+    case 5:
+    case 6:
+    {
+        emit(G, "{\n");
+        unsigned n = 1 + pick(G, 4);
+        for (unsigned i = 0; i < n; i++)
+            gen_statement(G, depth - 1, indent + 2);
+        emit(G, "%*s}\n", indent, "");
+        return;
+    }
+    case 7:
+        emit(G, "s = ");
+        gen_string(G);
+        emit(G, ";\n");
+        return;
+    case 8:
+        emit(G, "v%u = ", pick(G, 8));
+        gen_deep_expr(G);
+        emit(G, ";\n");
+        return;
+    default:
+        emit(G, "v%u %s ", pick(G, 8), assign_ops[pick(G, sizeof(assign_ops) / sizeof(assign_ops[0]))]);
+        gen_expr(G, 5);
+        emit(G, ";\n");
+        return;
+    }
+}
+
+static void gen_struct(generator *G)
+{
+    emit(G, "struct s%u {", G->next_id++);
+    unsigned n = 1 + pick(G, 5);
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (pick(G, 3) == 0)
+            emit(G, " %s m%u[%u];", types[pick(G, 3)], i, 1 + pick(G, 64));
+        else
+            emit(G, " %s m%u;", types[pick(G, 3)], i);
+    }
+    emit(G, " };\n");
+}
+
+static void gen_global(generator *G)
+{
+    unsigned id = G->next_id++;
+    if (pick(G, 4) == 0)
+        emit(G, "const struct s%u k%u;\n", pick(G, id + 1), id);
+    else
+        emit(G, "%s g%u[%u], h%u = %u;\n", types[pick(G, 3)], id, 1 + pick(G, 256), id, pick(G, 1000));
+}
+
+static void gen_function(generator *G)
+{
+    unsigned id = G->next_id++;
+    emit(G, "%s f%u(int a, float b[], const struct s%u p)\n{\n", types[pick(G, 4)], id, pick(G, id + 1));
+    emit(G, "  int v0, v1, v2, v3;\n  float v4, v5;\n  char v6, v7;\n  char s[%u];\n", MAX_STRING + 1);
+    unsigned n = 2 + pick(G, 10);
+    for (unsigned i = 0; i < n; i++)
+        gen_statement(G, 4, 2);
+    emit(G, "  return ");
+    gen_expr(G, 3);
+    emit(G, ";\n}\n\n");
+}
+
+static void gen_header(const char *outdir, unsigned index, uint64_t seed)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_h%u.h", outdir, index);
+    generator G = {fopen(path, "w"), seed ^ (0x9E3779B97F4A7C15ULL * (index + 1)), 0, 0};
+    if (!G.out)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", path);
+        exit(1);
+    }
+    for (unsigned i = 0; i < 8; i++)
+        gen_struct(&G);
+    fclose(G.out);
+}
+
+static long long parse_size(const char *text)
+{
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end)
+    {
+    case 'G': case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        size *= 1024;
+    }
+    return size;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <size>[K|M|G] <output directory> [seed]\n", argv[0]);
+        return 1;
+    }
+    long long size = parse_size(argv[1]);
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    for (unsigned i = 0; i < NHEADERS; i++)
+        gen_header(argv[2], i, seed);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench.c", argv[2]);
+    generator G = {fopen(path, "w"), seed ? seed : 1, 0, 0};
+    if (!G.out)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", path);
+        return 1;
+    }
+    static char buffer[1 << 16];
+    setvbuf(G.out, buffer, _IOFBF, sizeof(buffer));
+    while (G.written < size)
+    {
+        unsigned r = pick(&G, 100);
+        if (r < 10)
+            gen_struct(&G);
+        else if (r < 25)
+            gen_global(&G);
+        else if (r < 30)
+            gen_comment(&G);
+        else if (r < 32)
+            emit(&G, "#include \"bench_h%u.h\"\n", pick(&G, NHEADERS));
+        else
+            gen_function(&G);
+    }
+    fclose(G.out);
+    return 0;
+}
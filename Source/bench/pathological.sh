@@ -0,0 +1,154 @@
+#!/bin/sh
+# Adversarial inputs for mycc, run by "make pathological".
+#
+# Every case is generated at a base size in bytes, then at 2x and 4x that.
+# A case fails if mycc crashes or exits with an unexpected status, if the
+# largest input takes longer than the time budget or more memory than the
+# memory budget, or if doubling the input more than doubles the time
+# (with PATHO_SLACK, default 1.5, allowed for noise; quadratic work shows up
+# as 4). The growth per doubling is taken over the whole 1x to 4x range, and
+# only when the 1x run takes at least 50 ms. Times are the best of
+# PATHO_REPEAT runs (default 3).
+#
+# Usage: bench/pathological.sh [case...]
+
+cd "$(dirname "$0")/.."
+MYCC="$(pwd)/mycc"
+DATA=bench/data/pathological
+REPEAT=${PATHO_REPEAT:-3}
+SLACK=${PATHO_SLACK:-1.5}
+SELECTED=" $* "
+mkdir -p "$DATA"
+rm -f "$DATA/failures"
+
+# name, base size, time budget for 4x (s), peak RSS budget (KB), expected exit status
+CASES="
+long_block_comment   8000000  2   8000  0
+long_line_comment    8000000  2   8000  0
+nested_parens        1000000  2   8000  0
+deep_unary           1000000  2   8000  0
+deep_blocks          1000000  2   8000  0
+too_deep_parens      1000000  1   8000  1
+repeated_includes     500000  4   8000  0
+include_cycle             10  1   8000  1
+long_strings         8000000  2   8000  0
+huge_string          8000000  2  80000  0
+long_identifiers     8000000  2   8000  0
+"
+
+# Writes case $1 of about $2 bytes to $3
+generate() {
+    awk -v kind="$1" -v size="$2" '
+    # s repeated n times, by doubling so that long runs stay linear
+    function repeat(s, n,    r) {
+        r = ""
+        for (; n > 0; n = int(n / 2)) { if (n % 2) r = r s; s = s s }
+        return r
+    }
+    BEGIN {
+        if (kind == "long_block_comment") {
+            line = repeat("a comment line that never ends ", 3)
+            print "/*"; for (n = 0; n < size; n += length(line) + 1) print line; print "*/"
+            print "int x;"
+        } else if (kind == "long_line_comment") {
+            printf "//"; chunk = repeat("x", 1000)
+            for (n = 0; n < size; n += 1000) printf "%s", chunk
+            print ""; print "int x;"
+        } else if (kind == "nested_parens") {
+            stmt = "  v = " repeat("(", 900) "1" repeat(")", 900) ";"
+            print "int f(int v) {"; for (n = 0; n < size; n += length(stmt) + 1) print stmt; print "}"
+        } else if (kind == "deep_unary") {
+            stmt = "  v = " repeat("- ", 900) "1;"
+            print "int f(int v) {"; for (n = 0; n < size; n += length(stmt) + 1) print stmt; print "}"
+        } else if (kind == "deep_blocks") {
+            stmt = "  " repeat("{ ", 900) repeat("} ", 900)
+            print "int f(int v) {"; for (n = 0; n < size; n += length(stmt) + 1) print stmt; print "}"
+        } else if (kind == "too_deep_parens") {
+            print "int f(int v) {"; print "  v = " repeat("(", size) "1" repeat(")", size) ";"; print "}"
+        } else if (kind == "repeated_includes") {
+            print "int small;" > "small.h"
+            line = "#include \"small.h\""
+            for (n = 0; n < size; n += length(line) + 1) print line
+        } else if (kind == "include_cycle") {
+            print "#include \"cycle.h\"" > "cycle.h"
+            print "#include \"cycle.h\""
+        } else if (kind == "long_strings") {
+            # Each ends in an escape, which the -1 output keeps as written
+            stmt = "  s = \"" repeat("a", 1019) "\\n\";"
+            print "int f(char s[]) {"; for (n = 0; n < size; n += length(stmt) + 1) print stmt; print "}"
+        } else if (kind == "huge_string") {
+            print "int f(char s[]) {"; print "  s = \"" repeat("\\n", size / 2) "\";"; print "}"
+        } else if (kind == "long_identifiers") {
+            id = repeat("abcdefgh", 128)
+            print "int f(int v) {"
+            for (n = 0; n < size; n += 2 * length(id) + 6) print "  " id " = " id ";"
+            print "}"
+        }
+    }' >"$3"
+}
+
+# Best wall time in seconds of $REPEAT runs of mycc -2 on $1
+best_time() {
+    i=0
+    best=""
+    while [ $i -lt "$REPEAT" ]; do
+        start=$(date +%s%N)
+        "$MYCC" -2 "$1" >/dev/null 2>&1
+        end=$(date +%s%N)
+        best=$(echo "$start $end $best" | awk '{ t = ($2 - $1) / 1e9; if ($3 == "" || t < $3) t = t; else t = $3; printf "%.6f\n", t }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+printf "%-20s %8s %8s %8s %8s %9s  %s\n" case "1x (s)" "2x (s)" "4x (s)" ratio "RSS (KB)" result
+echo "$CASES" | while read -r name base budget mem expected; do
+    [ -n "$name" ] || continue
+    if [ "$SELECTED" != "  " ] && ! echo "$SELECTED" | grep -q " $name "; then
+        continue
+    fi
+    cd "$DATA"
+    times=""
+    result=ok
+    for scale in 1 2 4; do
+        file=${name}_$scale.c
+        generate "$name" $((base * scale)) "$file"
+        stats=$("$MYCC" -2 "$file" --stats=json 2>&1 >/dev/null | tail -n 1)
+        "$MYCC" -2 "$file" >/dev/null 2>&1
+        status=$?
+        if [ $status -gt 128 ]; then
+            result="FAIL: crashed with signal $((status - 128)) at ${scale}x"
+            break
+        fi
+        if [ $status -ne "$expected" ]; then
+            result="FAIL: exit status $status, expected $expected at ${scale}x"
+            break
+        fi
+        times="$times $(best_time "$file")"
+        rss=$(echo "$stats" | sed -n 's/.*"peak_rss_kb": \([0-9]*\).*/\1/p')
+        rss=${rss:-0}
+    done
+    cd - >/dev/null
+    if [ "$result" = ok ]; then
+        line=$(echo "$times $budget $rss $mem $SLACK" | awk '{
+            ratio = $1 >= 0.05 ? sqrt($3 / $1) : 0
+            if ($3 > $4) result = "FAIL: over the time budget of " $4 " s"
+            else if ($5 > $6) result = "FAIL: over the memory budget of " $6 " KB"
+            else if (ratio > 2 * $7) result = "FAIL: time grows faster than the input"
+            else result = "ok"
+            printf "%8.3f %8.3f %8.3f %8s %9d  %s\n", $1, $2, $3, ratio ? sprintf("%.2f", ratio) : "n/a", $5, result
+        }')
+        printf "%-20s %s\n" "$name" "$line"
+        case $line in *FAIL*) result=FAIL ;; esac
+    else
+        printf "%-20s %8s %8s %8s %8s %9s  %s\n" "$name" - - - - - "$result"
+    fi
+    case $result in FAIL*) echo fail >>"$DATA/failures" ;; esac
+done
+
+if [ -s "$DATA/failures" ]; then
+    rm -f "$DATA/failures"
+    echo "Some pathological cases failed"
+    exit 1
+fi
+echo "All pathological cases passed"
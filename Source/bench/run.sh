@@ -0,0 +1,210 @@
+#!/bin/sh
+# Interpreter throughput of mycc -run and -jit, run by "make bench-run".
+#
+# Every kernel is run by the register bytecode VM (-run), by the syntax
+# tree walker (-run --ast), which is the baseline the VM is measured
+# against, and as machine code compiled in memory (-jit), which is measured
+# against the VM; all times include parsing and compiling. A cc -O0 build of
+# the same source, with int as long and float as double so that it computes
+# what mycc does, gives the expected output and a native time for
+# reference. A kernel fails if any of them prints something else; the
+# compile report -jit prints to stderr is left out.
+# The kernels are those of bench/asm.sh, made smaller to suit interpreters.
+# Times are the best of RUN_REPEAT runs (default 3).
+#
+# Usage: bench/run.sh [kernel...]
+
+cd "$(dirname "$0")/.."
+MYCC="$(pwd)/mycc"
+CC=${CC:-cc}
+DATA=bench/data/run
+REPEAT=${RUN_REPEAT:-3}
+SELECTED=" $* "
+mkdir -p "$DATA"
+rm -f "$DATA/failures"
+
+# Writes kernel $1 to $2
+generate() {
+    case $1 in
+    fib) cat <<'EOF'
+int fib(int n) {
+    if (n < 2)
+        return n;
+    return fib(n - 1) + fib(n - 2);
+}
+int main() {
+    printf("%ld\n", fib(27));
+    return 0;
+}
+EOF
+    ;;
+    sieve) cat <<'EOF'
+int composite[200000];
+int sieve(int n) {
+    int i;
+    int j;
+    int count = 0;
+    for (i = 0; i < n; i = i + 1)
+        composite[i] = 0;
+    for (i = 2; i < n; i = i + 1) {
+        if (composite[i] == 0) {
+            count = count + 1;
+            for (j = i + i; j < n; j = j + i)
+                composite[j] = 1;
+        }
+    }
+    return count;
+}
+int main() {
+    int round;
+    int total = 0;
+    for (round = 0; round < 5; round = round + 1)
+        total = total + sieve(200000);
+    printf("%ld\n", total);
+    return 0;
+}
+EOF
+    ;;
+    matmul) cat <<'EOF'
+float a[6400];
+float b[6400];
+float c[6400];
+int main() {
+    int n = 80;
+    int i;
+    int j;
+    int k;
+    for (i = 0; i < n * n; i = i + 1) {
+        a[i] = i % 7 - 3;
+        b[i] = i % 5 * 0.5;
+    }
+    for (i = 0; i < n; i = i + 1) {
+        for (j = 0; j < n; j = j + 1) {
+            float sum = 0.0;
+            for (k = 0; k < n; k = k + 1)
+                sum = sum + a[i * n + k] * b[k * n + j];
+            c[i * n + j] = sum;
+        }
+    }
+    float trace = 0.0;
+    for (i = 0; i < n; i = i + 1)
+        trace = trace + c[i * n + i];
+    printf("%f\n", trace);
+    return 0;
+}
+EOF
+    ;;
+    particles) cat <<'EOF'
+struct particle {
+    float x;
+    float v;
+    int bounces;
+};
+struct particle ps[1000];
+void step(struct particle p[], int n, float dt) {
+    int i;
+    for (i = 0; i < n; i = i + 1) {
+        p[i].x = p[i].x + p[i].v * dt;
+        if (p[i].x < 0.0 || p[i].x > 100.0) {
+            p[i].v = -p[i].v;
+            p[i].bounces = p[i].bounces + 1;
+        }
+    }
+}
+int main() {
+    int i;
+    int bounces = 0;
+    for (i = 0; i < 1000; i = i + 1) {
+        ps[i].x = i % 100;
+        ps[i].v = (i % 13 - 6) * 0.75;
+        ps[i].bounces = 0;
+    }
+    for (i = 0; i < 1000; i = i + 1)
+        step(ps, 1000, 0.125);
+    for (i = 0; i < 1000; i = i + 1)
+        bounces = bounces + ps[i].bounces;
+    printf("%ld\n", bounces);
+    return 0;
+}
+EOF
+    ;;
+    collatz) cat <<'EOF'
+int steps(int n) {
+    int count = 0;
+    while (n != 1) {
+        if (n % 2 == 0)
+            n = n / 2;
+        else
+            n = 3 * n + 1;
+        count = count + 1;
+    }
+    return count;
+}
+int main() {
+    int i;
+    int best = 0;
+    int longest = 0;
+    for (i = 1; i < 100000; i = i + 1) {
+        int s = steps(i);
+        if (s > longest) {
+            longest = s;
+            best = i;
+        }
+    }
+    printf("%ld %ld\n", best, longest);
+    return 0;
+}
+EOF
+    ;;
+    esac >"$2"
+}
+
+# Best wall time in seconds of $REPEAT runs of the command "$@"
+best_time() {
+    i=0
+    best=""
+    while [ $i -lt "$REPEAT" ]; do
+        start=$(date +%s%N)
+        "$@" >/dev/null 2>&1
+        end=$(date +%s%N)
+        best=$(echo "$start $end $best" | awk '{ t = ($2 - $1) / 1e9; if ($3 == "" || t < $3) t = t; else t = $3; printf "%.6f\n", t }')
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+printf '#include <stdio.h>\n#define int long\n#define float double\n' >"$DATA/reference.h"
+printf "%-10s %10s %10s %8s %10s %8s %10s  %s\n" kernel "ast (s)" "vm (s)" speedup "jit (s)" speedup "cc -O0" result
+for name in fib sieve matmul particles collatz; do
+    if [ "$SELECTED" != "  " ] && ! echo "$SELECTED" | grep -q " $name "; then
+        continue
+    fi
+    file=$DATA/$name.c
+    generate $name "$file"
+    result=ok
+    if $CC -w -O0 -include "$DATA/reference.h" -o "$DATA/$name.O0" "$file"; then
+        expected=$("$DATA/$name.O0")
+        [ "$("$MYCC" -run --ast "$file" 2>&1)" = "$expected" ] || result="FAIL: -run --ast printed something else than cc -O0"
+        [ "$("$MYCC" -run "$file" 2>&1)" = "$expected" ] || result="FAIL: -run printed something else than cc -O0"
+        [ "$("$MYCC" -jit "$file" 2>/dev/null)" = "$expected" ] || result="FAIL: -jit printed something else than cc -O0"
+    else
+        result="FAIL: cc -O0 build"
+    fi
+    if [ "$result" != ok ]; then
+        printf "%-10s %10s %10s %8s %10s %8s %10s  %s\n" "$name" - - - - - - "$result"
+        echo "$name" >>"$DATA/failures"
+        continue
+    fi
+    ast=$(best_time "$MYCC" -run --ast "$file")
+    vm=$(best_time "$MYCC" -run "$file")
+    jit=$(best_time "$MYCC" -jit "$file")
+    O0=$(best_time "$DATA/$name.O0")
+    speedup=$(echo "$ast $vm" | awk '{ printf "%.2fx", $1 / ($2 > 0 ? $2 : 1e-6) }')
+    jit_speedup=$(echo "$vm $jit" | awk '{ printf "%.2fx", $1 / ($2 > 0 ? $2 : 1e-6) }')
+    printf "%-10s %10s %10s %8s %10s %8s %10s  %s\n" "$name" "$ast" "$vm" "$speedup" "$jit" "$jit_speedup" "$O0" "$result"
+done
+
+if [ -s "$DATA/failures" ]; then
+    echo "Failed: $(tr '\n' ' ' <"$DATA/failures")"
+    exit 1
+fi
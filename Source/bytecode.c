@@ -0,0 +1,1308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bytecode.h"
+#include "intern.h"
+#include "mem.h"
+
+enum {
+    BC_NOP, // Removed
+    BC_LABEL,
+    BC_LCONST,
+    BC_DCONST,
+    BC_LLOAD,
+    BC_DLOAD,
+    BC_LSTORE,
+    BC_DSTORE,
+    BC_LINC,     // Adds value.i to a local, as iinc does
+    BC_LADD,
+    BC_LSUB,
+    BC_LMUL,
+    BC_LDIV,
+    BC_LREM,
+    BC_LAND,
+    BC_LOR,
+    BC_LXOR,
+    BC_LNEG,
+    BC_DADD,
+    BC_DSUB,
+    BC_DMUL,
+    BC_DDIV,
+    BC_DNEG,
+    BC_L2D,
+    BC_D2L,
+    BC_LCMP,
+    BC_DCMPL,    // -1 for unordered
+    BC_DCMPG,    // 1 for unordered
+    BC_IFEQ,     // The conditions come in pairs of a condition and its inverse
+    BC_IFNE,
+    BC_IFLT,
+    BC_IFGE,
+    BC_IFGT,
+    BC_IFLE,
+    BC_GOTO,
+    BC_TABLESWITCH, // On a long, where the JVM's takes an int
+    BC_LALOAD,   // Loads from an address
+    BC_DALOAD,
+    BC_LASTORE,  // Stores to an address, below the value
+    BC_DASTORE,
+    BC_GETSTATIC,
+    BC_PUTSTATIC,
+    BC_STATICADDR, // Address of a global
+    BC_FRAMEADDR,  // Address of value.i bytes into the frame
+    BC_LDC,        // Address of a string literal
+    BC_INVOKE,
+    BC_LRETURN,
+    BC_DRETURN,
+    BC_RETURN,
+    BC_POP,
+    BC_DUP,
+    BC_SWAP,
+    BC_OP_COUNT
+};
+
+// Names and stack effects. Calls pop their arguments and push their result
+static const struct {
+    const char *name;
+    int8_t pops, pushes;
+} infos[BC_OP_COUNT] = {
+    [BC_NOP] = {"nop", 0, 0}, [BC_LABEL] = {"", 0, 0},
+    [BC_LCONST] = {"ldc2_w", 0, 1}, [BC_DCONST] = {"ldc2_w", 0, 1},
+    [BC_LLOAD] = {"lload", 0, 1}, [BC_DLOAD] = {"dload", 0, 1},
+    [BC_LSTORE] = {"lstore", 1, 0}, [BC_DSTORE] = {"dstore", 1, 0}, [BC_LINC] = {"linc", 0, 0},
+    [BC_LADD] = {"ladd", 2, 1}, [BC_LSUB] = {"lsub", 2, 1}, [BC_LMUL] = {"lmul", 2, 1},
+    [BC_LDIV] = {"ldiv", 2, 1}, [BC_LREM] = {"lrem", 2, 1}, [BC_LAND] = {"land", 2, 1},
+    [BC_LOR] = {"lor", 2, 1}, [BC_LXOR] = {"lxor", 2, 1}, [BC_LNEG] = {"lneg", 1, 1},
+    [BC_DADD] = {"dadd", 2, 1}, [BC_DSUB] = {"dsub", 2, 1}, [BC_DMUL] = {"dmul", 2, 1},
+    [BC_DDIV] = {"ddiv", 2, 1}, [BC_DNEG] = {"dneg", 1, 1},
+    [BC_L2D] = {"l2d", 1, 1}, [BC_D2L] = {"d2l", 1, 1},
+    [BC_LCMP] = {"lcmp", 2, 1}, [BC_DCMPL] = {"dcmpl", 2, 1}, [BC_DCMPG] = {"dcmpg", 2, 1},
+    [BC_IFEQ] = {"ifeq", 1, 0}, [BC_IFNE] = {"ifne", 1, 0}, [BC_IFLT] = {"iflt", 1, 0},
+    [BC_IFGE] = {"ifge", 1, 0}, [BC_IFGT] = {"ifgt", 1, 0}, [BC_IFLE] = {"ifle", 1, 0},
+    [BC_GOTO] = {"goto", 0, 0}, [BC_TABLESWITCH] = {"tableswitch", 1, 0},
+    [BC_LALOAD] = {"laload", 1, 1}, [BC_DALOAD] = {"daload", 1, 1},
+    [BC_LASTORE] = {"lastore", 2, 0}, [BC_DASTORE] = {"dastore", 2, 0},
+    [BC_GETSTATIC] = {"getstatic", 0, 1}, [BC_PUTSTATIC] = {"putstatic", 1, 0},
+    [BC_STATICADDR] = {"staticaddr", 0, 1}, [BC_FRAMEADDR] = {"frameaddr", 0, 1}, [BC_LDC] = {"ldc", 0, 1},
+    [BC_INVOKE] = {"invokestatic", 0, 0},
+    [BC_LRETURN] = {"lreturn", 1, 0}, [BC_DRETURN] = {"dreturn", 1, 0}, [BC_RETURN] = {"return", 0, 0},
+    [BC_POP] = {"pop", 1, 0}, [BC_DUP] = {"dup", 1, 2}, [BC_SWAP] = {"swap", 2, 2},
+};
+
+#define BC_INVERSE(op) (BC_IFEQ + (((op) - BC_IFEQ) ^ 1))
+
+typedef struct {
+    uint8_t op;
+    uint8_t type; // Of a static
+    uint16_t argc; // Of a call, which pushes a result when results is 1
+    uint8_t results;
+    uint32_t name; // Of a static, a string, or a called method with its descriptor
+    uint32_t label; // Defined by a label, or target of a branch, or the default of a tableswitch
+    uint32_t local;
+    uint32_t table; // Labels of a tableswitch, count of them from the method's table on
+    uint32_t count;
+    union {
+        int64_t i;
+        double d;
+    } value;
+} bc_inst;
+
+// How a value reaches its users
+enum {
+    MODE_NONE,  // Nobody uses it
+    MODE_STACK, // Left on the operand stack for its only user
+    MODE_LOCAL, // Stored to a local, and loaded by each user
+    MODE_REMAT  // Pushed again by each user: constants and addresses
+};
+
+typedef struct {
+    ir_module *M;
+    ir_function *F;
+    uint8_t *mode;
+    uint32_t *uses;
+    uint32_t *user; // Of a value with a single use
+    uint32_t *slot; // Local of each value
+    uint32_t nslots;
+    int64_t *offset; // In the frame of each slot instruction
+    int64_t frame;
+    uint32_t *stack; // Values on the stack while deciding modes
+    uint32_t *phis; // Written by the edge being looked at
+    uint32_t *sources; // Of those phis
+    uint32_t nstack;
+    bc_inst *code;
+    uint32_t ncode;
+    uint32_t code_capacity;
+    uint32_t nlabels; // Block b has label b, and the rest come after
+    uint32_t *table; // Of the tableswitches
+    uint32_t ntable;
+    uint32_t table_capacity;
+    int cond; // Branch for the last comparison left to its branch
+} method;
+
+static void method_error(const method *m, const char *message)
+{
+    fprintf(stderr, "Bytecode error in function %s: %s\n", intern_text(m->F->name), message);
+    exit(1);
+}
+
+static bc_inst *emit(method *m, int op)
+{
+    if (m->ncode == m->code_capacity)
+    {
+        m->code_capacity = m->code_capacity ? m->code_capacity * 2 : 256;
+        m->code = mem_realloc(MEM_IR, m->code, m->code_capacity * sizeof(bc_inst));
+    }
+    bc_inst *c = &m->code[m->ncode++];
+    memset(c, 0, sizeof(*c));
+    c->op = op;
+    return c;
+}
+
+static void emit_label(method *m, uint32_t label)
+{
+    emit(m, BC_LABEL)->label = label;
+}
+
+static void emit_jump(method *m, int op, uint32_t label)
+{
+    emit(m, op)->label = label;
+}
+
+static bool is_compare(unsigned op)
+{
+    return op >= IR_EQ && op <= IR_GE;
+}
+
+static bool has_phis(const ir_function *F, uint32_t block)
+{
+    uint32_t first = F->blocks[block].first;
+    return first && F->insts[first].op == IR_PHI;
+}
+
+// A global scalar at the address value, which getstatic and putstatic reach by name
+static const ir_global *static_field(const method *m, uint32_t value)
+{
+    const ir_inst *A = &m->F->insts[value];
+    if (A->op != IR_GLOBAL)
+        return NULL;
+    const ir_global *G = ir_find_global(m->M, A->name);
+    return G && G->type != IR_VOID ? G : NULL;
+}
+
+// The phis of the successor by edge k of block that the edge writes, with the value each gets
+static uint32_t edge_phis(const method *m, uint32_t block, uint32_t k)
+{
+    const ir_function *F = m->F;
+    uint32_t s = ir_list_at(F, F->blocks[block].succs)[k];
+    uint32_t operand = ir_edge_operand(F, block, k);
+    uint32_t n = 0;
+    for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+    {
+        uint32_t source = F->pool[F->insts[i].a + operand];
+        if (m->mode[i] == MODE_LOCAL && source != i)
+        {
+            m->phis[n] = i;
+            m->sources[n++] = source;
+        }
+    }
+    return n;
+}
+
+// The operands of I that go on the stack, in order. A jump takes the values of the phis it writes
+static uint32_t operands(const method *m, const ir_inst *I, const uint32_t **ops, uint32_t pair[2])
+{
+    pair[0] = I->a;
+    pair[1] = I->b;
+    *ops = pair;
+    switch (I->op)
+    {
+    case IR_PHI:
+        return 0;
+    case IR_JUMP:
+        *ops = m->sources;
+        return edge_phis(m, I->block, 0);
+    case IR_CALL:
+        *ops = m->F->pool + I->a;
+        return I->b;
+    case IR_LOAD:
+        return static_field(m, I->a) ? 0 : 1;
+    case IR_STORE:
+        if (!static_field(m, I->a))
+            return 2;
+        *ops = pair + 1;
+        return 1;
+    default:
+        return ir_operand_count(I);
+    }
+}
+
+// Modes
+
+static void demote(method *m, uint32_t value)
+{
+    m->mode[value] = MODE_LOCAL;
+    for (uint32_t k = 0; k < m->nstack; k++)
+    {
+        if (m->stack[k] != value)
+            continue;
+        memmove(m->stack + k, m->stack + k + 1, (m->nstack - k - 1) * sizeof(uint32_t));
+        m->nstack--;
+        return;
+    }
+}
+
+/*
+A value with its only use later in its block starts out on the stack.
+Walking the block with the stack as it would be, a user finds the values
+it takes from the stack on top in operand order, or for two operands, the
+second alone on top with the first pushed after it and swapped. Whatever a
+user cannot take that way goes to a local instead. Values are computed in
+their place either way, so nothing moves past a store or a call.
+*/
+static void stackify(method *m, uint32_t block)
+{
+    ir_function *F = m->F;
+    m->nstack = 0;
+    for (uint32_t i = F->blocks[block].first; i; i = F->insts[i].next)
+    {
+        const uint32_t *ops, pair[2];
+        uint32_t k = operands(m, &F->insts[i], &ops, (uint32_t *)pair);
+        uint32_t n = m->nstack;
+        if (k == 2 && F->insts[i].op != IR_JUMP)
+        {
+            bool s0 = m->mode[ops[0]] == MODE_STACK, s1 = m->mode[ops[1]] == MODE_STACK;
+            uint32_t top = n ? m->stack[n - 1] : 0, below = n > 1 ? m->stack[n - 2] : 0;
+            if (s0 && s1 && top == ops[1] && below == ops[0])
+                m->nstack -= 2;
+            else if (s1 && top == ops[1])
+            {
+                m->nstack--;
+                if (s0)
+                    demote(m, ops[0]);
+            }
+            else if (s0 && top == ops[0])
+            {
+                m->nstack--;
+                if (s1)
+                    demote(m, ops[1]);
+            }
+            else
+            {
+                if (s0)
+                    demote(m, ops[0]);
+                if (s1)
+                    demote(m, ops[1]);
+            }
+        }
+        else
+        {
+            uint32_t taken = 0;
+            for (uint32_t c = k < n ? k : n; c > 0 && !taken; c--)
+            {
+                bool on_top = true;
+                for (uint32_t j = 0; j < c && on_top; j++)
+                    on_top = m->mode[ops[j]] == MODE_STACK && m->stack[n - c + j] == ops[j];
+                if (on_top)
+                    taken = c;
+            }
+            m->nstack -= taken;
+            for (uint32_t j = taken; j < k; j++)
+            {
+                if (m->mode[ops[j]] == MODE_STACK)
+                    demote(m, ops[j]);
+            }
+        }
+        if (m->mode[i] == MODE_STACK)
+            m->stack[m->nstack++] = i;
+    }
+}
+
+/*
+Whether the only use of value is later in block, or is the phi of the block
+it jumps to that takes it, so that it can wait on the stack until then.
+*/
+static bool stays_in_block(const method *m, uint32_t block, uint32_t value)
+{
+    const ir_function *F = m->F;
+    const ir_inst *U = &F->insts[m->user[value]];
+    if (U->op != IR_PHI)
+        return U->block == block;
+    const ir_inst *T = &F->insts[F->blocks[block].last];
+    return T->op == IR_JUMP && m->uses[m->user[value]] &&
+           ir_list_at(F, F->blocks[block].succs)[0] == U->block &&
+           F->pool[U->a + ir_edge_operand(F, block, 0)] == value;
+}
+
+static void decide_modes(method *m)
+{
+    ir_function *F = m->F;
+    m->mode = mem_calloc(MEM_IR, F->ninsts, 1);
+    m->uses = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    m->user = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    m->slot = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    m->offset = mem_calloc(MEM_IR, F->ninsts, sizeof(int64_t));
+    m->stack = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    m->phis = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    m->sources = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            for (uint32_t k = 0; k < ir_operand_count(I); k++)
+            {
+                uint32_t u = *ir_operand(F, I, k);
+                m->uses[u]++;
+                m->user[u] = i;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->type == IR_VOID)
+                m->mode[i] = MODE_NONE;
+            else if (I->op == IR_CONST || I->op == IR_GLOBAL || I->op == IR_SLOT || I->op == IR_STRING)
+                m->mode[i] = MODE_REMAT;
+            else if (m->uses[i] == 0)
+                m->mode[i] = MODE_NONE;
+            else if (I->op != IR_PHI && I->op != IR_PARAM && m->uses[i] == 1 && stays_in_block(m, b, i))
+                m->mode[i] = MODE_STACK;
+            else
+                m->mode[i] = MODE_LOCAL;
+            if (I->op == IR_SLOT)
+            {
+                m->offset[i] = m->frame;
+                m->frame += (I->value.i + 7) & ~(int64_t)7;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (!F->blocks[b].dead)
+            stackify(m, b);
+    }
+    // Parameters are the first locals, as in the JVM
+    m->nslots = F->params.count;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            if (F->insts[i].op == IR_PARAM)
+                m->slot[i] = (uint32_t)F->insts[i].value.i;
+            else if (m->mode[i] == MODE_LOCAL)
+                m->slot[i] = m->nslots++;
+        }
+    }
+}
+
+// Code
+
+static void push_value(method *m, uint32_t value)
+{
+    const ir_inst *I = &m->F->insts[value];
+    if (m->mode[value] == MODE_LOCAL)
+    {
+        emit(m, I->type == IR_FLOAT ? BC_DLOAD : BC_LLOAD)->local = m->slot[value];
+        return;
+    }
+    bc_inst *c;
+    switch (I->op)
+    {
+    case IR_CONST:
+        c = emit(m, I->type == IR_FLOAT ? BC_DCONST : BC_LCONST);
+        memcpy(&c->value, &I->value, sizeof(c->value));
+        break;
+    case IR_GLOBAL:
+        emit(m, BC_STATICADDR)->name = I->name;
+        break;
+    case IR_SLOT:
+        emit(m, BC_FRAMEADDR)->value.i = m->offset[value];
+        break;
+    case IR_STRING:
+        emit(m, BC_LDC)->name = I->name;
+        break;
+    }
+}
+
+static void store_value(method *m, uint32_t value)
+{
+    emit(m, m->F->insts[value].type == IR_FLOAT ? BC_DSTORE : BC_LSTORE)->local = m->slot[value];
+}
+
+// Pushes the operands that are not on the stack yet, giving whether the two operands are the other way round
+static bool push_operands(method *m, const uint32_t *ops, uint32_t k)
+{
+    if (k == 2 && m->mode[ops[1]] == MODE_STACK && m->mode[ops[0]] != MODE_STACK)
+    {
+        push_value(m, ops[0]);
+        return true;
+    }
+    for (uint32_t j = 0; j < k; j++)
+    {
+        if (m->mode[ops[j]] != MODE_STACK)
+            push_value(m, ops[j]);
+    }
+    return false;
+}
+
+/*
+Writes the phis of the successor by edge k of block. The copies go one
+after the other when none overwrites a local a later one reads and no
+value is waiting on the stack, and otherwise every value is pushed before
+any is stored.
+*/
+static void edge_copies(method *m, uint32_t block, uint32_t k)
+{
+    uint32_t n = edge_phis(m, block, k);
+    bool in_order = true;
+    for (uint32_t j = 0; j < n && in_order; j++)
+    {
+        uint32_t source = m->sources[j];
+        if (m->mode[source] == MODE_STACK)
+            in_order = false;
+        for (uint32_t i = 0; i < j; i++)
+        {
+            if (m->mode[source] == MODE_LOCAL && m->slot[source] == m->slot[m->phis[i]])
+                in_order = false;
+        }
+    }
+    for (uint32_t j = 0; j < n; j++)
+    {
+        if (m->mode[m->sources[j]] != MODE_STACK)
+            push_value(m, m->sources[j]);
+        if (in_order)
+            store_value(m, m->phis[j]);
+    }
+    for (uint32_t j = n; j > 0 && !in_order; j--)
+        store_value(m, m->phis[j - 1]);
+}
+
+static int mirror(int op)
+{
+    switch (op)
+    {
+    case IR_LT:
+        return IR_GT;
+    case IR_LE:
+        return IR_GE;
+    case IR_GT:
+        return IR_LT;
+    case IR_GE:
+        return IR_LE;
+    default:
+        return op;
+    }
+}
+
+/*
+Compares like javac: lcmp, or for doubles dcmpg when testing for less and
+dcmpl when testing for greater, so that unordered operands fail the test
+and pass its inverse. Gives the branch taken when the comparison holds.
+*/
+static int emit_compare(method *m, int op, uint8_t type)
+{
+    static const uint8_t branches[] = {BC_IFEQ, BC_IFNE, BC_IFLT, BC_IFLE, BC_IFGT, BC_IFGE};
+    if (type == IR_FLOAT)
+        emit(m, op == IR_LT || op == IR_LE ? BC_DCMPG : BC_DCMPL);
+    else
+        emit(m, BC_LCMP);
+    return branches[op - IR_EQ];
+}
+
+static void emit_branch(method *m, uint32_t i)
+{
+    ir_function *F = m->F;
+    const ir_inst *I = &F->insts[i];
+    int branch = BC_IFNE;
+    if (m->mode[I->a] == MODE_STACK && is_compare(F->insts[I->a].op))
+        branch = m->cond;
+    else
+    {
+        emit(m, BC_LCONST);
+        emit(m, BC_LCMP);
+    }
+    const uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+    uint32_t edge = has_phis(F, succs[0]) ? m->nlabels++ : succs[0];
+    emit_jump(m, branch, edge);
+    edge_copies(m, I->block, 1);
+    emit_jump(m, BC_GOTO, succs[1]);
+    if (edge != succs[0])
+    {
+        emit_label(m, edge);
+        edge_copies(m, I->block, 0);
+        emit_jump(m, BC_GOTO, succs[0]);
+    }
+}
+
+// The successors of a switch have no phis, so its labels are those of their blocks
+static void emit_switch(method *m, uint32_t i)
+{
+    ir_function *F = m->F;
+    const ir_inst *I = &F->insts[i];
+    const uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+    bc_inst *c = emit(m, BC_TABLESWITCH);
+    c->value.i = I->value.i;
+    c->label = succs[0];
+    c->table = m->ntable;
+    c->count = I->b;
+    if (m->ntable + I->b > m->table_capacity)
+    {
+        while (m->ntable + I->b > m->table_capacity)
+            m->table_capacity = m->table_capacity ? m->table_capacity * 2 : 64;
+        m->table = mem_realloc(MEM_IR, m->table, m->table_capacity * sizeof(uint32_t));
+    }
+    for (uint32_t k = 0; k < I->b; k++)
+        m->table[m->ntable++] = succs[F->pool[I->name + k]];
+}
+
+static void emit_inst(method *m, uint32_t i)
+{
+    static const uint8_t int_ops[] = {
+        [IR_ADD] = BC_LADD, [IR_SUB] = BC_LSUB, [IR_MUL] = BC_LMUL, [IR_DIV] = BC_LDIV,
+        [IR_MOD] = BC_LREM, [IR_AND] = BC_LAND, [IR_OR] = BC_LOR
+    };
+    static const uint8_t float_ops[] = {
+        [IR_ADD] = BC_DADD, [IR_SUB] = BC_DSUB, [IR_MUL] = BC_DMUL, [IR_DIV] = BC_DDIV
+    };
+    ir_function *F = m->F;
+    ir_inst *I = &F->insts[i];
+    uint8_t mode = m->mode[i];
+    // Phis are written by the edges into their block, and parameters arrive in their locals
+    if (I->op == IR_PHI || I->op == IR_PARAM || mode == MODE_REMAT || (mode == MODE_NONE && !ir_has_effect(I->op)))
+        return;
+    const uint32_t *ops, pair[2];
+    uint32_t k = operands(m, I, &ops, (uint32_t *)pair);
+    // A jump leaves the values of phis to its edge
+    bool swapped = I->op != IR_JUMP && push_operands(m, ops, k);
+    int op = I->op;
+    switch (op)
+    {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+        if (swapped && (op == IR_SUB || op == IR_DIV || op == IR_MOD))
+            emit(m, BC_SWAP);
+        emit(m, I->type == IR_FLOAT ? float_ops[op] : int_ops[op]);
+        break;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+    {
+        int branch = emit_compare(m, swapped ? mirror(op) : op, F->insts[I->a].type);
+        if (mode == MODE_STACK && F->insts[m->user[i]].op == IR_BRANCH)
+        {
+            m->cond = branch;
+            return;
+        }
+        uint32_t holds = m->nlabels++, done = m->nlabels++;
+        emit_jump(m, branch, holds);
+        emit(m, BC_LCONST)->value.i = 0;
+        emit_jump(m, BC_GOTO, done);
+        emit_label(m, holds);
+        emit(m, BC_LCONST)->value.i = 1;
+        emit_label(m, done);
+        break;
+    }
+    case IR_NEG:
+        emit(m, I->type == IR_FLOAT ? BC_DNEG : BC_LNEG);
+        break;
+    case IR_NOT:
+        emit(m, BC_LCONST)->value.i = -1;
+        emit(m, BC_LXOR);
+        break;
+    case IR_ITOF:
+        emit(m, BC_L2D);
+        break;
+    case IR_FTOI:
+        emit(m, BC_D2L);
+        break;
+    case IR_LOAD:
+        if (static_field(m, I->a))
+        {
+            bc_inst *c = emit(m, BC_GETSTATIC);
+            c->name = F->insts[I->a].name;
+            c->type = I->type;
+        }
+        else
+            emit(m, I->type == IR_FLOAT ? BC_DALOAD : BC_LALOAD);
+        break;
+    case IR_STORE:
+        if (static_field(m, I->a))
+        {
+            bc_inst *c = emit(m, BC_PUTSTATIC);
+            c->name = F->insts[I->a].name;
+            c->type = F->insts[I->b].type;
+            break;
+        }
+        if (swapped)
+            emit(m, BC_SWAP);
+        emit(m, F->insts[I->b].type == IR_FLOAT ? BC_DASTORE : BC_LASTORE);
+        break;
+    case IR_CALL:
+    {
+        // The descriptor is the one of the callee when it is known, as in the JVM
+        static const char letters[] = {[IR_VOID] = 'V', [IR_INT] = 'J', [IR_FLOAT] = 'D'};
+        const char *name = intern_text(I->name);
+        size_t length = strlen(name);
+        char *descriptor = mem_alloc(MEM_IR, length + I->b + 4);
+        memcpy(descriptor, name, length);
+        descriptor[length++] = '(';
+        ir_function *callee = ir_find_function(m->M, I->name);
+        for (uint32_t j = 0; j < I->b; j++)
+        {
+            uint8_t type = callee && j < callee->params.count ? ir_list_at(callee, callee->params)[j] : F->insts[ops[j]].type;
+            descriptor[length++] = letters[type];
+        }
+        descriptor[length++] = ')';
+        descriptor[length++] = letters[I->type];
+        if (swapped)
+            emit(m, BC_SWAP);
+        bc_inst *c = emit(m, BC_INVOKE);
+        c->name = intern(descriptor, length);
+        c->argc = I->b;
+        c->results = I->type != IR_VOID;
+        mem_free(descriptor);
+        break;
+    }
+    case IR_RETURN:
+        emit(m, !I->a ? BC_RETURN : F->type == IR_FLOAT ? BC_DRETURN : BC_LRETURN);
+        break;
+    case IR_JUMP:
+    {
+        edge_copies(m, I->block, 0);
+        emit_jump(m, BC_GOTO, ir_list_at(F, F->blocks[I->block].succs)[0]);
+        break;
+    }
+    case IR_BRANCH:
+        emit_branch(m, i);
+        break;
+    case IR_SWITCH:
+        emit_switch(m, i);
+        break;
+    }
+    if (mode == MODE_LOCAL)
+        store_value(m, i);
+    else if (mode == MODE_NONE && I->type != IR_VOID)
+        emit(m, BC_POP);
+}
+
+// Peephole optimizer
+
+static bool is_branch(int op)
+{
+    return (op >= BC_IFEQ && op <= BC_IFLE) || op == BC_GOTO;
+}
+
+static bool ends_flow(int op)
+{
+    return op == BC_GOTO || op == BC_TABLESWITCH || op == BC_LRETURN || op == BC_DRETURN || op == BC_RETURN;
+}
+
+static bool is_load(int op)
+{
+    return op == BC_LLOAD || op == BC_DLOAD;
+}
+
+static bool is_store(int op)
+{
+    return op == BC_LSTORE || op == BC_DSTORE;
+}
+
+// Pushes of one value that read nothing that can change and fail in no way
+static bool is_pure_push(int op)
+{
+    return op == BC_LCONST || op == BC_DCONST || is_load(op) || op == BC_STATICADDR || op == BC_FRAMEADDR ||
+           op == BC_LDC || op == BC_GETSTATIC || op == BC_DUP;
+}
+
+static void compact(method *m)
+{
+    uint32_t n = 0;
+    for (uint32_t k = 0; k < m->ncode; k++)
+    {
+        if (m->code[k].op != BC_NOP)
+            m->code[n++] = m->code[k];
+    }
+    m->ncode = n;
+}
+
+// Whether label comes before any instruction from k on
+static bool label_follows(const method *m, uint32_t k, uint32_t label)
+{
+    for (; k < m->ncode && (m->code[k].op == BC_LABEL || m->code[k].op == BC_NOP); k++)
+    {
+        if (m->code[k].op == BC_LABEL && m->code[k].label == label)
+            return true;
+    }
+    return false;
+}
+
+static bool fold_long(int op, int64_t a, int64_t b, int64_t *result)
+{
+    uint64_t x = (uint64_t)a, y = (uint64_t)b;
+    switch (op)
+    {
+    case BC_LADD:
+        *result = (int64_t)(x + y);
+        return true;
+    case BC_LSUB:
+        *result = (int64_t)(x - y);
+        return true;
+    case BC_LMUL:
+        *result = (int64_t)(x * y);
+        return true;
+    case BC_LDIV:
+    case BC_LREM:
+        // Division by zero is left to fail where it runs
+        if (b == 0 || (a == INT64_MIN && b == -1))
+            return false;
+        *result = op == BC_LDIV ? a / b : a % b;
+        return true;
+    case BC_LAND:
+        *result = a & b;
+        return true;
+    case BC_LOR:
+        *result = a | b;
+        return true;
+    case BC_LXOR:
+        *result = a ^ b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool fold_double(int op, double a, double b, double *result)
+{
+    switch (op)
+    {
+    case BC_DADD:
+        *result = a + b;
+        return true;
+    case BC_DSUB:
+        *result = a - b;
+        return true;
+    case BC_DMUL:
+        *result = a * b;
+        return true;
+    case BC_DDIV:
+        *result = a / b;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool branch_taken(int op, int64_t a, int64_t b)
+{
+    int c = a < b ? -1 : a > b;
+    switch (op)
+    {
+    case BC_IFEQ:
+        return c == 0;
+    case BC_IFNE:
+        return c != 0;
+    case BC_IFLT:
+        return c < 0;
+    case BC_IFGE:
+        return c >= 0;
+    case BC_IFGT:
+        return c > 0;
+    default:
+        return c <= 0;
+    }
+}
+
+/*
+One pass over the code, giving whether it changed anything:
+- a jump to the next instruction goes, and a conditional jump over an
+  unconditional one is inverted to take its place
+- jumps to jumps go straight to the end, and code after a jump or a
+  return that no label leads to goes
+- constants are folded through arithmetic, conversions and comparisons
+  with branches, and adding 0 or multiplying by 1 goes
+- a store followed by a load of the same local keeps the value on the
+  stack, stores to locals never loaded become pops, and pops of values
+  pushed right before go with them
+- loading a local, adding a constant and storing it back is a linc
+*/
+static bool peephole_pass(method *m)
+{
+    compact(m);
+    bc_inst *code = m->code;
+    uint32_t n = m->ncode;
+    uint32_t *at = mem_alloc(MEM_IR, m->nlabels * sizeof(uint32_t));
+    uint32_t *loads = mem_calloc(MEM_IR, m->nslots + 1, sizeof(uint32_t));
+    for (uint32_t k = 0; k < n; k++)
+    {
+        if (code[k].op == BC_LABEL)
+            at[code[k].label] = k;
+        else if (is_load(code[k].op))
+            loads[code[k].local]++;
+    }
+    bool changed = false;
+    for (uint32_t k = 0; k < n; k++)
+    {
+        bc_inst *c = &code[k];
+        bc_inst *next = k + 1 < n ? &code[k + 1] : NULL;
+        bc_inst *third = k + 2 < n ? &code[k + 2] : NULL;
+        bc_inst *fourth = k + 3 < n ? &code[k + 3] : NULL;
+        if (is_branch(c->op))
+        {
+            // Follow jumps to jumps, though not around a loop of them
+            for (uint32_t hops = 0; hops < 8; hops++)
+            {
+                uint32_t t = at[c->label] + 1;
+                while (t < n && (code[t].op == BC_LABEL || code[t].op == BC_NOP))
+                    t++;
+                if (t == n || code[t].op != BC_GOTO || code[t].label == c->label)
+                    break;
+                c->label = code[t].label;
+                changed = true;
+            }
+            if (label_follows(m, k + 1, c->label))
+            {
+                c->op = c->op == BC_GOTO ? BC_NOP : BC_POP;
+                changed = true;
+                continue;
+            }
+            if (c->op != BC_GOTO && next && next->op == BC_GOTO && label_follows(m, k + 2, c->label))
+            {
+                c->op = BC_INVERSE(c->op);
+                c->label = next->label;
+                next->op = BC_NOP;
+                changed = true;
+                continue;
+            }
+        }
+        if (ends_flow(c->op))
+        {
+            for (uint32_t j = k + 1; j < n && code[j].op != BC_LABEL; j++)
+            {
+                changed |= code[j].op != BC_NOP;
+                code[j].op = BC_NOP;
+            }
+            continue;
+        }
+        if (c->op == BC_LCONST && next && next->op == BC_LCONST && third)
+        {
+            int64_t result;
+            if (fold_long(third->op, c->value.i, next->value.i, &result))
+            {
+                c->value.i = result;
+                next->op = third->op = BC_NOP;
+                changed = true;
+                continue;
+            }
+            if (third->op == BC_LCMP && fourth && fourth->op >= BC_IFEQ && fourth->op <= BC_IFLE)
+            {
+                bool taken = branch_taken(fourth->op, c->value.i, next->value.i);
+                c->op = next->op = third->op = BC_NOP;
+                fourth->op = taken ? BC_GOTO : BC_NOP;
+                changed = true;
+                continue;
+            }
+        }
+        if (c->op == BC_DCONST && next && next->op == BC_DCONST && third)
+        {
+            double result;
+            if (fold_double(third->op, c->value.d, next->value.d, &result))
+            {
+                c->value.d = result;
+                next->op = third->op = BC_NOP;
+                changed = true;
+                continue;
+            }
+        }
+        if (c->op == BC_LCONST && next)
+        {
+            int64_t v = c->value.i;
+            bool identity = (v == 0 && (next->op == BC_LADD || next->op == BC_LSUB || next->op == BC_LOR || next->op == BC_LXOR)) ||
+                            (v == 1 && (next->op == BC_LMUL || next->op == BC_LDIV));
+            if (identity || next->op == BC_LNEG || next->op == BC_L2D)
+            {
+                if (identity)
+                    c->op = BC_NOP;
+                else if (next->op == BC_LNEG)
+                    c->value.i = (int64_t)(0 - (uint64_t)v);
+                else
+                {
+                    c->op = BC_DCONST;
+                    c->value.d = (double)v;
+                }
+                next->op = BC_NOP;
+                changed = true;
+                continue;
+            }
+        }
+        if (c->op == BC_DCONST && next && (next->op == BC_DNEG || (next->op == BC_D2L && c->value.d > -9.2e18 && c->value.d < 9.2e18)))
+        {
+            if (next->op == BC_DNEG)
+                c->value.d = -c->value.d;
+            else
+            {
+                c->op = BC_LCONST;
+                c->value.i = (int64_t)c->value.d;
+            }
+            next->op = BC_NOP;
+            changed = true;
+            continue;
+        }
+        if (is_store(c->op) && next && next->op == c->op - BC_LSTORE + BC_LLOAD && next->local == c->local)
+        {
+            if (loads[c->local] == 1)
+            {
+                c->op = next->op = BC_NOP;
+            }
+            else
+            {
+                next->op = c->op;
+                c->op = BC_DUP;
+            }
+            loads[next->local]--;
+            changed = true;
+            continue;
+        }
+        if (is_load(c->op) && next && next->op == c->op - BC_LLOAD + BC_LSTORE && next->local == c->local)
+        {
+            c->op = next->op = BC_NOP;
+            changed = true;
+            continue;
+        }
+        if ((is_store(c->op) && loads[c->local] == 0) || (c->op == BC_LINC && loads[c->local] == 0))
+        {
+            c->op = c->op == BC_LINC ? BC_NOP : BC_POP;
+            changed = true;
+            continue;
+        }
+        if (is_pure_push(c->op) && next && next->op == BC_POP)
+        {
+            c->op = next->op = BC_NOP;
+            changed = true;
+            continue;
+        }
+        if (fourth && fourth->op == BC_LSTORE && (third->op == BC_LADD || third->op == BC_LSUB))
+        {
+            bc_inst *load = c->op == BC_LLOAD ? c : next;
+            bc_inst *constant = c->op == BC_LLOAD ? next : c;
+            bool ordered = load == c || third->op == BC_LADD;
+            if (load->op == BC_LLOAD && constant->op == BC_LCONST && ordered && load->local == fourth->local &&
+                constant->value.i > INT32_MIN && constant->value.i <= INT32_MAX)
+            {
+                int64_t step = third->op == BC_LADD ? constant->value.i : -constant->value.i;
+                c->op = BC_LINC;
+                c->local = fourth->local;
+                c->value.i = step;
+                next->op = third->op = fourth->op = BC_NOP;
+                changed = true;
+                continue;
+            }
+        }
+    }
+    mem_free(at);
+    mem_free(loads);
+    return changed;
+}
+
+// Drops labels nothing jumps to, and numbers the locals still used after the parameters, two slots
+// each as longs and doubles take in the JVM
+static void tidy(method *m)
+{
+    bool *targets = mem_calloc(MEM_IR, m->nlabels, sizeof(bool));
+    for (uint32_t k = 0; k < m->ncode; k++)
+    {
+        const bc_inst *c = &m->code[k];
+        if (is_branch(c->op) || c->op == BC_TABLESWITCH)
+            targets[c->label] = true;
+        for (uint32_t j = 0; c->op == BC_TABLESWITCH && j < c->count; j++)
+            targets[m->table[c->table + j]] = true;
+    }
+    uint32_t *renumber = mem_alloc(MEM_IR, (m->nslots + 1) * sizeof(uint32_t));
+    uint32_t nparams = m->F->params.count, used = 2 * nparams;
+    for (uint32_t s = 0; s < m->nslots; s++)
+        renumber[s] = s < nparams ? 2 * s : UINT32_MAX;
+    for (uint32_t k = 0; k < m->ncode; k++)
+    {
+        bc_inst *c = &m->code[k];
+        if (c->op == BC_LABEL && !targets[c->label])
+            c->op = BC_NOP;
+        if (is_load(c->op) || is_store(c->op) || c->op == BC_LINC)
+        {
+            if (renumber[c->local] == UINT32_MAX)
+            {
+                renumber[c->local] = used;
+                used += 2;
+            }
+            c->local = renumber[c->local];
+        }
+    }
+    m->nslots = used;
+    compact(m);
+    mem_free(targets);
+    mem_free(renumber);
+}
+
+static unsigned count_code(const method *m)
+{
+    unsigned count = 0;
+    for (uint32_t k = 0; k < m->ncode; k++)
+        count += m->code[k].op != BC_LABEL && m->code[k].op != BC_NOP;
+    return count;
+}
+
+/*
+The depth of the stack before each instruction, which like the JVM's
+verifier insists on being the same by every path, and the deepest it gets.
+*/
+static uint32_t max_stack(method *m)
+{
+    uint32_t n = m->ncode, max = 0, nwork = 0;
+    int32_t *depth = mem_alloc(MEM_IR, (n + 1) * sizeof(int32_t));
+    uint32_t *at = mem_alloc(MEM_IR, m->nlabels * sizeof(uint32_t));
+    uint32_t *work = mem_alloc(MEM_IR, (2 * n + m->ntable + 2) * 2 * sizeof(uint32_t));
+    for (uint32_t k = 0; k < n; k++)
+    {
+        depth[k] = -1;
+        if (m->code[k].op == BC_LABEL)
+            at[m->code[k].label] = k;
+    }
+    work[nwork++] = 0;
+    work[nwork++] = 0;
+    while (nwork)
+    {
+        int32_t d = (int32_t)work[--nwork];
+        uint32_t k = work[--nwork];
+        if (k >= n)
+            continue;
+        if (depth[k] >= 0)
+        {
+            if (depth[k] != d)
+                method_error(m, "The stack has different depths at a label");
+            continue;
+        }
+        depth[k] = d;
+        const bc_inst *c = &m->code[k];
+        int pops = c->op == BC_INVOKE ? c->argc : infos[c->op].pops;
+        int pushes = c->op == BC_INVOKE ? c->results : infos[c->op].pushes;
+        if (d < pops)
+            method_error(m, "The stack underflows");
+        d += pushes - pops;
+        if ((uint32_t)d > max)
+            max = d;
+        if (!ends_flow(c->op))
+        {
+            work[nwork++] = k + 1;
+            work[nwork++] = (uint32_t)d;
+        }
+        if (is_branch(c->op) || c->op == BC_TABLESWITCH)
+        {
+            work[nwork++] = at[c->label];
+            work[nwork++] = (uint32_t)d;
+        }
+        for (uint32_t j = 0; c->op == BC_TABLESWITCH && j < c->count; j++)
+        {
+            work[nwork++] = at[m->table[c->table + j]];
+            work[nwork++] = (uint32_t)d;
+        }
+    }
+    mem_free(depth);
+    mem_free(at);
+    mem_free(work);
+    return max;
+}
+
+// Output
+
+static void write_double(FILE *out, double d)
+{
+    char text[40];
+    snprintf(text, sizeof(text), "%.17g", d);
+    fputs(text, out);
+    // Written with a point, so it reads back as a double
+    if (!strpbrk(text, ".eni"))
+        fputs(".0", out);
+}
+
+static void write_string(FILE *out, uint32_t name)
+{
+    const unsigned char *text = (const unsigned char *)intern_text(name);
+    size_t length = intern_length(name);
+    fputc('"', out);
+    for (size_t k = 0; k < length; k++)
+    {
+        if (text[k] == '"' || text[k] == '\\')
+            fprintf(out, "\\%c", text[k]);
+        else if (text[k] == '\n')
+            fputs("\\n", out);
+        else if (text[k] < 32 || text[k] > 126)
+            fprintf(out, "\\%03o", text[k]);
+        else
+            fputc(text[k], out);
+    }
+    fputc('"', out);
+}
+
+static void write_inst(FILE *out, const method *m, const bc_inst *c)
+{
+    if (c->op == BC_LABEL)
+    {
+        fprintf(out, "L%u:\n", c->label);
+        return;
+    }
+    if (c->op == BC_LCONST && (c->value.i == 0 || c->value.i == 1))
+    {
+        fprintf(out, "    lconst_%lld\n", (long long)c->value.i);
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &c->value.d, sizeof(bits));
+    if (c->op == BC_DCONST && (bits == 0 || c->value.d == 1.0))
+    {
+        fprintf(out, "    dconst_%d\n", (int)c->value.d);
+        return;
+    }
+    fprintf(out, "    %s", infos[c->op].name);
+    switch (c->op)
+    {
+    case BC_LCONST:
+        fprintf(out, " %lld", (long long)c->value.i);
+        break;
+    case BC_DCONST:
+        fputc(' ', out);
+        write_double(out, c->value.d);
+        break;
+    case BC_LLOAD:
+    case BC_DLOAD:
+    case BC_LSTORE:
+    case BC_DSTORE:
+        fprintf(out, " %u", c->local);
+        break;
+    case BC_LINC:
+        fprintf(out, " %u %lld", c->local, (long long)c->value.i);
+        break;
+    case BC_GETSTATIC:
+    case BC_PUTSTATIC:
+        fprintf(out, " %s %c", intern_text(c->name), c->type == IR_FLOAT ? 'D' : 'J');
+        break;
+    case BC_STATICADDR:
+    case BC_INVOKE:
+        fprintf(out, " %s", intern_text(c->name));
+        break;
+    case BC_FRAMEADDR:
+        fprintf(out, " %lld", (long long)c->value.i);
+        break;
+    case BC_LDC:
+        fputc(' ', out);
+        write_string(out, c->name);
+        break;
+    case BC_TABLESWITCH:
+        fprintf(out, " %lld %lld\n", (long long)c->value.i, (long long)((uint64_t)c->value.i + c->count - 1));
+        for (uint32_t j = 0; j < c->count; j++)
+            fprintf(out, "        L%u\n", m->table[c->table + j]);
+        fprintf(out, "        default: L%u", c->label);
+        break;
+    default:
+        if (is_branch(c->op))
+            fprintf(out, " L%u", c->label);
+        break;
+    }
+    fputc('\n', out);
+}
+
+static void write_method(FILE *out, FILE *report, bytecode_stats *stats, ir_module *M, uint32_t f)
+{
+    method m;
+    memset(&m, 0, sizeof(m));
+    m.M = M;
+    m.F = &M->functions[f];
+    ir_function *F = m.F;
+    m.nlabels = F->nblocks;
+    decide_modes(&m);
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        emit_label(&m, b);
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            emit_inst(&m, i);
+    }
+    unsigned before = count_code(&m);
+    while (peephole_pass(&m))
+        ;
+    tidy(&m);
+    unsigned after = count_code(&m);
+    uint32_t stack = max_stack(&m);
+
+    static const char letters[] = {[IR_VOID] = 'V', [IR_INT] = 'J', [IR_FLOAT] = 'D'};
+    const char *name = intern_text(F->name);
+    fprintf(out, "\n.method public static %s(", name);
+    for (uint32_t p = 0; p < F->params.count; p++)
+        fputc(letters[ir_list_at(F, F->params)[p]], out);
+    // In words, two per value, counting the int of a comparison, which takes one, as a long
+    fprintf(out, ")%c\n    .limit stack %u\n    .limit locals %u\n", letters[F->type], 2 * stack, m.nslots);
+    if (m.frame)
+        fprintf(out, "    .limit frame %lld\n", (long long)m.frame);
+    fprintf(out, "    ; %u instructions, %u after the peephole optimizer\n", before, after);
+    for (uint32_t k = 0; k < m.ncode; k++)
+        write_inst(out, &m, &m.code[k]);
+    fputs(".end method\n", out);
+    if (report)
+        fprintf(report, "  %s: %u instructions, %u after the peephole optimizer\n", name, before, after);
+    stats->methods++;
+    stats->before += before;
+    stats->after += after;
+
+    mem_free(m.mode);
+    mem_free(m.uses);
+    mem_free(m.user);
+    mem_free(m.slot);
+    mem_free(m.offset);
+    mem_free(m.stack);
+    mem_free(m.phis);
+    mem_free(m.sources);
+    mem_free(m.code);
+    mem_free(m.table);
+}
+
+void bytecode_emit(ir_module *M, FILE *out, FILE *report, bytecode_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    fprintf(out, ".source %s\n", M->filename);
+    // Arrays and structs are fields of bytes, of their size
+    for (uint32_t g = 0; g < M->nglobals; g++)
+    {
+        const ir_global *G = &M->globals[g];
+        fprintf(out, ".field public static %s ", intern_text(G->name));
+        if (G->type == IR_VOID)
+            fprintf(out, "[B %u\n", G->size);
+        else if (G->type == IR_FLOAT)
+        {
+            fputs("D = ", out);
+            write_double(out, G->init.d);
+            fputc('\n', out);
+        }
+        else
+            fprintf(out, "J = %lld\n", (long long)G->init.i);
+    }
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        if (M->functions[f].defined)
+            write_method(out, report, stats, M, f);
+    }
+}
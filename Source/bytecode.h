@@ -0,0 +1,24 @@
+#include <stdio.h> // For FILE type
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "ir.h"
+
+/*
+Stack machine bytecode in the style of JVM assembly, one method per
+function of the optimized IR. Ints are longs (J) and floats doubles (D),
+and every value takes two slots of the locals and two words of the
+operand stack, as in the JVM.
+Memory, which the JVM has no instructions for, is reached by address, with
+laload and lastore taking an address instead of an array and an index.
+*/
+typedef struct {
+    unsigned methods;
+    unsigned before; // Instructions, before the peephole optimizer
+    unsigned after;
+} bytecode_stats;
+
+// Writes M to out, and the instruction counts of each method to report unless it is NULL
+void bytecode_emit(ir_module *M, FILE *out, FILE *report, bytecode_stats *stats);
+
+#endif
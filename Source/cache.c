@@ -0,0 +1,436 @@
+#define _GNU_SOURCE // For copy_file_range
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "cache.h"
+#include "hash.h"
+#include "depscan.h"
+#include "mem.h"
+
+/*
+Content-addressed cache of -1/-2 results. The key hashes the tool version
+and the running executable, the command line options, the input file and
+every file it includes. The executable stands for the compiler, since the
+build time of this file says nothing of the objects rebuilt after it. An
+entry is <key>.out, a copy of the output file (missing if the run failed
+and removed it), and <key>.meta with the exit status and everything the run
+printed, so failed runs replay their diagnostics too. The modification time
+of the .meta file is the last use, for LRU eviction.
+*/
+
+#define CACHE_META_MAGIC "mycc-cache 1"
+
+static const char *tool_version = "1.0 " __DATE__ " " __TIME__;
+
+typedef struct {
+    long hits;
+    long misses;
+    long evictions;
+} cache_stats;
+
+// Cache directory from MYCC_CACHE_DIR, else ~/.cache/mycc, created if needed
+static void cache_dir(char *dir)
+{
+    const char *env = getenv("MYCC_CACHE_DIR");
+    const char *home = getenv("HOME");
+    if (env && *env)
+        snprintf(dir, PATH_MAX, "%s", env);
+    else if (home && *home)
+        snprintf(dir, PATH_MAX, "%s/.cache/mycc", home);
+    else
+        snprintf(dir, PATH_MAX, ".mycc-cache");
+    // mkdir -p
+    for (char *p = dir + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+    mkdir(dir, 0755);
+}
+
+// Size limit from MYCC_CACHE_SIZE, which takes an optional K, M or G suffix
+static long cache_limit(void)
+{
+    const char *env = getenv("MYCC_CACHE_SIZE");
+    if (!env || !*env)
+        return CACHE_DEFAULT_SIZE;
+    char *end;
+    long limit = strtol(env, &end, 10);
+    if (*end == 'K' || *end == 'k')
+        limit *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        limit *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g')
+        limit *= 1024L * 1024 * 1024;
+    return limit;
+}
+
+// Adds the name and contents of a file to the key, or a marker if it cannot be read
+static void hash_file(hash_state *H, const char *filename)
+{
+    hash_update(H, filename, strlen(filename) + 1);
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        hash_update(H, "\0missing", 8);
+        return;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        hash_update(H, buffer, n);
+    fclose(f);
+    hash_update(H, "\0end", 4);
+}
+
+static void compute_key(int argc, char *argv[], char *infilename, char *key)
+{
+    hash_state H[2];
+    dep_list D;
+    memset(&D, 0, sizeof(D));
+    D.keep_going = true;
+    scan_dependencies(infilename, &D);
+    for (int h = 0; h < 2; h++)
+    {
+        hash_init(&H[h], h);
+        hash_update(&H[h], tool_version, strlen(tool_version) + 1);
+        hash_file(&H[h], "/proc/self/exe");
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--cache") != 0)
+                hash_update(&H[h], argv[i], strlen(argv[i]) + 1);
+        }
+        hash_file(&H[h], infilename);
+        for (size_t i = 0; i < D.count; i++)
+            hash_file(&H[h], D.files[i]);
+    }
+    dep_list_free(&D);
+    snprintf(key, 33, "%016llx%016llx", (unsigned long long)hash_final(&H[0]), (unsigned long long)hash_final(&H[1]));
+}
+
+// Copies a file with copy_file_range, falling back to read/write
+static int copy_file(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return -1;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return -1;
+    }
+    int status = 0;
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+        ;
+    if (n < 0)
+    {
+        char buffer[65536];
+        lseek(in, 0, SEEK_SET);
+        lseek(out, 0, SEEK_SET);
+        if (ftruncate(out, 0) < 0)
+            status = -1;
+        while (status == 0 && (n = read(in, buffer, sizeof(buffer))) > 0)
+        {
+            if (write(out, buffer, n) != n)
+                status = -1;
+        }
+        if (n < 0)
+            status = -1;
+    }
+    close(in);
+    if (close(out) < 0)
+        status = -1;
+    return status;
+}
+
+// Reads and updates the hit/miss counters under a lock
+static void update_stats(const char *dir, long hits, long misses, long evictions, cache_stats *out)
+{
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/stats", dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    cache_stats stats = {0, 0, 0};
+    if (fd < 0)
+    {
+        if (out)
+            *out = stats;
+        return;
+    }
+    flock(fd, LOCK_EX);
+    char text[256];
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    if (n > 0)
+    {
+        text[n] = '\0';
+        sscanf(text, "hits %ld misses %ld evictions %ld", &stats.hits, &stats.misses, &stats.evictions);
+    }
+    stats.hits += hits;
+    stats.misses += misses;
+    stats.evictions += evictions;
+    if (hits || misses || evictions)
+    {
+        int len = snprintf(text, sizeof(text), "hits %ld\nmisses %ld\nevictions %ld\n", stats.hits, stats.misses, stats.evictions);
+        if (lseek(fd, 0, SEEK_SET) == 0 && ftruncate(fd, 0) == 0 && write(fd, text, len) != len)
+            fprintf(stderr, "Warning: Cannot update cache statistics\n");
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (out)
+        *out = stats;
+}
+
+typedef struct {
+    char key[33];
+    struct timespec used;
+    long size;
+} cache_entry;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const cache_entry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec)
+        return (x->used.tv_sec > y->used.tv_sec) - (x->used.tv_sec < y->used.tv_sec);
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// Lists every entry with its total size, returns the number of entries
+static size_t list_entries(const char *dir, cache_entry **entries, long *total)
+{
+    DIR *d = opendir(dir);
+    size_t count = 0, capacity = 0;
+    *entries = NULL;
+    *total = 0;
+    if (!d)
+        return 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        size_t len = strlen(e->d_name);
+        if (len != 37 || strcmp(e->d_name + 32, ".meta") != 0)
+            continue;
+        char path[PATH_MAX + 64];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &st) < 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            *entries = mem_realloc(MEM_OTHER, *entries, capacity * sizeof(cache_entry));
+        }
+        cache_entry *entry = &(*entries)[count++];
+        memcpy(entry->key, e->d_name, 32);
+        entry->key[32] = '\0';
+        entry->used = st.st_mtim;
+        entry->size = st.st_size;
+        snprintf(path, sizeof(path), "%s/%s.out", dir, entry->key);
+        if (stat(path, &st) == 0)
+            entry->size += st.st_size;
+        *total += entry->size;
+    }
+    closedir(d);
+    return count;
+}
+
+// Removes least recently used entries until the cache fits in its size limit
+static long evict(const char *dir, long limit)
+{
+    cache_entry *entries;
+    long total;
+    size_t count = list_entries(dir, &entries, &total);
+    long evicted = 0;
+    if (total > limit)
+    {
+        qsort(entries, count, sizeof(cache_entry), compare_entries);
+        for (size_t i = 0; i < count && total > limit; i++)
+        {
+            char path[PATH_MAX + 64];
+            snprintf(path, sizeof(path), "%s/%s.meta", dir, entries[i].key);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%s.out", dir, entries[i].key);
+            unlink(path);
+            total -= entries[i].size;
+            evicted++;
+        }
+    }
+    mem_free(entries);
+    return evicted;
+}
+
+static char *read_all(FILE *f, long *len)
+{
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = mem_alloc(MEM_OTHER, *len + 1);
+    if (fread(data, 1, *len, f) != (size_t)*len)
+        *len = 0;
+    return data;
+}
+
+// Replays a stored entry, returns false if it is missing or damaged
+static bool replay(const char *dir, const char *key, char *outfilename, int *status)
+{
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s.meta", dir, key);
+    FILE *meta = fopen(path, "rb");
+    if (!meta)
+        return false;
+    char magic[32];
+    int has_output;
+    long out_len, err_len;
+    bool valid = fgets(magic, sizeof(magic), meta) && strcmp(magic, CACHE_META_MAGIC "\n") == 0 &&
+                 fscanf(meta, "status %d\noutput %d\nstdout %ld\n", status, &has_output, &out_len) == 3 &&
+                 out_len >= 0;
+    char *out_text = NULL, *err_text = NULL;
+    if (valid)
+    {
+        out_text = mem_alloc(MEM_OTHER, out_len + 1);
+        valid = fread(out_text, 1, out_len, meta) == (size_t)out_len &&
+                fscanf(meta, "\nstderr %ld\n", &err_len) == 1 && err_len >= 0;
+    }
+    if (valid)
+    {
+        err_text = mem_alloc(MEM_OTHER, err_len + 1);
+        valid = fread(err_text, 1, err_len, meta) == (size_t)err_len;
+    }
+    fclose(meta);
+    if (valid)
+    {
+        snprintf(path, sizeof(path), "%s/%s.out", dir, key);
+        if (has_output)
+            valid = copy_file(path, outfilename) == 0;
+        else
+            remove(outfilename);
+    }
+    if (valid)
+    {
+        fwrite(out_text, 1, out_len, stdout);
+        fwrite(err_text, 1, err_len, stderr);
+        snprintf(path, sizeof(path), "%s/%s.meta", dir, key);
+        utimes(path, NULL);
+    }
+    mem_free(out_text);
+    mem_free(err_text);
+    return valid;
+}
+
+// Stores the result of a run, the .meta file is renamed into place last
+static void store(const char *dir, const char *key, char *outfilename, int status,
+                  const char *out_text, long out_len, const char *err_text, long err_len)
+{
+    char path[PATH_MAX + 64], tmppath[PATH_MAX + 96];
+    bool has_output = access(outfilename, F_OK) == 0;
+    if (has_output)
+    {
+        snprintf(path, sizeof(path), "%s/%s.out", dir, key);
+        snprintf(tmppath, sizeof(tmppath), "%s.%d", path, (int)getpid());
+        if (copy_file(outfilename, tmppath) != 0 || rename(tmppath, path) != 0)
+        {
+            unlink(tmppath);
+            return;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s.meta", dir, key);
+    snprintf(tmppath, sizeof(tmppath), "%s.%d", path, (int)getpid());
+    FILE *meta = fopen(tmppath, "wb");
+    if (!meta)
+        return;
+    fprintf(meta, CACHE_META_MAGIC "\nstatus %d\noutput %d\nstdout %ld\n", status, has_output, out_len);
+    fwrite(out_text, 1, out_len, meta);
+    fprintf(meta, "\nstderr %ld\n", err_len);
+    fwrite(err_text, 1, err_len, meta);
+    if (fclose(meta) != 0 || rename(tmppath, path) != 0)
+        unlink(tmppath);
+}
+
+/*
+Serve a -1/-2 run from the cache. Returns true if the caller is done, with
+*status set to the exit status: either the result was replayed from the
+cache, or it was computed by a child process and stored. Returns false in
+that child process, which carries on with the normal run while everything
+it prints is captured, and also if the cache cannot be used at all.
+*/
+bool cache_run(int argc, char *argv[], char *infilename, char *outfilename, int *status)
+{
+    char dir[PATH_MAX];
+    char key[33];
+    cache_dir(dir);
+    compute_key(argc, argv, infilename, key);
+    if (replay(dir, key, outfilename, status))
+    {
+        update_stats(dir, 1, 0, 0, NULL);
+        return true;
+    }
+
+    FILE *out_capture = tmpfile();
+    FILE *err_capture = tmpfile();
+    if (!out_capture || !err_capture)
+        return false;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        dup2(fileno(out_capture), STDOUT_FILENO);
+        dup2(fileno(err_capture), STDERR_FILENO);
+        return false;
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    *status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+    long out_len, err_len;
+    char *out_text = read_all(out_capture, &out_len);
+    char *err_text = read_all(err_capture, &err_len);
+    fwrite(out_text, 1, out_len, stdout);
+    fwrite(err_text, 1, err_len, stderr);
+    if (WIFEXITED(wstatus))
+        store(dir, key, outfilename, *status, out_text, out_len, err_text, err_len);
+    mem_free(out_text);
+    mem_free(err_text);
+    fclose(out_capture);
+    fclose(err_capture);
+    update_stats(dir, 0, 1, evict(dir, cache_limit()), NULL);
+    return true;
+}
+
+// Prints hit/miss counters and the current size of the cache
+int cache_print_stats(void)
+{
+    char dir[PATH_MAX];
+    cache_dir(dir);
+    cache_stats stats;
+    update_stats(dir, 0, 0, 0, &stats);
+    cache_entry *entries;
+    long total;
+    size_t count = list_entries(dir, &entries, &total);
+    mem_free(entries);
+    long lookups = stats.hits + stats.misses;
+    printf("Cache directory: %s\n", dir);
+    printf("Hits: %ld\n", stats.hits);
+    printf("Misses: %ld\n", stats.misses);
+    printf("Hit rate: %.1f%%\n", lookups ? 100.0 * stats.hits / lookups : 0.0);
+    printf("Evictions: %ld\n", stats.evictions);
+    printf("Entries: %zu\n", count);
+    printf("Size: %ld of %ld bytes\n", total, cache_limit());
+    return 0;
+}
@@ -0,0 +1,12 @@
+#include <stdbool.h>
+#ifndef CACHE_H
+#define CACHE_H
+
+// Default size limit of the result cache, overridden by MYCC_CACHE_SIZE
+#define CACHE_DEFAULT_SIZE (256L * 1024 * 1024)
+
+bool cache_run(int argc, char *argv[], char *infilename, char *outfilename, int *status);
+
+int cache_print_stats(void);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "depscan.h"
+#include "strtab.h"
+#include "mem.h"
+#include "ioload.h"
+
+/*
+Dependency scanning only looks for #include "..." directives, without
+lexing. It follows the same rules as getNextToken for what counts as a
+directive: # outside of comments, string and character literals, then the
+word include, then a quoted file name. Everything else is skipped with
+memchr or a table lookup.
+*/
+
+// Adds file unless it was seen before, returns true if it is new
+static bool dep_list_add(dep_list *D, const char *file)
+{
+    size_t seen = D->visited.count;
+    strtab_add(&D->visited, file);
+    if (D->visited.count == seen)
+        return false;
+    if (D->count == D->capacity)
+    {
+        D->capacity = D->capacity ? D->capacity * 2 : 16;
+        D->files = mem_realloc(MEM_INCLUDES, D->files, D->capacity * sizeof(char *));
+    }
+    D->files[D->count++] = mem_strdup(MEM_INCLUDES, file);
+    return true;
+}
+
+void dep_list_free(dep_list *D)
+{
+    for (size_t i = 0; i < D->count; i++)
+        mem_free(D->files[i]);
+    mem_free(D->files);
+    strtab_free(&D->visited);
+    memset(D, 0, sizeof(*D));
+}
+
+// Line number of position p, only computed when reporting an error
+static unsigned line_at(const char *text, const char *p)
+{
+    unsigned lineno = 1;
+    const char *nl;
+    while ((nl = memchr(text, '\n', p - text)) != NULL)
+    {
+        lineno++;
+        text = nl + 1;
+    }
+    return lineno;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+Calls found with the name of every #include "..." directive in text, in
+order, and the position of its #. Names longer than 254 bytes are cut off.
+*/
+void scan_includes(const char *text, size_t size, include_found found, void *context)
+{
+    // Characters that can change what the scanner is inside of
+    static const bool special[256] = {['#'] = true, ['"'] = true, ['\''] = true, ['/'] = true};
+
+    const char *p = text;
+    const char *end = text + size;
+    while (p < end)
+    {
+        while (p < end && !special[(unsigned char)*p])
+            p++;
+        if (p >= end)
+            break;
+        char c = *p++;
+        if (c == '/')
+        {
+            if (p < end && *p == '/')
+            {
+                const char *nl = memchr(p, '\n', end - p);
+                p = nl ? nl + 1 : end;
+            }
+            else if (p < end && *p == '*')
+            {
+                p++;
+                while (p < end)
+                {
+                    const char *star = memchr(p, '*', end - p);
+                    if (!star)
+                    {
+                        p = end;
+                        break;
+                    }
+                    p = star + 1;
+                    if (p < end && *p == '/')
+                    {
+                        p++;
+                        break;
+                    }
+                }
+            }
+        }
+        else if (c == '"')
+        {
+            while (p < end && *p != '"')
+                p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+            p++;
+        }
+        else if (c == '\'')
+        {
+            p += (p < end && *p == '\\') ? 3 : 2;
+        }
+        else
+        {
+            // #: the directive name ends at the first blank, then comes the quoted file name
+            const char *hash = p - 1;
+            while (p < end && is_blank(*p))
+                p++;
+            const char *word = p;
+            while (p < end && !is_blank(*p))
+                p++;
+            if (p - word != 7 || memcmp(word, "include", 7) != 0)
+                continue;
+            p++;
+            while (p < end && is_blank(*p))
+                p++;
+            if (p >= end || *p != '"')
+                continue;
+            const char *name = ++p;
+            while (p < end && *p != '"' && *p != '\n' && p - name < 254)
+                p++;
+            char file[255];
+            memcpy(file, name, p - name);
+            file[p - name] = '\0';
+            if (p < end && *p == '"')
+                p++;
+            found(context, file, hash);
+        }
+    }
+}
+
+static void scan_file(char *filename, const char *includer, const char *includer_text, const char *at, dep_list *D);
+
+// What scan_text passes to each include it finds
+typedef struct {
+    char *filename;
+    const char *text;
+    dep_list *D;
+} scan_context;
+
+static void add_include(void *context, const char *file, const char *at)
+{
+    scan_context *C = context;
+    if (dep_list_add(C->D, file))
+        scan_file(C->D->files[C->D->count - 1], C->filename, C->text, at, C->D);
+}
+
+static void scan_text(char *filename, const char *text, size_t size, dep_list *D)
+{
+    scan_context C = {filename, text, D};
+    scan_includes(text, size, add_include, &C);
+}
+
+// Scans filename, which was included from includer at position at (NULL for the input file)
+static void scan_file(char *filename, const char *includer, const char *includer_text, const char *at, dep_list *D)
+{
+    long loaded_size;
+    char *loaded = ioload_take(filename, &loaded_size);
+    if (loaded)
+    {
+        scan_text(filename, loaded, loaded_size, D);
+        mem_free(loaded);
+        return;
+    }
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (D->keep_going)
+        {
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        if (includer)
+            fprintf(stderr, "Lexer error in file %s line %d at text %s: Cannot open include file\n", includer, line_at(includer_text, at), filename);
+        else
+            fprintf(stderr, "Error: No such input file %s\n", filename);
+        exit(1);
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Cannot map input file %s\n", filename);
+        exit(1);
+    }
+    scan_text(filename, text, st.st_size, D);
+    munmap(text, st.st_size);
+}
+
+// Collects every file filename includes, directly or not
+void scan_dependencies(char *filename, dep_list *D)
+{
+    strtab_add(&D->visited, filename);
+    scan_file(filename, NULL, NULL, NULL, D);
+}
+
+// Writes "target: filename deps..." in make syntax, wrapping long lines
+void write_dependency_rule(FILE *output, char *target, char *filename, dep_list *D)
+{
+    size_t column = fprintf(output, "%s: %s", target, filename);
+    for (size_t i = 0; i < D->count; i++)
+    {
+        if (column + strlen(D->files[i]) + 1 > 78)
+        {
+            fprintf(output, " \\\n ");
+            column = 1;
+        }
+        column += fprintf(output, " %s", D->files[i]);
+    }
+    fprintf(output, "\n");
+}
@@ -0,0 +1,28 @@
+#include <stdio.h> // For FILE type
+#ifndef DEPSCAN_H
+#define DEPSCAN_H
+
+#include <stdbool.h>
+#include "strtab.h"
+
+// Include files found while scanning, in the order they were first seen
+typedef struct {
+    char **files;
+    size_t count;
+    size_t capacity;
+    strtab visited;
+    bool keep_going; // Skip includes that cannot be opened instead of exiting
+} dep_list;
+
+// Called by scan_includes with each included file name and where its directive starts
+typedef void (*include_found)(void *context, const char *file, const char *at);
+
+void scan_includes(const char *text, size_t size, include_found found, void *context);
+
+void scan_dependencies(char *filename, dep_list *D);
+
+void write_dependency_rule(FILE *output, char *target, char *filename, dep_list *D);
+
+void dep_list_free(dep_list *D);
+
+#endif
@@ -0,0 +1,134 @@
+#include <string.h>
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t v)
+{
+    acc ^= round64(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void hash_init(hash_state *H, uint64_t seed)
+{
+    memset(H, 0, sizeof(*H));
+    H->seed = seed;
+    H->v[0] = seed + PRIME1 + PRIME2;
+    H->v[1] = seed + PRIME2;
+    H->v[2] = seed;
+    H->v[3] = seed - PRIME1;
+}
+
+void hash_update(hash_state *H, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    H->total += len;
+    if (H->buffered + len < 32)
+    {
+        memcpy(H->buffer + H->buffered, p, len);
+        H->buffered += len;
+        return;
+    }
+    if (H->buffered)
+    {
+        size_t fill = 32 - H->buffered;
+        memcpy(H->buffer + H->buffered, p, fill);
+        for (int i = 0; i < 4; i++)
+            H->v[i] = round64(H->v[i], read64(H->buffer + 8 * i));
+        p += fill;
+        len -= fill;
+        H->buffered = 0;
+    }
+    while (len >= 32)
+    {
+        for (int i = 0; i < 4; i++)
+            H->v[i] = round64(H->v[i], read64(p + 8 * i));
+        p += 32;
+        len -= 32;
+    }
+    memcpy(H->buffer, p, len);
+    H->buffered = len;
+}
+
+uint64_t hash_final(const hash_state *H)
+{
+    uint64_t h;
+    if (H->total >= 32)
+    {
+        h = rotl(H->v[0], 1) + rotl(H->v[1], 7) + rotl(H->v[2], 12) + rotl(H->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = merge_round(h, H->v[i]);
+    }
+    else
+    {
+        h = H->seed + PRIME5;
+    }
+    h += H->total;
+
+    const unsigned char *p = H->buffer;
+    size_t len = H->buffered;
+    while (len >= 8)
+    {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4)
+    {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0)
+    {
+        h ^= (*p++) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    hash_state H;
+    hash_init(&H, seed);
+    hash_update(&H, data, len);
+    return hash_final(&H);
+}
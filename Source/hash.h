@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <stddef.h>
+#ifndef HASH_H
+#define HASH_H
+
+// Streaming 64-bit hash, same results as XXH64
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+    uint64_t seed;
+} hash_state;
+
+void hash_init(hash_state *H, uint64_t seed);
+
+void hash_update(hash_state *H, const void *data, size_t len);
+
+uint64_t hash_final(const hash_state *H);
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+#endif
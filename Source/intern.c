@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "intern.h"
+#include "mem.h"
+
+/*
+Names are spread over shards by the top bits of their hash, each shard
+being an open addressing table of its own with its own lock. Looking a
+name up takes no lock: a slot is only ever written once, after the entry
+it points to is complete, and a table that grows is copied rather than
+rehashed in place, with the old one kept until exit for readers still
+probing it. Only a name not found takes its shard's lock to add it.
+*/
+#define SHARD_BITS 6
+#define SHARDS (1 << SHARD_BITS)
+
+// Names a shard can hold, so that an id fits in 32 bits with the shard in its low bits
+#define MAX_NAMES ((1u << (32 - SHARD_BITS)) - 1)
+
+// Entries of a shard are kept in pages that double in size, page k holding
+// FIRST_PAGE << k of them, so that an entry never moves once it is visible
+#define FIRST_PAGE 64
+#define MAX_PAGES 24
+
+// Bytes of text a thread takes for its arena at a time
+#define CHUNK_SIZE (16 * 1024)
+
+typedef struct {
+    const char *text;
+    uint32_t length;
+    unsigned tag;
+} entry;
+
+typedef struct table {
+    _Atomic uint64_t *slots; // Hash in the high word, index in the shard + 1 in the low word, 0 is empty
+    size_t mask;
+    struct table *retired; // Table this one replaced
+} table;
+
+typedef struct {
+    pthread_mutex_t lock;
+    _Atomic(table *) table;
+    atomic_uint count;
+    _Atomic(entry *) pages[MAX_PAGES];
+} shard;
+
+// Block of interned text, with the text following the header
+typedef struct chunk {
+    struct chunk *next;
+} chunk;
+
+static shard shards[SHARDS];
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+
+// Every chunk of every thread, to free at exit
+static _Atomic(chunk *) chunks;
+
+// Where the text of the next name this thread adds goes, so threads never share a chunk
+static _Thread_local char *arena_next;
+static _Thread_local size_t arena_left;
+
+static uint32_t hash_text(const char *text, size_t length)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        h = (h ^ (unsigned char)text[i]) * 16777619u;
+    return h;
+}
+
+static table *new_table(size_t nslots)
+{
+    table *T = mem_alloc(MEM_NAMES, sizeof(table));
+    T->slots = mem_calloc(MEM_NAMES, nslots, sizeof(uint64_t));
+    T->mask = nslots - 1;
+    T->retired = NULL;
+    return T;
+}
+
+static void release_all(void)
+{
+    for (unsigned s = 0; s < SHARDS; s++)
+    {
+        table *T = atomic_load(&shards[s].table);
+        while (T)
+        {
+            table *retired = T->retired;
+            mem_free((void *)T->slots);
+            mem_free(T);
+            T = retired;
+        }
+        for (unsigned k = 0; k < MAX_PAGES; k++)
+            mem_free(atomic_load(&shards[s].pages[k]));
+        pthread_mutex_destroy(&shards[s].lock);
+    }
+    chunk *c = atomic_load(&chunks);
+    while (c)
+    {
+        chunk *next = c->next;
+        mem_free(c);
+        c = next;
+    }
+}
+
+static void start(void)
+{
+    for (unsigned s = 0; s < SHARDS; s++)
+    {
+        pthread_mutex_init(&shards[s].lock, NULL);
+        atomic_init(&shards[s].table, new_table(FIRST_PAGE));
+    }
+    atexit(release_all);
+}
+
+static inline unsigned page_of(uint32_t index)
+{
+    return 31 - __builtin_clz(index / FIRST_PAGE + 1);
+}
+
+static inline uint32_t page_start(unsigned page)
+{
+    return FIRST_PAGE * ((1u << page) - 1);
+}
+
+static inline entry *entry_at(shard *S, uint32_t index)
+{
+    unsigned page = page_of(index);
+    return atomic_load_explicit(&S->pages[page], memory_order_acquire) + (index - page_start(page));
+}
+
+static inline uint32_t make_id(unsigned s, uint32_t index)
+{
+    return ((index << SHARD_BITS) | s) + 1;
+}
+
+static inline entry *entry_of(uint32_t id)
+{
+    return entry_at(&shards[(id - 1) & (SHARDS - 1)], (id - 1) >> SHARD_BITS);
+}
+
+// Copies text into this thread's arena. A long name gets a chunk of its own
+static const char *arena_copy(const char *text, size_t length)
+{
+    char *copy;
+    if (length + 1 > arena_left)
+    {
+        size_t size = length + 1 > CHUNK_SIZE / 4 ? length + 1 : CHUNK_SIZE;
+        chunk *c = mem_alloc(MEM_NAMES, sizeof(chunk) + size);
+        c->next = atomic_load_explicit(&chunks, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak(&chunks, &c->next, c))
+            ;
+        copy = (char *)(c + 1);
+        if (size == CHUNK_SIZE)
+        {
+            arena_next = copy + length + 1;
+            arena_left = size - length - 1;
+        }
+    }
+    else
+    {
+        copy = arena_next;
+        arena_next += length + 1;
+        arena_left -= length + 1;
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+static uint32_t find(shard *S, unsigned s, const table *T, uint32_t hash, const char *text, size_t length)
+{
+    for (size_t i = hash & T->mask;; i = (i + 1) & T->mask)
+    {
+        uint64_t slot = atomic_load_explicit(&T->slots[i], memory_order_acquire);
+        if (!slot)
+            return 0;
+        if ((uint32_t)(slot >> 32) != hash)
+            continue;
+        uint32_t index = (uint32_t)slot - 1;
+        const entry *e = entry_at(S, index);
+        if (e->length == length && memcmp(e->text, text, length) == 0)
+            return make_id(s, index);
+    }
+}
+
+static void place(table *T, uint64_t slot)
+{
+    size_t i = (slot >> 32) & T->mask;
+    while (atomic_load_explicit(&T->slots[i], memory_order_relaxed))
+        i = (i + 1) & T->mask;
+    atomic_store_explicit(&T->slots[i], slot, memory_order_release);
+}
+
+// Called with the shard locked
+static uint32_t add(shard *S, unsigned s, table *T, uint32_t hash, const char *text, size_t length)
+{
+    uint32_t index = atomic_load_explicit(&S->count, memory_order_relaxed);
+    if (index >= MAX_NAMES)
+    {
+        fprintf(stderr, "Error: Too many distinct names\n");
+        exit(1);
+    }
+    unsigned page = page_of(index);
+    if (index == page_start(page))
+        atomic_store_explicit(&S->pages[page], mem_alloc(MEM_NAMES, ((size_t)FIRST_PAGE << page) * sizeof(entry)), memory_order_release);
+    entry *e = entry_at(S, index);
+    e->text = arena_copy(text, length);
+    e->length = length;
+    e->tag = 0;
+
+    if ((index + 1) * 2 > T->mask + 1)
+    {
+        table *bigger = new_table((T->mask + 1) * 2);
+        for (size_t i = 0; i <= T->mask; i++)
+        {
+            uint64_t slot = atomic_load_explicit(&T->slots[i], memory_order_relaxed);
+            if (slot)
+                place(bigger, slot);
+        }
+        bigger->retired = T;
+        atomic_store_explicit(&S->table, bigger, memory_order_release);
+        T = bigger;
+    }
+    place(T, ((uint64_t)hash << 32) | (index + 1));
+    atomic_store_explicit(&S->count, index + 1, memory_order_relaxed);
+    return make_id(s, index);
+}
+
+void intern_start(void)
+{
+    pthread_once(&started, start);
+}
+
+// Returns the id of text, adding it the first time it is seen
+uint32_t intern(const char *text, size_t length)
+{
+    pthread_once(&started, start);
+    uint32_t hash = hash_text(text, length);
+    unsigned s = hash >> (32 - SHARD_BITS);
+    shard *S = &shards[s];
+    uint32_t id = find(S, s, atomic_load_explicit(&S->table, memory_order_acquire), hash, text, length);
+    if (id)
+        return id;
+
+    pthread_mutex_lock(&S->lock);
+    table *T = atomic_load_explicit(&S->table, memory_order_relaxed);
+    id = find(S, s, T, hash, text, length); // Another thread may have added it since
+    if (!id)
+        id = add(S, s, T, hash, text, length);
+    pthread_mutex_unlock(&S->lock);
+    return id;
+}
+
+const char *intern_text(uint32_t id)
+{
+    return entry_of(id)->text;
+}
+
+size_t intern_length(uint32_t id)
+{
+    return entry_of(id)->length;
+}
+
+void intern_set_tag(uint32_t id, unsigned tag)
+{
+    entry_of(id)->tag = tag;
+}
+
+unsigned intern_tag(uint32_t id)
+{
+    return entry_of(id)->tag;
+}
+
+size_t intern_count(void)
+{
+    size_t count = 0;
+    for (unsigned s = 0; s < SHARDS; s++)
+        count += atomic_load_explicit(&shards[s].count, memory_order_relaxed);
+    return count;
+}
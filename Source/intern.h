@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <stddef.h>
+#ifndef INTERN_H
+#define INTERN_H
+
+/*
+Process-wide table of names, shared by every thread. The same text always
+gets the same id, whichever thread or file it was seen in first, so two
+names are equal exactly when their ids are. Id 0 is never given out.
+Interned text stays put until the process exits.
+*/
+uint32_t intern(const char *text, size_t length);
+
+// Sets the table up, which the first intern does otherwise. Exit handlers
+// registered after this run while interned text is still there
+void intern_start(void);
+
+// NUL-terminated text of a name
+const char *intern_text(uint32_t id);
+
+size_t intern_length(uint32_t id);
+
+// A small number kept with a name, 0 until set. Set tags before other threads look the name up
+void intern_set_tag(uint32_t id, unsigned tag);
+
+unsigned intern_tag(uint32_t id);
+
+// Number of distinct names interned so far
+size_t intern_count(void);
+
+#endif
@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "ioload.h"
+#include "depscan.h"
+#include "hash.h"
+#include "mem.h"
+
+// Most reads in flight at once, and most pread threads
+#define IOLOAD_MAX_DEPTH 256
+
+// Largest single read, the kernel caps one read at just under 2 GB
+#define IOLOAD_MAX_READ (1L << 30)
+
+#define LOAD_BUCKETS 4096
+
+enum {
+    LOAD_QUEUED,  // Waiting for a free read slot
+    LOAD_READING, // Being read
+    LOAD_DONE,    // Read, text holds the contents
+    LOAD_FAILED,  // Could not be opened or read
+    LOAD_TAKEN    // Handed out by ioload_take, or left for the caller to read
+};
+
+typedef struct load_entry {
+    char *name;
+    int state;
+    char *text; // NUL-terminated contents when LOAD_DONE
+    long size;
+    struct load_entry *next_queued;
+    struct load_entry *next_in_bucket;
+} load_entry;
+
+/*
+Every file ever requested has an entry, found by name through the hash
+buckets, so no file is read twice. Queued entries also form a FIFO. All of
+it is guarded by lock: loader threads wait on work for entries to read,
+and ioload_take waits on loaded for a read to finish.
+*/
+static load_entry *buckets[LOAD_BUCKETS];
+static load_entry *queue_head, *queue_tail;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+static bool started, stopping;
+static unsigned depth;
+static pthread_t threads[IOLOAD_MAX_DEPTH];
+static unsigned nthreads;
+static const char *backend;
+
+static load_entry **bucket_of(const char *name)
+{
+    return &buckets[hash_bytes(name, strlen(name), 0) % LOAD_BUCKETS];
+}
+
+static load_entry *find_entry(const char *name)
+{
+    for (load_entry *E = *bucket_of(name); E; E = E->next_in_bucket)
+    {
+        if (strcmp(E->name, name) == 0)
+            return E;
+    }
+    return NULL;
+}
+
+// Queues filename unless it was requested before
+void ioload_request(const char *filename)
+{
+    if (!started)
+        return;
+    pthread_mutex_lock(&lock);
+    if (!stopping && !find_entry(filename))
+    {
+        load_entry *E = mem_calloc(MEM_INCLUDES, 1, sizeof(load_entry));
+        E->name = mem_strdup(MEM_INCLUDES, filename);
+        E->state = LOAD_QUEUED;
+        load_entry **bucket = bucket_of(filename);
+        E->next_in_bucket = *bucket;
+        *bucket = E;
+        if (queue_tail)
+            queue_tail->next_queued = E;
+        else
+            queue_head = E;
+        queue_tail = E;
+        pthread_cond_signal(&work);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Next entry to read, marked as being read, or NULL. Called with lock held
+static load_entry *next_queued(void)
+{
+    while (queue_head && !stopping)
+    {
+        load_entry *E = queue_head;
+        queue_head = E->next_queued;
+        if (!queue_head)
+            queue_tail = NULL;
+        if (E->state == LOAD_QUEUED)
+        {
+            E->state = LOAD_READING;
+            return E;
+        }
+    }
+    return NULL;
+}
+
+static void queue_include(void *context, const char *file, const char *at)
+{
+    (void)context;
+    (void)at;
+    ioload_request(file);
+}
+
+// Publishes the result of reading E, queueing the files it includes first
+static void finish(load_entry *E, char *text, long size)
+{
+    if (text)
+    {
+        text[size] = '\0';
+        scan_includes(text, size, queue_include, NULL);
+    }
+    pthread_mutex_lock(&lock);
+    E->state = text ? LOAD_DONE : LOAD_FAILED;
+    E->text = text;
+    E->size = size;
+    pthread_cond_broadcast(&loaded);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+Returns the contents of filename (NUL-terminated, freed with mem_free) and
+sets *size, waiting if it is being read. Returns NULL if it was never
+requested, could not be read or was taken before, and also if its read has
+not started yet: then the caller reads it sooner by itself.
+*/
+char *ioload_take(const char *filename, long *size)
+{
+    if (!started)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    load_entry *E = find_entry(filename);
+    char *text = NULL;
+    if (E && E->state == LOAD_QUEUED)
+        E->state = LOAD_TAKEN;
+    while (E && E->state == LOAD_READING)
+        pthread_cond_wait(&loaded, &lock);
+    if (E && E->state == LOAD_DONE)
+    {
+        text = E->text;
+        *size = E->size;
+        E->text = NULL;
+        E->state = LOAD_TAKEN;
+    }
+    pthread_mutex_unlock(&lock);
+    return text;
+}
+
+// Opens filename and allocates room for all of it, returns the descriptor or -1
+static int open_input(const char *filename, char **text, long *size)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    *text = mem_alloc(MEM_INCLUDES, *size + 1);
+    return fd;
+}
+
+// Fallback loader: each thread reads one whole file at a time with pread
+static void *pread_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (true)
+    {
+        load_entry *E = next_queued();
+        if (!E)
+        {
+            if (stopping)
+                break;
+            pthread_cond_wait(&work, &lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+        char *text = NULL;
+        long size = 0, done = 0;
+        int fd = open_input(E->name, &text, &size);
+        while (fd >= 0 && done < size)
+        {
+            ssize_t n = pread(fd, text + done, size - done < IOLOAD_MAX_READ ? size - done : IOLOAD_MAX_READ, done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (fd >= 0)
+            close(fd);
+        if (fd < 0 || done < size)
+        {
+            mem_free(text);
+            text = NULL;
+        }
+        finish(E, text, size);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/*
+io_uring loader, through the raw system calls as there is no liburing: one
+thread keeps up to depth reads in flight on a ring. It only blocks in the
+kernel when every slot is busy or there is nothing queued, so opening the
+next file overlaps with reads already submitted.
+*/
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring;
+
+// A read in flight, the ring hands back its address as user_data
+typedef struct {
+    load_entry *E; // NULL when the slot is free
+    int fd;
+    char *text;
+    long size;
+    long done;
+    struct iovec iov;
+} uring_read;
+
+static uring ring;
+
+static bool uring_setup(uring *R, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    R->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (R->fd < 0)
+        return false;
+    R->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    R->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (R->cq_ring_size > R->sq_ring_size)
+            R->sq_ring_size = R->cq_ring_size;
+        R->cq_ring_size = R->sq_ring_size;
+    }
+    R->sq_ring = mmap(NULL, R->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_SQ_RING);
+    R->cq_ring = R->sq_ring;
+    if (R->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        R->cq_ring = mmap(NULL, R->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_CQ_RING);
+    R->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    R->sqes = R->cq_ring == MAP_FAILED ? MAP_FAILED :
+              mmap(NULL, R->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_SQES);
+    if (R->sqes == MAP_FAILED)
+    {
+        if (R->cq_ring != MAP_FAILED && R->cq_ring != R->sq_ring)
+            munmap(R->cq_ring, R->cq_ring_size);
+        if (R->sq_ring != MAP_FAILED)
+            munmap(R->sq_ring, R->sq_ring_size);
+        close(R->fd);
+        return false;
+    }
+    char *sq = R->sq_ring, *cq = R->cq_ring;
+    R->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    R->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    R->sq_array = (unsigned *)(sq + p.sq_off.array);
+    R->cq_head = (unsigned *)(cq + p.cq_off.head);
+    R->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    R->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    R->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+static void uring_close(uring *R)
+{
+    munmap(R->sqes, R->sqes_size);
+    if (R->cq_ring != R->sq_ring)
+        munmap(R->cq_ring, R->cq_ring_size);
+    munmap(R->sq_ring, R->sq_ring_size);
+    close(R->fd);
+}
+
+static int uring_enter(uring *R, unsigned submit, unsigned wait)
+{
+    int n;
+    do
+        n = syscall(__NR_io_uring_enter, R->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Submits the rest of r's file
+static void submit_read(uring *R, uring_read *r)
+{
+    long left = r->size - r->done;
+    r->iov.iov_base = r->text + r->done;
+    r->iov.iov_len = left < IOLOAD_MAX_READ ? left : IOLOAD_MAX_READ;
+    unsigned tail = *R->sq_tail;
+    unsigned index = tail & *R->sq_mask;
+    struct io_uring_sqe *sqe = &R->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = r->fd;
+    sqe->addr = (uintptr_t)&r->iov;
+    sqe->len = 1;
+    sqe->off = r->done;
+    sqe->user_data = (uintptr_t)r;
+    R->sq_array[index] = index;
+    __atomic_store_n(R->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (uring_enter(R, 1, 0) < 0)
+    {
+        fprintf(stderr, "Error: Cannot submit a read of %s to io_uring\n", r->E->name);
+        exit(1);
+    }
+}
+
+// Ends r's read, successful or not, and frees its slot
+static void end_read(uring_read *r, bool ok)
+{
+    close(r->fd);
+    if (!ok)
+    {
+        mem_free(r->text);
+        r->text = NULL;
+    }
+    finish(r->E, r->text, r->done);
+    r->E = NULL;
+}
+
+// Waits for at least one completion and handles all there are, returns the number of files finished
+static unsigned reap(uring *R)
+{
+    unsigned finished = 0;
+    uring_enter(R, 0, 1);
+    unsigned head = *R->cq_head;
+    while (head != __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &R->cqes[head & *R->cq_mask];
+        uring_read *r = (uring_read *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(R->cq_head, head, __ATOMIC_RELEASE);
+        if (res < 0)
+        {
+            end_read(r, false);
+            finished++;
+            continue;
+        }
+        r->done += res;
+        if (res > 0 && r->done < r->size)
+        {
+            submit_read(R, r);
+            continue;
+        }
+        end_read(r, true); // A file that shrank since fstat ends where the reads did
+        finished++;
+    }
+    return finished;
+}
+
+static void *uring_thread(void *arg)
+{
+    uring *R = arg;
+    uring_read *reads = mem_calloc(MEM_INCLUDES, depth, sizeof(uring_read));
+    unsigned in_flight = 0;
+    pthread_mutex_lock(&lock);
+    while (true)
+    {
+        load_entry *E;
+        while (in_flight < depth && (E = next_queued()) != NULL)
+        {
+            pthread_mutex_unlock(&lock);
+            uring_read *r = reads;
+            while (r->E)
+                r++;
+            r->E = E;
+            r->done = 0;
+            r->fd = open_input(E->name, &r->text, &r->size);
+            if (r->fd < 0)
+            {
+                finish(E, NULL, 0);
+                r->E = NULL;
+            }
+            else if (r->size == 0)
+                end_read(r, true);
+            else
+            {
+                submit_read(R, r);
+                in_flight++;
+            }
+            pthread_mutex_lock(&lock);
+        }
+        if (in_flight == 0)
+        {
+            if (stopping)
+                break;
+            pthread_cond_wait(&work, &lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+        in_flight -= reap(R);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    mem_free(reads);
+    return NULL;
+}
+
+/*
+Starts the loader with up to depth reads in flight. io_uring is tried
+first (when use_io_uring is set), a pool of depth pread threads is used if
+the kernel does not have it or does not allow it.
+*/
+void ioload_start(unsigned reads, bool use_io_uring)
+{
+    if (started || reads == 0)
+        return;
+    depth = reads < IOLOAD_MAX_DEPTH ? reads : IOLOAD_MAX_DEPTH;
+    started = true;
+    stopping = false;
+    atexit(ioload_stop);
+    if (use_io_uring && uring_setup(&ring, depth))
+    {
+        backend = "io_uring";
+        if (pthread_create(&threads[0], NULL, uring_thread, &ring) == 0)
+        {
+            nthreads = 1;
+            return;
+        }
+        uring_close(&ring);
+    }
+    backend = "threads";
+    for (unsigned i = 0; i < depth; i++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, pread_thread, NULL) == 0)
+            nthreads++;
+    }
+    if (nthreads == 0)
+    {
+        // No threads to read with: callers read everything themselves
+        started = false;
+        backend = NULL;
+    }
+}
+
+// Waits for the reads in flight, then frees every file that was not taken
+void ioload_stop(void)
+{
+    if (!started)
+        return;
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        if (pthread_equal(threads[i], pthread_self()))
+            return; // Exiting from a loader thread, the process is going away anyway
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+    for (unsigned i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    if (strcmp(backend, "io_uring") == 0)
+        uring_close(&ring);
+    for (size_t b = 0; b < LOAD_BUCKETS; b++)
+    {
+        load_entry *E = buckets[b];
+        while (E)
+        {
+            load_entry *next = E->next_in_bucket;
+            mem_free(E->text);
+            mem_free(E->name);
+            mem_free(E);
+            E = next;
+        }
+        buckets[b] = NULL;
+    }
+    queue_head = queue_tail = NULL;
+    nthreads = 0;
+    started = false;
+    backend = NULL;
+}
+
+const char *ioload_backend(void)
+{
+    return backend;
+}
@@ -0,0 +1,25 @@
+#include <stdbool.h>
+#ifndef IOLOAD_H
+#define IOLOAD_H
+
+// Reads kept in flight at once when --prefetch is given without a number
+#define IOLOAD_DEFAULT_DEPTH 8
+
+/*
+Reads input files in the background while the compiler works on others.
+Files are read whole, with io_uring when the kernel allows it and with a
+pool of pread threads otherwise. Each file read is scanned for #include
+"..." directives, and the files they name are queued as well.
+*/
+void ioload_start(unsigned depth, bool use_io_uring);
+
+void ioload_request(const char *filename);
+
+char *ioload_take(const char *filename, long *size);
+
+void ioload_stop(void);
+
+// "io_uring" or "threads" once started, NULL otherwise
+const char *ioload_backend(void);
+
+#endif
@@ -0,0 +1,2034 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "ir.h"
+#include "lexer.h"
+#include "intern.h"
+#include "mem.h"
+
+#define NO_BLOCK UINT32_MAX
+#define NO_VAR UINT32_MAX
+
+// Makes room for one more item in items, an array of count items of size bytes
+static void *reserve(void *items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+    *capacity = *capacity ? *capacity * 2 : 16;
+    return mem_realloc(MEM_IR, items, (size_t)*capacity * size);
+}
+
+static void module_error(const ir_module *M, unsigned line, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "IR error in file %s line %u: ", M->filename, line);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+// Name maps, open addressing on the interned id, which is never 0
+
+static uint32_t names_slot(const ir_names *N, uint32_t name)
+{
+    uint32_t i = (name * 2654435761u) & (N->nslots - 1);
+    while (N->keys[i] && N->keys[i] != name)
+        i = (i + 1) & (N->nslots - 1);
+    return i;
+}
+
+static bool names_get(const ir_names *N, uint32_t name, uint32_t *value)
+{
+    if (!N->nslots)
+        return false;
+    uint32_t i = names_slot(N, name);
+    if (!N->keys[i])
+        return false;
+    *value = N->values[i];
+    return true;
+}
+
+static void names_put(ir_names *N, uint32_t name, uint32_t value)
+{
+    if ((N->count + 1) * 2 > N->nslots)
+    {
+        ir_names old = *N;
+        N->nslots = old.nslots ? old.nslots * 2 : 16;
+        N->keys = mem_calloc(MEM_IR, N->nslots, sizeof(uint32_t));
+        N->values = mem_alloc(MEM_IR, N->nslots * sizeof(uint32_t));
+        for (uint32_t i = 0; i < old.nslots; i++)
+        {
+            if (!old.keys[i])
+                continue;
+            uint32_t j = names_slot(N, old.keys[i]);
+            N->keys[j] = old.keys[i];
+            N->values[j] = old.values[i];
+        }
+        mem_free(old.keys);
+        mem_free(old.values);
+    }
+    uint32_t i = names_slot(N, name);
+    if (!N->keys[i])
+    {
+        N->keys[i] = name;
+        N->count++;
+    }
+    N->values[i] = value;
+}
+
+static void names_free(ir_names *N)
+{
+    mem_free(N->keys);
+    mem_free(N->values);
+}
+
+void ir_module_init(ir_module *M, char *filename)
+{
+    memset(M, 0, sizeof(*M));
+    M->filename = filename;
+}
+
+ir_function *ir_find_function(const ir_module *M, uint32_t name)
+{
+    uint32_t i;
+    return names_get(&M->function_names, name, &i) ? &M->functions[i] : NULL;
+}
+
+ir_global *ir_find_global(const ir_module *M, uint32_t name)
+{
+    uint32_t i;
+    return names_get(&M->global_names, name, &i) ? &M->globals[i] : NULL;
+}
+
+const ir_struct *ir_find_struct(const ir_module *M, uint32_t name)
+{
+    uint32_t i;
+    return names_get(&M->struct_names, name, &i) ? &M->structs[i] : NULL;
+}
+
+static const ir_struct *find_struct(const ir_module *M, uint32_t name, unsigned line)
+{
+    const ir_struct *S = ir_find_struct(M, name);
+    if (!S)
+        module_error(M, line, "Unknown struct %s", intern_text(name));
+    return S;
+}
+
+static unsigned value_type(ast_type type)
+{
+    if (type.base == AST_TYPE_VOID)
+        return IR_VOID;
+    return type.base == AST_TYPE_FLOAT ? IR_FLOAT : IR_INT;
+}
+
+// Bytes taken by an object of type, an array of length of them when length is above 0
+static int64_t object_size(const ir_module *M, ast_type type, int64_t length, unsigned line)
+{
+    int64_t size = IR_SCALAR_SIZE;
+    if (type.base == AST_TYPE_STRUCT)
+        size = find_struct(M, type.name, line)->size;
+    else if (type.base == AST_TYPE_VOID)
+        module_error(M, line, "Variable of type void");
+    return length > 0 ? size * length : size;
+}
+
+void ir_define_struct(ir_module *M, const ast *T, uint32_t name, uint32_t members, unsigned line)
+{
+    M->structs = reserve(M->structs, M->nstructs, &M->structs_capacity, sizeof(ir_struct));
+    ir_struct *S = &M->structs[M->nstructs];
+    S->name = name;
+    S->first = M->nmembers;
+    S->count = 0;
+    int64_t offset = 0;
+    for (uint32_t m = members; m; m = ast_at(T, m)->next)
+    {
+        const ast_node *decl = ast_at(T, m);
+        for (uint32_t i = S->first; i < M->nmembers; i++)
+        {
+            if (M->members[i].name == decl->name)
+                module_error(M, decl->line, "Duplicate member %s", intern_text(decl->name));
+        }
+        M->members = reserve(M->members, M->nmembers, &M->members_capacity, sizeof(ir_member));
+        ir_member *member = &M->members[M->nmembers++];
+        member->name = decl->name;
+        member->type = decl->type;
+        member->length = decl->value.i;
+        member->offset = offset;
+        offset += object_size(M, decl->type, decl->value.i, decl->line);
+        S->count++;
+    }
+    if (offset > UINT32_MAX)
+        module_error(M, line, "Struct %s is too large", intern_text(name));
+    S->size = offset ? offset : IR_SCALAR_SIZE;
+    // A later definition of the same name, in another function, hides this one from then on
+    names_put(&M->struct_names, name, M->nstructs++);
+}
+
+// Value of a constant expression, for the initializers of globals. Gives the IR type, or IR_VOID when it is not constant
+static unsigned fold_initializer(const ast *T, uint32_t n, int64_t *i, double *d)
+{
+    const ast_node *x = ast_at(T, n);
+    int64_t ia, ib;
+    double da, db;
+    unsigned ta, tb;
+    switch (x->kind)
+    {
+    case AST_INT:
+        *i = x->value.i;
+        return IR_INT;
+    case AST_FLOAT:
+        *d = x->value.d;
+        return IR_FLOAT;
+    case AST_CAST:
+        ta = fold_initializer(T, x->a, &ia, &da);
+        if (ta == IR_VOID || value_type(x->type) == IR_VOID)
+            return IR_VOID;
+        if (value_type(x->type) == IR_FLOAT)
+            *d = ta == IR_FLOAT ? da : (double)ia;
+        else
+            *i = ta == IR_INT ? ia : (int64_t)da;
+        return value_type(x->type);
+    case AST_UNARY:
+        ta = fold_initializer(T, x->a, &ia, &da);
+        if (ta == IR_FLOAT && x->op == TOKEN_MINUS)
+        {
+            *d = -da;
+            return IR_FLOAT;
+        }
+        if (ta != IR_INT)
+            return IR_VOID;
+        *i = x->op == TOKEN_MINUS ? (int64_t)(0 - (uint64_t)ia) : x->op == TOKEN_TILDE ? ~ia : !ia;
+        return IR_INT;
+    case AST_BINARY:
+        ta = fold_initializer(T, x->a, &ia, &da);
+        tb = fold_initializer(T, x->b, &ib, &db);
+        if (ta == IR_VOID || tb == IR_VOID)
+            return IR_VOID;
+        if (ta == IR_FLOAT || tb == IR_FLOAT)
+        {
+            if (ta == IR_INT)
+                da = ia;
+            if (tb == IR_INT)
+                db = ib;
+            switch (x->op)
+            {
+            case TOKEN_PLUS:
+                *d = da + db;
+                return IR_FLOAT;
+            case TOKEN_MINUS:
+                *d = da - db;
+                return IR_FLOAT;
+            case TOKEN_ASTERISK:
+                *d = da * db;
+                return IR_FLOAT;
+            case TOKEN_SLASH:
+                *d = da / db;
+                return IR_FLOAT;
+            }
+            return IR_VOID;
+        }
+        switch (x->op)
+        {
+        case TOKEN_PLUS:
+            *i = (int64_t)((uint64_t)ia + (uint64_t)ib);
+            return IR_INT;
+        case TOKEN_MINUS:
+            *i = (int64_t)((uint64_t)ia - (uint64_t)ib);
+            return IR_INT;
+        case TOKEN_ASTERISK:
+            *i = (int64_t)((uint64_t)ia * (uint64_t)ib);
+            return IR_INT;
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+            if (ib == 0 || (ia == INT64_MIN && ib == -1))
+                return IR_VOID;
+            *i = x->op == TOKEN_SLASH ? ia / ib : ia % ib;
+            return IR_INT;
+        case TOKEN_AMPERSAND:
+            *i = ia & ib;
+            return IR_INT;
+        case TOKEN_PIPE:
+            *i = ia | ib;
+            return IR_INT;
+        }
+        return IR_VOID;
+    }
+    return IR_VOID;
+}
+
+void ir_define_global(ir_module *M, const ast *T, uint32_t decl)
+{
+    const ast_node *x = ast_at(T, decl);
+    if (ir_find_global(M, x->name))
+        module_error(M, x->line, "Duplicate global variable %s", intern_text(x->name));
+    M->globals = reserve(M->globals, M->nglobals, &M->globals_capacity, sizeof(ir_global));
+    ir_global *G = &M->globals[M->nglobals];
+    memset(G, 0, sizeof(*G));
+    G->name = x->name;
+    G->decl = x->type;
+    G->length = x->value.i;
+    int64_t size = object_size(M, x->type, x->value.i, x->line);
+    if (size > UINT32_MAX)
+        module_error(M, x->line, "Global variable %s is too large", intern_text(x->name));
+    G->size = size;
+    G->type = x->value.i || x->type.base == AST_TYPE_STRUCT ? IR_VOID : value_type(x->type);
+    if (x->a)
+    {
+        if (G->type == IR_VOID)
+            module_error(M, x->line, "Arrays and structs cannot be initialized");
+        int64_t i = 0;
+        double d = 0;
+        unsigned type = fold_initializer(T, x->a, &i, &d);
+        if (type == IR_VOID)
+            module_error(M, x->line, "Initializer of %s is not a constant", intern_text(x->name));
+        if (G->type == IR_FLOAT)
+            G->init.d = type == IR_FLOAT ? d : (double)i;
+        else
+            G->init.i = type == IR_INT ? i : (int64_t)d;
+    }
+    names_put(&M->global_names, x->name, M->nglobals++);
+}
+
+// Building a function
+
+static uint32_t pool_reserve(ir_function *F, uint32_t count)
+{
+    while (F->pool_size + count > F->pool_capacity)
+    {
+        F->pool_capacity = F->pool_capacity ? F->pool_capacity * 2 : 256;
+        F->pool = mem_realloc(MEM_IR, F->pool, F->pool_capacity * sizeof(uint32_t));
+    }
+    uint32_t start = F->pool_size;
+    if (count)
+        memset(F->pool + start, 0, count * sizeof(uint32_t));
+    F->pool_size += count;
+    return start;
+}
+
+static void list_push(ir_function *F, ir_list *L, uint32_t value)
+{
+    if (L->count == L->capacity)
+    {
+        uint32_t capacity = L->capacity ? L->capacity * 2 : 2;
+        uint32_t start = pool_reserve(F, capacity);
+        memcpy(F->pool + start, F->pool + L->start, L->count * sizeof(uint32_t));
+        L->start = start;
+        L->capacity = capacity;
+    }
+    F->pool[L->start + L->count++] = value;
+}
+
+static uint32_t add_inst(ir_function *F, unsigned op, unsigned type)
+{
+    F->insts = reserve(F->insts, F->ninsts, &F->insts_capacity, sizeof(ir_inst));
+    ir_inst *I = &F->insts[F->ninsts];
+    memset(I, 0, sizeof(*I));
+    I->op = op;
+    I->type = type;
+    return F->ninsts++;
+}
+
+static uint32_t add_block(ir_function *F)
+{
+    F->blocks = reserve(F->blocks, F->nblocks, &F->blocks_capacity, sizeof(ir_block));
+    memset(&F->blocks[F->nblocks], 0, sizeof(ir_block));
+    return F->nblocks++;
+}
+
+static void append(ir_function *F, uint32_t block, uint32_t inst)
+{
+    ir_block *B = &F->blocks[block];
+    F->insts[inst].block = block;
+    F->insts[inst].next = 0;
+    if (B->last)
+        F->insts[B->last].next = inst;
+    else
+        B->first = inst;
+    B->last = inst;
+}
+
+static void prepend(ir_function *F, uint32_t block, uint32_t inst)
+{
+    ir_block *B = &F->blocks[block];
+    F->insts[inst].block = block;
+    F->insts[inst].next = B->first;
+    B->first = inst;
+    if (!B->last)
+        B->last = inst;
+}
+
+static void add_edge(ir_function *F, uint32_t from, uint32_t to)
+{
+    list_push(F, &F->blocks[from].succs, to);
+    list_push(F, &F->blocks[to].preds, from);
+}
+
+static uint32_t resolve(const ir_function *F, uint32_t v)
+{
+    while (v && F->insts[v].op == IR_COPY)
+        v = F->insts[v].a;
+    return v;
+}
+
+// Takes an instruction out of its block
+void ir_unlink(ir_function *F, uint32_t inst)
+{
+    ir_block *B = &F->blocks[F->insts[inst].block];
+    uint32_t prev = 0;
+    for (uint32_t i = B->first; i; prev = i, i = F->insts[i].next)
+    {
+        if (i != inst)
+            continue;
+        if (prev)
+            F->insts[prev].next = F->insts[i].next;
+        else
+            B->first = F->insts[i].next;
+        if (B->last == i)
+            B->last = prev;
+        F->insts[i].next = 0;
+        return;
+    }
+}
+
+uint32_t ir_edge_operand(const ir_function *F, uint32_t from, uint32_t k)
+{
+    const ir_block *B = &F->blocks[from];
+    uint32_t to = ir_list_at(F, B->succs)[k];
+    // A branch can reach the same block by both edges, which then has two predecessors from
+    uint32_t repeat = 0;
+    for (uint32_t j = 0; j < k; j++)
+        repeat += ir_list_at(F, B->succs)[j] == to;
+    const ir_block *T = &F->blocks[to];
+    for (uint32_t j = 0; j < T->preds.count; j++)
+    {
+        if (ir_list_at(F, T->preds)[j] == from && repeat-- == 0)
+            return j;
+    }
+    return 0;
+}
+
+void ir_remove_edge(ir_function *F, uint32_t from, uint32_t to)
+{
+    ir_list *succs = &F->blocks[from].succs;
+    uint32_t *s = ir_list_at(F, *succs);
+    for (uint32_t i = 0; i < succs->count; i++)
+    {
+        if (s[i] == to)
+        {
+            memmove(s + i, s + i + 1, (succs->count - i - 1) * sizeof(uint32_t));
+            succs->count--;
+            break;
+        }
+    }
+    ir_block *B = &F->blocks[to];
+    uint32_t *p = ir_list_at(F, B->preds);
+    uint32_t k = 0;
+    while (k < B->preds.count && p[k] != from)
+        k++;
+    if (k == B->preds.count)
+        return;
+    memmove(p + k, p + k + 1, (B->preds.count - k - 1) * sizeof(uint32_t));
+    B->preds.count--;
+    // Phis have an operand per predecessor, in the same order
+    for (uint32_t i = B->first; i; i = F->insts[i].next)
+    {
+        ir_inst *I = &F->insts[i];
+        if (I->op != IR_PHI || k >= I->b)
+            continue;
+        memmove(F->pool + I->a + k, F->pool + I->a + k + 1, (I->b - k - 1) * sizeof(uint32_t));
+        I->b--;
+    }
+}
+
+/*
+SSA construction follows Braun et al., "Simple and Efficient Construction
+of Static Single Assignment Form": each block maps variables to their
+current value, reading a variable a block does not define looks in its
+predecessors, and a block only gets phis once it is sealed, when all of its
+predecessors are known. Phis that turn out to merge a single value become
+copies, which ir_simplify removes with the rest.
+*/
+
+typedef struct {
+    uint32_t name;
+    ast_type type;
+    int64_t length; // 0 for a scalar, -1 for an array parameter
+    uint32_t var; // SSA variable of a scalar, NO_VAR otherwise
+    uint32_t address; // Instruction giving the address of an array or a struct
+} local;
+
+// Where an lvalue lives: in an SSA variable, or in memory at address
+typedef struct {
+    uint32_t var;
+    uint32_t address;
+    ast_type type;
+    int64_t length;
+} place;
+
+typedef struct {
+    uint32_t block;
+    uint32_t var;
+    uint32_t phi;
+} pending_phi;
+
+// Where break and continue go. A switch only takes break, and has the continue of the loop around it
+typedef struct {
+    uint32_t break_block;
+    uint32_t continue_block; // NO_BLOCK in a switch outside any loop
+} loop;
+
+// A case or default label of a switch, and the block it starts
+typedef struct {
+    uint32_t node;
+    uint32_t block;
+    int64_t value;
+} switch_label;
+
+typedef struct {
+    ir_module *M;
+    ir_function *F;
+    const ast *T;
+    uint32_t block; // Where code goes, NO_BLOCK after a jump until there is more
+    unsigned line; // Of the node being lowered, for errors
+    local *locals;
+    uint32_t nlocals;
+    uint32_t locals_capacity;
+    uint8_t *var_types;
+    uint32_t nvars;
+    uint32_t vars_capacity;
+    uint64_t *def_keys; // Value of a variable in a block, by var << 32 | block, plus one so 0 is empty
+    uint32_t *def_values;
+    uint32_t def_slots;
+    uint32_t def_count;
+    pending_phi *pending; // Phis of blocks not sealed yet, whose operands are still to be read
+    uint32_t npending;
+    uint32_t pending_capacity;
+    loop *loops;
+    uint32_t nloops;
+    uint32_t loops_capacity;
+    switch_label *labels; // Of the switches being lowered, each in source order, so by node
+    uint32_t nlabels;
+    uint32_t labels_capacity;
+    uint32_t switch_labels; // First label of the innermost switch
+} builder;
+
+static void lower_error(const builder *B, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "IR error in file %s line %u: ", B->M->filename, B->line);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+static uint32_t def_slot(const builder *B, uint64_t key)
+{
+    uint32_t i = (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (B->def_slots - 1);
+    while (B->def_keys[i] && B->def_keys[i] != key)
+        i = (i + 1) & (B->def_slots - 1);
+    return i;
+}
+
+static void write_var(builder *B, uint32_t var, uint32_t block, uint32_t value)
+{
+    if ((B->def_count + 1) * 2 > B->def_slots)
+    {
+        uint64_t *keys = B->def_keys;
+        uint32_t *values = B->def_values;
+        uint32_t nslots = B->def_slots;
+        B->def_slots = nslots ? nslots * 2 : 256;
+        B->def_keys = mem_calloc(MEM_IR, B->def_slots, sizeof(uint64_t));
+        B->def_values = mem_alloc(MEM_IR, B->def_slots * sizeof(uint32_t));
+        for (uint32_t i = 0; i < nslots; i++)
+        {
+            if (!keys[i])
+                continue;
+            uint32_t j = def_slot(B, keys[i]);
+            B->def_keys[j] = keys[i];
+            B->def_values[j] = values[i];
+        }
+        mem_free(keys);
+        mem_free(values);
+    }
+    uint64_t key = ((uint64_t)var << 32 | block) + 1;
+    uint32_t i = def_slot(B, key);
+    if (!B->def_keys[i])
+    {
+        B->def_keys[i] = key;
+        B->def_count++;
+    }
+    B->def_values[i] = value;
+}
+
+static uint32_t defined_value(const builder *B, uint32_t var, uint32_t block)
+{
+    if (!B->def_slots)
+        return 0;
+    uint32_t i = def_slot(B, ((uint64_t)var << 32 | block) + 1);
+    return B->def_keys[i] ? B->def_values[i] : 0;
+}
+
+static uint32_t new_var(builder *B, unsigned type)
+{
+    B->var_types = reserve(B->var_types, B->nvars, &B->vars_capacity, 1);
+    B->var_types[B->nvars] = type;
+    return B->nvars++;
+}
+
+// Block code goes into. Code after a jump is unreachable, and gets a block with no predecessors
+static uint32_t current(builder *B)
+{
+    if (B->block == NO_BLOCK)
+    {
+        B->block = add_block(B->F);
+        B->F->blocks[B->block].sealed = true;
+    }
+    return B->block;
+}
+
+static uint32_t emit(builder *B, unsigned op, unsigned type, uint32_t a, uint32_t b)
+{
+    uint32_t block = current(B);
+    uint32_t i = add_inst(B->F, op, type);
+    B->F->insts[i].a = a;
+    B->F->insts[i].b = b;
+    append(B->F, block, i);
+    return i;
+}
+
+static uint32_t int_const(builder *B, int64_t value)
+{
+    uint32_t i = emit(B, IR_CONST, IR_INT, 0, 0);
+    B->F->insts[i].value.i = value;
+    return i;
+}
+
+static uint32_t float_const(builder *B, double value)
+{
+    uint32_t i = emit(B, IR_CONST, IR_FLOAT, 0, 0);
+    B->F->insts[i].value.d = value;
+    return i;
+}
+
+// Zero of type at the start of the entry block, for variables read before they are assigned
+static uint32_t zero(builder *B, unsigned type)
+{
+    uint32_t i = add_inst(B->F, IR_CONST, type);
+    prepend(B->F, 0, i);
+    return i;
+}
+
+static uint32_t read_var(builder *B, uint32_t var, uint32_t block);
+
+static uint32_t remove_trivial_phi(builder *B, uint32_t phi)
+{
+    ir_function *F = B->F;
+    uint32_t same = 0;
+    for (uint32_t i = 0; i < F->insts[phi].b; i++)
+    {
+        uint32_t v = resolve(F, F->pool[F->insts[phi].a + i]);
+        if (v == same || v == phi)
+            continue;
+        if (same)
+            return phi;
+        same = v;
+    }
+    if (!same)
+        same = zero(B, F->insts[phi].type);
+    F->insts[phi].op = IR_COPY;
+    F->insts[phi].a = same;
+    F->insts[phi].b = 0;
+    return same;
+}
+
+static uint32_t add_phi_operands(builder *B, uint32_t var, uint32_t phi)
+{
+    ir_function *F = B->F;
+    uint32_t block = F->insts[phi].block;
+    uint32_t count = F->blocks[block].preds.count;
+    uint32_t start = pool_reserve(F, count);
+    F->insts[phi].a = start;
+    F->insts[phi].b = count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t pred = ir_list_at(F, F->blocks[block].preds)[i];
+        uint32_t v = read_var(B, var, pred);
+        F->pool[start + i] = v;
+    }
+    return remove_trivial_phi(B, phi);
+}
+
+static uint32_t new_phi(builder *B, uint32_t var, uint32_t block)
+{
+    uint32_t i = add_inst(B->F, IR_PHI, B->var_types[var]);
+    prepend(B->F, block, i);
+    return i;
+}
+
+static uint32_t read_var(builder *B, uint32_t var, uint32_t block)
+{
+    uint32_t v = defined_value(B, var, block);
+    if (v)
+        return resolve(B->F, v);
+    ir_block *b = &B->F->blocks[block];
+    if (!b->sealed)
+    {
+        v = new_phi(B, var, block);
+        B->pending = reserve(B->pending, B->npending, &B->pending_capacity, sizeof(pending_phi));
+        B->pending[B->npending++] = (pending_phi){block, var, v};
+    }
+    else if (b->preds.count == 0)
+    {
+        v = zero(B, B->var_types[var]);
+    }
+    else if (b->preds.count == 1)
+    {
+        v = read_var(B, var, ir_list_at(B->F, b->preds)[0]);
+    }
+    else
+    {
+        // The phi is the variable's value while its operands are read, which ends cycles
+        v = new_phi(B, var, block);
+        write_var(B, var, block, v);
+        v = add_phi_operands(B, var, v);
+    }
+    write_var(B, var, block, v);
+    return v;
+}
+
+static void seal(builder *B, uint32_t block)
+{
+    for (uint32_t i = 0; i < B->npending;)
+    {
+        if (B->pending[i].block != block)
+        {
+            i++;
+            continue;
+        }
+        pending_phi p = B->pending[i];
+        B->pending[i] = B->pending[--B->npending];
+        add_phi_operands(B, p.var, p.phi);
+    }
+    B->F->blocks[block].sealed = true;
+}
+
+static void jump(builder *B, uint32_t target)
+{
+    if (B->block == NO_BLOCK)
+        return;
+    emit(B, IR_JUMP, IR_VOID, 0, 0);
+    add_edge(B->F, B->block, target);
+    B->block = NO_BLOCK;
+}
+
+static void branch(builder *B, uint32_t condition, uint32_t yes, uint32_t no)
+{
+    emit(B, IR_BRANCH, IR_VOID, condition, 0);
+    add_edge(B->F, B->block, yes);
+    add_edge(B->F, B->block, no);
+    B->block = NO_BLOCK;
+}
+
+static uint32_t new_block(builder *B)
+{
+    return add_block(B->F);
+}
+
+static unsigned type_of(const builder *B, uint32_t v)
+{
+    return B->F->insts[v].type;
+}
+
+static uint32_t convert(builder *B, uint32_t v, unsigned type)
+{
+    if (type == IR_FLOAT && type_of(B, v) == IR_INT)
+        return emit(B, IR_ITOF, IR_FLOAT, v, 0);
+    if (type == IR_INT && type_of(B, v) == IR_FLOAT)
+        return emit(B, IR_FTOI, IR_INT, v, 0);
+    return v;
+}
+
+// Int that is not 0 when v is not 0, for branches
+static uint32_t truth(builder *B, uint32_t v)
+{
+    if (type_of(B, v) == IR_FLOAT)
+        return emit(B, IR_NE, IR_INT, v, float_const(B, 0));
+    return v;
+}
+
+static void check_value(const builder *B, uint32_t v)
+{
+    if (type_of(B, v) == IR_VOID)
+        lower_error(B, "Void value used in an expression");
+}
+
+static uint32_t lower_expression(builder *B, uint32_t n);
+
+static local *find_local(builder *B, uint32_t name)
+{
+    for (uint32_t i = B->nlocals; i > 0; i--)
+    {
+        if (B->locals[i - 1].name == name)
+            return &B->locals[i - 1];
+    }
+    return NULL;
+}
+
+static place lower_place(builder *B, uint32_t n)
+{
+    const ast_node *x = ast_at(B->T, n);
+    B->line = x->line;
+    place p = {NO_VAR, 0, {AST_TYPE_INT, 0}, 0};
+    if (x->kind == AST_NAME)
+    {
+        local *l = find_local(B, x->name);
+        if (l)
+        {
+            p.var = l->var;
+            p.address = l->address;
+            p.type = l->type;
+            p.length = l->length;
+            return p;
+        }
+        ir_global *G = ir_find_global(B->M, x->name);
+        if (!G)
+            lower_error(B, "Undeclared identifier %s", intern_text(x->name));
+        p.address = emit(B, IR_GLOBAL, IR_INT, 0, 0);
+        B->F->insts[p.address].name = x->name;
+        p.type = G->decl;
+        p.length = G->length;
+        return p;
+    }
+    if (x->kind == AST_INDEX)
+    {
+        place base = lower_place(B, x->a);
+        B->line = x->line;
+        if (!base.length)
+            lower_error(B, "Only arrays can be indexed");
+        uint32_t index = lower_expression(B, x->b);
+        check_value(B, index);
+        if (type_of(B, index) != IR_INT)
+            lower_error(B, "Array index is not an integer");
+        int64_t size = object_size(B->M, base.type, 0, x->line);
+        uint32_t offset = emit(B, IR_MUL, IR_INT, index, int_const(B, size));
+        p.address = emit(B, IR_ADD, IR_INT, base.address, offset);
+        p.type = base.type;
+        return p;
+    }
+    if (x->kind == AST_MEMBER)
+    {
+        place base = lower_place(B, x->a);
+        B->line = x->line;
+        if (base.length || base.type.base != AST_TYPE_STRUCT)
+            lower_error(B, "Member %s of something that is not a struct", intern_text(x->name));
+        const ir_struct *S = find_struct(B->M, base.type.name, x->line);
+        for (uint32_t i = S->first; i < S->first + S->count; i++)
+        {
+            const ir_member *m = &B->M->members[i];
+            if (m->name != x->name)
+                continue;
+            p.address = m->offset ? emit(B, IR_ADD, IR_INT, base.address, int_const(B, m->offset)) : base.address;
+            p.type = m->type;
+            p.length = m->length;
+            return p;
+        }
+        lower_error(B, "Struct %s has no member %s", intern_text(S->name), intern_text(x->name));
+    }
+    lower_error(B, "Expression cannot be assigned to");
+    return p;
+}
+
+// Arrays and structs stand for their address
+static bool is_aggregate(place p)
+{
+    return p.length || p.type.base == AST_TYPE_STRUCT;
+}
+
+static uint32_t place_value(builder *B, place p)
+{
+    if (p.var != NO_VAR)
+        return read_var(B, p.var, current(B));
+    if (is_aggregate(p))
+        return p.address;
+    return emit(B, IR_LOAD, value_type(p.type), p.address, 0);
+}
+
+// Stores value at p, giving the value as stored
+static uint32_t store(builder *B, place p, uint32_t value)
+{
+    if (is_aggregate(p))
+        lower_error(B, "Arrays and structs cannot be assigned");
+    check_value(B, value);
+    value = convert(B, value, value_type(p.type));
+    if (p.var != NO_VAR)
+        write_var(B, p.var, current(B), value);
+    else
+        emit(B, IR_STORE, IR_VOID, p.address, value);
+    return value;
+}
+
+static unsigned binary_op(unsigned token)
+{
+    switch (token)
+    {
+    case TOKEN_PLUS:
+    case TOKEN_ADD_ASSIGN:
+    case TOKEN_INC:
+        return IR_ADD;
+    case TOKEN_MINUS:
+    case TOKEN_SUB_ASSIGN:
+    case TOKEN_DEC:
+        return IR_SUB;
+    case TOKEN_ASTERISK:
+    case TOKEN_MUL_ASSIGN:
+        return IR_MUL;
+    case TOKEN_SLASH:
+    case TOKEN_DIV_ASSIGN:
+        return IR_DIV;
+    case TOKEN_PERCENT:
+        return IR_MOD;
+    case TOKEN_AMPERSAND:
+        return IR_AND;
+    case TOKEN_PIPE:
+        return IR_OR;
+    case TOKEN_EQ:
+        return IR_EQ;
+    case TOKEN_NE:
+        return IR_NE;
+    case TOKEN_LESS:
+        return IR_LT;
+    case TOKEN_LE:
+        return IR_LE;
+    case TOKEN_GREATER:
+        return IR_GT;
+    default:
+        return IR_GE;
+    }
+}
+
+// a op b, in floats when either is one
+static uint32_t arithmetic(builder *B, unsigned op, uint32_t a, uint32_t b)
+{
+    check_value(B, a);
+    check_value(B, b);
+    unsigned type = type_of(B, a) == IR_FLOAT || type_of(B, b) == IR_FLOAT ? IR_FLOAT : IR_INT;
+    if (type == IR_FLOAT && (op == IR_MOD || op == IR_AND || op == IR_OR))
+        lower_error(B, "Operator needs integers");
+    a = convert(B, a, type);
+    b = convert(B, b, type);
+    return emit(B, op, op >= IR_EQ && op <= IR_GE ? IR_INT : type, a, b);
+}
+
+// a && b or a || b, as branches around b. The result is 0 or 1
+static uint32_t lower_logical(builder *B, const ast_node *x)
+{
+    bool is_and = x->op == TOKEN_AND;
+    uint32_t result = new_var(B, IR_INT);
+    uint32_t a = lower_expression(B, x->a);
+    check_value(B, a);
+    a = truth(B, a);
+    uint32_t right = new_block(B);
+    uint32_t join = new_block(B);
+    write_var(B, result, current(B), int_const(B, is_and ? 0 : 1));
+    if (is_and)
+        branch(B, a, right, join);
+    else
+        branch(B, a, join, right);
+    seal(B, right);
+    B->block = right;
+    uint32_t b = lower_expression(B, x->b);
+    check_value(B, b);
+    b = arithmetic(B, IR_NE, b, int_const(B, 0));
+    write_var(B, result, current(B), b);
+    jump(B, join);
+    seal(B, join);
+    B->block = join;
+    return read_var(B, result, join);
+}
+
+// a ? b : c. Each arm is left open until the type of the other is known, to convert it
+static uint32_t lower_conditional(builder *B, const ast_node *x)
+{
+    uint32_t condition = lower_expression(B, x->a);
+    check_value(B, condition);
+    condition = truth(B, condition);
+    uint32_t then = new_block(B);
+    uint32_t otherwise = new_block(B);
+    uint32_t join = new_block(B);
+    uint32_t c = x->c;
+    branch(B, condition, then, otherwise);
+    seal(B, then);
+    seal(B, otherwise);
+    B->block = then;
+    uint32_t a = lower_expression(B, x->b);
+    uint32_t then_end = current(B);
+    B->block = otherwise;
+    uint32_t b = lower_expression(B, c);
+    uint32_t otherwise_end = current(B);
+    if ((type_of(B, a) == IR_VOID) != (type_of(B, b) == IR_VOID))
+        lower_error(B, "Void value used in an expression");
+    unsigned type = type_of(B, a) == IR_FLOAT || type_of(B, b) == IR_FLOAT ? IR_FLOAT : type_of(B, a);
+    uint32_t result = type == IR_VOID ? NO_VAR : new_var(B, type);
+    B->block = then_end;
+    if (result != NO_VAR)
+        write_var(B, result, then_end, convert(B, a, type));
+    jump(B, join);
+    B->block = otherwise_end;
+    if (result != NO_VAR)
+        write_var(B, result, otherwise_end, convert(B, b, type));
+    jump(B, join);
+    seal(B, join);
+    B->block = join;
+    if (result == NO_VAR)
+        return a;
+    return read_var(B, result, join);
+}
+
+static uint32_t lower_call(builder *B, const ast_node *x)
+{
+    if (!x->name)
+        lower_error(B, "Only functions can be called, by name");
+    uint32_t name = x->name;
+    if (find_local(B, name) || ir_find_global(B->M, name))
+        lower_error(B, "%s is not a function", intern_text(name));
+    const ir_function *callee = ir_find_function(B->M, name);
+    uint32_t count = 0;
+    for (uint32_t arg = x->a; arg; arg = ast_at(B->T, arg)->next)
+        count++;
+    if (callee && callee->params.count != count)
+        lower_error(B, "Wrong number of arguments to function %s", intern_text(name));
+    unsigned line = B->line;
+    // Arguments are lowered first, as they can call functions themselves
+    uint32_t *args = mem_alloc(MEM_IR, (count ? count : 1) * sizeof(uint32_t));
+    uint32_t i = 0;
+    for (uint32_t arg = x->a; arg; arg = ast_at(B->T, arg)->next, i++)
+    {
+        unsigned kind = ast_at(B->T, arg)->kind;
+        uint32_t v;
+        if (kind == AST_NAME || kind == AST_INDEX || kind == AST_MEMBER)
+        {
+            place p = lower_place(B, arg);
+            v = place_value(B, p);
+            // Whether the callee reads the chars as C does is only known once the module is complete
+            if (p.length && p.type.base == AST_TYPE_CHAR)
+            {
+                ir_module *M = B->M;
+                M->char_calls = reserve(M->char_calls, M->nchar_calls, &M->char_calls_capacity, sizeof(ir_char_call));
+                M->char_calls[M->nchar_calls++] = (ir_char_call){name, line};
+            }
+        }
+        else
+            v = lower_expression(B, arg);
+        B->line = line;
+        check_value(B, v);
+        if (callee)
+            v = convert(B, v, ir_list_at(callee, callee->params)[i]);
+        args[i] = v;
+    }
+    unsigned type = callee ? callee->type : IR_INT;
+    uint32_t call = emit(B, IR_CALL, type, 0, count);
+    uint32_t start = pool_reserve(B->F, count);
+    if (count)
+        memcpy(B->F->pool + start, args, count * sizeof(uint32_t));
+    B->F->insts[call].a = start;
+    B->F->insts[call].name = name;
+    mem_free(args);
+    return call;
+}
+
+static uint32_t lower_expression(builder *B, uint32_t n)
+{
+    const ast_node *x = ast_at(B->T, n);
+    B->line = x->line;
+    uint32_t v, one;
+    place p;
+    switch (x->kind)
+    {
+    case AST_INT:
+        return int_const(B, x->value.i);
+    case AST_FLOAT:
+        return float_const(B, x->value.d);
+    case AST_STRING:
+        v = emit(B, IR_STRING, IR_INT, 0, 0);
+        B->F->insts[v].name = x->name;
+        return v;
+    case AST_NAME:
+    case AST_INDEX:
+    case AST_MEMBER:
+        return place_value(B, lower_place(B, n));
+    case AST_UNARY:
+        v = lower_expression(B, x->a);
+        B->line = x->line;
+        check_value(B, v);
+        if (x->op == TOKEN_EXCLAMATION)
+            return arithmetic(B, IR_EQ, v, int_const(B, 0));
+        if (x->op == TOKEN_TILDE && type_of(B, v) == IR_FLOAT)
+            lower_error(B, "Operator needs integers");
+        return emit(B, x->op == TOKEN_MINUS ? IR_NEG : IR_NOT, type_of(B, v), v, 0);
+    case AST_PREFIX:
+    case AST_POSTFIX:
+        p = lower_place(B, x->a);
+        B->line = x->line;
+        if (is_aggregate(p))
+            lower_error(B, "Arrays and structs cannot be incremented");
+        v = place_value(B, p);
+        one = type_of(B, v) == IR_FLOAT ? float_const(B, 1) : int_const(B, 1);
+        one = store(B, p, emit(B, binary_op(x->op), type_of(B, v), v, one));
+        return x->kind == AST_PREFIX ? one : v;
+    case AST_BINARY:
+        if (x->op == TOKEN_AND || x->op == TOKEN_OR)
+            return lower_logical(B, x);
+        v = lower_expression(B, x->a);
+        one = lower_expression(B, x->b);
+        B->line = x->line;
+        return arithmetic(B, binary_op(x->op), v, one);
+    case AST_ASSIGN:
+        p = lower_place(B, x->a);
+        if (x->op == TOKEN_EQUAL)
+        {
+            v = lower_expression(B, x->b);
+        }
+        else
+        {
+            if (is_aggregate(p))
+                lower_error(B, "Arrays and structs cannot be assigned");
+            uint32_t old = place_value(B, p);
+            v = arithmetic(B, binary_op(x->op), old, lower_expression(B, x->b));
+        }
+        B->line = x->line;
+        return store(B, p, v);
+    case AST_CONDITIONAL:
+        return lower_conditional(B, x);
+    case AST_CALL:
+        return lower_call(B, x);
+    case AST_CAST:
+        v = lower_expression(B, x->a);
+        return convert(B, v, value_type(x->type));
+    }
+    lower_error(B, "Unexpected expression");
+    return 0;
+}
+
+static void lower_statement(builder *B, uint32_t n);
+
+static void lower_statements(builder *B, uint32_t first)
+{
+    uint32_t scope = B->nlocals;
+    for (uint32_t s = first; s; s = ast_at(B->T, s)->next)
+        lower_statement(B, s);
+    B->nlocals = scope;
+}
+
+static local *add_local(builder *B, const ast_node *decl)
+{
+    B->locals = reserve(B->locals, B->nlocals, &B->locals_capacity, sizeof(local));
+    local *l = &B->locals[B->nlocals++];
+    l->name = decl->name;
+    l->type = decl->type;
+    l->length = decl->value.i;
+    l->var = NO_VAR;
+    l->address = 0;
+    return l;
+}
+
+static void lower_declaration(builder *B, const ast_node *x)
+{
+    local *l = add_local(B, x);
+    if (l->length || l->type.base == AST_TYPE_STRUCT)
+    {
+        if (x->a)
+            lower_error(B, "Arrays and structs cannot be initialized");
+        // Frame slots go at the start of the entry block, which runs once
+        int64_t size = object_size(B->M, l->type, l->length, x->line);
+        l->address = add_inst(B->F, IR_SLOT, IR_INT);
+        B->F->insts[l->address].value.i = size;
+        prepend(B->F, 0, l->address);
+        return;
+    }
+    if (l->type.base == AST_TYPE_VOID)
+        lower_error(B, "Variable of type void");
+    l->var = new_var(B, value_type(l->type));
+    if (x->a)
+    {
+        place p = {l->var, 0, l->type, 0};
+        uint32_t v = lower_expression(B, x->a);
+        B->line = x->line;
+        store(B, p, v);
+    }
+}
+
+static void enter_loop(builder *B, uint32_t break_block, uint32_t continue_block)
+{
+    B->loops = reserve(B->loops, B->nloops, &B->loops_capacity, sizeof(loop));
+    B->loops[B->nloops++] = (loop){break_block, continue_block};
+}
+
+static uint32_t lower_condition(builder *B, uint32_t n)
+{
+    uint32_t v = lower_expression(B, n);
+    check_value(B, v);
+    return truth(B, v);
+}
+
+/*
+Switches. Each case and default label starts a block, and the switch goes
+to the labels by a search over the case values: a jump table when they are
+dense enough, comparisons one after the other when there are few, and
+otherwise a binary search, which narrows the range down to one of those.
+The table of an IR_SWITCH reaches each label through a block of its own,
+so that the labels the statement before falls into can have phis.
+*/
+#define SWITCH_CHAIN_MAX 3 // Cases a compare chain takes, where a table or a search would not pay
+#define SWITCH_TABLE_MIN 4
+#define SWITCH_TABLE_DENSITY 40 // Percent of the table that has to be cases
+
+// Adds the labels of the switch whose body has statement n, leaving those of nested switches to them
+static void collect_labels(builder *B, uint32_t n)
+{
+    const ast_node *x = ast_at(B->T, n);
+    switch (x->kind)
+    {
+    case AST_BLOCK:
+        for (uint32_t s = x->a; s; s = ast_at(B->T, s)->next)
+            collect_labels(B, s);
+        break;
+    case AST_IF:
+        collect_labels(B, x->b);
+        if (x->c)
+            collect_labels(B, x->c);
+        break;
+    case AST_WHILE:
+    case AST_DO:
+        collect_labels(B, x->b);
+        break;
+    case AST_FOR:
+        collect_labels(B, x->d);
+        break;
+    case AST_CASE:
+    case AST_DEFAULT:
+        // The labels of a run come in the order of their nodes, which keeps the labels sorted by node
+        for (uint32_t l = n; l; l = l == n ? x->c : ast_at(B->T, l)->next)
+        {
+            B->labels = reserve(B->labels, B->nlabels, &B->labels_capacity, sizeof(switch_label));
+            B->labels[B->nlabels++] = (switch_label){l, new_block(B), 0};
+        }
+        if (x->b)
+            collect_labels(B, x->b);
+        break;
+    }
+}
+
+// Block of label n of the innermost switch, or NO_BLOCK
+static uint32_t find_label(const builder *B, uint32_t n)
+{
+    uint32_t low = B->switch_labels, high = B->nlabels;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (B->labels[mid].node < n)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < B->nlabels && B->labels[low].node == n ? B->labels[low].block : NO_BLOCK;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    int64_t x = ((const switch_label *)a)->value, y = ((const switch_label *)b)->value;
+    return (x > y) - (x < y);
+}
+
+static bool is_dense(const switch_label *cases, uint32_t count)
+{
+    uint64_t range = (uint64_t)cases[count - 1].value - (uint64_t)cases[0].value;
+    return count >= SWITCH_TABLE_MIN && range < (uint64_t)count * 100 / SWITCH_TABLE_DENSITY;
+}
+
+// Makes the edge from block from to a label, through a block of its own
+static void switch_edge(builder *B, uint32_t from, uint32_t to)
+{
+    uint32_t edge = new_block(B);
+    add_edge(B->F, from, edge);
+    seal(B, edge);
+    B->block = edge;
+    jump(B, to);
+}
+
+static void lower_table(builder *B, uint32_t value, const switch_label *cases, uint32_t count, uint32_t otherwise)
+{
+    ir_function *F = B->F;
+    uint32_t from = current(B);
+    uint32_t length = (uint32_t)((uint64_t)cases[count - 1].value - (uint64_t)cases[0].value + 1);
+    uint32_t i = emit(B, IR_SWITCH, IR_VOID, value, length);
+    uint32_t table = pool_reserve(F, length);
+    F->insts[i].name = table;
+    F->insts[i].value.i = cases[0].value;
+    switch_edge(B, from, otherwise);
+    for (uint32_t k = 0; k < count; k++)
+    {
+        F->pool[table + ((uint64_t)cases[k].value - (uint64_t)cases[0].value)] = k + 1;
+        switch_edge(B, from, cases[k].block);
+    }
+    B->block = NO_BLOCK;
+}
+
+static void lower_chain(builder *B, uint32_t value, const switch_label *cases, uint32_t count, uint32_t otherwise)
+{
+    for (uint32_t k = 0; k < count; k++)
+    {
+        uint32_t c = int_const(B, cases[k].value);
+        uint32_t next = k + 1 < count ? new_block(B) : otherwise;
+        branch(B, emit(B, IR_EQ, IR_INT, value, c), cases[k].block, next);
+        if (next == otherwise)
+            return;
+        seal(B, next);
+        B->block = next;
+    }
+    jump(B, otherwise);
+}
+
+// Goes to the label of the case value equals, of count sorted cases, or to otherwise
+static void lower_cases(builder *B, uint32_t value, const switch_label *cases, uint32_t count, uint32_t otherwise, ir_switch *S)
+{
+    if (count && is_dense(cases, count))
+    {
+        lower_table(B, value, cases, count, otherwise);
+        S->tables++;
+        return;
+    }
+    if (count <= SWITCH_CHAIN_MAX)
+    {
+        lower_chain(B, value, cases, count, otherwise);
+        return;
+    }
+    uint32_t half = count / 2;
+    uint32_t below = new_block(B), above = new_block(B);
+    uint32_t c = int_const(B, cases[half].value);
+    branch(B, emit(B, IR_LT, IR_INT, value, c), below, above);
+    seal(B, below);
+    seal(B, above);
+    B->block = below;
+    lower_cases(B, value, cases, half, otherwise, S);
+    B->block = above;
+    lower_cases(B, value, cases + half, count - half, otherwise, S);
+}
+
+static void lower_switch(builder *B, const ast_node *x)
+{
+    uint32_t value = lower_expression(B, x->a);
+    unsigned line = B->line = x->line;
+    check_value(B, value);
+    if (type_of(B, value) == IR_FLOAT)
+        lower_error(B, "Switch on a float");
+    uint32_t outer = B->switch_labels;
+    B->switch_labels = B->nlabels;
+    collect_labels(B, x->b);
+    uint32_t count = B->nlabels - B->switch_labels;
+    switch_label *cases = mem_alloc(MEM_IR, (count + 1) * sizeof(switch_label));
+    uint32_t ncases = 0, after = new_block(B), otherwise = after;
+    for (uint32_t k = B->switch_labels; k < B->nlabels; k++)
+    {
+        const ast_node *label = ast_at(B->T, B->labels[k].node);
+        B->line = label->line;
+        if (label->kind == AST_DEFAULT)
+        {
+            if (otherwise != after)
+                lower_error(B, "More than one default in a switch");
+            otherwise = B->labels[k].block;
+            continue;
+        }
+        double d;
+        if (fold_initializer(B->T, label->a, &B->labels[k].value, &d) != IR_INT)
+            lower_error(B, "Case value is not an integer constant");
+        cases[ncases++] = B->labels[k];
+    }
+    qsort(cases, ncases, sizeof(switch_label), by_value);
+    for (uint32_t k = 1; k < ncases; k++)
+    {
+        if (cases[k].value != cases[k - 1].value)
+            continue;
+        // At the later of the two, which has the higher node
+        B->line = ast_at(B->T, cases[k - 1].node > cases[k].node ? cases[k - 1].node : cases[k].node)->line;
+        lower_error(B, "Duplicate case value %lld", (long long)cases[k].value);
+    }
+
+    ir_module *M = B->M;
+    M->switches = reserve(M->switches, M->nswitches, &M->switches_capacity, sizeof(ir_switch));
+    ir_switch *S = &M->switches[M->nswitches++];
+    memset(S, 0, sizeof(*S));
+    S->function = B->F->name;
+    S->line = line;
+    S->cases = ncases;
+    S->has_default = otherwise != after;
+    if (ncases)
+    {
+        S->low = cases[0].value;
+        S->high = cases[ncases - 1].value;
+    }
+    S->strategy = ncases && is_dense(cases, ncases) ? IR_SWITCH_TABLE :
+                  ncases <= SWITCH_CHAIN_MAX ? IR_SWITCH_CHAIN : IR_SWITCH_SEARCH;
+    current(B);
+    lower_cases(B, value, cases, ncases, otherwise, S);
+    mem_free(cases);
+
+    // Statements before the first label are only reached by jumping into them, which nothing does
+    B->block = NO_BLOCK;
+    enter_loop(B, after, B->nloops ? B->loops[B->nloops - 1].continue_block : NO_BLOCK);
+    lower_statement(B, x->b);
+    B->nloops--;
+    jump(B, after);
+    seal(B, after);
+    B->block = after;
+    B->nlabels = B->switch_labels;
+    B->switch_labels = outer;
+}
+
+static void lower_statement(builder *B, uint32_t n)
+{
+    const ast_node *x = ast_at(B->T, n);
+    B->line = x->line;
+    uint32_t then, otherwise, after, header, body, step;
+    switch (x->kind)
+    {
+    case AST_EXPRESSION:
+        lower_expression(B, x->a);
+        break;
+    case AST_DECL:
+        lower_declaration(B, x);
+        break;
+    case AST_BLOCK:
+        lower_statements(B, x->a);
+        break;
+    case AST_IF:
+        then = new_block(B);
+        after = new_block(B);
+        otherwise = x->c ? new_block(B) : after;
+        branch(B, lower_condition(B, x->a), then, otherwise);
+        seal(B, then);
+        B->block = then;
+        lower_statement(B, x->b);
+        jump(B, after);
+        if (x->c)
+        {
+            seal(B, otherwise);
+            B->block = otherwise;
+            lower_statement(B, x->c);
+            jump(B, after);
+        }
+        seal(B, after);
+        B->block = after;
+        break;
+    case AST_WHILE:
+        header = new_block(B);
+        body = new_block(B);
+        after = new_block(B);
+        jump(B, header);
+        B->block = header;
+        branch(B, lower_condition(B, x->a), body, after);
+        seal(B, body);
+        B->block = body;
+        enter_loop(B, after, header);
+        lower_statement(B, x->b);
+        B->nloops--;
+        jump(B, header);
+        seal(B, header);
+        seal(B, after);
+        B->block = after;
+        break;
+    case AST_DO:
+        body = new_block(B);
+        step = new_block(B);
+        after = new_block(B);
+        jump(B, body);
+        B->block = body;
+        enter_loop(B, after, step);
+        lower_statement(B, x->b);
+        B->nloops--;
+        jump(B, step);
+        seal(B, step);
+        B->block = step;
+        branch(B, lower_condition(B, x->a), body, after);
+        seal(B, body);
+        seal(B, after);
+        B->block = after;
+        break;
+    case AST_FOR:
+        if (x->a)
+            lower_expression(B, x->a);
+        header = new_block(B);
+        body = new_block(B);
+        step = new_block(B);
+        after = new_block(B);
+        jump(B, header);
+        B->block = header;
+        if (x->b)
+            branch(B, lower_condition(B, x->b), body, after);
+        else
+            jump(B, body);
+        seal(B, body);
+        B->block = body;
+        enter_loop(B, after, step);
+        lower_statement(B, x->d);
+        B->nloops--;
+        jump(B, step);
+        seal(B, step);
+        B->block = step;
+        if (x->c)
+            lower_expression(B, x->c);
+        jump(B, header);
+        seal(B, header);
+        seal(B, after);
+        B->block = after;
+        break;
+    case AST_SWITCH:
+        lower_switch(B, x);
+        break;
+    case AST_CASE:
+    case AST_DEFAULT:
+        // Each label of a run falls into the next, as if each were the statement of the one before
+        for (uint32_t l = n; l; l = l == n ? x->c : ast_at(B->T, l)->next)
+        {
+            body = find_label(B, l);
+            if (body == NO_BLOCK)
+                lower_error(B, "%s outside of a switch", ast_at(B->T, l)->kind == AST_CASE ? "case" : "default");
+            // Every jump to the label is known by now: the switch's, and the statement before it
+            jump(B, body);
+            seal(B, body);
+            B->block = body;
+        }
+        if (x->b)
+            lower_statement(B, x->b);
+        break;
+    case AST_BREAK:
+        if (!B->nloops)
+            lower_error(B, "break outside of a loop or a switch");
+        jump(B, B->loops[B->nloops - 1].break_block);
+        break;
+    case AST_CONTINUE:
+        if (!B->nloops || B->loops[B->nloops - 1].continue_block == NO_BLOCK)
+            lower_error(B, "continue outside of a loop");
+        jump(B, B->loops[B->nloops - 1].continue_block);
+        break;
+    case AST_RETURN:
+        if (x->a)
+        {
+            uint32_t v = lower_expression(B, x->a);
+            B->line = x->line;
+            if (B->F->type == IR_VOID)
+                lower_error(B, "Function returning void returns a value");
+            check_value(B, v);
+            emit(B, IR_RETURN, IR_VOID, convert(B, v, B->F->type), 0);
+        }
+        else
+        {
+            emit(B, IR_RETURN, IR_VOID, 0, 0);
+        }
+        B->block = NO_BLOCK;
+        break;
+    }
+}
+
+static void builder_free(builder *B)
+{
+    mem_free(B->locals);
+    mem_free(B->var_types);
+    mem_free(B->def_keys);
+    mem_free(B->def_values);
+    mem_free(B->pending);
+    mem_free(B->loops);
+    mem_free(B->labels);
+}
+
+static void function_free(ir_function *F)
+{
+    mem_free(F->insts);
+    mem_free(F->blocks);
+    mem_free(F->pool);
+    ast_free(&F->tree);
+}
+
+void ir_define_function(ir_module *M, const ast *T, uint32_t name, ast_type type, uint32_t params, uint32_t body, unsigned line)
+{
+    if (type.base == AST_TYPE_STRUCT)
+        module_error(M, line, "Function %s returns a struct", intern_text(name));
+    uint32_t index;
+    if (names_get(&M->function_names, name, &index))
+    {
+        if (M->functions[index].defined && body)
+            module_error(M, line, "Duplicate definition of function %s", intern_text(name));
+        if (!body)
+            return;
+        function_free(&M->functions[index]);
+    }
+    else
+    {
+        M->functions = reserve(M->functions, M->nfunctions, &M->functions_capacity, sizeof(ir_function));
+        index = M->nfunctions++;
+        names_put(&M->function_names, name, index);
+    }
+    ir_function *F = &M->functions[index];
+    memset(F, 0, sizeof(*F));
+    F->name = name;
+    F->type = value_type(type);
+    F->line = line;
+    F->defined = body != 0;
+    add_inst(F, IR_NOP, IR_VOID);
+    // Arrays and structs are passed by address, and the callee copies a struct, as C passes it by value
+    for (uint32_t p = params; p; p = ast_at(T, p)->next)
+    {
+        const ast_node *x = ast_at(T, p);
+        list_push(F, &F->params, x->value.i || x->type.base == AST_TYPE_STRUCT ? IR_INT : value_type(x->type));
+    }
+    if (!body)
+        return;
+    if (M->keep_trees)
+    {
+        // Nodes refer to each other by index, so the copy is of the whole declaration
+        F->tree.nodes = mem_alloc(MEM_IR, T->count * sizeof(ast_node));
+        memcpy(F->tree.nodes, T->nodes, T->count * sizeof(ast_node));
+        F->tree.count = F->tree.capacity = T->count;
+        F->tree_params = params;
+        F->tree_body = body;
+    }
+
+    builder B;
+    memset(&B, 0, sizeof(B));
+    B.M = M;
+    B.F = F;
+    B.T = T;
+    B.line = line;
+    B.block = add_block(F);
+    F->blocks[0].sealed = true;
+    uint32_t i = 0;
+    for (uint32_t p = params; p; p = ast_at(T, p)->next, i++)
+    {
+        const ast_node *x = ast_at(T, p);
+        local *l = add_local(&B, x);
+        uint32_t value = emit(&B, IR_PARAM, ir_list_at(F, F->params)[i], 0, 0);
+        F->insts[value].value.i = i;
+        if (l->length)
+        {
+            l->address = value;
+        }
+        else if (l->type.base == AST_TYPE_STRUCT)
+        {
+            // The caller passes the address of its struct, which is copied so that writes stay the callee's own
+            int64_t size = object_size(M, l->type, 0, x->line);
+            l->address = add_inst(F, IR_SLOT, IR_INT);
+            F->insts[l->address].value.i = size;
+            prepend(F, 0, l->address);
+            for (int64_t offset = 0; offset < size; offset += IR_SCALAR_SIZE)
+            {
+                uint32_t from = offset ? emit(&B, IR_ADD, IR_INT, value, int_const(&B, offset)) : value;
+                uint32_t to = offset ? emit(&B, IR_ADD, IR_INT, l->address, int_const(&B, offset)) : l->address;
+                emit(&B, IR_STORE, IR_VOID, to, emit(&B, IR_LOAD, IR_INT, from, 0));
+            }
+        }
+        else
+        {
+            if (l->type.base == AST_TYPE_VOID)
+                module_error(M, x->line, "Parameter of type void");
+            l->var = new_var(&B, value_type(l->type));
+            write_var(&B, l->var, 0, value);
+        }
+    }
+    lower_statements(&B, ast_at(T, body)->a);
+    // Falling off the end returns, with 0 unless the function returns void
+    if (B.block != NO_BLOCK)
+    {
+        uint32_t value = 0;
+        if (F->type == IR_INT)
+            value = int_const(&B, 0);
+        else if (F->type == IR_FLOAT)
+            value = float_const(&B, 0);
+        emit(&B, IR_RETURN, IR_VOID, value, 0);
+    }
+    builder_free(&B);
+    ir_simplify(F);
+}
+
+/*
+Appends a block to its only predecessor when that jumps nowhere else, which
+takes the empty blocks lowering leaves between statements. Phis are gone
+from such blocks by then, as a single predecessor makes them trivial.
+*/
+static void merge_blocks(ir_function *F)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t b = 1; b < F->nblocks; b++)
+        {
+            ir_block *B = &F->blocks[b];
+            if (B->dead || B->preds.count != 1)
+                continue;
+            uint32_t p = ir_list_at(F, B->preds)[0];
+            ir_block *P = &F->blocks[p];
+            if (p == b || P->succs.count != 1 || F->insts[P->last].op != IR_JUMP)
+                continue;
+            uint32_t jump = P->last;
+            ir_unlink(F, jump);
+            F->insts[jump].op = IR_NOP;
+            for (uint32_t i = B->first; i; i = F->insts[i].next)
+                F->insts[i].block = p;
+            if (P->last)
+                F->insts[P->last].next = B->first;
+            else
+                P->first = B->first;
+            if (B->last)
+                P->last = B->last;
+            P->succs = B->succs;
+            for (uint32_t k = 0; k < P->succs.count; k++)
+            {
+                ir_block *S = &F->blocks[ir_list_at(F, P->succs)[k]];
+                for (uint32_t j = 0; j < S->preds.count; j++)
+                {
+                    if (ir_list_at(F, S->preds)[j] == b)
+                        ir_list_at(F, S->preds)[j] = p;
+                }
+            }
+            memset(B, 0, sizeof(*B));
+            B->dead = true;
+            changed = true;
+        }
+    }
+}
+
+/*
+A switch reaches each of its successors through a block that only jumps
+on, which lowering puts there so that the successors have no phis. Where
+the block jumped to has none, the switch goes to it directly.
+*/
+static void thread_switches(ir_function *F)
+{
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        ir_block *B = &F->blocks[b];
+        if (B->dead || !B->last || F->insts[B->last].op != IR_SWITCH)
+            continue;
+        for (uint32_t k = 0; k < B->succs.count; k++)
+        {
+            uint32_t s = ir_list_at(F, B->succs)[k];
+            ir_block *S = &F->blocks[s];
+            if (S->preds.count != 1 || S->first != S->last || F->insts[S->first].op != IR_JUMP)
+                continue;
+            uint32_t t = ir_list_at(F, S->succs)[0];
+            ir_block *T = &F->blocks[t];
+            bool repeat = false;
+            for (uint32_t j = 0; j < B->succs.count; j++)
+                repeat |= ir_list_at(F, B->succs)[j] == t;
+            if (t == s || repeat || (T->first && F->insts[T->first].op == IR_PHI))
+                continue;
+            ir_list_at(F, B->succs)[k] = t;
+            for (uint32_t j = 0; j < T->preds.count; j++)
+            {
+                if (ir_list_at(F, T->preds)[j] == s)
+                    ir_list_at(F, T->preds)[j] = b;
+            }
+            F->insts[S->first].op = IR_NOP;
+            memset(S, 0, sizeof(*S));
+            S->dead = true;
+        }
+    }
+}
+
+/*
+Cleans up a function: drops blocks that cannot be reached from the entry,
+turns phis that merge a single value into copies until there are none,
+points every operand past the copies and unlinks copies and nops, then
+takes switches straight to their cases where it can and merges
+straight-line blocks.
+*/
+void ir_simplify(ir_function *F)
+{
+    bool *reached = mem_calloc(MEM_IR, F->nblocks, sizeof(bool));
+    uint32_t *stack = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    uint32_t depth = 0;
+    reached[0] = true;
+    stack[depth++] = 0;
+    while (depth)
+    {
+        ir_block *B = &F->blocks[stack[--depth]];
+        for (uint32_t i = 0; i < B->succs.count; i++)
+        {
+            uint32_t s = ir_list_at(F, B->succs)[i];
+            if (!reached[s])
+            {
+                reached[s] = true;
+                stack[depth++] = s;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        ir_block *B = &F->blocks[b];
+        if (reached[b] || B->dead)
+            continue;
+        while (B->succs.count)
+            ir_remove_edge(F, b, ir_list_at(F, B->succs)[0]);
+        for (uint32_t i = B->first; i; i = F->insts[i].next)
+            F->insts[i].op = IR_NOP;
+        B->first = B->last = 0;
+        B->preds.count = 0;
+        B->dead = true;
+    }
+    mem_free(reached);
+    mem_free(stack);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t b = 0; b < F->nblocks; b++)
+        {
+            for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            {
+                ir_inst *I = &F->insts[i];
+                if (I->op != IR_PHI || I->b == 0)
+                    continue;
+                uint32_t same = 0;
+                bool trivial = true;
+                for (uint32_t k = 0; k < I->b && trivial; k++)
+                {
+                    uint32_t v = resolve(F, F->pool[I->a + k]);
+                    if (v == same || v == i)
+                        continue;
+                    trivial = !same;
+                    same = v;
+                }
+                if (trivial && same)
+                {
+                    I->op = IR_COPY;
+                    I->a = same;
+                    I->b = 0;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->op == IR_COPY)
+                continue;
+            for (uint32_t k = 0; k < ir_operand_count(I); k++)
+            {
+                uint32_t *operand = ir_operand(F, I, k);
+                *operand = resolve(F, *operand);
+            }
+        }
+    }
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        ir_block *B = &F->blocks[b];
+        uint32_t last = 0;
+        for (uint32_t i = B->first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->op == IR_COPY || I->op == IR_NOP)
+            {
+                I->op = IR_NOP;
+                continue;
+            }
+            if (last)
+                F->insts[last].next = i;
+            else
+                B->first = i;
+            last = i;
+        }
+        if (last)
+            F->insts[last].next = 0;
+        else
+            B->first = 0;
+        B->last = last;
+    }
+    thread_switches(F);
+    merge_blocks(F);
+}
+
+void ir_module_free(ir_module *M)
+{
+    for (uint32_t i = 0; i < M->nfunctions; i++)
+        function_free(&M->functions[i]);
+    mem_free(M->functions);
+    mem_free(M->globals);
+    mem_free(M->structs);
+    mem_free(M->members);
+    mem_free(M->switches);
+    mem_free(M->char_calls);
+    names_free(&M->function_names);
+    names_free(&M->global_names);
+    names_free(&M->struct_names);
+    memset(M, 0, sizeof(*M));
+}
+
+// Dump
+
+static const char *const op_names[IR_OP_COUNT] = {
+    "nop", "copy", "const", "string", "param", "phi", "add", "sub", "mul", "div", "mod", "and", "or",
+    "eq", "ne", "lt", "le", "gt", "ge", "neg", "not", "itof", "ftoi", "global", "slot", "load", "store",
+    "call", "jump", "branch", "return", "switch"};
+
+static const char *const type_names[] = {"void", "int", "float"};
+
+static void dump_string(const char *text, size_t length, FILE *out)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", out);
+        else if (c == '\t')
+            fputs("\\t", out);
+        else if (c < 32 || c >= 127)
+            fprintf(out, "\\x%02x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void dump_inst(const ir_function *F, uint32_t i, FILE *out)
+{
+    const ir_inst *I = &F->insts[i];
+    const ir_block *B = &F->blocks[I->block];
+    fputs("    ", out);
+    if (I->type != IR_VOID)
+        fprintf(out, "v%u %s = ", i, type_names[I->type]);
+    fputs(op_names[I->op], out);
+    switch (I->op)
+    {
+    case IR_CONST:
+        if (I->type == IR_FLOAT)
+            fprintf(out, " %.17g", I->value.d);
+        else
+            fprintf(out, " %lld", (long long)I->value.i);
+        break;
+    case IR_PARAM:
+    case IR_SLOT:
+        fprintf(out, " %lld", (long long)I->value.i);
+        break;
+    case IR_STRING:
+        fputc(' ', out);
+        dump_string(intern_text(I->name), intern_length(I->name), out);
+        break;
+    case IR_GLOBAL:
+        fprintf(out, " %s", intern_text(I->name));
+        break;
+    case IR_PHI:
+        for (uint32_t k = 0; k < I->b; k++)
+            fprintf(out, "%s v%u b%u", k ? "," : "", F->pool[I->a + k], ir_list_at(F, B->preds)[k]);
+        break;
+    case IR_CALL:
+        fprintf(out, " %s(", intern_text(I->name));
+        for (uint32_t k = 0; k < I->b; k++)
+            fprintf(out, "%sv%u", k ? ", " : "", F->pool[I->a + k]);
+        fputc(')', out);
+        break;
+    case IR_JUMP:
+        fprintf(out, " b%u", ir_list_at(F, B->succs)[0]);
+        break;
+    case IR_BRANCH:
+        fprintf(out, " v%u, b%u, b%u", I->a, ir_list_at(F, B->succs)[0], ir_list_at(F, B->succs)[1]);
+        break;
+    case IR_SWITCH:
+        fprintf(out, " v%u, %lld:", I->a, (long long)I->value.i);
+        for (uint32_t k = 0; k < I->b; k++)
+            fprintf(out, " b%u", ir_list_at(F, B->succs)[F->pool[I->name + k]]);
+        fprintf(out, ", else b%u", ir_list_at(F, B->succs)[0]);
+        break;
+    default:
+        for (uint32_t k = 0; k < ir_operand_count(I); k++)
+            fprintf(out, "%s v%u", k ? "," : "", k ? I->b : I->a);
+        break;
+    }
+    fputc('\n', out);
+}
+
+static void dump_signature(const ir_function *F, FILE *out)
+{
+    fprintf(out, "%s %s(", F->defined ? "function" : "declare", intern_text(F->name));
+    for (uint32_t i = 0; i < F->params.count; i++)
+        fprintf(out, "%s%s", i ? ", " : "", type_names[ir_list_at(F, F->params)[i]]);
+    fprintf(out, ") %s\n", type_names[F->type]);
+}
+
+void ir_dump(const ir_module *M, FILE *out)
+{
+    for (uint32_t g = 0; g < M->nglobals; g++)
+    {
+        const ir_global *G = &M->globals[g];
+        if (G->type == IR_VOID)
+            fprintf(out, "global %s [%u bytes]\n", intern_text(G->name), G->size);
+        else if (G->type == IR_FLOAT)
+            fprintf(out, "global %s float = %.17g\n", intern_text(G->name), G->init.d);
+        else
+            fprintf(out, "global %s int = %lld\n", intern_text(G->name), (long long)G->init.i);
+    }
+    if (M->nglobals)
+        fputc('\n', out);
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        const ir_function *F = &M->functions[f];
+        dump_signature(F, out);
+        if (!F->defined)
+            continue;
+        for (uint32_t b = 0; b < F->nblocks; b++)
+        {
+            const ir_block *B = &F->blocks[b];
+            if (B->dead)
+                continue;
+            fprintf(out, "  b%u:", b);
+            if (B->preds.count)
+                fputs(" <-", out);
+            for (uint32_t k = 0; k < B->preds.count; k++)
+                fprintf(out, " b%u", ir_list_at(F, B->preds)[k]);
+            fputc('\n', out);
+            for (uint32_t i = B->first; i; i = F->insts[i].next)
+                dump_inst(F, i, out);
+        }
+        fputc('\n', out);
+    }
+}
+
+void ir_dump_switches(const ir_module *M, FILE *out)
+{
+    static const char *const strategies[] = {"compare chain", "binary search", "jump table"};
+    for (uint32_t k = 0; k < M->nswitches; k++)
+    {
+        const ir_switch *S = &M->switches[k];
+        fprintf(out, "Switch in %s line %u: %u case%s", intern_text(S->function), S->line, S->cases,
+                S->cases == 1 ? "" : "s");
+        if (S->cases)
+            fprintf(out, " from %lld to %lld", (long long)S->low, (long long)S->high);
+        fprintf(out, "%s, %s", S->has_default ? " and a default" : "", strategies[S->strategy]);
+        if (S->strategy == IR_SWITCH_SEARCH && S->tables)
+            fprintf(out, " to %u jump table%s", S->tables, S->tables == 1 ? "" : "s");
+        fputc('\n', out);
+    }
+}
+
+void ir_check_native_calls(const ir_module *M)
+{
+    for (uint32_t k = 0; k < M->nchar_calls; k++)
+    {
+        const ir_char_call *C = &M->char_calls[k];
+        const ir_function *F = ir_find_function(M, C->callee);
+        if (!F || !F->defined)
+            module_error(M, C->line, "Char array passed to %s, which is not defined here and would read its 8-byte chars as bytes",
+                         intern_text(C->callee));
+    }
+}
@@ -0,0 +1,306 @@
+#include <stdio.h> // For FILE type
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef IR_H
+#define IR_H
+
+#include "ast.h"
+
+// Types of IR values. Every scalar is 8 bytes in memory, chars included
+enum {
+    IR_VOID,
+    IR_INT,
+    IR_FLOAT
+};
+
+#define IR_SCALAR_SIZE 8
+
+/*
+Instructions. Arithmetic and comparisons work on ints or floats by the
+type of their operands, and a comparison gives an int 0 or 1. Addresses
+are ints. The last instruction of a block is one of the terminators, which
+leave the block by its successors in order.
+*/
+enum {
+    IR_NOP,    // Removed
+    IR_COPY,   // a, only while a function is being built
+    IR_CONST,  // value.i, or value.d for a float
+    IR_STRING, // Address of the string literal name
+    IR_PARAM,  // Parameter value.i
+    IR_PHI,    // One operand per predecessor of the block, in the same order
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_AND,
+    IR_OR,
+    IR_EQ,
+    IR_NE,
+    IR_LT,
+    IR_LE,
+    IR_GT,
+    IR_GE,
+    IR_NEG,
+    IR_NOT,    // Bitwise complement
+    IR_ITOF,
+    IR_FTOI,
+    IR_GLOBAL, // Address of the global variable name
+    IR_SLOT,   // Address of value.i bytes of the function's frame
+    IR_LOAD,   // Value of the type at address a
+    IR_STORE,  // Stores b at address a
+    IR_CALL,   // Calls the function name with the operands as arguments
+    IR_JUMP,   // To the only successor
+    IR_BRANCH, // To the first successor if a is not 0, else to the second
+    IR_RETURN, // a, or nothing when a is 0
+    IR_SWITCH, // To the successor at a - value.i in the table of b successor indexes in the function's
+               // pool from name on, or to the first when a - value.i is outside it or 0 there
+    IR_OP_COUNT
+};
+
+// Operands a and b are instruction indexes, 0 for none. A phi or a call has b
+// operands instead, in the function's pool from a on
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    uint32_t block;
+    uint32_t next; // Next instruction of the block, 0 after the last
+    uint32_t a, b;
+    uint32_t name;
+    union {
+        int64_t i;
+        double d;
+    } value;
+} ir_inst;
+
+// A range of the function's pool that can grow, by moving to its end
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+    uint32_t capacity;
+} ir_list;
+
+typedef struct {
+    uint32_t first, last; // Instructions, phis first
+    ir_list preds;
+    ir_list succs; // The successors of a switch are distinct and have no phis
+    bool sealed; // Every predecessor is known, while the function is being built
+    bool dead; // Removed as unreachable
+} ir_block;
+
+/*
+A function is three arrays, instructions, blocks and a pool of uint32
+lists, that refer to each other by index. Instruction 0 and block 0 exist:
+instruction 0 stands for no value and block 0 is the entry.
+*/
+typedef struct {
+    uint32_t name;
+    uint8_t type; // Of the return value
+    bool defined;
+    unsigned line;
+    ir_list params; // Type of each parameter
+    ir_inst *insts;
+    uint32_t ninsts;
+    uint32_t insts_capacity;
+    ir_block *blocks;
+    uint32_t nblocks;
+    uint32_t blocks_capacity;
+    uint32_t *pool;
+    uint32_t pool_size;
+    uint32_t pool_capacity;
+    ast tree; // Copy of the declaration's syntax tree when the module keeps them, with its parameters and body
+    uint32_t tree_params;
+    uint32_t tree_body;
+} ir_function;
+
+typedef struct {
+    uint32_t name;
+    uint8_t type; // IR_INT or IR_FLOAT for a scalar, IR_VOID for an array or a struct
+    ast_type decl; // As declared
+    int64_t length; // Elements of an array, 0 for a scalar
+    uint32_t size;
+    union {
+        int64_t i;
+        double d;
+    } init;
+} ir_global;
+
+typedef struct {
+    uint32_t name;
+    ast_type type;
+    int64_t length; // Elements of an array member, 0 for a scalar
+    uint32_t offset;
+} ir_member;
+
+typedef struct {
+    uint32_t name;
+    uint32_t size;
+    uint32_t first; // Members from first in the module's members
+    uint32_t count;
+} ir_struct;
+
+// How a switch statement was lowered
+enum {
+    IR_SWITCH_CHAIN,  // Comparisons with each case in turn
+    IR_SWITCH_SEARCH, // A binary search over the sorted cases, to chains or tables for the ranges it narrows to
+    IR_SWITCH_TABLE   // One IR_SWITCH indexed by the value
+};
+
+typedef struct {
+    uint32_t function;
+    unsigned line;
+    uint32_t cases;
+    int64_t low, high; // Smallest and largest case, when there is one
+    bool has_default;
+    uint8_t strategy;
+    uint32_t tables; // IR_SWITCH instructions it got
+} ir_switch;
+
+// A call that passes a char array, whose chars take 8 bytes each like every scalar
+typedef struct {
+    uint32_t callee;
+    unsigned line;
+} ir_char_call;
+
+// Names are looked up in maps from interned name to index
+typedef struct {
+    uint32_t *keys;
+    uint32_t *values;
+    uint32_t nslots;
+    uint32_t count;
+} ir_names;
+
+typedef struct {
+    char *filename;
+    ir_function *functions; // Prototypes too, which have no blocks
+    uint32_t nfunctions;
+    uint32_t functions_capacity;
+    ir_global *globals;
+    uint32_t nglobals;
+    uint32_t globals_capacity;
+    ir_struct *structs;
+    uint32_t nstructs;
+    uint32_t structs_capacity;
+    ir_member *members;
+    uint32_t nmembers;
+    uint32_t members_capacity;
+    ir_switch *switches; // Every switch statement, in the order they were lowered
+    uint32_t nswitches;
+    uint32_t switches_capacity;
+    ir_char_call *char_calls;
+    uint32_t nchar_calls;
+    uint32_t char_calls_capacity;
+    ir_names function_names;
+    ir_names global_names;
+    ir_names struct_names;
+    bool keep_trees; // For the tree-walking interpreter of -run --ast
+} ir_module;
+
+void ir_module_init(ir_module *M, char *filename);
+
+void ir_define_struct(ir_module *M, const ast *T, uint32_t name, uint32_t members, unsigned line);
+
+void ir_define_global(ir_module *M, const ast *T, uint32_t decl);
+
+void ir_define_function(ir_module *M, const ast *T, uint32_t name, ast_type type, uint32_t params, uint32_t body, unsigned line);
+
+ir_function *ir_find_function(const ir_module *M, uint32_t name);
+
+ir_global *ir_find_global(const ir_module *M, uint32_t name);
+
+// The latest definition of the struct name, or NULL
+const ir_struct *ir_find_struct(const ir_module *M, uint32_t name);
+
+void ir_unlink(ir_function *F, uint32_t inst);
+
+// Index of the operand of the phis of a successor of from that comes by edge k of from
+uint32_t ir_edge_operand(const ir_function *F, uint32_t from, uint32_t k);
+
+// Removes the edge between two blocks, and the operands of the phis of to that came by it
+void ir_remove_edge(ir_function *F, uint32_t from, uint32_t to);
+
+// Removes unreachable blocks, phis of a single value, copies and nops
+void ir_simplify(ir_function *F);
+
+// Sparse conditional constant propagation. Gives whether anything changed
+bool ir_sccp(ir_function *F);
+
+// Dead code elimination. Gives whether anything changed
+bool ir_dce(ir_function *F);
+
+// Runs the passes above over every function until they change nothing
+void ir_optimize(ir_module *M);
+
+void ir_dump(const ir_module *M, FILE *out);
+
+// Prints how each switch statement was lowered, a line each
+void ir_dump_switches(const ir_module *M, FILE *out);
+
+// Fails with an IR error where a char array is passed to a function M does not define, which would read it as bytes
+void ir_check_native_calls(const ir_module *M);
+
+void ir_module_free(ir_module *M);
+
+static inline bool ir_is_terminator(unsigned op)
+{
+    return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN || op == IR_SWITCH;
+}
+
+// Whether the instruction has to stay even when its value is not used
+static inline bool ir_has_effect(unsigned op)
+{
+    return op == IR_STORE || op == IR_CALL || ir_is_terminator(op);
+}
+
+static inline uint32_t ir_operand_count(const ir_inst *I)
+{
+    switch (I->op)
+    {
+    case IR_PHI:
+    case IR_CALL:
+        return I->b;
+    case IR_COPY:
+    case IR_NEG:
+    case IR_NOT:
+    case IR_ITOF:
+    case IR_FTOI:
+    case IR_LOAD:
+    case IR_BRANCH:
+    case IR_SWITCH:
+        return 1;
+    case IR_RETURN:
+        return I->a ? 1 : 0;
+    case IR_NOP:
+    case IR_CONST:
+    case IR_STRING:
+    case IR_PARAM:
+    case IR_GLOBAL:
+    case IR_SLOT:
+    case IR_JUMP:
+        return 0;
+    default:
+        return 2;
+    }
+}
+
+// Operand i of instruction I of F, which can be assigned to
+static inline uint32_t *ir_operand(ir_function *F, ir_inst *I, uint32_t i)
+{
+    if (I->op == IR_PHI || I->op == IR_CALL)
+        return &F->pool[I->a + i];
+    return i == 0 ? &I->a : &I->b;
+}
+
+static inline uint32_t *ir_list_at(const ir_function *F, ir_list L)
+{
+    return F->pool + L.start;
+}
+
+// Index of the successor switch I takes when its operand is value
+static inline uint32_t ir_switch_successor(const ir_function *F, const ir_inst *I, int64_t value)
+{
+    uint64_t k = (uint64_t)value - (uint64_t)I->value.i;
+    return k < I->b ? F->pool[I->name + k] : 0;
+}
+
+#endif
@@ -0,0 +1,500 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ir.h"
+#include "mem.h"
+
+// Lattice of sparse conditional constant propagation, from unknown yet to not constant
+enum {
+    LATTICE_TOP,
+    LATTICE_CONST,
+    LATTICE_BOTTOM
+};
+
+typedef struct {
+    uint8_t state;
+    union {
+        int64_t i;
+        double d;
+    } value;
+} lattice;
+
+typedef struct {
+    uint32_t from, to;
+} edge;
+
+/*
+Wegman and Zadeck's sparse conditional constant propagation. Blocks are
+only visited once an edge into them is found executable, starting from the
+entry, and a branch on a constant only makes the edge it takes executable.
+Values move down the lattice as they are visited, and the users of a value
+that moved are visited again. Once nothing moves, constants replace the
+instructions they were found for, and branches and switches on constants
+become jumps, which leaves the blocks that were never reached for
+ir_simplify to remove.
+*/
+typedef struct {
+    ir_function *F;
+    lattice *values;
+    bool *reached; // Executable blocks
+    bool *taken; // Executable edges, by the pool index of the edge in the predecessors of its block
+    uint32_t *use_start; // Users of instruction i are uses[use_start[i]] up to uses[use_start[i + 1]]
+    uint32_t *uses;
+    edge *edges;
+    uint32_t nedges;
+    uint32_t edges_capacity;
+    uint32_t *work; // Instructions to visit again
+    uint32_t nwork;
+    uint32_t work_capacity;
+} sccp;
+
+static void *grow(void *items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    return mem_realloc(MEM_IR, items, (size_t)*capacity * size);
+}
+
+static void add_flow(sccp *S, uint32_t from, uint32_t to)
+{
+    S->edges = grow(S->edges, S->nedges, &S->edges_capacity, sizeof(edge));
+    S->edges[S->nedges++] = (edge){from, to};
+}
+
+static bool same_value(const lattice *a, const lattice *b)
+{
+    return memcmp(&a->value, &b->value, sizeof(a->value)) == 0;
+}
+
+// Folds an arithmetic instruction over constant operands. Gives false when it cannot be folded
+static bool fold(const ir_inst *I, unsigned type, const lattice *a, const lattice *b, lattice *out)
+{
+    out->value.i = 0;
+    if (type == IR_FLOAT)
+    {
+        double x = a->value.d, y = b ? b->value.d : 0;
+        switch (I->op)
+        {
+        case IR_ADD:
+            out->value.d = x + y;
+            return true;
+        case IR_SUB:
+            out->value.d = x - y;
+            return true;
+        case IR_MUL:
+            out->value.d = x * y;
+            return true;
+        case IR_DIV:
+            if (y == 0)
+                return false;
+            out->value.d = x / y;
+            return true;
+        case IR_EQ:
+            out->value.i = x == y;
+            return true;
+        case IR_NE:
+            out->value.i = x != y;
+            return true;
+        case IR_LT:
+            out->value.i = x < y;
+            return true;
+        case IR_LE:
+            out->value.i = x <= y;
+            return true;
+        case IR_GT:
+            out->value.i = x > y;
+            return true;
+        case IR_GE:
+            out->value.i = x >= y;
+            return true;
+        case IR_NEG:
+            out->value.d = -x;
+            return true;
+        case IR_FTOI:
+            if (!(x > -9.2e18 && x < 9.2e18))
+                return false;
+            out->value.i = (int64_t)x;
+            return true;
+        }
+        return false;
+    }
+    int64_t x = a->value.i, y = b ? b->value.i : 0;
+    switch (I->op)
+    {
+    case IR_ADD:
+        out->value.i = (int64_t)((uint64_t)x + (uint64_t)y);
+        return true;
+    case IR_SUB:
+        out->value.i = (int64_t)((uint64_t)x - (uint64_t)y);
+        return true;
+    case IR_MUL:
+        out->value.i = (int64_t)((uint64_t)x * (uint64_t)y);
+        return true;
+    case IR_DIV:
+    case IR_MOD:
+        // Left for the program to fail on when it runs
+        if (y == 0 || (x == INT64_MIN && y == -1))
+            return false;
+        out->value.i = I->op == IR_DIV ? x / y : x % y;
+        return true;
+    case IR_AND:
+        out->value.i = x & y;
+        return true;
+    case IR_OR:
+        out->value.i = x | y;
+        return true;
+    case IR_EQ:
+        out->value.i = x == y;
+        return true;
+    case IR_NE:
+        out->value.i = x != y;
+        return true;
+    case IR_LT:
+        out->value.i = x < y;
+        return true;
+    case IR_LE:
+        out->value.i = x <= y;
+        return true;
+    case IR_GT:
+        out->value.i = x > y;
+        return true;
+    case IR_GE:
+        out->value.i = x >= y;
+        return true;
+    case IR_NEG:
+        out->value.i = (int64_t)(0 - (uint64_t)x);
+        return true;
+    case IR_NOT:
+        out->value.i = ~x;
+        return true;
+    case IR_ITOF:
+        out->value.d = (double)x;
+        return true;
+    }
+    return false;
+}
+
+// Where instruction i of F belongs in the lattice, from its operands as known so far
+static lattice evaluate(sccp *S, uint32_t i)
+{
+    ir_function *F = S->F;
+    ir_inst *I = &F->insts[i];
+    lattice result = {LATTICE_BOTTOM, {0}};
+    switch (I->op)
+    {
+    case IR_CONST:
+        result.state = LATTICE_CONST;
+        result.value.i = I->value.i;
+        return result;
+    case IR_PHI:
+    {
+        // Only operands that come by executable edges count
+        const ir_block *B = &F->blocks[I->block];
+        result.state = LATTICE_TOP;
+        for (uint32_t k = 0; k < I->b; k++)
+        {
+            if (!S->taken[B->preds.start + k])
+                continue;
+            const lattice *v = &S->values[F->pool[I->a + k]];
+            if (v->state == LATTICE_TOP)
+                continue;
+            if (v->state == LATTICE_BOTTOM || (result.state == LATTICE_CONST && !same_value(&result, v)))
+            {
+                result.state = LATTICE_BOTTOM;
+                return result;
+            }
+            result = *v;
+        }
+        return result;
+    }
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+    case IR_NEG:
+    case IR_NOT:
+    case IR_ITOF:
+    case IR_FTOI:
+    {
+        const lattice *a = &S->values[I->a];
+        const lattice *b = ir_operand_count(I) == 2 ? &S->values[I->b] : NULL;
+        if (a->state == LATTICE_BOTTOM || (b && b->state == LATTICE_BOTTOM))
+            return result;
+        if (a->state == LATTICE_TOP || (b && b->state == LATTICE_TOP))
+        {
+            result.state = LATTICE_TOP;
+            return result;
+        }
+        if (fold(I, F->insts[I->a].type, a, b, &result))
+            result.state = LATTICE_CONST;
+        return result;
+    }
+    }
+    return result;
+}
+
+static void visit(sccp *S, uint32_t i)
+{
+    ir_function *F = S->F;
+    ir_inst *I = &F->insts[i];
+    uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+    if (I->op == IR_JUMP)
+    {
+        add_flow(S, I->block, succs[0]);
+        return;
+    }
+    if (I->op == IR_BRANCH)
+    {
+        const lattice *condition = &S->values[I->a];
+        if (condition->state == LATTICE_CONST)
+        {
+            add_flow(S, I->block, succs[condition->value.i ? 0 : 1]);
+        }
+        else if (condition->state == LATTICE_BOTTOM)
+        {
+            add_flow(S, I->block, succs[0]);
+            add_flow(S, I->block, succs[1]);
+        }
+        return;
+    }
+    if (I->op == IR_SWITCH)
+    {
+        const lattice *value = &S->values[I->a];
+        if (value->state == LATTICE_CONST)
+        {
+            add_flow(S, I->block, succs[ir_switch_successor(F, I, value->value.i)]);
+        }
+        else if (value->state == LATTICE_BOTTOM)
+        {
+            for (uint32_t k = 0; k < F->blocks[I->block].succs.count; k++)
+                add_flow(S, I->block, succs[k]);
+        }
+        return;
+    }
+    if (I->type == IR_VOID)
+        return;
+    lattice *current = &S->values[i];
+    if (current->state == LATTICE_BOTTOM)
+        return;
+    lattice next = evaluate(S, i);
+    if (next.state == current->state && (next.state != LATTICE_CONST || same_value(&next, current)))
+        return;
+    *current = next;
+    for (uint32_t u = S->use_start[i]; u < S->use_start[i + 1]; u++)
+    {
+        S->work = grow(S->work, S->nwork, &S->work_capacity, sizeof(uint32_t));
+        S->work[S->nwork++] = S->uses[u];
+    }
+}
+
+// Counts the users of every instruction, then lists them, so each value finds its users
+static void build_uses(sccp *S)
+{
+    ir_function *F = S->F;
+    S->use_start = mem_calloc(MEM_IR, F->ninsts + 1, sizeof(uint32_t));
+    for (uint32_t b = 0; b < F->nblocks; b++)
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            for (uint32_t k = 0; k < ir_operand_count(&F->insts[i]); k++)
+                S->use_start[*ir_operand(F, &F->insts[i], k) + 1]++;
+    for (uint32_t i = 0; i < F->ninsts; i++)
+        S->use_start[i + 1] += S->use_start[i];
+    S->uses = mem_alloc(MEM_IR, (S->use_start[F->ninsts] + 1) * sizeof(uint32_t));
+    uint32_t *fill = mem_alloc(MEM_IR, (F->ninsts + 1) * sizeof(uint32_t));
+    memcpy(fill, S->use_start, (F->ninsts + 1) * sizeof(uint32_t));
+    for (uint32_t b = 0; b < F->nblocks; b++)
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            for (uint32_t k = 0; k < ir_operand_count(&F->insts[i]); k++)
+                S->uses[fill[*ir_operand(F, &F->insts[i], k)]++] = i;
+    mem_free(fill);
+}
+
+bool ir_sccp(ir_function *F)
+{
+    sccp S;
+    memset(&S, 0, sizeof(S));
+    S.F = F;
+    S.values = mem_calloc(MEM_IR, F->ninsts, sizeof(lattice));
+    S.reached = mem_calloc(MEM_IR, F->nblocks, sizeof(bool));
+    S.taken = mem_calloc(MEM_IR, F->pool_size + 1, sizeof(bool));
+    build_uses(&S);
+
+    S.reached[0] = true;
+    for (uint32_t i = F->blocks[0].first; i; i = F->insts[i].next)
+        visit(&S, i);
+    while (S.nedges || S.nwork)
+    {
+        while (S.nedges)
+        {
+            edge e = S.edges[--S.nedges];
+            ir_block *B = &F->blocks[e.to];
+            uint32_t *preds = ir_list_at(F, B->preds);
+            uint32_t k = 0;
+            while (k < B->preds.count && (preds[k] != e.from || S.taken[B->preds.start + k]))
+                k++;
+            if (k == B->preds.count)
+                continue;
+            S.taken[B->preds.start + k] = true;
+            // A block reached before only has its phis to look at again
+            bool first = !S.reached[e.to];
+            S.reached[e.to] = true;
+            for (uint32_t i = B->first; i; i = F->insts[i].next)
+            {
+                if (first || F->insts[i].op == IR_PHI)
+                    visit(&S, i);
+            }
+        }
+        while (S.nwork && !S.nedges)
+        {
+            uint32_t i = S.work[--S.nwork];
+            if (S.reached[F->insts[i].block])
+                visit(&S, i);
+        }
+    }
+
+    bool changed = false;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (!S.reached[b])
+            continue;
+        for (uint32_t i = F->blocks[b].first; i;)
+        {
+            ir_inst *I = &F->insts[i];
+            uint32_t next = I->next;
+            if (I->op == IR_BRANCH && S.values[I->a].state == LATTICE_CONST)
+            {
+                uint32_t *succs = ir_list_at(F, F->blocks[b].succs);
+                uint32_t untaken = succs[S.values[I->a].value.i ? 1 : 0];
+                ir_remove_edge(F, b, untaken);
+                I->op = IR_JUMP;
+                I->a = 0;
+                changed = true;
+            }
+            else if (I->op == IR_SWITCH && S.values[I->a].state == LATTICE_CONST)
+            {
+                ir_block *B = &F->blocks[b];
+                uint32_t taken = ir_list_at(F, B->succs)[ir_switch_successor(F, I, S.values[I->a].value.i)];
+                while (B->succs.count > 1)
+                {
+                    uint32_t *succs = ir_list_at(F, B->succs);
+                    ir_remove_edge(F, b, succs[0] == taken ? succs[1] : succs[0]);
+                }
+                I->op = IR_JUMP;
+                I->a = I->b = I->name = 0;
+                changed = true;
+            }
+            else if (S.values[i].state == LATTICE_CONST && I->op != IR_CONST && !ir_has_effect(I->op))
+            {
+                // Phis stay first in their block, so a constant phi moves to the entry
+                if (I->op == IR_PHI)
+                {
+                    ir_unlink(F, i);
+                    I->next = F->blocks[0].first;
+                    F->blocks[0].first = i;
+                    if (!F->blocks[0].last)
+                        F->blocks[0].last = i;
+                    I->block = 0;
+                }
+                I->op = IR_CONST;
+                I->a = I->b = 0;
+                I->value.i = S.values[i].value.i;
+                changed = true;
+            }
+            i = next;
+        }
+    }
+    mem_free(S.values);
+    mem_free(S.reached);
+    mem_free(S.taken);
+    mem_free(S.use_start);
+    mem_free(S.uses);
+    mem_free(S.edges);
+    mem_free(S.work);
+    if (changed)
+        ir_simplify(F);
+    return changed;
+}
+
+// Keeps what has an effect and what it uses, and drops everything else
+bool ir_dce(ir_function *F)
+{
+    bool *live = mem_calloc(MEM_IR, F->ninsts, sizeof(bool));
+    uint32_t *work = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    uint32_t nwork = 0;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            if (ir_has_effect(F->insts[i].op))
+            {
+                live[i] = true;
+                work[nwork++] = i;
+            }
+        }
+    }
+    while (nwork)
+    {
+        ir_inst *I = &F->insts[work[--nwork]];
+        for (uint32_t k = 0; k < ir_operand_count(I); k++)
+        {
+            uint32_t v = *ir_operand(F, I, k);
+            if (v && !live[v])
+            {
+                live[v] = true;
+                work[nwork++] = v;
+            }
+        }
+    }
+    bool changed = false;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        ir_block *B = &F->blocks[b];
+        uint32_t last = 0;
+        for (uint32_t i = B->first; i; i = F->insts[i].next)
+        {
+            if (!live[i])
+            {
+                F->insts[i].op = IR_NOP;
+                changed = true;
+                continue;
+            }
+            if (last)
+                F->insts[last].next = i;
+            else
+                B->first = i;
+            last = i;
+        }
+        if (last)
+            F->insts[last].next = 0;
+        else
+            B->first = 0;
+        B->last = last;
+    }
+    mem_free(live);
+    mem_free(work);
+    return changed;
+}
+
+void ir_optimize(ir_module *M)
+{
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        ir_function *F = &M->functions[f];
+        if (!F->defined)
+            continue;
+        bool changed = true;
+        while (changed)
+        {
+            changed = ir_sccp(F);
+            changed |= ir_dce(F);
+        }
+    }
+}
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "jit.h"
+#include "x86.h"
+#include "vm.h"
+#include "intern.h"
+#include "mem.h"
+
+// Where the machine code of x86_encode can run
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_NATIVE
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define JIT_CODE (256u << 20) // Bytes of address space for the code, of which only what is used is touched
+#define JIT_STACK_DEFAULT (8u << 20) // Stack assumed when its size is unlimited
+#define JIT_STACK_RESERVE (256u << 10)
+
+typedef struct {
+    ir_module *M;
+    x86_links links;
+    uint8_t *code; // The mapped region, stubs first
+    size_t used;
+    size_t page;
+    void **entries; // Of each function of the module, then of the C functions called without a declaration
+    uint32_t *undeclared; // Names of those
+    uint32_t nundeclared;
+    uint32_t undeclared_capacity;
+    uint32_t *order; // Functions in the order they were compiled
+    uint32_t ncompiled;
+    size_t *sizes; // Bytes of machine code of each function
+    double *times; // Seconds each took to compile
+    double compiling;
+    x86_stats stats;
+} jit;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t to_int(double d)
+{
+    // Out of range conversions give what cvttsd2si does
+    if (!(d > -9223372036854775808.0 && d < 9223372036854775808.0))
+        return INT64_MIN;
+    return (int64_t)d;
+}
+
+// Calls of functions that are not declared go to the C library, like the ones only declared
+static void find_undeclared(jit *J)
+{
+    ir_module *M = J->M;
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        ir_function *F = &M->functions[f];
+        for (uint32_t i = 1; F->defined && i < F->ninsts; i++)
+        {
+            uint32_t name = F->insts[i].name;
+            if (F->insts[i].op != IR_CALL || ir_find_function(M, name))
+                continue;
+            uint32_t k = 0;
+            while (k < J->nundeclared && J->undeclared[k] != name)
+                k++;
+            if (k < J->nundeclared)
+                continue;
+            if (J->nundeclared == J->undeclared_capacity)
+            {
+                J->undeclared_capacity = J->undeclared_capacity ? J->undeclared_capacity * 2 : 16;
+                J->undeclared = mem_realloc(MEM_IR, J->undeclared, J->undeclared_capacity * sizeof(uint32_t));
+            }
+            J->undeclared[J->nundeclared++] = name;
+        }
+    }
+}
+
+static void *native(uint32_t name)
+{
+    vm_native fn = vm_find_native(name);
+    void *address;
+    memcpy(&address, &fn, sizeof(address));
+    return address;
+}
+
+static void **entry(void *context, uint32_t name)
+{
+    jit *J = context;
+    ir_function *F = ir_find_function(J->M, name);
+    uint32_t k = 0;
+    if (F)
+        k = (uint32_t)(F - J->M->functions);
+    else
+    {
+        while (J->undeclared[k] != name)
+            k++;
+        k += J->M->nfunctions;
+    }
+    if (!J->entries[k])
+        vm_error("Function %s is neither defined nor in the C library", intern_text(name));
+    return &J->entries[k];
+}
+
+static void division_by_zero(void)
+{
+    vm_error("Division by zero");
+}
+
+static void stack_overflow(uint32_t name)
+{
+    vm_error("Stack overflow in %s", intern_text(name));
+}
+
+/*
+The lowest rsp compiled code may take: the stack size limit below where
+jit_run is, keeping JIT_STACK_RESERVE bytes for the C functions it calls
+and for reporting the overflow.
+*/
+static uintptr_t stack_limit(void)
+{
+    char here;
+    struct rlimit limit;
+    size_t size = JIT_STACK_DEFAULT;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = limit.rlim_cur;
+    if (size < 2 * JIT_STACK_RESERVE)
+        return 0;
+    return (uintptr_t)&here - size + JIT_STACK_RESERVE;
+}
+
+// Makes the pages from byte from to byte to of the code writable, or executable again
+static void protect(jit *J, size_t from, size_t to, bool writable)
+{
+    from -= from % J->page;
+    if (mprotect(J->code + from, to - from, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+        vm_error("Cannot make the compiled code %s", writable ? "writable" : "executable");
+}
+
+// Copies size bytes of code to the end of the region, 16-byte aligned, giving where they went
+static uint8_t *place(jit *J, const uint8_t *code, size_t size)
+{
+    size_t at = (J->used + 15) & ~(size_t)15;
+    if (at + size > JIT_CODE)
+        vm_error("The compiled code takes more than %u MB", JIT_CODE >> 20);
+    protect(J, J->used, at + size, true);
+    memcpy(J->code + at, code, size);
+    protect(J, J->used, at + size, false);
+    J->used = at + size;
+    return J->code + at;
+}
+
+// Compiles function f, called by its stub on its first call, giving its code
+static void *compile(jit *J, uint32_t f)
+{
+    double start = now();
+    size_t size;
+    uint8_t *code = x86_encode(J->M, f, &J->links, &J->stats, &size);
+    J->entries[f] = place(J, code, size);
+    mem_free(code);
+    J->sizes[f] = size;
+    J->times[f] = now() - start;
+    J->compiling += J->times[f];
+    J->order[J->ncompiled++] = f;
+    return J->entries[f];
+}
+
+static void put_bytes(uint8_t **p, const char *bytes, size_t count)
+{
+    memcpy(*p, bytes, count);
+    *p += count;
+}
+
+static void put_int(uint8_t **p, uint64_t value, unsigned size)
+{
+    for (unsigned k = 0; k < size; k++)
+        *(*p)++ = (uint8_t)(value >> 8 * k);
+}
+
+/*
+The stub of function f saves the argument registers, calls compile, puts
+them back and jumps to the code compile gives, with the stack as the call
+left it, so that the function gets its arguments as if called directly.
+The six pushes and the 64 bytes for the xmm registers keep rsp 16-byte
+aligned for the call.
+*/
+static uint8_t *write_stub(jit *J, uint8_t *p, uint32_t f)
+{
+    void *(*target)(jit *, uint32_t) = compile;
+    uint64_t address;
+    memcpy(&address, &target, sizeof(address));
+    put_bytes(&p, "\x55\x48\x89\xE5", 4); // pushq %rbp; movq %rsp, %rbp
+    put_bytes(&p, "\x57\x56\x52\x51\x41\x50\x41\x51", 8); // pushq %rdi, %rsi, %rdx, %rcx, %r8, %r9
+    put_bytes(&p, "\x48\x83\xEC\x40", 4); // subq $64, %rsp
+    for (unsigned k = 0; k < 8; k++)
+    {
+        put_bytes(&p, "\xF2\x0F\x11", 3); // movsd %xmmk, 8k(%rsp)
+        put_int(&p, 0x44 | k << 3, 1);
+        put_int(&p, 0x24, 1);
+        put_int(&p, 8 * k, 1);
+    }
+    put_bytes(&p, "\x48\xBF", 2); // movabsq $J, %rdi
+    put_int(&p, (uint64_t)(uintptr_t)J, 8);
+    put_bytes(&p, "\xBE", 1); // movl $f, %esi
+    put_int(&p, f, 4);
+    put_bytes(&p, "\x48\xB8", 2); // movabsq $compile, %rax
+    put_int(&p, address, 8);
+    put_bytes(&p, "\xFF\xD0", 2); // call *%rax
+    for (unsigned k = 0; k < 8; k++)
+    {
+        put_bytes(&p, "\xF2\x0F\x10", 3); // movsd 8k(%rsp), %xmmk
+        put_int(&p, 0x44 | k << 3, 1);
+        put_int(&p, 0x24, 1);
+        put_int(&p, 8 * k, 1);
+    }
+    put_bytes(&p, "\x48\x83\xC4\x40", 4); // addq $64, %rsp
+    put_bytes(&p, "\x41\x59\x41\x58\x59\x5A\x5E\x5F", 8); // popq %r9, %r8, %rcx, %rdx, %rsi, %rdi
+    put_bytes(&p, "\x5D\xFF\xE0", 3); // popq %rbp; jmp *%rax
+    return p;
+}
+
+static void report(const jit *J, double total)
+{
+    const ir_module *M = J->M;
+    size_t bytes = 0;
+    for (uint32_t k = 0; k < J->ncompiled; k++)
+    {
+        uint32_t f = J->order[k];
+        bytes += J->sizes[f];
+        fprintf(stderr, "JIT %s: %zu bytes in %.3f ms\n", intern_text(M->functions[f].name), J->sizes[f],
+                J->times[f] * 1e3);
+    }
+    fprintf(stderr, "JIT: %u functions, %zu bytes, %u of %u values in registers, compiled in %.3f ms and ran in %.3f ms\n",
+            J->ncompiled, bytes, J->stats.in_registers, J->stats.values, J->compiling * 1e3, (total - J->compiling) * 1e3);
+}
+#endif
+
+int64_t jit_run(ir_module *M)
+{
+    ir_function *main = ir_find_function(M, intern("main", 4));
+    if (!main || !main->defined)
+        vm_error("No function main");
+#ifdef JIT_NATIVE
+    jit J;
+    memset(&J, 0, sizeof(J));
+    J.M = M;
+    J.page = (size_t)sysconf(_SC_PAGESIZE);
+    void *region = mmap(NULL, JIT_CODE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        fprintf(stderr, "JIT: Cannot map memory for code, running on the bytecode interpreter\n");
+        return vm_run(M);
+    }
+    J.code = region;
+    find_undeclared(&J);
+    J.entries = mem_calloc(MEM_IR, M->nfunctions + J.nundeclared + 1, sizeof(void *));
+    J.order = mem_alloc(MEM_IR, (M->nfunctions + 1) * sizeof(uint32_t));
+    J.sizes = mem_calloc(MEM_IR, M->nfunctions + 1, sizeof(size_t));
+    J.times = mem_calloc(MEM_IR, M->nfunctions + 1, sizeof(double));
+    uint8_t *p = J.code;
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        if (M->functions[f].defined)
+        {
+            J.entries[f] = p;
+            p = write_stub(&J, p, f);
+        }
+        else
+            J.entries[f] = native(M->functions[f].name);
+    }
+    for (uint32_t k = 0; k < J.nundeclared; k++)
+        J.entries[M->nfunctions + k] = native(J.undeclared[k]);
+    J.used = (size_t)(p - J.code);
+    if (mprotect(J.code, J.used ? J.used : 1, PROT_READ | PROT_EXEC) != 0)
+    {
+        fprintf(stderr, "JIT: Executable memory is not allowed, running on the bytecode interpreter\n");
+        munmap(region, JIT_CODE);
+        mem_free(J.entries);
+        mem_free(J.order);
+        mem_free(J.sizes);
+        mem_free(J.times);
+        mem_free(J.undeclared);
+        return vm_run(M);
+    }
+    J.links.globals = vm_globals(M);
+    J.links.entry = entry;
+    J.links.context = &J;
+    J.links.division_by_zero = division_by_zero;
+    J.links.stack_limit = stack_limit();
+    J.links.stack_overflow = stack_overflow;
+
+    // main is called with its parameters, if any, 0
+    void *code = J.entries[main - M->functions];
+    int64_t result = 0;
+    double start = now();
+    if (main->type == IR_FLOAT)
+    {
+        double (*fn)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t);
+        memcpy(&fn, &code, sizeof(fn));
+        result = to_int(fn(0, 0, 0, 0, 0, 0));
+    }
+    else
+    {
+        int64_t (*fn)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t);
+        memcpy(&fn, &code, sizeof(fn));
+        result = fn(0, 0, 0, 0, 0, 0);
+        if (main->type == IR_VOID)
+            result = 0;
+    }
+    double total = now() - start;
+    fflush(stdout);
+    report(&J, total);
+
+    munmap(region, JIT_CODE);
+    vm_globals_free(M, J.links.globals);
+    mem_free(J.entries);
+    mem_free(J.order);
+    mem_free(J.sizes);
+    mem_free(J.times);
+    mem_free(J.undeclared);
+    return result;
+#else
+    fprintf(stderr, "JIT: Compiled code only runs on x86-64, running on the bytecode interpreter\n");
+    return vm_run(M);
+#endif
+}
@@ -0,0 +1,22 @@
+#include <stdint.h>
+#ifndef JIT_H
+#define JIT_H
+
+#include "ir.h"
+
+/*
+Runs programs as machine code without an assembler or a linker. Functions
+of the optimized IR are compiled by the x86-64 backend of -2 --asm, with
+the same register allocation, straight into memory mapped executable, each
+the first time it is called: until then its entry is a stub that compiles
+it and jumps to it. Calls go through the entries, so that functions are
+compiled lazily whatever calls them. The compile time of each function and
+the time spent compiling against running are printed to stderr. Where code
+cannot be run, off x86-64 or when the system forbids executable memory,
+the program runs on the bytecode interpreter of -run instead.
+*/
+
+// Runs main, giving what it returns
+int64_t jit_run(ir_module *M);
+
+#endif
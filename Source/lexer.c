@@ -4,55 +4,595 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "lexer.h"
+#include "stats.h"
+#include "trace.h"
+#include "mem.h"
+#include "pch.h"
+#include "ioload.h"
+#include "intern.h"
 
-bool isKeyword(char *checking_string);
-bool isType(char *checking_string);
 bool isOperator(char *checking_string);
 bool isSymbol(char c);
-bool isIdentifier(lexer *L, char *checking_string);
-int getKeywordToken(lexer *L, char *checking_string);
 int getOperatorToken(lexer *L, char *checking_string);
 int getSymbolToken(char c);
 
+static void scan_token(lexer *L);
+
+/*
+Keywords and type names, interned before anything is lexed with their
+token as the tag, so an identifier is told apart from them by its tag
+instead of by comparing its text against each of them.
+*/
+static const struct {
+    const char *text;
+    unsigned token;
+} reserved_words[] = {
+    {"const", TOKEN_CONST}, {"struct", TOKEN_STRUCT}, {"for", TOKEN_FOR}, {"while", TOKEN_WHILE},
+    {"do", TOKEN_DO}, {"if", TOKEN_IF}, {"else", TOKEN_ELSE}, {"break", TOKEN_BREAK},
+    {"continue", TOKEN_CONTINUE}, {"return", TOKEN_RETURN}, {"switch", TOKEN_SWITCH},
+    {"case", TOKEN_CASE}, {"default", TOKEN_DEFAULT},
+    {"void", TOKEN_TYPE}, {"char", TOKEN_TYPE}, {"int", TOKEN_TYPE}, {"float", TOKEN_TYPE}};
+
+static pthread_once_t reserved_once = PTHREAD_ONCE_INIT;
+
+static void intern_reserved_words(void)
+{
+    for (size_t i = 0; i < sizeof(reserved_words) / sizeof(reserved_words[0]); i++)
+        intern_set_tag(intern(reserved_words[i].text, strlen(reserved_words[i].text)), reserved_words[i].token);
+}
+
+// Number of files being included on this thread, to stop include cycles
+static _Thread_local unsigned include_depth;
+
+// Token text of included files is accounted separately from that of the file being compiled
+static inline int text_subsystem(void)
+{
+    return include_depth ? MEM_INCLUDES : MEM_LEXER_TEXT;
+}
+
+/*
+The lexer sees its input through a window that is refilled from the file
+as it is used up. A refill drops the bytes before the mark, the start of
+the token being scanned, and the buffer only grows when one token is
+longer than it, so every token is a single span of the window. Token text
+is copied once, straight from that span, and there is no limit on how long
+a token can be. Text already in memory is used as the window directly.
+*/
+static bool refill(lexer *L)
+{
+    if (L->fd < 0)
+        return false;
+    long keep = L->window_offset + L->window_size - L->mark;
+    if (keep + LEX_BUFFER_SIZE > L->buffer_capacity)
+    {
+        long capacity = L->buffer_capacity ? L->buffer_capacity : LEX_BUFFER_SIZE;
+        while (keep + LEX_BUFFER_SIZE > capacity)
+            capacity *= 2;
+        char *buffer = mem_alloc(text_subsystem(), capacity);
+        if (keep > 0)
+            memcpy(buffer, L->window + (L->mark - L->window_offset), keep);
+        mem_free(L->buffer);
+        L->buffer = buffer;
+        L->buffer_capacity = capacity;
+    }
+    else if (keep > 0)
+        memmove(L->buffer, L->window + (L->mark - L->window_offset), keep);
+    L->window = L->buffer;
+    L->window_offset = L->mark;
+    L->window_size = keep;
+
+    ssize_t n = read(L->fd, L->buffer + keep, L->buffer_capacity - keep);
+    if (n < 0)
+    {
+        fprintf(stderr, "Lexer error in file %s line %d: Cannot read input\n", L->filename, lexer_token_line(L, NULL));
+        exit(1);
+    }
+    if (n == 0)
+    {
+        close(L->fd);
+        L->fd = -1;
+        return false;
+    }
+    if (L->lazy_lines)
+        line_table_scan(&L->lines, L->buffer + keep, L->window_offset + keep, n);
+    L->window_size += n;
+    return true;
+}
+
+// Reads one character, keeping track of the byte offset
+static inline int next_char(lexer *L)
+{
+    if (L->pos - L->window_offset >= L->window_size && !refill(L))
+        return EOF;
+    return (unsigned char)L->window[L->pos++ - L->window_offset];
+}
+
+// Pushes back a character read by next_char, which the window still holds
+static inline void unread_char(lexer *L, int c)
+{
+    if (c == EOF)
+        return;
+    L->pos--;
+}
+
+// The input from offset up to the current position
+static inline const char *span(lexer *L, long offset)
+{
+    return L->window + (offset - L->window_offset);
+}
+
+// Copies the input from offset up to the current position into new token text
+static char *span_dup(lexer *L, long offset)
+{
+    return stats_strndup(text_subsystem(), span(L, offset), L->pos - offset);
+}
+
+// Opens infilename and reads the first token, for init_lexer and init_lexer_lines
+static void start_lexer(lexer *L, char *infilename, char *outfilename, bool lazy_lines)
+{
+    init_lexer_at(L, infilename, 0, 1, LEX_MODE_CODE);
+    L->lazy_lines = lazy_lines;
+    if (lazy_lines)
+    {
+        line_table_init(&L->lines);
+        if (L->window_size > 0) // Read ahead whole, so there will be no refill to scan it
+            line_table_scan(&L->lines, L->window, 0, L->window_size);
+    }
+    stats_enter(PHASE_OPEN);
+    L->outfile = outfilename ? deferred_output_open() : NULL;
+    stats_leave();
+    L->outfilename = outfilename;
+    L->defer_includes = false;
+    getNextToken(L);
+}
+
+// Counts the newlines of a token or directive from offset on, which the newline case of scan_token does not see
+static void count_lines(lexer *L, long offset)
+{
+    if (L->lazy_lines)
+        return;
+    const char *p = span(L, offset), *end = span(L, L->pos);
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        L->lineno++;
+        p++;
+    }
+}
+
 void init_lexer(lexer *L, char *infilename, char *outfilename)
 {
     if (!L)
         return; // If lexer object is null
-    L->filename = infilename;
-    L->infile = fopen(infilename, "r");
-    L->outfile = fopen(outfilename, "a");
-    L->outfilename = outfilename;
+    start_lexer(L, infilename, outfilename, false);
+}
+
+/*
+Like init_lexer, but without counting lines: tokens only get their offset,
+and the lines table collects where lines start as the input is read in. A
+line (or column) is then only worked out for the tokens that need one, with
+lexer_token_line or line_table_column.
+*/
+void init_lexer_lines(lexer *L, char *infilename, char *outfilename)
+{
+    if (!L)
+        return;
+    start_lexer(L, infilename, outfilename, true);
+}
+
+/*
+Start lexing infilename from a saved checkpoint (offset, line and mode)
+instead of the top of the file. No token is read yet, and #include
+directives are returned as TOKEN_INCLUDE tokens rather than expanded.
+Returns false if the file cannot be opened.
+*/
+bool init_lexer_at(lexer *L, char *infilename, long offset, unsigned lineno, int mode)
+{
+    if (!L)
+        return false;
+    long size;
+    char *text = offset == 0 ? ioload_take(infilename, &size) : NULL;
+    if (text)
+    {
+        // Read ahead by ioload: lexed from memory, and the window is freed by lexer_close
+        init_lexer_text(L, infilename, text, size, 0, lineno, mode);
+        L->buffer = text;
+        L->buffer_capacity = size + 1;
+        return true;
+    }
+    init_lexer_text(L, infilename, NULL, 0, offset, lineno, mode);
+    stats_enter(PHASE_OPEN);
+    L->fd = open(infilename, O_RDONLY);
+    stats_leave();
+    if (L->fd < 0)
+        return false;
+    if (offset > 0)
+        lseek(L->fd, offset, SEEK_SET);
+    return true;
+}
+
+// Like init_lexer_at, for text of size bytes already read from filename
+void init_lexer_text(lexer *L, char *filename, const char *text, long size, long offset, unsigned lineno, int mode)
+{
+    pthread_once(&reserved_once, intern_reserved_words);
+    L->filename = filename;
+    L->fd = -1;
+    L->window = text;
+    L->window_offset = 0;
+    L->window_size = size;
+    L->mark = offset;
+    L->buffer = NULL;
+    L->buffer_capacity = 0;
+    L->outfile = NULL;
+    L->outfilename = NULL;
     L->current.attrb = NULL;
-    L->lineno = 1;
+    L->current.name = 0;
+    L->current.ID = END;
+    L->lineno = lineno;
+    L->pos = offset;
+    L->mode = mode;
+    L->defer_includes = true;
+    L->lazy_lines = false;
+    if (!text)
+        L->window_offset = offset;
+}
+
+// Releases the text of token t. Interned text is shared, and stays until exit
+void release_token(token *t)
+{
+    if (!t->name)
+        stats_free(t->attrb);
+    t->attrb = NULL;
+}
+
+// Closes the input and releases the window, but not the current token's text
+void lexer_close(lexer *L)
+{
+    if (L->fd >= 0)
+        close(L->fd);
+    L->fd = -1;
+    mem_free(L->buffer);
+    L->buffer = NULL;
+    L->window = NULL;
+    L->window_size = 0;
+    if (L->lazy_lines)
+        line_table_free(&L->lines);
+    L->lazy_lines = false;
+}
+
+/*
+The tokens of included files follow the main output of a -1 or -2 run,
+whichever way its tokens come in. They wait in a temporary file until the
+main output is written, and are then appended to it.
+*/
+FILE *deferred_output_open(void)
+{
+    FILE *deferred = tmpfile();
+    if (!deferred)
+    {
+        fprintf(stderr, "Error: Cannot open a temporary file for the tokens of included files\n");
+        exit(1);
+    }
+    return deferred;
+}
+
+// Appends what deferred holds to filename, whose own output must be closed or flushed, and closes deferred
+void deferred_output_close(FILE *deferred, const char *filename)
+{
+    if (!deferred)
+        return;
+    FILE *output = fopen(filename, "a");
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", filename);
+        exit(1);
+    }
+    char buffer[65536];
+    size_t n;
+    rewind(deferred);
+    while ((n = fread(buffer, 1, sizeof(buffer), deferred)) > 0)
+        fwrite(buffer, 1, n, output);
+    fclose(output);
+    fclose(deferred);
+}
+
+/*
+Lexes the file an #include directive in includer names, writing its tokens
+to output (if not NULL) in the -1 format. Includes nested in it are lexed
+the same way, into the same output. An up to date .pch of the file is
+replayed instead of lexing it.
+*/
+void lex_include(char *includer, unsigned lineno, char *filename, FILE *output)
+{
+    if (include_depth >= MAX_INCLUDE_DEPTH)
+    {
+        fprintf(stderr, "Lexer error in file %s line %d at text %s: #include nested too deeply\n", includer, lineno, filename);
+        exit(1);
+    }
+    stats_enter(PHASE_INCLUDE);
+    trace_begin("include", filename, includer, lineno);
+    if (pch_include(filename, output))
+    {
+        trace_end();
+        stats_leave();
+        return;
+    }
+    lexer P;
+    if (!init_lexer_at(&P, filename, 0, 1, LEX_MODE_CODE))
+    {
+        fprintf(stderr, "Lexer error in file %s line %d at text %s: Cannot open include file\n", includer, lineno, filename);
+        exit(1);
+    }
+    P.defer_includes = false;
+    P.outfile = output;
+    include_depth++;
+    getNextToken(&P);
+    while (P.current.ID != END)
+    {
+        if (output)
+        {
+            stats_enter(PHASE_OUTPUT);
+            fprintf(output, "File %s Line %d Token %d Text %s\n", filename, P.current.lineno, P.current.ID, P.current.attrb);
+            stats_leave();
+        }
+        release_token(&P.current);
+        getNextToken(&P);
+    }
+    include_depth--;
+    lexer_close(&P);
+    trace_end();
+    stats_leave();
+}
+
+// Set the current token to the next token, counting it when --stats is on
+void getNextToken(lexer *L)
+{
+    if (!stats.enabled)
+    {
+        scan_token(L);
+        L->current.length = L->pos - L->current.offset;
+        return;
+    }
+    long start = L->pos;
+    stats_push(PHASE_LEX);
+    scan_token(L);
+    stats_pop();
+    L->current.length = L->pos - L->current.offset;
+    stats.bytes_read += L->pos - start;
+    if (L->current.ID < STATS_MAX_TOKEN)
+        stats.tokens[L->current.ID]++;
+    if (L->current.ID == TOKEN_STRING)
+        stats.string_bytes += strlen(L->current.attrb);
+}
+
+/*
+Skips the rest of a block whose { is the current token and reads the token
+after its }, for a parser that only wants the declarations around it. The
+text in between is looked at a character at a time for braces and newlines,
+and only strings, characters, comments and directives, where a brace may
+not count, are handed to scan_token; no other token is made. Returns false,
+with END as the current token, when the input ends before the }.
+*/
+bool lexer_skip_block(lexer *L)
+{
+    unsigned depth = 1;
+    while (depth > 0)
+    {
+        L->mark = L->pos;
+        int c = next_char(L);
+        switch (c)
+        {
+        case '{':
+            depth++;
+            continue;
+        case '}':
+            depth--;
+            continue;
+        case '\n':
+            if (!L->lazy_lines)
+                L->lineno++;
+            continue;
+        case '"':
+        case '\'':
+        case '/':
+        case '#':
+        case EOF:
+            break;
+        default:
+            continue;
+        }
+        unread_char(L, c);
+        scan_token(L);
+        if (L->current.ID == END)
+            return false;
+        if (L->current.ID == TOKEN_LBRACE)
+            depth++;
+        else if (L->current.ID == TOKEN_RBRACE)
+            depth--;
+        release_token(&L->current);
+    }
     getNextToken(L);
+    return true;
+}
+
+/*
+Copies the string literal from offset up to the current position into new
+token text, written the way the -1 output has always shown it: an escaped
+quote loses its backslash and an escaped space loses the space.
+*/
+static char *string_text(lexer *L, long offset)
+{
+    const char *s = span(L, offset);
+    long length = L->pos - offset;
+    char *text = mem_alloc(text_subsystem(), length + 1);
+    if (stats.enabled)
+        stats.strdups++;
+    long n = 0;
+    for (long i = 0; i < length; i++)
+    {
+        if (s[i] != '\\' || i + 1 == length)
+        {
+            text[n++] = s[i];
+            continue;
+        }
+        char escaped = s[++i];
+        if (escaped == '"')
+            text[n++] = '"';
+        else if (escaped == ' ')
+            text[n++] = '\\';
+        else
+        {
+            text[n++] = '\\';
+            text[n++] = escaped;
+        }
+    }
+    text[n] = '\0';
+    return text;
+}
+
+/*
+Numeric literals are decoded once, here, into token.value, so nothing
+after the lexer has to parse their text again. Integers saturate at
+INT64_MAX and reals at infinity, with token.overflow set.
+*/
+
+static int64_t decode_decimal(const char *digits, long n, bool *overflow)
+{
+    uint64_t value = 0;
+    for (long i = 0; i < n; i++)
+    {
+        unsigned d = digits[i] - '0';
+        if (value > (uint64_t)(INT64_MAX - d) / 10)
+        {
+            *overflow = true;
+            return INT64_MAX;
+        }
+        value = value * 10 + d;
+    }
+    return value;
+}
+
+static int64_t decode_hex(const char *digits, long n, bool *overflow)
+{
+    uint64_t value = 0;
+    for (long i = 0; i < n; i++)
+    {
+        unsigned d = isdigit((unsigned char)digits[i]) ? digits[i] - '0' : (digits[i] | 0x20) - 'a' + 10;
+        if (value > (uint64_t)(INT64_MAX - d) / 16)
+        {
+            *overflow = true;
+            return INT64_MAX;
+        }
+        value = value * 16 + d;
+    }
+    return value;
+}
+
+// Powers of ten that are exact as doubles
+static const double exact_powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/*
+Decodes a real literal of n bytes at s, whose NUL-terminated copy is text.
+When the digits fit in the 53 bits of a double and the power of ten is
+exact (Clinger's fast path), one multiplication or division rounds
+correctly, which covers nearly every literal written by hand or by a table
+generator. Anything else goes to strtod, which is slower but always right.
+*/
+static double decode_real(const char *s, long n, const char *text, bool *overflow)
+{
+    uint64_t mantissa = 0;
+    int digits = 0; // Significant digits in mantissa
+    long exponent = 0;
+    long i = 0;
+    for (; i < n && isdigit((unsigned char)s[i]); i++)
+    {
+        if (mantissa == 0 && s[i] == '0')
+            continue;
+        if (++digits > 19)
+            goto slow;
+        mantissa = mantissa * 10 + (s[i] - '0');
+    }
+    if (i < n && s[i] == '.')
+    {
+        for (i++; i < n && isdigit((unsigned char)s[i]); i++)
+        {
+            exponent--;
+            if (mantissa == 0 && s[i] == '0')
+                continue;
+            if (++digits > 19)
+                goto slow;
+            mantissa = mantissa * 10 + (s[i] - '0');
+        }
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E'))
+    {
+        bool negative = false;
+        long e = 0;
+        i++;
+        if (i < n && (s[i] == '+' || s[i] == '-'))
+            negative = s[i++] == '-';
+        for (; i < n; i++)
+        {
+            if (e < 100000)
+                e = e * 10 + (s[i] - '0');
+        }
+        exponent += negative ? -e : e;
+    }
+    if (mantissa == 0)
+        return 0.0;
+    if (mantissa <= (1ULL << 53))
+    {
+        // Moving powers of ten into the mantissa while it stays exact reaches a few more
+        while (exponent > 22 && mantissa <= (1ULL << 53) / 10)
+        {
+            mantissa *= 10;
+            exponent--;
+        }
+        if (exponent >= 0 && exponent <= 22)
+            return (double)mantissa * exact_powers[exponent];
+        if (exponent < 0 && exponent >= -22)
+            return (double)mantissa / exact_powers[-exponent];
+    }
+slow:;
+    double value = strtod(text, NULL);
+    if (isinf(value))
+        *overflow = true;
+    return value;
 }
 
 /*
 Set the current token to the next token on the input stream
 If we encounter eof, use end
 */
-void getNextToken(lexer *L)
+static void scan_token(lexer *L)
 {
 
     int c;
-    int is_single_comment = 0;
-    int is_multi_comment = 0;
+    L->current.name = 0;
     while (true)
     {
-        c = fgetc(L->infile);
+        L->mark = L->pos;
+        c = next_char(L);
         // Case 1: End of File
         if (c == EOF)
         {
             // Case 1.1: If multiline comment was started but not closed
-            if (is_multi_comment)
+            if (L->mode == LEX_MODE_BLOCK_COMMENT)
             {
-                fprintf(stderr, "Lexer error in file %s line %d: No closing argument.", L->filename, L->lineno);
+                fprintf(stderr, "Lexer error in file %s line %d: No closing argument.", L->filename, lexer_token_line(L, NULL));
                 exit(1);
             }
 
             L->current.ID = END;
+            L->current.attrb = NULL;
             L->current.lineno = L->lineno;
+            L->current.offset = L->pos;
             return;
         }
 
@@ -65,8 +605,10 @@ void getNextToken(lexer *L)
         // Case 3: NewLine
         if (c == '\n')
         {
-            L->lineno++;
-            is_single_comment = 0;
+            if (!L->lazy_lines)
+                L->lineno++;
+            if (L->mode == LEX_MODE_LINE_COMMENT)
+                L->mode = LEX_MODE_CODE;
             continue;
         }
 
@@ -74,195 +616,159 @@ void getNextToken(lexer *L)
         // Case 4.1: End of multiline comment
         if (c == '*')
         {
-            int next = fgetc(L->infile);
+            int next = next_char(L);
             if (next == '/')
             {
-                is_multi_comment = 0;
+                if (L->mode == LEX_MODE_BLOCK_COMMENT)
+                    L->mode = LEX_MODE_CODE;
                 continue;
             }
-            ungetc(next, L->infile);
+            unread_char(L, next);
         }
         // Case 4.2: Inside a comment
-        if (is_single_comment || is_multi_comment)
+        if (L->mode != LEX_MODE_CODE)
             continue;
 
         // Case 4.3: Start of Comment
         if (c == '/')
         {
-            int next = fgetc(L->infile);
+            int next = next_char(L);
 
             // Case 4.3.1: Start of SingleLine Comments
             if (next == '/')
             {
-                is_single_comment = 1;
+                L->mode = LEX_MODE_LINE_COMMENT;
                 continue;
             }
 
             // Case 4.3.2: Start of Multiline Comments
             if (next == '*')
             {
-                is_multi_comment = 1;
+                L->mode = LEX_MODE_BLOCK_COMMENT;
                 continue;
             }
 
             // Edge Case: Its a div assign operator
             if (next == '=')
             {
+                L->current.lineno = L->lineno;
+                L->current.offset = L->pos - 2;
                 L->current.ID = TOKEN_DIV_ASSIGN;
-                L->current.attrb = strdup("/=");
+                L->current.attrb = stats_strdup(text_subsystem(), "/=");
                 return;
             }
 
             // Else Case: Its just a division operator
-            ungetc(next, L->infile);
+            unread_char(L, next);
+            L->current.lineno = L->lineno;
+            L->current.offset = L->pos - 1;
             L->current.ID = TOKEN_SLASH;
-            L->current.attrb = strdup("/");
+            L->current.attrb = stats_strdup(text_subsystem(), "/");
             return;
         }
 
         // Case 5: #include directives
         if (c == '#')
         {
-            c = fgetc(L->infile);
-            char checking_string[255];
-            int i = 0;
+            long directive_offset = L->pos - 1;
+            c = next_char(L);
             while (((c == ' ') || (c == '\t') || (c == '\r')) && c != EOF && c != '\n')
             {
-                c = fgetc(L->infile);
+                c = next_char(L);
             }
-            while (!((c == ' ') || (c == '\t') || (c == '\r')) && c != EOF && i < 253)
+            long word = L->pos - 1;
+            while (!((c == ' ') || (c == '\t') || (c == '\r')) && c != EOF)
             {
-                checking_string[i++] = c;
-                c = fgetc(L->infile);
+                c = next_char(L);
             }
-            checking_string[i] = '\0';
-            if (strcmp(checking_string, "include") == 0)
+            long word_length = L->pos - (c == EOF ? 0 : 1) - word;
+            if (word_length == 7 && memcmp(span(L, word), "include", 7) == 0)
             {
-                c = fgetc(L->infile);
+                c = next_char(L);
                 while (((c == ' ') || (c == '\t') || (c == '\r')) && c != EOF && c != '\n')
                 {
-                    c = fgetc(L->infile);
+                    c = next_char(L);
                 }
 
                 if (c == '"')
                 {
-                    i = 0;
-                    c = fgetc(L->infile);
-                    while (c != '"' && c != EOF && c != '\n' && i < 254)
-                    {
-                        checking_string[i++] = c;
-                        c = fgetc(L->infile);
-                    }
-                    checking_string[i] = '\0';
-                    FILE *incFile = fopen(checking_string, "r");
-                    if (!incFile)
+                    long name = L->pos;
+                    c = next_char(L);
+                    while (c != '"' && c != EOF && c != '\n')
                     {
-                        fprintf(stderr, "Lexer error in file %s line %d at text %s: Cannot open include file\n", L->filename, L->lineno, checking_string);
-                        exit(1);
+                        c = next_char(L);
                     }
-                    fclose(incFile);
-                    lexer P;
-                    char *inc_outfilename = L->outfilename;
-                    init_lexer(&P, checking_string, inc_outfilename);
-                    P.outfile = L->outfile;
-                    while (P.current.ID != END)
+                    long name_length = L->pos - (c == EOF ? 0 : 1) - name;
+                    char *filename = stats_strndup(text_subsystem(), span(L, name), name_length);
+                    if (L->defer_includes)
                     {
-
-                        fprintf(P.outfile, "File %s Line %d Token %d Text %s\n", checking_string, P.lineno, P.current.ID, P.current.attrb);
-                        free(P.current.attrb);
-                        getNextToken(&P);
+                        L->current.ID = TOKEN_INCLUDE;
+                        L->current.attrb = filename;
+                        L->current.lineno = L->lineno;
+                        L->current.offset = directive_offset;
+                        count_lines(L, directive_offset);
+                        return;
                     }
-                    fopen(L->outfilename, "a");
+                    unsigned line = L->lazy_lines ? line_table_line(&L->lines, directive_offset) : L->lineno;
+                    lex_include(L->filename, line, filename, L->outfile);
+                    stats_free(filename);
                 }
             }
+            count_lines(L, directive_offset);
             continue;
         }
 
         L->current.lineno = L->lineno; // At this point, we have skipped past all comments and whitespace
+        L->current.offset = L->pos - 1;
 
         // Case 6: String Literal
         if (c == '"')
         {
-            char checking_string[1024];
-            int i = 0;
-            checking_string[i++] = '"';
-            while ((c = fgetc(L->infile)) != '"' && c != EOF)
+            while ((c = next_char(L)) != '"' && c != EOF)
             {
                 if (c == '\\')
                 {
-                    c = fgetc(L->infile);
+                    c = next_char(L);
                     switch (c)
                     {
                     case ' ':
-                        checking_string[i++] = '\\';
-                        break;
                     case 'n':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = 'n';
-                        break;
                     case 't':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = 't';
-                        break;
                     case 'r':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = 'r';
-                        break;
                     case 'a':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = 'a';
-                        break;
                     case 'b':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = 'b';
-                        break;
                     case '\\':
-                        checking_string[i++] = '\\';
-                        checking_string[i++] = '\\';
-                        break;
                     case '"':
-                        checking_string[i++] = '"';
                         break;
                     default:
-                        fprintf(stderr, "Lexer error in file %s line %d at text \\%s: Invalid escape sequence\n", L->filename, L->lineno, checking_string);
+                        unread_char(L, c);
+                        L->pos--;
+                        char *text = string_text(L, L->current.offset);
+                        fprintf(stderr, "Lexer error in file %s line %d at text \\%s: Invalid escape sequence\n", L->filename, lexer_token_line(L, &L->current), text);
                         exit(1);
                     }
                 }
-                else
-                {
-                    checking_string[i++] = c;
-                }
-                if (i >= 1023)
-                {
-                    fprintf(stderr, "Lexer error in file %s line %d at text %s: String literal too long\n", L->filename, L->current.lineno, checking_string);
-                    exit(1);
-                }
             }
             if (c == EOF)
             {
-                fprintf(stderr, "Lexer error in file %s line %d at text %s: End of file while reading string literal\n", L->filename, L->current.lineno, checking_string);
+                char *text = string_text(L, L->current.offset);
+                fprintf(stderr, "Lexer error in file %s line %d at text %s: End of file while reading string literal\n", L->filename, lexer_token_line(L, &L->current), text);
                 exit(1);
             }
-            checking_string[i++] = '"';
-            checking_string[i] = '\0';
             L->current.ID = TOKEN_STRING;
-            L->current.attrb = strdup(checking_string);
+            L->current.attrb = string_text(L, L->current.offset);
+            count_lines(L, L->current.offset);
             return;
         }
 
         // Case 7: Character Literal
         if (c == '\'')
         {
-            char checking_string[7];
-
-            int i = 0;
-            checking_string[i++] = '\'';
-            c = fgetc(L->infile);
+            c = next_char(L);
             // Handing the extra escape characters
             if (c == '\\')
             {
-                checking_string[i++] = c;
-                c = fgetc(L->infile);
+                c = next_char(L);
                 switch (c)
                 {
                 case 't':
@@ -273,162 +779,101 @@ void getNextToken(lexer *L)
                 case 'r':
                 case 'n':
                 case '\\':
-                    checking_string[i++] = c;
                     break;
                 default:
-                    fprintf(stderr, "Lexer error in file %s line %d at text %s: Invalid escape sequence\n", L->filename, L->current.lineno, checking_string);
+                    fprintf(stderr, "Lexer error in file %s line %d at text %.*s: Invalid escape sequence\n", L->filename, lexer_token_line(L, &L->current),
+                            (int)(L->pos - L->current.offset - (c != EOF)), span(L, L->current.offset));
                     exit(1);
                 }
             }
-            else
-            {
-                checking_string[i++] = c;
-            }
-            c = fgetc(L->infile);
+            c = next_char(L);
             if (c != '\'')
             {
-                checking_string[i++] = c;
-                checking_string[i++] = '\0';
-                fprintf(stderr, "Lexer error in file %s line %d at text %s: Expected closing ' for character literal.\n", L->filename, L->current.lineno, checking_string);
+                fprintf(stderr, "Lexer error in file %s line %d at text %.*s: Expected closing ' for character literal.\n", L->filename, lexer_token_line(L, &L->current),
+                        (int)(L->pos - L->current.offset), span(L, L->current.offset));
                 exit(1);
             }
-            checking_string[i++] = '\'';
-            checking_string[i] = '\0';
             L->current.ID = TOKEN_CHAR;
-            L->current.attrb = strdup(checking_string);
+            L->current.attrb = span_dup(L, L->current.offset);
+            count_lines(L, L->current.offset);
             return;
         }
 
         // Case 8: Integer Literal
         if (isdigit(c))
         {
-            char checking_string[48];
-            int i = 0;
-            checking_string[i++] = c;
             bool has_dot = false;
             bool has_exponent = false;
 
             if (c == '0')
             {
-                int next = fgetc(L->infile);
+                int next = next_char(L);
                 if (next == 'x' || next == 'X')
                 {
                     // Hexadecimal number
-                    checking_string[i++] = next;
-                    while ((c = fgetc(L->infile)) != EOF && isxdigit(c))
-                    {
-                        if (i < 47)
-                            checking_string[i++] = c;
-                    }
-                    if (i == 2)
+                    long digits = L->pos;
+                    while ((c = next_char(L)) != EOF && isxdigit(c))
+                        ;
+                    if (c != EOF)
+                        unread_char(L, c);
+                    if (L->pos == digits)
                     { // Just "0x" with no digits
                         fprintf(stderr, "Lexer error in file %s line %d: Invalid hexadecimal number\n",
-                                L->filename, L->lineno);
+                                L->filename, lexer_token_line(L, NULL));
                         exit(1);
                     }
-                    if (c != EOF)
-                        ungetc(c, L->infile);
-                    checking_string[i] = '\0';
                     L->current.ID = TOKEN_HEX;
+                    L->current.overflow = false;
+                    L->current.value.i = decode_hex(span(L, digits), L->pos - digits, &L->current.overflow);
                     // Convert hex to decimal for attrb
-                    long val = strtol(checking_string, NULL, 16);
-                    char decimal_str[48];
-                    snprintf(decimal_str, 48, "%ld", val);
-                    L->current.attrb = strdup(decimal_str);
+                    char decimal_str[24];
+                    snprintf(decimal_str, sizeof(decimal_str), "%" PRId64, L->current.value.i);
+                    L->current.attrb = stats_strdup(text_subsystem(), decimal_str);
                     L->current.lineno = L->lineno;
                     return;
                 }
                 else
                 {
-                    ungetc(next, L->infile);
+                    unread_char(L, next);
                 }
             }
 
             // Decimal or real number
-            while (isdigit(c = fgetc(L->infile)))
-            {
-                if (i < 47)
-                    checking_string[i++] = c;
-                else
-                {
-                    fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                    exit(1);
-                }
-            }
+            while (isdigit(c = next_char(L)))
+                ;
             if (c == '.')
             {
                 has_dot = true;
-                if (i < 47)
-                {
-                    checking_string[i++] = c;
-                }
-                else
-                {
-                    fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                    exit(1);
-                }
-
-                while (isdigit(c = fgetc(L->infile)))
-                {
-                    if (i < 47)
-                    {
-                        checking_string[i++] = c;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                        exit(1);
-                    }
-                }
+                while (isdigit(c = next_char(L)))
+                    ;
             }
             if (c == 'e' || c == 'E')
             {
                 has_exponent = true;
-                if (i < 47)
-                    checking_string[i++] = c;
-                else
-                {
-                    fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                    exit(1);
-                }
-                c = fgetc(L->infile);
+                c = next_char(L);
                 if (c == '+' || c == '-')
-                {
-                    if (i < 47)
-                        checking_string[i++] = c;
-                    else
-                    {
-                        fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                        exit(1);
-                    }
-                    c = fgetc(L->infile);
-                }
+                    c = next_char(L);
                 while (isdigit(c))
-                {
-                    if (i < 47)
-                        checking_string[i++] = c;
-                    else
-                    {
-                        fprintf(stderr, "Lexer error in file %s line %d at text %s: Integer literal is too long\n", L->filename, L->current.lineno, checking_string);
-                        exit(1);
-                    }
-                    c = fgetc(L->infile);
-                }
+                    c = next_char(L);
             }
             if (c != EOF)
-                ungetc(c, L->infile);
-            checking_string[i] = '\0';
+                unread_char(L, c);
 
             L->current.ID = (has_dot || has_exponent) ? TOKEN_REAL : TOKEN_INT;
-            L->current.attrb = strdup(checking_string);
+            L->current.attrb = span_dup(L, L->current.offset);
             L->current.lineno = L->lineno;
+            L->current.overflow = false;
+            if (L->current.ID == TOKEN_INT)
+                L->current.value.i = decode_decimal(L->current.attrb, L->pos - L->current.offset, &L->current.overflow);
+            else
+                L->current.value.d = decode_real(span(L, L->current.offset), L->pos - L->current.offset, L->current.attrb, &L->current.overflow);
             return;
         }
         else if (c == '.')
         {
 
             L->current.ID = TOKEN_DOT;
-            L->current.attrb = strdup(".");
+            L->current.attrb = stats_strdup(text_subsystem(), ".");
             L->current.lineno = L->lineno;
             return;
         }
@@ -436,39 +881,21 @@ void getNextToken(lexer *L)
         // Case 9: Identifiers
         if (isalpha(c) || c == '_')
         {
-            ungetc(c, L->infile);
-            char checking_string[48];
-            if (isIdentifier(L, checking_string))
-            {
-                if (isKeyword(checking_string))
-                {
-                    L->current.ID = getKeywordToken(L, checking_string);
-                    L->current.attrb = strdup(checking_string);
-                    return;
-                }
-                else if (isType(checking_string))
-                {
-                    L->current.ID = TOKEN_TYPE;
-                    L->current.attrb = strdup(checking_string);
-                    return;
-                }
-                else
-                {
-                    L->current.ID = TOKEN_IDENTIFIER;
-                    L->current.attrb = strdup(checking_string);
-                    return;
-                }
-            }
+            while ((c = next_char(L)) != EOF && (isalnum(c) || c == '_'))
+                ;
+            unread_char(L, c);
+            uint32_t name = intern(span(L, L->current.offset), L->pos - L->current.offset);
+            unsigned reserved = intern_tag(name);
+            L->current.ID = reserved ? reserved : TOKEN_IDENTIFIER;
+            L->current.name = name;
+            L->current.attrb = (char *)intern_text(name);
+            return;
         }
 
         // Case 10: Symbols
         if (isSymbol(c))
         {
-            char checking_string[48];
-            checking_string[0] = c;
-            checking_string[1] = '\0';
-
-            char next = fgetc(L->infile);
+            int next = next_char(L);
             if ((c == '=' && next == '=') ||
                 (c == '!' && next == '=') ||
                 (c == '>' && next == '=') ||
@@ -480,55 +907,67 @@ void getNextToken(lexer *L)
                 (c == '*' && next == '=') ||
                 (c == '/' && next == '='))
             {
-                checking_string[1] = next;
-                checking_string[2] = '\0';
-                int token = getOperatorToken(L, checking_string);
+                char *text = span_dup(L, L->current.offset);
+                int token = getOperatorToken(L, text);
                 if (token != -1)
                 {
                     L->current.ID = token;
-                    L->current.attrb = strdup(checking_string);
+                    L->current.attrb = text;
                     return;
                 }
             }
             else
             {
-                ungetc(next, L->infile);
+                unread_char(L, next);
                 L->current.ID = getSymbolToken(c);
-                L->current.attrb = strdup(checking_string);
+                L->current.attrb = span_dup(L, L->current.offset);
                 return;
             }
         }
-        fprintf(stderr, "Lexer error in file %s line %d at text %c: Unexpected symbol\n", L->filename, L->current.lineno, c);
+        fprintf(stderr, "Lexer error in file %s line %d at text %c: Unexpected symbol\n", L->filename, lexer_token_line(L, &L->current), c);
         exit(1);
     }
 }
 
-bool isKeyword(char *checking_string)
+/*
+Decodes the escapes of a string or character literal's source text (as
+token_text gives it, quotes included) into out, which needs length bytes.
+Returns the number of bytes written. Token text keeps the escapes as
+written, so this is only done for the literals that need their value.
+*/
+size_t decode_literal(const char *text, long length, char *out)
 {
-    const char *keywords[] = {
-        "const", "struct", "for", "while", "do", "if", "else", "break", "continue", "return", "switch", "case", "default"};
-    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+    size_t n = 0;
+    for (long i = 1; i < length - 1; i++)
     {
-        if (strcmp(checking_string, keywords[i]) == 0)
+        if (text[i] != '\\' || i + 1 >= length - 1)
         {
-            return true;
+            out[n++] = text[i];
+            continue;
         }
-    }
-    return false;
-}
-
-bool isType(char *checking_string)
-{
-    const char *types[] = {
-        "void", "char", "int", "float"};
-    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
-    {
-        if (strcmp(checking_string, types[i]) == 0)
+        switch (text[++i])
         {
-            return true;
+        case 'n':
+            out[n++] = '\n';
+            break;
+        case 't':
+            out[n++] = '\t';
+            break;
+        case 'r':
+            out[n++] = '\r';
+            break;
+        case 'a':
+            out[n++] = '\a';
+            break;
+        case 'b':
+            out[n++] = '\b';
+            break;
+        default: // \\, \", \' and "\ "
+            out[n++] = text[i];
+            break;
         }
     }
-    return false;
+    return n;
 }
 
 bool isSymbol(char c)
@@ -545,31 +984,6 @@ bool isSymbol(char c)
     return false;
 }
 
-bool isIdentifier(lexer *L, char *checking_string)
-{
-    int i = 0;
-    int c;
-    while ((c = fgetc(L->infile)) != EOF && (isalnum(c) || c == '_'))
-    {
-        if (i < 48)
-        {
-            checking_string[i++] = c;
-        }
-        else
-        {
-            checking_string[44] = '.';
-            checking_string[45] = '.';
-            checking_string[46] = '.';
-            checking_string[47] = '\0';
-            fprintf(stderr, "Lexer error in file %s line %d at text %s: Identifier too long\n", L->filename, L->lineno, checking_string);
-            return false;
-        }
-    }
-    checking_string[i] = '\0';
-    ungetc(c, L->infile);
-    return true;
-}
-
 int getSymbolToken(char c)
 {
     const char symbols[] = {
@@ -592,23 +1006,6 @@ int getSymbolToken(char c)
     exit(1);
 }
 
-int getKeywordToken(lexer *L, char *checking_string)
-{
-    const char *keywords[] = {
-        "const", "struct", "for", "while", "do", "if", "else", "break", "continue", "return", "switch", "case", "default"};
-    int tokens[] = {
-        TOKEN_CONST, TOKEN_STRUCT, TOKEN_FOR, TOKEN_WHILE, TOKEN_DO, TOKEN_IF, TOKEN_ELSE, TOKEN_BREAK, TOKEN_CONTINUE, TOKEN_RETURN, TOKEN_SWITCH, TOKEN_CASE, TOKEN_DEFAULT};
-    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
-    {
-        if (strcmp(checking_string, keywords[i]) == 0)
-        {
-            return tokens[i];
-        }
-    }
-    fprintf(stderr, "Lexer error in file %s line %d at text %s: Invalid keyword\n", L->filename, L->lineno, checking_string);
-    exit(1);
-}
-
 int getOperatorToken(lexer *L, char *checking_string)
 {
     const char *operators[] = {
@@ -622,6 +1019,16 @@ int getOperatorToken(lexer *L, char *checking_string)
             return tokens[i];
         }
     }
-    fprintf(stderr, "Lexer error in file %s line %d at text %s: Invalid operator\n", L->filename, L->lineno, checking_string);
+    fprintf(stderr, "Lexer error in file %s line %d at text %s: Invalid operator\n", L->filename, lexer_token_line(L, NULL), checking_string);
     exit(1);
-}
\ No newline at end of file
+}
+
+// Replaces the .c extension of infilename with extension
+char *output_filename(char *infilename, char *extension)
+{
+    size_t stem = strlen(infilename) >= 2 ? strlen(infilename) - 2 : strlen(infilename);
+    char *outfilename = mem_alloc(MEM_OUTPUT_NAMES, stem + strlen(extension) + 1);
+    memcpy(outfilename, infilename, stem);
+    strcpy(outfilename + stem, extension);
+    return outfilename;
+}
@@ -1,7 +1,11 @@
 #include <stdio.h> // For FILE type
+#include <stdbool.h>
+#include <stdint.h>
 #ifndef LEXER_H
 #define LEXER_H
 
+#include "linetab.h"
+
 
 #define END 0
 
@@ -68,25 +72,95 @@
 #define TOKEN_MUL_ASSIGN 363
 #define TOKEN_DIV_ASSIGN 364
 
+// Only returned by lexers started with init_lexer_at, which defer #include
+// directives to the caller instead of expanding them
+#define TOKEN_INCLUDE 501
+
+// Deepest chain of files including each other, past which an include cycle is assumed
+#define MAX_INCLUDE_DEPTH 200
+
+// Bytes read from the input at a time. The buffer only grows past this for a longer token
+#define LEX_BUFFER_SIZE (64 * 1024)
+
+// Lexical modes, i.e. what the lexer is inside of between two characters
+#define LEX_MODE_CODE 0
+#define LEX_MODE_LINE_COMMENT 1
+#define LEX_MODE_BLOCK_COMMENT 2
+
 
 typedef struct {
     unsigned ID; //Token ID
-    char* attrb; // Token word
-    unsigned lineno; //Token line number
+    char* attrb; // Token word, the interned text of name for identifiers, types and keywords
+    uint32_t name; // Interned id of the word of identifiers, types and keywords, 0 for other tokens
+    unsigned lineno; //Token line number, not kept by a lexer with lazy_lines (see lexer_token_line)
+    long offset; // Byte offset of the first character of the token
+    long length; // Bytes of source text the token spans from offset
+    union {
+        int64_t i; // TOKEN_INT and TOKEN_HEX
+        double d;  // TOKEN_REAL
+    } value; // Decoded number, only set for those three kinds
+    bool overflow; // The number did not fit, value.i is INT64_MAX or value.d infinite
 } token;
 
 typedef struct {
     char* filename;
     char* outfilename;
-    unsigned lineno;
-    FILE* infile;
-    FILE* outfile;
+    unsigned lineno; // Line of pos, only counted without lazy_lines
+    long pos; // Byte offset of the next character to be read
+    int mode; // One of LEX_MODE_*, kept here so lexing can resume mid-file
+    bool defer_includes;
+    int fd; // File the window is refilled from, -1 at its end or when lexing text already in memory
+    const char* window; // Input bytes from window_offset up to window_offset + window_size
+    long window_offset;
+    long window_size;
+    long mark; // Offset of the start of the token being scanned, which the window keeps
+    char* buffer; // Holds the window when reading from fd
+    long buffer_capacity;
+    FILE* outfile; // Tokens of included files, for deferred_output_close to add to outfilename
     token current;
+    bool lazy_lines; // Lines are looked up in the lines table on demand instead of counted
+    line_table lines; // Starts of the lines read so far, with lazy_lines
 } lexer; //Tracks where I am in the lexer
 
 
 void init_lexer(lexer *L, char *infilename, char *outfilename);
 
+bool init_lexer_at(lexer *L, char *infilename, long offset, unsigned lineno, int mode);
+
+void init_lexer_lines(lexer *L, char *infilename, char *outfilename);
+
+void init_lexer_text(lexer *L, char *filename, const char *text, long size, long offset, unsigned lineno, int mode);
+
+void lexer_close(lexer *L);
+
+void release_token(token *t);
+
 void getNextToken(lexer *L);
 
+bool lexer_skip_block(lexer *L);
+
+void lex_include(char *includer, unsigned lineno, char *filename, FILE *output);
+
+FILE *deferred_output_open(void);
+
+void deferred_output_close(FILE *deferred, const char *filename);
+
+char *output_filename(char *infilename, char *extension);
+
+size_t decode_literal(const char *text, long length, char *out);
+
+// The source text of the current token, valid until the next call to getNextToken
+static inline const char *token_text(const lexer *L)
+{
+    return L->window + (L->current.offset - L->window_offset);
+}
+
+// Line of token t of L, or of the next character when t is NULL
+static inline unsigned lexer_token_line(const lexer *L, const token *t)
+{
+    if (!L->lazy_lines)
+        return t ? t->lineno : L->lineno;
+    return line_table_line(&L->lines, t ? t->offset : L->pos);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "linetab.h"
+#include "mem.h"
+
+void line_table_init(line_table *T)
+{
+    T->capacity = 1024;
+    T->starts = mem_alloc(MEM_LEXER_TEXT, T->capacity * sizeof(long));
+    T->starts[0] = 0;
+    T->count = 1;
+}
+
+// Makes room for n more line starts
+static inline void reserve(line_table *T, size_t n)
+{
+    if (T->count + n <= T->capacity)
+        return;
+    while (T->count + n > T->capacity)
+        T->capacity *= 2;
+    T->starts = mem_realloc(MEM_LEXER_TEXT, T->starts, T->capacity * sizeof(long));
+}
+
+/*
+Newlines are found 16 bytes at a time: one compare gives a mask with a bit
+set for every newline in the block, and each set bit is a line start. Text
+without newlines costs a compare and a test per block, instead of a compare
+and a branch per character as when the lexer counted them.
+*/
+void line_table_scan(line_table *T, const char *text, long offset, long size)
+{
+    long i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(text + i)), newline));
+        if (!mask)
+            continue;
+        reserve(T, 16);
+        while (mask)
+        {
+            T->starts[T->count++] = offset + i + __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (text[i] == '\n')
+        {
+            reserve(T, 1);
+            T->starts[T->count++] = offset + i + 1;
+        }
+    }
+}
+
+// Index of the last line starting at or before offset
+static size_t find_line(const line_table *T, long offset)
+{
+    size_t lo = 0, hi = T->count;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (T->starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+unsigned line_table_line(const line_table *T, long offset)
+{
+    return find_line(T, offset) + 1;
+}
+
+unsigned line_table_column(const line_table *T, long offset)
+{
+    return offset - T->starts[find_line(T, offset)] + 1;
+}
+
+void line_table_free(line_table *T)
+{
+    mem_free(T->starts);
+    memset(T, 0, sizeof(*T));
+}
@@ -0,0 +1,24 @@
+#include <stddef.h>
+#ifndef LINETAB_H
+#define LINETAB_H
+
+// Byte offsets at which the lines of a file start, for finding the line of an offset later
+typedef struct {
+    long *starts; // In increasing order, starts[0] is 0
+    size_t count;
+    size_t capacity;
+} line_table;
+
+void line_table_init(line_table *T);
+
+// Adds the lines starting after a newline in the size bytes of text, which are at offset in the file
+void line_table_scan(line_table *T, const char *text, long offset, long size);
+
+// Line (from 1) and column (from 1, in bytes) of offset, which must have been scanned up to
+unsigned line_table_line(const line_table *T, long offset);
+
+unsigned line_table_column(const line_table *T, long offset);
+
+void line_table_free(line_table *T);
+
+#endif
@@ -1,14 +1,531 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include "lexer.h"
 #include "parser.h"
+#include "relex.h"
+#include "tokbin.h"
+#include "symindex.h"
+#include "depscan.h"
+#include "cache.h"
+#include "watch.h"
+#include "stats.h"
+#include "trace.h"
+#include "mem.h"
+#include "pch.h"
+#include "ioload.h"
+#include "program.h"
+#include "ir.h"
+#include "x86.h"
+#include "bytecode.h"
+#include "vm.h"
+#include "jit.h"
+#include "walk.h"
 
 void show_usage() {
     fprintf(stderr, "Usage: mycc -mode infile\nValid modes:\n");
     fprintf(stderr, " -0: Version information only\n");
     fprintf(stderr, " -1: Phase 1 Lexer Parsing \n");
     fprintf(stderr, " -2: Phase 2 Parser Parsing \n");
+    fprintf(stderr, " -M: Print a make rule listing the files each input includes\n");
+    fprintf(stderr, " -MD: Write that make rule to a .d file next to each input\n");
+    fprintf(stderr, " -run: Run the program, compiled to register bytecode, exiting with what main returns\n");
+    fprintf(stderr, " -jit: Run the program, compiled to x86-64 machine code in memory as functions are first called\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, " -1 --relex oldfile newfile: Lex newfile incrementally from the tokens of oldfile\n");
+    fprintf(stderr, " -1 --binary infile: Write the tokens to a binary .tokbin file\n");
+    fprintf(stderr, " -2 infile.tokbin: Parse the tokens of a .tokbin file without lexing\n");
+    fprintf(stderr, " -2 --index[=file] infile: Also add the declarations to a symbol index (default %s)\n", SYMINDEX_DEFAULT);
+    fprintf(stderr, " -2 --decls-only infile: Only report global declarations and function signatures\n");
+    fprintf(stderr, " -2 --watch file/dir...: Parse again whenever a source or a file it includes changes\n");
+    fprintf(stderr, " -2 --dump-ir[=raw] infile: Also write the SSA form of the functions to a .ir file, optimized unless raw\n");
+    fprintf(stderr, " -2 --asm[=naive] infile: Also write x86-64 assembly to a .s file, with every value in the frame if naive\n");
+    fprintf(stderr, " -2 --bytecode infile: Also write JVM-style stack bytecode to a .j file, with instruction counts per function\n");
+    fprintf(stderr, " -2 --switch-stats infile: Print whether each switch became a jump table, a binary search or a compare chain\n");
+    fprintf(stderr, " -2 --program [--jobs=n] infile...: Parse the files in parallel and check their globals against each other\n");
+    fprintf(stderr, " -M/-MD -MT target infile: Use target instead of the .o file in the rule\n");
+    fprintf(stderr, " -run --ast infile: Run the program by walking its syntax trees instead, as a baseline\n");
+    fprintf(stderr, " -1/-2 --cache infile: Reuse the result of an earlier run on identical inputs\n");
+    fprintf(stderr, " -1/-2 --stats[=json] infile: Print phase times and counters to stderr\n");
+    fprintf(stderr, " -1/-2 --trace=file infile: Record spans per file, include and declaration for a trace viewer\n");
+    fprintf(stderr, " -1/-2 --mem-limit=size infile: Fail once more than size bytes (K, M or G suffix) are allocated\n");
+    fprintf(stderr, " -1/-2 --mem-report infile: Print the memory each subsystem allocated and leaked to stderr\n");
+    fprintf(stderr, " -1/-2/-M/-MD --prefetch[=n]: Read up to n inputs and includes ahead in the background (on for -M/-MD, n = %d)\n", IOLOAD_DEFAULT_DEPTH);
+    fprintf(stderr, " --no-io-uring: Read ahead with a pool of threads instead of io_uring\n");
+    fprintf(stderr, " --cache-stats: Print result cache statistics\n");
+    fprintf(stderr, " --lookup name [--index=file]: Print where name is declared, from a .symidx or a .pch\n");
+    fprintf(stderr, " --merge-index outfile infile...: Merge symbol indexes from batch runs\n");
+    fprintf(stderr, " --pch header [-o file]: Precompile header, by default to the .pch that #include uses while it is up to date\n");
+}
+
+// Returns true if option is one of the arguments after the mode
+bool has_option(int argc, char *argv[], char *option) {
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], option) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the first argument after the mode that is not an option, or NULL
+char *input_argument(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            return argv[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the index file named by --index=<file>, the default one for a plain --index, or NULL
+char *index_filename(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--index=", 8) == 0) {
+            return argv[i] + 8;
+        }
+        if (strcmp(argv[i], "--index") == 0) {
+            return SYMINDEX_DEFAULT;
+        }
+    }
+    return NULL;
+}
+
+// Returns true if -2 should also lower the input to IR
+bool dump_ir_wanted(int argc, char *argv[]) {
+    return has_option(argc, argv, "--dump-ir") || has_option(argc, argv, "--dump-ir=raw");
+}
+
+// Writes the IR of the functions of infilename next to it, after optimizing them unless --dump-ir=raw
+int write_ir(int argc, char *argv[], ir_module *M, char *infilename) {
+    if (!has_option(argc, argv, "--dump-ir=raw")) {
+        ir_optimize(M);
+    }
+    char *irfilename = output_filename(infilename, ".ir");
+    FILE *output = fopen(irfilename, "w");
+    if (!output) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", irfilename);
+        mem_free(irfilename);
+        return 1;
+    }
+    ir_dump(M, output);
+    fclose(output);
+    printf("Wrote the IR to %s\n", irfilename);
+    mem_free(irfilename);
+    return 0;
+}
+
+// Returns true if -2 should also write assembly
+bool asm_wanted(int argc, char *argv[]) {
+    return has_option(argc, argv, "--asm") || has_option(argc, argv, "--asm=naive");
+}
+
+// Writes the optimized functions of infilename as x86-64 assembly next to it
+int write_asm(int argc, char *argv[], ir_module *M, char *infilename) {
+    bool naive = has_option(argc, argv, "--asm=naive");
+    ir_check_native_calls(M);
+    ir_optimize(M);
+    char *asmfilename = output_filename(infilename, ".s");
+    FILE *output = fopen(asmfilename, "w");
+    if (!output) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", asmfilename);
+        mem_free(asmfilename);
+        return 1;
+    }
+    x86_stats stats;
+    x86_emit(M, output, naive, &stats);
+    fclose(output);
+    printf("Wrote the assembly to %s (%u functions, %u of %u values in registers)\n", asmfilename,
+           stats.functions, stats.in_registers, stats.values);
+    mem_free(asmfilename);
+    return 0;
+}
+
+// Writes the optimized functions of infilename as stack bytecode next to it
+int write_bytecode(ir_module *M, char *infilename) {
+    ir_optimize(M);
+    char *bcfilename = output_filename(infilename, ".j");
+    FILE *output = fopen(bcfilename, "w");
+    if (!output) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", bcfilename);
+        mem_free(bcfilename);
+        return 1;
+    }
+    bytecode_stats stats;
+    bytecode_emit(M, output, stdout, &stats);
+    fclose(output);
+    printf("Wrote the bytecode to %s (%u methods, %u instructions, %u after the peephole optimizer)\n", bcfilename,
+           stats.methods, stats.before, stats.after);
+    mem_free(bcfilename);
+    return 0;
+}
+
+// Parses infilename as -2 does and runs it, by walking its syntax trees with --ast or as machine code with -jit
+int run_program(int argc, char *argv[]) {
+    char *infilename = input_argument(argc, argv);
+    bool jit = strcmp(argv[1], "-jit") == 0;
+    if (!infilename) {
+        fprintf(stderr, jit ? "Usage: %s -jit <input file>\n" : "Usage: %s -run [--ast] <input file>\n", argv[0]);
+        return 1;
+    }
+    FILE *input = fopen(infilename, "r");
+    if (!input) {
+        printf("Error: No such input file");
+        exit(1);
+    }
+    fclose(input);
+    bool walk = !jit && has_option(argc, argv, "--ast");
+    char *outfilename = output_filename(infilename, ".parser");
+    lexer L;
+    init_lexer_lines(&L, infilename, outfilename);
+    FILE *output = fopen(outfilename, "w");
+    if (!output) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+        return 1;
+    }
+    parser P;
+    memset(&P, 0, sizeof(P));
+    ir_module module;
+    ir_module_init(&module, infilename);
+    module.keep_trees = walk;
+    P.module = &module;
+    init_parser(&P, &L, output, infilename, outfilename);
+    lexer_close(&L);
+    fclose(output);
+    deferred_output_close(L.outfile, L.outfilename);
+    mem_free(outfilename);
+    ir_check_native_calls(&module);
+    int64_t status;
+    if (walk) {
+        status = walk_run(&module);
+    }
+    else {
+        ir_optimize(&module);
+        status = jit ? jit_run(&module) : vm_run(&module);
+    }
+    ir_module_free(&module);
+    fflush(stdout);
+    return (int)(status & 255);
+}
+
+// Returns true if filename ends with extension
+bool has_extension(char *filename, char *extension) {
+    size_t len = strlen(filename);
+    size_t ext_len = strlen(extension);
+    return len >= ext_len && strcmp(filename + len - ext_len, extension) == 0;
+}
+
+// Prints every declaration of name found in the index, or in the declarations of a .pch
+int lookup_symbol(char *name, char *indexfilename) {
+    symbol_index X;
+    pch H;
+    bool from_pch = indexfilename && has_extension(indexfilename, ".pch");
+    if (from_pch) {
+        if (pch_open(&H, indexfilename) != 0) {
+            return 1;
+        }
+        X = H.symbols;
+    }
+    else {
+        const char *filename = indexfilename ? indexfilename : SYMINDEX_DEFAULT;
+        if (symindex_compact(filename) != 0 || symindex_open(&X, filename) != 0) {
+            return 1;
+        }
+    }
+    size_t first;
+    size_t count = symindex_lookup(&X, name, &first);
+    for (size_t i = first; i < first + count; i++) {
+        symbol s = symindex_get(&X, i);
+        printf("File %s Line %d: %s %s\n", s.file, s.line, s.kind, s.name);
+    }
+    if (from_pch) {
+        pch_close(&H);
+    }
+    else {
+        symindex_close(&X);
+    }
+    if (count == 0) {
+        fprintf(stderr, "No declaration of %s found\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+// Lexes oldfile, then re-lexes newfile starting from the nearest checkpoint before the first change
+int relex_files(char *oldfilename, char *newfilename) {
+    token_stream S;
+    stream_lex(&S, oldfilename);
+    size_t old_count = S.count;
+    S.filename = newfilename;
+    size_t relexed = stream_relex(&S);
+
+    char *outfilename = output_filename(newfilename, ".lexer");
+    FILE *output = fopen(outfilename, "w");
+    if (!output) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+        return 1;
+    }
+    stream_write(&S, output, outfilename);
+    fclose(output);
+    printf("Re-lexed %zu of %zu tokens (previously %zu). Check %s for details\n", relexed, S.count, old_count, outfilename);
+    stream_free(&S);
+    mem_free(outfilename);
+    return 0;
+}
+
+// Precompiles the header after --pch into the file after -o, by default the header's name with .pch
+int precompile_header(int argc, char *argv[]) {
+    char *header = NULL;
+    char *outfilename = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outfilename = argv[++i];
+        }
+        else if (!header && strncmp(argv[i], "--", 2) != 0) {
+            header = argv[i];
+        }
+    }
+    if (!header) {
+        fprintf(stderr, "Usage: %s --pch <header> [-o <file>]\n", argv[0]);
+        return 1;
+    }
+    char *defaultfilename = outfilename ? NULL : output_filename(header, ".pch");
+    if (!outfilename) {
+        outfilename = defaultfilename;
+    }
+    int status = pch_write(header, outfilename);
+    if (status == 0) {
+        printf("Completed precompiling. Check %s for details\n", outfilename);
+    }
+    mem_free(defaultfilename);
+    return status;
+}
+
+// Scans each input for #include "..." lines without lexing it, and emits a make rule
+int scan_files(int argc, char *argv[], bool write_d_files, unsigned prefetch) {
+    char *target = NULL;
+    char **inputs = mem_alloc(MEM_OTHER, argc * sizeof(char *));
+    int ninputs = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-MT") == 0) {
+            if (i + 1 < argc) {
+                target = argv[i + 1];
+            }
+            i++;
+        }
+        else if (strncmp(argv[i], "--", 2) != 0) {
+            inputs[ninputs++] = argv[i];
+        }
+    }
+    int status = 0;
+    int requested = 0;
+    for (int i = 0; i < ninputs && status == 0; i++) {
+        // Keep this input and the next prefetch ones queued, their includes are queued as they are read
+        for (; requested < ninputs && requested <= i + (int)prefetch; requested++) {
+            ioload_request(inputs[requested]);
+        }
+        dep_list D;
+        memset(&D, 0, sizeof(D));
+        scan_dependencies(inputs[i], &D);
+        char *objfilename = output_filename(inputs[i], ".o");
+        if (write_d_files) {
+            char *depfilename = output_filename(inputs[i], ".d");
+            FILE *output = fopen(depfilename, "w");
+            if (!output) {
+                fprintf(stderr, "Error: Cannot open output file %s\n", depfilename);
+                status = 1;
+            }
+            else {
+                write_dependency_rule(output, target ? target : objfilename, inputs[i], &D);
+                fclose(output);
+            }
+            mem_free(depfilename);
+        }
+        else {
+            write_dependency_rule(stdout, target ? target : objfilename, inputs[i], &D);
+        }
+        mem_free(objfilename);
+        dep_list_free(&D);
+    }
+    if (ninputs == 0) {
+        fprintf(stderr, "Usage: %s -M <input file>...\n", argv[0]);
+        status = 1;
+    }
+    mem_free(inputs);
+    return status;
+}
+
+// Returns true for --stats=json, false for a plain --stats; sets *enabled if either was given
+bool stats_option(int argc, char *argv[], bool *enabled) {
+    *enabled = has_option(argc, argv, "--stats") || has_option(argc, argv, "--stats=json");
+    return has_option(argc, argv, "--stats=json");
+}
+
+// Returns the file named by --trace=<file>, or NULL
+char *trace_filename(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            return argv[i] + 8;
+        }
+    }
+    return NULL;
+}
+
+// Returns the byte count of --mem-limit=<size>, which may end in K, M or G, or 0 if not given
+size_t mem_limit_option(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--mem-limit=", 12) == 0) {
+            char *end;
+            unsigned long long size = strtoull(argv[i] + 12, &end, 10);
+            if (*end == 'K' || *end == 'k') {
+                size <<= 10;
+                end++;
+            }
+            else if (*end == 'M' || *end == 'm') {
+                size <<= 20;
+                end++;
+            }
+            else if (*end == 'G' || *end == 'g') {
+                size <<= 30;
+                end++;
+            }
+            if (*end != '\0' || size == 0) {
+                fprintf(stderr, "Error: Invalid memory limit %s\n", argv[i] + 12);
+                exit(1);
+            }
+            return size;
+        }
+    }
+    return 0;
+}
+
+// Returns how many files to keep reading ahead: n for --prefetch=<n>, the default for a plain
+// --prefetch and for -M/-MD, otherwise 0
+unsigned prefetch_option(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--prefetch=", 11) == 0) {
+            char *end;
+            unsigned long depth = strtoul(argv[i] + 11, &end, 10);
+            if (*end != '\0' || end == argv[i] + 11) {
+                fprintf(stderr, "Error: Invalid prefetch depth %s\n", argv[i] + 11);
+                exit(1);
+            }
+            return depth;
+        }
+        if (strcmp(argv[i], "--prefetch") == 0) {
+            return IOLOAD_DEFAULT_DEPTH;
+        }
+    }
+    if (strcmp(argv[1], "-M") == 0 || strcmp(argv[1], "-MD") == 0) {
+        return IOLOAD_DEFAULT_DEPTH;
+    }
+    return 0;
+}
+
+static bool stats_json;
+
+void print_stats(void) {
+    stats_print(stderr, stats_json);
+}
+
+void print_mem_report(void) {
+    mem_report(stderr);
+}
+
+// Returns the output file of a -1/-2 run that can be served from the result cache, or NULL
+char *cached_output_filename(int argc, char *argv[]) {
+    char *infilename = input_argument(argc, argv);
+    bool stats_wanted;
+    stats_option(argc, argv, &stats_wanted);
+    if (!infilename || has_option(argc, argv, "--relex") || index_filename(argc, argv) || stats_wanted ||
+        trace_filename(argc, argv) || has_option(argc, argv, "--mem-report")) {
+        return NULL;
+    }
+    // The key only covers the first input and what it includes, where --program reads them all
+    if (has_option(argc, argv, "--program")) {
+        return NULL;
+    }
+    // Only the one output file is kept, so runs that also write the IR, assembly or bytecode are not cached
+    if (dump_ir_wanted(argc, argv) || asm_wanted(argc, argv) || has_option(argc, argv, "--bytecode")) {
+        return NULL;
+    }
+    if (strcmp(argv[1], "-1") == 0) {
+        return output_filename(infilename, has_option(argc, argv, "--binary") ? ".tokbin" : ".lexer");
+    }
+    if (strcmp(argv[1], "-2") == 0 && !has_extension(infilename, ".tokbin")) {
+        return output_filename(infilename, ".parser");
+    }
+    return NULL;
+}
+
+// Collects the files and directories after the mode and starts watching them
+int watch_inputs(int argc, char *argv[]) {
+    char **paths = mem_alloc(MEM_OTHER, argc * sizeof(char *));
+    int npaths = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            paths[npaths++] = argv[i];
+        }
+    }
+    if (npaths == 0) {
+        fprintf(stderr, "Usage: %s -2 --watch <file or directory>...\n", argv[0]);
+        mem_free(paths);
+        return 1;
+    }
+    int status = watch_files(paths, npaths, has_option(argc, argv, "--decls-only"));
+    mem_free(paths);
+    return status;
+}
+
+// Returns the thread count of --jobs=<n>, or the number of processors online
+unsigned jobs_option(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            char *end;
+            unsigned long jobs = strtoul(argv[i] + 7, &end, 10);
+            if (*end != '\0' || jobs == 0) {
+                fprintf(stderr, "Error: Invalid job count %s\n", argv[i] + 7);
+                exit(1);
+            }
+            return jobs;
+        }
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? online : 1;
+}
+
+// Parses the inputs as one program and reports the globals that do not agree across files
+int parse_program(int argc, char *argv[]) {
+    char **inputs = mem_alloc(MEM_OTHER, argc * sizeof(char *));
+    uint32_t ninputs = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            inputs[ninputs++] = argv[i];
+        }
+    }
+    if (ninputs == 0) {
+        fprintf(stderr, "Usage: %s -2 --program <input file>...\n", argv[0]);
+        mem_free(inputs);
+        return 1;
+    }
+    for (uint32_t i = 0; i < ninputs; i++) {
+        if (access(inputs[i], R_OK) != 0) {
+            fprintf(stderr, "Error: No such input file %s\n", inputs[i]);
+            mem_free(inputs);
+            return 1;
+        }
+    }
+    program G;
+    program_init(&G, inputs, ninputs);
+    // The phase timers and counters of --stats are not kept per thread
+    program_parse(&G, stats.enabled ? 1 : jobs_option(argc, argv));
+    size_t problems = program_check(&G, stderr);
+    printf("Completed parsing %u files, %zu problems found\n", ninputs, problems);
+    program_free(&G);
+    mem_free(inputs);
+    return problems ? 1 : 0;
 }
 
 void show_version() {
@@ -19,6 +536,44 @@ void show_version() {
 
 
 int main(int argc, char *argv[]) {
+    bool stats_wanted;
+    stats_json = argc > 2 && stats_option(argc, argv, &stats_wanted);
+    if (argc > 2 && stats_wanted) {
+        // Also printed when an error exits
+        stats_start();
+        atexit(print_stats);
+    }
+    if (argc > 2 && (mem_limit_option(argc, argv) || has_option(argc, argv, "--mem-report"))) {
+        mem_start(mem_limit_option(argc, argv));
+        if (has_option(argc, argv, "--mem-report")) {
+            atexit(print_mem_report);
+        }
+    }
+    if (argc > 2 && trace_filename(argc, argv)) {
+        // The span of the input file ends when the trace is written at exit
+        trace_open(trace_filename(argc, argv));
+        trace_begin("file", input_argument(argc, argv) ? input_argument(argc, argv) : argv[1], NULL, 0);
+    }
+
+    if (argc > 2 && has_option(argc, argv, "--cache")) {
+        char *outfilename = cached_output_filename(argc, argv);
+        int status;
+        if (outfilename && cache_run(argc, argv, input_argument(argc, argv), outfilename, &status)) {
+            mem_free(outfilename);
+            return status;
+        }
+        mem_free(outfilename);
+    }
+
+    // After the cache, as a child forked by cache_run would not have the loader threads
+    if (argc > 2 && prefetch_option(argc, argv) > 0) {
+        ioload_start(prefetch_option(argc, argv), !has_option(argc, argv, "--no-io-uring"));
+        if (strcmp(argv[1], "-M") != 0 && strcmp(argv[1], "-MD") != 0 && input_argument(argc, argv)) {
+            // Its includes are queued as soon as it has been read
+            ioload_request(input_argument(argc, argv));
+        }
+    }
+
     if (argc == 1) {
         show_usage();
     }
@@ -29,25 +584,35 @@ int main(int argc, char *argv[]) {
         }
         show_version();
     }
+    else if(strcmp(argv[1], "-1") == 0 && argc >= 3 && strcmp(argv[2], "--relex") == 0) {
+        if (argc < 5) {
+            fprintf(stderr, "Usage: %s -1 --relex <old file> <new file>\n", argv[0]);
+            return 1;
+        }
+        return relex_files(argv[3], argv[4]);
+    }
     else if(strcmp(argv[1], "-1") == 0){
-        if (argc < 3) {
+        char *infilename = input_argument(argc, argv);
+        if (!infilename) {
             fprintf(stderr, "Usage: %s <input file>\n", argv[0]);
             return 1;
         }
-        char *infilename = argv[2];
-        FILE *input = fopen(argv[2], "r");
+        FILE *input = fopen(infilename, "r");
         if (!input) {
             printf("Error: No such input file");
             exit(1);
         }
-        char *truncated_infilename = malloc(strlen(infilename) -1);
-        if (!truncated_infilename) {
-            fprintf(stderr,"Failed to allocate memory for output file name");
-            return 1;
+        if (has_option(argc, argv, "--binary")) {
+            fclose(input);
+            char *outfilename = output_filename(infilename, ".tokbin");
+            if (tokbin_write(infilename, outfilename) != 0) {
+                return 1;
+            }
+            printf("Completed lexing. Check %s for details\n", outfilename);
+            mem_free(outfilename);
+            return 0;
         }
-        strncpy(truncated_infilename,infilename,strlen(infilename)-2);
-        char *outfilename = malloc(strlen(truncated_infilename) + strlen(".lexer") + 1);
-        snprintf(outfilename, strlen(truncated_infilename) + strlen(".lexer") + 1, "%s.lexer", truncated_infilename);
+        char *outfilename = output_filename(infilename, ".lexer");
 
         
         FILE *output = fopen(outfilename, "w");
@@ -57,48 +622,146 @@ int main(int argc, char *argv[]) {
 
         while (L.current.ID != END)
                     {
-                        fprintf(output, "File %s Line %d Token %d Text %s\n", L.filename, L.lineno, L.current.ID, L.current.attrb);
-                        free(L.current.attrb);
+                        stats_enter(PHASE_OUTPUT);
+                        fprintf(output, "File %s Line %d Token %d Text %s\n", L.filename, L.current.lineno, L.current.ID, L.current.attrb);
+                        stats_leave();
+                        release_token(&L.current);
                         getNextToken(&L);
                     }
         fclose(input);
+        lexer_close(&L);
         fclose(output);
+        deferred_output_close(L.outfile, L.outfilename);
         printf("Completed lexing. Check %s for details\n",outfilename);
+        mem_free(outfilename);
 
     }
-    else if(strcmp(argv[1],"-2") == 0) {
+    else if(strcmp(argv[1], "-M") == 0 || strcmp(argv[1], "-MD") == 0) {
+        return scan_files(argc, argv, strcmp(argv[1], "-MD") == 0, prefetch_option(argc, argv));
+    }
+    else if(strcmp(argv[1], "-run") == 0 || strcmp(argv[1], "-jit") == 0) {
+        return run_program(argc, argv);
+    }
+    else if(strcmp(argv[1], "--cache-stats") == 0) {
+        return cache_print_stats();
+    }
+    else if(strcmp(argv[1], "--lookup") == 0) {
         if (argc < 3) {
-            fprintf(stderr, "Usage: %s <input file>\n", argv[0]);
+            fprintf(stderr, "Usage: %s --lookup <name> [--index=<file>]\n", argv[0]);
             return 1;
         }
-        char *infilename = argv[2];
-        FILE *input = fopen(argv[2], "r");
-        if (!input) {
-            printf("Error: No such input file");
-            exit(1);
+        return lookup_symbol(argv[2], index_filename(argc, argv));
+    }
+    else if(strcmp(argv[1], "--pch") == 0) {
+        return precompile_header(argc, argv);
+    }
+    else if(strcmp(argv[1], "--merge-index") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s --merge-index <output index> <input index>...\n", argv[0]);
+            return 1;
         }
-        fclose(input);
-        char *truncated_infilename = malloc(strlen(infilename) -1);
-        if (!truncated_infilename) {
-            fprintf(stderr,"Failed to allocate memory for output file name");
+        return symindex_merge(argv[2], argv + 3, argc - 3);
+    }
+    else if(strcmp(argv[1],"-2") == 0 && has_option(argc, argv, "--watch")) {
+        return watch_inputs(argc, argv);
+    }
+    else if(strcmp(argv[1],"-2") == 0 && has_option(argc, argv, "--program")) {
+        return parse_program(argc, argv);
+    }
+    else if(strcmp(argv[1],"-2") == 0) {
+        char *infilename = input_argument(argc, argv);
+        if (!infilename) {
+            fprintf(stderr, "Usage: %s <input file>\n", argv[0]);
             return 1;
         }
-        strncpy(truncated_infilename,infilename,strlen(infilename)-2);
-        char *outfilename = malloc(strlen(truncated_infilename) + strlen(".parser") + 1);
-        snprintf(outfilename, strlen(truncated_infilename) + strlen(".parser") + 1, "%s.parser", truncated_infilename);
-
-        lexer L;
-        init_lexer(&L,infilename,outfilename);
-        FILE *output = fopen(outfilename, "w");
-
+        char *indexfilename = index_filename(argc, argv);
+        symbol_list symbols;
+        memset(&symbols, 0, sizeof(symbols));
         parser P;
-        init_parser(&P, &L, output, infilename, outfilename);
-        fclose(L.infile);
-        fclose(output);
-        printf("Completed parsing. Check %s for details\n", outfilename);
-        free(outfilename);
+        memset(&P, 0, sizeof(P));
+        if (indexfilename) {
+            P.symbols = &symbols;
+        }
+        P.decls_only = has_option(argc, argv, "--decls-only");
+        ir_module module;
+        bool dump_ir = dump_ir_wanted(argc, argv);
+        bool emit_asm = asm_wanted(argc, argv);
+        bool emit_bytecode = has_option(argc, argv, "--bytecode");
+        bool switch_stats = has_option(argc, argv, "--switch-stats");
+        if (dump_ir || emit_asm || emit_bytecode || switch_stats) {
+            P.module = &module;
+        }
+
+        char *outfilename;
+        if (has_extension(infilename, ".tokbin")) {
+            tokbin T;
+            if (tokbin_open(&T, infilename) != 0) {
+                return 1;
+            }
+            outfilename = output_filename((char *)tokbin_string(&T, T.source), ".parser");
+            FILE *output = fopen(outfilename, "w");
+            if (!output) {
+                fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+                return 1;
+            }
+            ir_module_init(&module, (char *)tokbin_string(&T, T.source));
+            init_parser_tokbin(&P, &T, output, outfilename);
+            fclose(output);
+            if (switch_stats) {
+                ir_dump_switches(&module, stderr);
+            }
+            if (dump_ir && write_ir(argc, argv, &module, P.filename) != 0) {
+                return 1;
+            }
+            if (emit_asm && write_asm(argc, argv, &module, P.filename) != 0) {
+                return 1;
+            }
+            if (emit_bytecode && write_bytecode(&module, P.filename) != 0) {
+                return 1;
+            }
+            if (indexfilename) {
+                symindex_update(indexfilename, &symbols, P.filename);
+            }
+            tokbin_close(&T);
+        }
+        else {
+            FILE *input = fopen(infilename, "r");
+            if (!input) {
+                printf("Error: No such input file");
+                exit(1);
+            }
+            fclose(input);
+            outfilename = output_filename(infilename, ".parser");
 
+            lexer L;
+            init_lexer_lines(&L,infilename,outfilename);
+            FILE *output = fopen(outfilename, "w");
 
+            ir_module_init(&module, infilename);
+            init_parser(&P, &L, output, infilename, outfilename);
+            lexer_close(&L);
+            fclose(output);
+            if (switch_stats) {
+                ir_dump_switches(&module, stderr);
+            }
+            if (dump_ir && write_ir(argc, argv, &module, infilename) != 0) {
+                return 1;
+            }
+            if (emit_asm && write_asm(argc, argv, &module, infilename) != 0) {
+                return 1;
+            }
+            if (emit_bytecode && write_bytecode(&module, infilename) != 0) {
+                return 1;
+            }
+            deferred_output_close(L.outfile, L.outfilename);
+            if (indexfilename) {
+                symindex_update(indexfilename, &symbols, infilename);
+            }
+        }
+        printf("Completed parsing. Check %s for details\n", outfilename);
+        mem_free(outfilename);
+        symbols_free(&symbols);
+        ir_module_free(&module);
     }
     else {
         show_usage();
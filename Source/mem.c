@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "mem.h"
+
+static const char *subsystem_names[MEM_COUNT] = {"lexer text", "names", "output names", "includes", "token streams", "ir", "other", "trace"};
+
+/*
+Each block starts with a header recording its size and subsystem, so
+mem_free knows what to take off without being told. The header is 16
+bytes, which keeps the block after it as aligned as malloc's.
+*/
+typedef struct {
+    size_t size;
+    size_t subsystem;
+} mem_header;
+
+typedef struct {
+    atomic_size_t allocations;
+    atomic_size_t live_bytes;
+    atomic_size_t live_blocks;
+    atomic_size_t peak_bytes;
+} mem_account;
+
+static mem_account accounts[MEM_COUNT];
+static atomic_size_t total_live, total_peak;
+static size_t limit;
+static bool accounting; // Off unless asked for, as it costs a few atomic operations per token
+
+void mem_start(size_t bytes)
+{
+    accounting = true;
+    limit = bytes;
+}
+
+static void raise_peak(atomic_size_t *peak, size_t value)
+{
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > old && !atomic_compare_exchange_weak_explicit(peak, &old, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// Accounts size more bytes to subsystem, failing if that goes over the limit
+static void charge(int subsystem, size_t size)
+{
+    if (!accounting)
+        return;
+    size_t total = atomic_fetch_add_explicit(&total_live, size, memory_order_relaxed) + size;
+    if (limit && total > limit)
+    {
+        fprintf(stderr, "Memory error: %zu bytes for %s would exceed the --mem-limit of %zu bytes\n", size, subsystem_names[subsystem], limit);
+        exit(1);
+    }
+    raise_peak(&total_peak, total);
+    mem_account *A = &accounts[subsystem];
+    atomic_fetch_add_explicit(&A->allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&A->live_blocks, 1, memory_order_relaxed);
+    raise_peak(&A->peak_bytes, atomic_fetch_add_explicit(&A->live_bytes, size, memory_order_relaxed) + size);
+}
+
+static void discharge(int subsystem, size_t size)
+{
+    if (!accounting)
+        return;
+    atomic_fetch_sub_explicit(&total_live, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&accounts[subsystem].live_bytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&accounts[subsystem].live_blocks, 1, memory_order_relaxed);
+}
+
+static void out_of_memory(int subsystem, size_t size)
+{
+    fprintf(stderr, "Memory error: Out of memory allocating %zu bytes for %s\n", size, subsystem_names[subsystem]);
+    exit(1);
+}
+
+void *mem_alloc(int subsystem, size_t size)
+{
+    charge(subsystem, size);
+    mem_header *h = malloc(sizeof(mem_header) + size);
+    if (!h)
+        out_of_memory(subsystem, size);
+    h->size = size;
+    h->subsystem = subsystem;
+    return h + 1;
+}
+
+void *mem_calloc(int subsystem, size_t count, size_t size)
+{
+    if (size && count > ((size_t)-1 - sizeof(mem_header)) / size)
+        out_of_memory(subsystem, (size_t)-1);
+    void *p = mem_alloc(subsystem, count * size);
+    memset(p, 0, count * size);
+    return p;
+}
+
+// A block keeps the subsystem it was first allocated for
+void *mem_realloc(int subsystem, void *p, size_t size)
+{
+    if (!p)
+        return mem_alloc(subsystem, size);
+    mem_header *h = (mem_header *)p - 1;
+    size_t old_size = h->size;
+    subsystem = h->subsystem;
+    discharge(subsystem, old_size);
+    charge(subsystem, size);
+    h = realloc(h, sizeof(mem_header) + size);
+    if (!h)
+        out_of_memory(subsystem, size);
+    h->size = size;
+    return h + 1;
+}
+
+char *mem_strdup(int subsystem, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = mem_alloc(subsystem, len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+void mem_free(void *p)
+{
+    if (!p)
+        return;
+    mem_header *h = (mem_header *)p - 1;
+    discharge(h->subsystem, h->size);
+    free(h);
+}
+
+void mem_report(FILE *out)
+{
+    fprintf(out, "%-14s %12s %14s %12s %14s\n", "Memory", "Allocations", "Peak bytes", "Live blocks", "Live bytes");
+    size_t leaked = 0;
+    for (int s = 0; s < MEM_COUNT; s++)
+    {
+        mem_account *A = &accounts[s];
+        fprintf(out, "%-14s %12zu %14zu %12zu %14zu\n", subsystem_names[s], atomic_load(&A->allocations),
+                atomic_load(&A->peak_bytes), atomic_load(&A->live_blocks), atomic_load(&A->live_bytes));
+        leaked += atomic_load(&A->live_blocks);
+    }
+    fprintf(out, "Peak bytes in total: %zu\n", atomic_load(&total_peak));
+    if (leaked)
+        fprintf(out, "Still allocated at exit: %zu blocks, %zu bytes\n", leaked, atomic_load(&total_live));
+}
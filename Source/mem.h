@@ -0,0 +1,41 @@
+#include <stdio.h> // For FILE type
+#include <stddef.h>
+#ifndef MEM_H
+#define MEM_H
+
+// What an allocation is for, to account bytes and blocks to
+enum {
+    MEM_LEXER_TEXT,    // Token text and line table of the file being lexed
+    MEM_NAMES,         // Interned identifiers and keywords, shared by every file and thread
+    MEM_OUTPUT_NAMES,  // Output, dependency and temporary file names
+    MEM_INCLUDES,      // Token text of included files, scanned include lists and files read ahead
+    MEM_TOKENS,        // Resident token streams, .tokbin records and string tables
+    MEM_IR,            // Syntax trees and IR of function bodies
+    MEM_OTHER,         // Symbol indexes, the result cache and watch mode
+    MEM_TRACE,         // Spans recorded for --trace, until they are written at exit
+    MEM_COUNT
+};
+
+/*
+Every allocation of the compiler goes through these, so that once
+mem_start has been called the bytes and blocks live in each subsystem are
+known at any time. Past the limit, an allocation reports an error and exits
+instead of returning, and so does one that malloc fails.
+*/
+void *mem_alloc(int subsystem, size_t size);
+
+void *mem_calloc(int subsystem, size_t count, size_t size);
+
+void *mem_realloc(int subsystem, void *p, size_t size);
+
+char *mem_strdup(int subsystem, const char *s);
+
+void mem_free(void *p);
+
+// Starts accounting, allowing limit bytes to be live at once (0 for no limit)
+void mem_start(size_t limit);
+
+// Prints allocations, peak and live bytes of each subsystem; anything live at a normal exit is a leak
+void mem_report(FILE *out);
+
+#endif
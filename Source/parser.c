@@ -2,42 +2,317 @@
 #include <stdlib.h>
 #include <string.h>
 #include "parser.h"
+#include "stats.h"
+#include "trace.h"
+#include "intern.h"
+#include "mem.h"
 
 void parse(parser *P);
-void parse_declaration(parser *P);
-void parse_variable_list(parser *P, char *ident, unsigned line, char *kind);
-void parse_function_definition(parser *P);
-void parse_formal_parameter(parser *P);
-void parse_statement(parser *P);
-void parse_if_statement(parser *P);
-
-void parse_for_statement(parser *P);
-void parse_while_statement(parser *P);
-void parse_do_while_statement(parser *P);
-void parse_type_specifier(parser *P);
-void parse_statement_block(parser *P);
-void parse_assignment_expression(parser *P);
-void parse_conditional_expression(parser *P);
-void parse_logical_or_expression(parser *P);
-void parse_logical_and_expression(parser *P);
-void parse_bitwise_or_expression(parser *P);
-void parse_bitwise_and_expression(parser *P);
-void parse_equality_expression(parser *P);
-void parse_comparison_expression(parser *P);
-void parse_additive_expression(parser *P);
-void parse_multiplicative_expression(parser *P);
-void parse_unary_expression(parser *P);
-void parse_primary_expression(parser *P);
+uint32_t parse_declaration(parser *P);
+uint32_t parse_variable_list(parser *P, ast_type type, char *ident, unsigned line, char *kind);
+void parse_function_definition(parser *P, ast_type type, char *ident, unsigned line);
+uint32_t parse_formal_parameter(parser *P);
+void skip_function_body(parser *P);
+uint32_t parse_statement(parser *P);
+uint32_t parse_if_statement(parser *P);
+
+uint32_t parse_for_statement(parser *P);
+uint32_t parse_while_statement(parser *P);
+uint32_t parse_do_while_statement(parser *P);
+uint32_t parse_switch_statement(parser *P);
+uint32_t parse_labeled_statement(parser *P);
+ast_type parse_type_specifier(parser *P);
+uint32_t parse_statement_block(parser *P);
+uint32_t parse_assignment_expression(parser *P);
+uint32_t parse_conditional_expression(parser *P);
+uint32_t parse_logical_or_expression(parser *P);
+uint32_t parse_logical_and_expression(parser *P);
+uint32_t parse_bitwise_or_expression(parser *P);
+uint32_t parse_bitwise_and_expression(parser *P);
+uint32_t parse_equality_expression(parser *P);
+uint32_t parse_comparison_expression(parser *P);
+uint32_t parse_additive_expression(parser *P);
+uint32_t parse_multiplicative_expression(parser *P);
+uint32_t parse_unary_expression(parser *P);
+uint32_t parse_primary_expression(parser *P);
 void advance(parser *P);
 void match(parser *P, unsigned expected_id);
 
+// Reads the next token of the main file from a .tokbin, deferring tokens of included files
+// in the -1 format to follow the output, which is what the lexer does when parsing a source file
+static void replay_token(parser *P)
+{
+    const tokbin *T = P->replay;
+    while (P->replay_next < T->count)
+    {
+        const tokbin_record *r = &T->records[P->replay_next++];
+        if (tokbin_u32(r->file) != T->source)
+        {
+            fprintf(P->includes, "File %s Line %d Token %d Text %s\n", tokbin_string(T, tokbin_u32(r->file)),
+                    tokbin_u32(r->line), tokbin_u32(r->kind), tokbin_string(T, tokbin_u32(r->text)));
+            continue;
+        }
+        P->current_token.ID = tokbin_u32(r->kind);
+        P->current_token.lineno = tokbin_u32(r->line);
+        P->current_token.attrb = (char *)tokbin_string(T, tokbin_u32(r->text));
+        P->current_token.name = 0;
+        return;
+    }
+    P->current_token.ID = END;
+    P->current_token.lineno = T->end_line;
+    P->current_token.attrb = NULL;
+}
+
+// Reads the next token of a resident token stream, expanding includes like replay_token
+static void stream_token(parser *P)
+{
+    const token_stream *S = P->stream;
+    while (P->stream_next < S->count)
+    {
+        token *t = &S->tokens[P->stream_next++];
+        if (t->ID == TOKEN_INCLUDE)
+        {
+            lex_include(S->filename, t->lineno, t->attrb, P->includes);
+            continue;
+        }
+        P->current_token = *t;
+        return;
+    }
+    P->current_token.ID = END;
+    P->current_token.lineno = S->end_line;
+    P->current_token.offset = S->size;
+    P->current_token.attrb = NULL;
+}
+
+// Writes a declaration to the output, and to the symbol list if one is being built
+static void declare(parser *P, unsigned line, char *kind, char *ident)
+{
+    stats_enter(PHASE_OUTPUT);
+    fprintf(P->output, "File %s Line %d: %s %s\n", P->filename, line, kind, ident);
+    stats_leave();
+    trace_name(ident);
+    if (P->symbols)
+    {
+        symbols_add(P->symbols, ident, kind, P->filename, line);
+    }
+    if (P->program && strcmp(kind, "global variable") == 0)
+    {
+        program_declare(P->program, intern(ident, strlen(ident)), P->file_index, line, PROGRAM_VARIABLE, -1);
+    }
+}
+
+// Line of the current token. Tokens from a lexer with lazy lines only know their offset
+static unsigned current_line(parser *P)
+{
+    if (P->L)
+        return lexer_token_line(P->L, &P->current_token);
+    return P->current_token.lineno;
+}
+
+// Column of the current token, or 0 when its tokens do not come with source offsets
+static unsigned current_column(parser *P)
+{
+    if (P->L && P->L->lazy_lines)
+        return line_table_column(&P->L->lines, P->current_token.offset);
+    if (P->stream)
+    {
+        long offset = P->current_token.offset;
+        long start = offset;
+        while (start > 0 && P->stream->text[start - 1] != '\n')
+            start--;
+        return offset - start + 1;
+    }
+    return 0;
+}
+
+// Where the current token is, for diagnostics: "line N column C", or "line N" without a column
+static const char *position(parser *P)
+{
+    static _Thread_local char text[48];
+    unsigned column = current_column(P);
+    if (column)
+        snprintf(text, sizeof(text), "line %u column %u", current_line(P), column);
+    else
+        snprintf(text, sizeof(text), "line %u", current_line(P));
+    return text;
+}
+
+/*
+Text of the current identifier token, which stays valid after advance: the
+lexer interns identifiers, and replayed or streamed tokens belong to the
+.tokbin or the stream for the whole parse. Declarations keep it uncopied.
+*/
+static char *identifier_text(parser *P)
+{
+    return P->current_token.attrb;
+}
+
+// Text of the current token for error messages, which END and EOF have none of
+static const char *error_text(const parser *P)
+{
+    return P->current_token.attrb ? P->current_token.attrb : "";
+}
+
+// Tracks how deeply statements and expressions are nested, failing before the stack runs out
+static void nest(parser *P)
+{
+    P->depth++;
+    if (stats.enabled && P->depth > stats.max_depth)
+        stats.max_depth = P->depth;
+    if (P->depth > MAX_PARSE_DEPTH)
+    {
+        fprintf(stderr, "Parser error in file %s %s at text %s: Statements or expressions nested too deeply\n", P->filename, position(P), error_text(P));
+        remove(P->outfilename);
+        exit(1);
+    }
+}
+
+/*
+Syntax tree building, for -2 --dump-ir, --asm and --bytecode. Every parse function gives the node
+of what it parsed, which is always 0 unless P->module is set, so a plain
+parse builds nothing. Nodes are made once their operands are parsed.
+*/
+static uint32_t make(parser *P, unsigned kind, unsigned op, uint32_t a, uint32_t b)
+{
+    if (!P->module)
+        return 0;
+    uint32_t n = ast_add(&P->tree, kind, current_line(P));
+    ast_node *x = ast_at(&P->tree, n);
+    x->op = op;
+    x->a = a;
+    x->b = b;
+    return n;
+}
+
+static ast_node *node(parser *P, uint32_t n)
+{
+    return ast_at(&P->tree, n);
+}
+
+// Interned name of the current identifier. Replayed tokens come without one
+static uint32_t identifier_name(parser *P)
+{
+    if (P->current_token.name)
+        return P->current_token.name;
+    return intern(P->current_token.attrb, strlen(P->current_token.attrb));
+}
+
+// Type named by the current type keyword
+static ast_type keyword_type(parser *P)
+{
+    ast_type type = {AST_TYPE_INT, 0};
+    switch (P->current_token.attrb[0])
+    {
+    case 'v':
+        type.base = AST_TYPE_VOID;
+        break;
+    case 'c':
+        type.base = AST_TYPE_CHAR;
+        break;
+    case 'f':
+        type.base = AST_TYPE_FLOAT;
+        break;
+    }
+    return type;
+}
+
+// Value of the current integer token. Replayed tokens only have their text
+static int64_t integer_value(parser *P)
+{
+    const char *text = P->current_token.attrb;
+    if (!P->replay)
+        return P->current_token.value.i;
+    return strtoll(text, NULL, text[0] == '0' && (text[1] == 'x' || text[1] == 'X') ? 16 : 10);
+}
+
+// Node of the current literal token
+static uint32_t make_literal(parser *P)
+{
+    token *t = &P->current_token;
+    unsigned kind = t->ID == TOKEN_REAL ? AST_FLOAT : t->ID == TOKEN_STRING ? AST_STRING : AST_INT;
+    uint32_t n = make(P, kind, 0, 0, 0);
+    if (!n)
+        return 0;
+    if (t->ID == TOKEN_INT || t->ID == TOKEN_HEX)
+    {
+        node(P, n)->value.i = integer_value(P);
+        return n;
+    }
+    if (t->ID == TOKEN_REAL)
+    {
+        node(P, n)->value.d = P->replay ? strtod(t->attrb, NULL) : t->value.d;
+        return n;
+    }
+    // Character and string literals are decoded from their source text. The
+    // token text of a string has its escapes rewritten, so it is the fallback
+    const char *text = t->attrb;
+    long length = strlen(text);
+    if (P->L)
+    {
+        text = token_text(P->L);
+        length = t->length;
+    }
+    else if (P->stream)
+    {
+        text = P->stream->text + t->offset;
+        length = t->length;
+    }
+    char *decoded = mem_alloc(MEM_IR, length + 1);
+    size_t size = decode_literal(text, length, decoded);
+    if (t->ID == TOKEN_CHAR)
+        node(P, n)->value.i = size ? (unsigned char)decoded[0] : 0;
+    else
+        node(P, n)->name = intern(decoded, size);
+    mem_free(decoded);
+    return n;
+}
+
+// Declaration of ident, of type and array length
+static uint32_t make_decl(parser *P, ast_type type, char *ident, unsigned line, int64_t length)
+{
+    uint32_t n = make(P, AST_DECL, 0, 0, 0);
+    if (n)
+    {
+        ast_node *x = node(P, n);
+        x->name = intern(ident, strlen(ident));
+        x->type = type;
+        x->line = line;
+        x->value.i = length;
+    }
+    return n;
+}
+
+// Appends the nodes linked from n to the list from *first to *last
+static void append_node(parser *P, uint32_t *first, uint32_t *last, uint32_t n)
+{
+    if (!n)
+        return;
+    if (*last)
+        node(P, *last)->next = n;
+    else
+        *first = n;
+    while (node(P, n)->next)
+        n = node(P, n)->next;
+    *last = n;
+}
+
 // Helper function that puts next token in the parser
 void advance(parser *P)
 {
+    if (P->replay)
+    {
+        replay_token(P);
+        return;
+    }
+    if (P->stream)
+    {
+        stream_token(P);
+        return;
+    }
 
     if (P->current_token.attrb)
     {
-        free(P->current_token.attrb);
+        release_token(&P->current_token);
     }
     getNextToken(P->L);
     P->current_token = P->L->current;
@@ -52,7 +327,7 @@ void match(parser *P, unsigned expected_id)
     }
     else
     {
-        fprintf(stderr, "Parser error in file %s at line %d text %s: Expected token %d but got %d \n", P->filename, P->current_token.lineno, P->current_token.attrb ? P->current_token.attrb : "", expected_id, P->current_token.ID);
+        fprintf(stderr, "Parser error in file %s at %s text %s: Expected token %d but got %d \n", P->filename, position(P), error_text(P), expected_id, P->current_token.ID);
         remove(P->outfilename);
         exit(1);
     }
@@ -66,68 +341,130 @@ void init_parser(parser *P, lexer *L, FILE *output, char *infilename, char *outf
     P->filename = infilename;
     P->outfilename = outfilename;
     P->is_inside_function = false;
+    P->depth = 0;
     P->current_token = L->current;
+    P->replay = NULL;
+    P->stream = NULL;
+    parse(P);
+}
+
+// Initialise the Parser object to parse the tokens of a .tokbin file without lexing
+void init_parser_tokbin(parser *P, const tokbin *T, FILE *output, char *outfilename)
+{
+    P->L = NULL;
+    P->replay = T;
+    P->replay_next = 0;
+    P->stream = NULL;
+    P->output = output;
+    P->filename = (char *)tokbin_string(T, T->source);
+    P->outfilename = outfilename;
+    P->is_inside_function = false;
+    P->depth = 0;
+    P->includes = deferred_output_open();
+    replay_token(P);
     parse(P);
+    fflush(output);
+    deferred_output_close(P->includes, outfilename);
+    P->includes = NULL;
+}
+
+// Initialise the Parser object to parse a token stream that is kept in memory between runs
+void init_parser_stream(parser *P, const token_stream *S, FILE *output, char *outfilename)
+{
+    P->L = NULL;
+    P->replay = NULL;
+    P->stream = S;
+    P->stream_next = 0;
+    P->output = output;
+    P->filename = S->filename;
+    P->outfilename = outfilename;
+    P->is_inside_function = false;
+    P->depth = 0;
+    P->includes = deferred_output_open();
+    stream_token(P);
+    parse(P);
+    fflush(output);
+    deferred_output_close(P->includes, outfilename);
+    P->includes = NULL;
 }
 
 // Main parse function to be called in main.c
 void parse(parser *P)
 {
+    stats_enter(PHASE_PARSE);
+    memset(&P->tree, 0, sizeof(P->tree));
     while (P->current_token.ID != END)
     {
 
         if (P->current_token.ID == TOKEN_TYPE || P->current_token.ID == TOKEN_STRUCT || P->current_token.ID == TOKEN_CONST)
         {
+            // Named after the first thing it declares
+            trace_begin("declaration", NULL, P->filename, current_line(P));
             parse_declaration(P);
+            trace_end();
+            if (P->module)
+                ast_reset(&P->tree);
         }
         else
         {
-            fprintf(stderr, "Parser error in file %s in line %d at text %s: Expected function or global declaration\n", P->filename, P->current_token.lineno, P->current_token.attrb);
+            fprintf(stderr, "Parser error in file %s in %s at text %s: Expected function or global declaration\n", P->filename, position(P), error_text(P));
             remove(P->outfilename);
             exit(1);
         }
     }
+    ast_free(&P->tree);
+    stats_leave();
 }
 
-// Checks if current token is a function or a variable, calling the corresponding function for each
-void parse_declaration(parser *P)
+// Global variables of a declaration go into the IR module as they are parsed
+static void define_globals(parser *P, uint32_t decls)
 {
+    if (!P->module || P->is_inside_function)
+        return;
+    for (uint32_t d = decls; d; d = node(P, d)->next)
+        ir_define_global(P->module, &P->tree, d);
+}
+
+// Checks if current token is a function or a variable, calling the corresponding function for each.
+// Gives the declarations of the variables, linked by next
+uint32_t parse_declaration(parser *P)
+{
+    uint32_t first = 0, last = 0;
     if (P->current_token.ID == TOKEN_STRUCT)
     {
         advance(P);
         if (P->current_token.ID != TOKEN_IDENTIFIER)
         {
-            fprintf(stderr, "Parser error in file %s line %d at text %s: Expected struct name\n",
-                    P->filename, P->current_token.lineno, P->current_token.attrb);
+            fprintf(stderr, "Parser error in file %s %s at text %s: Expected struct name\n",
+                    P->filename, position(P), error_text(P));
             remove(P->outfilename);
             exit(1);
         }
-        char *struct_name = strdup(P->current_token.attrb);
-        unsigned line = P->current_token.lineno;
+        char *struct_name = identifier_text(P);
+        ast_type struct_type = {AST_TYPE_STRUCT, P->module ? identifier_name(P) : 0};
+        unsigned line = current_line(P);
         advance(P);
         if (P->current_token.ID == TOKEN_LBRACE)
         {
             // Struct definition
-            fprintf(P->output, "File %s Line %d: %s struct %s\n",
-                    P->filename, line, P->is_inside_function ? "local" : "global", struct_name);
+            declare(P, line, P->is_inside_function ? "local struct" : "global struct", struct_name);
             match(P, TOKEN_LBRACE);
             while (P->current_token.ID != TOKEN_RBRACE && P->current_token.ID != END)
             {
-                parse_type_specifier(P);
+                ast_type type = parse_type_specifier(P);
                 while (true)
                 {
                     if (P->current_token.ID != TOKEN_IDENTIFIER)
                     {
-                        fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier\n",
-                                P->filename, P->current_token.lineno, P->current_token.attrb);
+                        fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier\n",
+                                P->filename, position(P), error_text(P));
                         remove(P->outfilename);
                         exit(1);
                     }
-                    char *member_ident = strdup(P->current_token.attrb);
-                    unsigned member_line = P->current_token.lineno;
+                    char *member_ident = identifier_text(P);
+                    unsigned member_line = current_line(P);
                     advance(P);
-                    parse_variable_list(P, member_ident, member_line, "member");
-                    free(member_ident);
+                    append_node(P, &first, &last, parse_variable_list(P, type, member_ident, member_line, "member"));
                     if (P->current_token.ID == TOKEN_COMMA)
                     {
                         advance(P);
@@ -141,120 +478,135 @@ void parse_declaration(parser *P)
             }
             match(P, TOKEN_RBRACE);
             match(P, TOKEN_SEMICOLON);
+            if (P->module)
+                ir_define_struct(P->module, &P->tree, struct_type.name, first, line);
+            return 0;
         }
         else if (P->current_token.ID == TOKEN_IDENTIFIER)
         {
-            char *ident = strdup(P->current_token.attrb); // e.g., "strange" or "p"
-            unsigned ident_line = P->current_token.lineno;
+            char *ident = identifier_text(P); // e.g., "strange" or "p"
+            unsigned ident_line = current_line(P);
             advance(P);
             if (P->current_token.ID == TOKEN_LPAREN)
             {
                 // Function definition or prototype, e.g., "struct point strange(int z)"
-                fprintf(P->output, "File %s Line %d: function %s\n", P->filename, ident_line, ident);
-                parse_function_definition(P);
+                declare(P, ident_line, "function", ident);
+                parse_function_definition(P, struct_type, ident, ident_line);
             }
             else
             {
                 // Variable declaration, e.g., "struct point p;"
-                parse_variable_list(P, ident, ident_line, P->is_inside_function ? "local variable" : "global variable");
+                uint32_t decl = parse_variable_list(P, struct_type, ident, ident_line, P->is_inside_function ? "local variable" : "global variable");
+                append_node(P, &first, &last, decl);
                 if (P->current_token.ID == TOKEN_EQUAL)
                 {
                     advance(P);
-                    parse_assignment_expression(P);
+                    uint32_t init = parse_assignment_expression(P);
+                    if (decl)
+                        node(P, decl)->a = init;
                 }
                 while (P->current_token.ID == TOKEN_COMMA)
                 {
                     advance(P);
                     if (P->current_token.ID != TOKEN_IDENTIFIER)
                     {
-                        fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier after comma\n",
-                                P->filename, P->current_token.lineno, P->current_token.attrb);
+                        fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier after comma\n",
+                                P->filename, position(P), error_text(P));
                         remove(P->outfilename);
                         exit(1);
                     }
-                    free(ident);
-                    ident = strdup(P->current_token.attrb);
-                    unsigned new_line = P->current_token.lineno;
+                    ident = identifier_text(P);
+                    unsigned new_line = current_line(P);
                     advance(P);
-                    parse_variable_list(P, ident, new_line, P->is_inside_function ? "local variable" : "global variable");
+                    decl = parse_variable_list(P, struct_type, ident, new_line, P->is_inside_function ? "local variable" : "global variable");
+                    append_node(P, &first, &last, decl);
                     if (P->current_token.ID == TOKEN_EQUAL)
                     {
                         advance(P);
-                        parse_assignment_expression(P);
+                        uint32_t init = parse_assignment_expression(P);
+                        if (decl)
+                            node(P, decl)->a = init;
                     }
                 }
                 match(P, TOKEN_SEMICOLON);
+                define_globals(P, first);
             }
-            free(ident);
         }
         else
         {
-            fprintf(stderr, "Parser error in file %s line %d: Expected '{' or identifier after struct name\n",
-                    P->filename, P->current_token.lineno);
+            fprintf(stderr, "Parser error in file %s %s: Expected '{' or identifier after struct name\n",
+                    P->filename, position(P));
             remove(P->outfilename);
             exit(1);
         }
-        free(struct_name);
     }
     else
     {
-        parse_type_specifier(P);
+        ast_type type = parse_type_specifier(P);
         if (P->current_token.ID != TOKEN_IDENTIFIER)
         {
-            fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier\n", P->filename, P->current_token.lineno, P->current_token.attrb);
+            fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier\n", P->filename, position(P), error_text(P));
             remove(P->outfilename);
             exit(1);
         }
-        char *ident = strdup(P->current_token.attrb);
-        unsigned line = P->current_token.lineno;
+        char *ident = identifier_text(P);
+        unsigned line = current_line(P);
         advance(P);
         if (P->current_token.ID == TOKEN_LPAREN)
         {
             if(P->is_inside_function == true) {
-                fprintf(stderr, "Parser error in file %s line %d: Cannot nest functions", P->filename,P->current_token.lineno);
+                fprintf(stderr, "Parser error in file %s %s: Cannot nest functions", P->filename,position(P));
                 remove(P->outfilename);
                 exit(1);
             }
-            fprintf(P->output, "File %s Line %d: function %s\n", P->filename, line, ident);
-            parse_function_definition(P);
+            declare(P, line, "function", ident);
+            parse_function_definition(P, type, ident, line);
         }
         else
         {
-            parse_variable_list(P, ident, line, P->is_inside_function ? "local variable" : "global variable");
+            uint32_t decl = parse_variable_list(P, type, ident, line, P->is_inside_function ? "local variable" : "global variable");
+            append_node(P, &first, &last, decl);
             if (P->current_token.ID == TOKEN_EQUAL)
             {
                 advance(P);
-                parse_assignment_expression(P);
+                uint32_t init = parse_assignment_expression(P);
+                if (decl)
+                    node(P, decl)->a = init;
             }
             while (P->current_token.ID == TOKEN_COMMA)
             {
                 advance(P);
                 if (P->current_token.ID != TOKEN_IDENTIFIER)
                 {
-                    fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier after comma\n",
-                        P->filename, P->current_token.lineno, P->current_token.attrb);                    remove(P->outfilename);
+                    fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier after comma\n",
+                        P->filename, position(P), error_text(P));
+                    remove(P->outfilename);
                     exit(1);
                 }
-                free(ident);
-                ident = strdup(P->current_token.attrb);
-                line = P->current_token.lineno;
+                ident = identifier_text(P);
+                line = current_line(P);
                 advance(P);
-                parse_variable_list(P, ident, line, P->is_inside_function ? "local variable" : "global variable");
+                decl = parse_variable_list(P, type, ident, line, P->is_inside_function ? "local variable" : "global variable");
+                append_node(P, &first, &last, decl);
                 if (P->current_token.ID == TOKEN_EQUAL)
                 {
                     advance(P);
-                    parse_assignment_expression(P);
+                    uint32_t init = parse_assignment_expression(P);
+                    if (decl)
+                        node(P, decl)->a = init;
                 }
             }
             match(P, TOKEN_SEMICOLON);
+            define_globals(P, first);
         }
-        free(ident);
     }
+    return first;
 }
 
 // Handles const and struct
-void parse_type_specifier(parser *P)
+ast_type parse_type_specifier(parser *P)
 {
+    ast_type type = {AST_TYPE_INT, 0};
     bool has_const = false;
     if (P->current_token.ID == TOKEN_CONST)
     {
@@ -263,6 +615,7 @@ void parse_type_specifier(parser *P)
     }
     if (P->current_token.ID == TOKEN_TYPE)
     {
+        type = keyword_type(P);
         advance(P);
     }
     else if (P->current_token.ID == TOKEN_STRUCT)
@@ -270,17 +623,20 @@ void parse_type_specifier(parser *P)
         advance(P);
         if (P->current_token.ID != TOKEN_IDENTIFIER)
         {
-            fprintf(stderr, "Parser error in file %s line %d text %s: Expected struct name\n",
-                    P->filename, P->current_token.lineno, P->current_token.attrb);
+            fprintf(stderr, "Parser error in file %s %s text %s: Expected struct name\n",
+                    P->filename, position(P), error_text(P));
             remove(P->outfilename);
             exit(1);
         }
+        type.base = AST_TYPE_STRUCT;
+        if (P->module)
+            type.name = identifier_name(P);
         advance(P);
     }
     else
     {
-        fprintf(stderr, "Parser error in file %s line %d text %s: Expected character missing\n",
-                P->filename, P->current_token.lineno, P->current_token.attrb);
+        fprintf(stderr, "Parser error in file %s %s text %s: Expected character missing\n",
+                P->filename, position(P), error_text(P));
         remove(P->outfilename);
         exit(1);
     }
@@ -288,42 +644,50 @@ void parse_type_specifier(parser *P)
     {
         if (has_const)
         {
-            fprintf(stderr, "Parser error in file %s line %d: Duplicate const\n",
-                    P->filename, P->current_token.lineno);
+            fprintf(stderr, "Parser error in file %s %s: Duplicate const\n",
+                    P->filename, position(P));
             remove(P->outfilename);
             exit(1);
         }
         advance(P);
     }
+    return type;
 }
 
 //  Checks if the current token is a variable
-void parse_variable_list(parser *P, char *ident, unsigned line, char *kind)
+uint32_t parse_variable_list(parser *P, ast_type type, char *ident, unsigned line, char *kind)
 {
+    int64_t length = 0;
     if (P->current_token.ID == TOKEN_LBRACKET)
     {
         advance(P);
         if (P->current_token.ID != TOKEN_INT)
         {
-            fprintf(stderr, "Parser error in file %s line %d at text %s: Expected integer literal for array size\n", P->filename, P->current_token.lineno, P->current_token.attrb);
+            fprintf(stderr, "Parser error in file %s %s at text %s: Expected integer literal for array size\n", P->filename, position(P), error_text(P));
             remove(P->outfilename);
             exit(1);
         }
+        if (P->module)
+            length = integer_value(P);
         advance(P);
         match(P, TOKEN_RBRACKET);
     }
-    fprintf(P->output, "File %s Line %d: %s %s\n", P->filename, line, kind, ident);
+    declare(P, line, kind, ident);
+    return make_decl(P, type, ident, line, length);
 }
 
-// Checks if current token is a function definition
-void parse_function_definition(parser *P)
+// Checks if current token is a function definition, of the function ident of type declared on line
+void parse_function_definition(parser *P, ast_type type, char *ident, unsigned line)
 {
+    int arity = 0;
+    uint32_t params = 0, last = 0, body = 0;
     match(P, TOKEN_LPAREN);
     if (P->current_token.ID != TOKEN_RPAREN)
     {
         while (true)
         {
-            parse_formal_parameter(P);
+            append_node(P, &params, &last, parse_formal_parameter(P));
+            arity++;
             if (P->current_token.ID == TOKEN_COMMA)
             {
                 advance(P);
@@ -335,12 +699,23 @@ void parse_function_definition(parser *P)
         }
     }
     match(P, TOKEN_RPAREN);
+    if (P->program)
+    {
+        int kind = P->current_token.ID == TOKEN_SEMICOLON ? PROGRAM_PROTOTYPE : PROGRAM_FUNCTION;
+        program_declare(P->program, intern(ident, strlen(ident)), P->file_index, line, kind, arity);
+    }
     if (P->current_token.ID == TOKEN_SEMICOLON)
     {
         advance(P);
     }
+    else if (P->decls_only)
+    {
+        skip_function_body(P);
+    }
     else
     {
+        uint32_t first = 0;
+        last = 0;
         match(P, TOKEN_LBRACE);
         P->is_inside_function = true;
         while (P->current_token.ID != TOKEN_RBRACE && P->current_token.ID != END)
@@ -348,297 +723,497 @@ void parse_function_definition(parser *P)
 
             if (P->current_token.ID == TOKEN_TYPE || P->current_token.ID == TOKEN_STRUCT || P->current_token.ID == TOKEN_CONST)
             {
-                parse_declaration(P); // Local variables
+                append_node(P, &first, &last, parse_declaration(P)); // Local variables
             }
             else
             {
-                parse_statement(P);
+                append_node(P, &first, &last, parse_statement(P));
             }
         }
+        body = make(P, AST_BLOCK, 0, first, 0);
         match(P, TOKEN_RBRACE);
         P->is_inside_function = false;
     }
+    if (P->module)
+        ir_define_function(P->module, &P->tree, intern(ident, strlen(ident)), type, params, body, line);
+}
+
+// Skips a function body by counting braces, for when only declarations are wanted,
+// in the lexer when it is reading the source itself
+void skip_function_body(parser *P)
+{
+    if (!P->replay && !P->stream && P->current_token.ID == TOKEN_LBRACE)
+    {
+        release_token(&P->current_token);
+        bool closed = lexer_skip_block(P->L);
+        P->current_token = P->L->current;
+        if (!closed)
+            match(P, TOKEN_RBRACE);
+        return;
+    }
+    match(P, TOKEN_LBRACE);
+    unsigned depth = 1;
+    while (depth > 0)
+    {
+        if (P->current_token.ID == END)
+        {
+            match(P, TOKEN_RBRACE);
+        }
+        if (P->current_token.ID == TOKEN_LBRACE)
+        {
+            depth++;
+        }
+        else if (P->current_token.ID == TOKEN_RBRACE)
+        {
+            depth--;
+        }
+        advance(P);
+    }
 }
 
 //
-void parse_formal_parameter(parser *P)
+uint32_t parse_formal_parameter(parser *P)
 {
-    parse_type_specifier(P);
+    ast_type type = parse_type_specifier(P);
 
     if (P->current_token.ID != TOKEN_IDENTIFIER)
     {
-        fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier for parameter\n", P->filename, P->current_token.lineno, P->current_token.attrb);
+        fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier for parameter\n", P->filename, position(P), error_text(P));
         remove(P->outfilename);
         exit(1);
     }
 
-    char *ident = strdup(P->current_token.attrb);
-    unsigned line = P->current_token.lineno;
+    char *ident = identifier_text(P);
+    unsigned line = current_line(P);
+    int64_t length = 0;
     advance(P);
     if (P->current_token.ID == TOKEN_LBRACKET)
     {
         advance(P);
         match(P, TOKEN_RBRACKET);
+        length = -1;
     }
-    fprintf(P->output, "File %s Line %d: parameter %s\n", P->filename, line, ident);
-    free(ident);
+    declare(P, line, "parameter", ident);
+    return make_decl(P, type, ident, line, length);
 }
 
-void parse_statement(parser *P)
+uint32_t parse_statement(parser *P)
 {
+    uint32_t n = 0;
+    nest(P);
     if (P->current_token.ID == TOKEN_SEMICOLON)
     {
         advance(P);
     }
     else if (P->current_token.ID == TOKEN_BREAK)
     {
+        n = make(P, AST_BREAK, 0, 0, 0);
         advance(P);
         match(P, TOKEN_SEMICOLON);
     }
     else if (P->current_token.ID == TOKEN_CONTINUE)
     {
+        n = make(P, AST_CONTINUE, 0, 0, 0);
         advance(P);
         match(P, TOKEN_SEMICOLON);
     }
     else if (P->current_token.ID == TOKEN_RETURN)
     {
+        n = make(P, AST_RETURN, 0, 0, 0);
         advance(P);
         if (P->current_token.ID != TOKEN_SEMICOLON)
         {
-            parse_assignment_expression(P);
+            uint32_t value = parse_assignment_expression(P);
+            if (n)
+                node(P, n)->a = value;
         }
         match(P, TOKEN_SEMICOLON);
     }
     else if (P->current_token.ID == TOKEN_IF)
     {
-        parse_if_statement(P);
+        n = parse_if_statement(P);
     }
     else if (P->current_token.ID == TOKEN_FOR)
     {
-        parse_for_statement(P);
+        n = parse_for_statement(P);
     }
     else if (P->current_token.ID == TOKEN_WHILE)
     {
-        parse_while_statement(P);
+        n = parse_while_statement(P);
     }
     else if (P->current_token.ID == TOKEN_DO)
     {
-        parse_do_while_statement(P);
+        n = parse_do_while_statement(P);
+    }
+    else if (P->current_token.ID == TOKEN_SWITCH)
+    {
+        n = parse_switch_statement(P);
+    }
+    else if (P->current_token.ID == TOKEN_CASE || P->current_token.ID == TOKEN_DEFAULT)
+    {
+        n = parse_labeled_statement(P);
     }
     else if (P->current_token.ID == TOKEN_LBRACE)
     {
-        parse_statement_block(P);
+        n = parse_statement_block(P);
     }
     else
     {
-        parse_assignment_expression(P);
+        n = make(P, AST_EXPRESSION, 0, parse_assignment_expression(P), 0);
         match(P, TOKEN_SEMICOLON);
     }
+    P->depth--;
+    return n;
 }
 
-void parse_if_statement(parser *P)
+/*
+An else if goes on with the chain here instead of parsing the if as the
+statement of the else, so that a chain of any length nests no deeper than
+its first if.
+*/
+uint32_t parse_if_statement(parser *P)
 {
-    match(P, TOKEN_IF);
-    match(P, TOKEN_LPAREN);
-    parse_assignment_expression(P);
-    match(P, TOKEN_RPAREN);
-    parse_statement(P);
-    if (P->current_token.ID == TOKEN_ELSE)
+    uint32_t first = 0, last = 0;
+    for (;;)
     {
+        uint32_t n = make(P, AST_IF, 0, 0, 0);
+        match(P, TOKEN_IF);
+        match(P, TOKEN_LPAREN);
+        uint32_t condition = parse_assignment_expression(P);
+        match(P, TOKEN_RPAREN);
+        uint32_t then = parse_statement(P);
+        if (n)
+        {
+            node(P, n)->a = condition;
+            node(P, n)->b = then;
+        }
+        if (last)
+            node(P, last)->c = n;
+        else
+            first = n;
+        last = n;
+        if (P->current_token.ID != TOKEN_ELSE)
+            break;
         advance(P);
-        parse_statement(P);
+        if (P->current_token.ID != TOKEN_IF)
+        {
+            uint32_t otherwise = parse_statement(P);
+            if (n)
+                node(P, n)->c = otherwise;
+            break;
+        }
     }
+    return first;
 }
 
-void parse_for_statement(parser *P)
+uint32_t parse_for_statement(parser *P)
 {
+    uint32_t n = make(P, AST_FOR, 0, 0, 0);
+    uint32_t init = 0, condition = 0, step = 0;
     match(P, TOKEN_FOR);
     match(P, TOKEN_LPAREN);
     if (P->current_token.ID != TOKEN_SEMICOLON)
-        parse_assignment_expression(P);
+        init = parse_assignment_expression(P);
     match(P, TOKEN_SEMICOLON);
     if (P->current_token.ID != TOKEN_SEMICOLON)
-        parse_assignment_expression(P);
+        condition = parse_assignment_expression(P);
     match(P, TOKEN_SEMICOLON);
     if (P->current_token.ID != TOKEN_RPAREN)
-        parse_assignment_expression(P);
+        step = parse_assignment_expression(P);
     match(P, TOKEN_RPAREN);
-    parse_statement(P);
+    uint32_t body = parse_statement(P);
+    if (n)
+    {
+        node(P, n)->a = init;
+        node(P, n)->b = condition;
+        node(P, n)->c = step;
+        node(P, n)->d = body;
+    }
+    return n;
 }
 
-void parse_while_statement(parser *P)
+uint32_t parse_while_statement(parser *P)
 {
+    uint32_t n = make(P, AST_WHILE, 0, 0, 0);
     match(P, TOKEN_WHILE);
     match(P, TOKEN_LPAREN);
-    parse_assignment_expression(P);
+    uint32_t condition = parse_assignment_expression(P);
     match(P, TOKEN_RPAREN);
-    parse_statement(P);
+    uint32_t body = parse_statement(P);
+    if (n)
+    {
+        node(P, n)->a = condition;
+        node(P, n)->b = body;
+    }
+    return n;
 }
 
-void parse_do_while_statement(parser *P)
+uint32_t parse_do_while_statement(parser *P)
 {
+    uint32_t n = make(P, AST_DO, 0, 0, 0);
     match(P, TOKEN_DO);
-    parse_statement(P);
+    uint32_t body = parse_statement(P);
     match(P, TOKEN_WHILE);
     match(P, TOKEN_LPAREN);
-    parse_assignment_expression(P);
+    uint32_t condition = parse_assignment_expression(P);
     match(P, TOKEN_RPAREN);
     match(P, TOKEN_SEMICOLON);
+    if (n)
+    {
+        node(P, n)->a = condition;
+        node(P, n)->b = body;
+    }
+    return n;
+}
+
+uint32_t parse_switch_statement(parser *P)
+{
+    uint32_t n = make(P, AST_SWITCH, 0, 0, 0);
+    match(P, TOKEN_SWITCH);
+    match(P, TOKEN_LPAREN);
+    uint32_t value = parse_assignment_expression(P);
+    match(P, TOKEN_RPAREN);
+    uint32_t body = parse_statement(P);
+    if (n)
+    {
+        node(P, n)->a = value;
+        node(P, n)->b = body;
+    }
+    return n;
 }
 
-void parse_statement_block(parser *P)
+/*
+A run of case and default labels and the statement after them, as one node
+whose c lists the labels after the first. Stacked labels are a loop here
+rather than a statement each, so that a long run of them nests no deeper
+than one. Whether they are in a switch is left to the IR.
+*/
+uint32_t parse_labeled_statement(parser *P)
 {
+    uint32_t n = 0, first = 0, last = 0, statement = 0;
+    while (P->current_token.ID == TOKEN_CASE || P->current_token.ID == TOKEN_DEFAULT)
+    {
+        bool is_case = P->current_token.ID == TOKEN_CASE;
+        uint32_t label = make(P, is_case ? AST_CASE : AST_DEFAULT, 0, 0, 0);
+        advance(P);
+        if (is_case)
+        {
+            uint32_t value = parse_conditional_expression(P);
+            if (label)
+                node(P, label)->a = value;
+        }
+        match(P, TOKEN_COLON);
+        if (!n)
+            n = label;
+        else
+            append_node(P, &first, &last, label);
+    }
+    if (P->current_token.ID != TOKEN_RBRACE)
+        statement = parse_statement(P);
+    if (n)
+    {
+        node(P, n)->b = statement;
+        node(P, n)->c = first;
+    }
+    return n;
+}
+
+uint32_t parse_statement_block(parser *P)
+{
+    uint32_t n = make(P, AST_BLOCK, 0, 0, 0);
+    uint32_t first = 0, last = 0;
     match(P, TOKEN_LBRACE);
     while (P->current_token.ID != TOKEN_RBRACE && P->current_token.ID != END)
     {
         if (P->current_token.ID == TOKEN_TYPE || P->current_token.ID == TOKEN_STRUCT || P->current_token.ID == TOKEN_CONST)
         {
-            parse_declaration(P);
+            append_node(P, &first, &last, parse_declaration(P));
         }
         else
         {
-            parse_statement(P);
+            append_node(P, &first, &last, parse_statement(P));
         }
     }
     match(P, TOKEN_RBRACE);
+    if (n)
+        node(P, n)->a = first;
+    return n;
 }
 
-void parse_assignment_expression(parser *P)
+uint32_t parse_assignment_expression(parser *P)
 {
-    parse_conditional_expression(P);
+    nest(P);
+    uint32_t n = parse_conditional_expression(P);
     while (P->current_token.ID == TOKEN_EQUAL || P->current_token.ID == TOKEN_ADD_ASSIGN ||
            P->current_token.ID == TOKEN_SUB_ASSIGN || P->current_token.ID == TOKEN_MUL_ASSIGN ||
            P->current_token.ID == TOKEN_DIV_ASSIGN)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_assignment_expression(P);
+        n = make(P, AST_ASSIGN, op, n, parse_assignment_expression(P));
     }
+    P->depth--;
+    return n;
 }
 
-void parse_conditional_expression(parser *P)
+uint32_t parse_conditional_expression(parser *P)
 {
-    parse_logical_or_expression(P);
+    uint32_t n = parse_logical_or_expression(P);
     if (P->current_token.ID == TOKEN_QUESTION)
     {
         advance(P);
-        parse_assignment_expression(P);
+        uint32_t then = parse_assignment_expression(P);
         match(P, TOKEN_COLON);
-        parse_conditional_expression(P);
+        uint32_t otherwise = parse_conditional_expression(P);
+        n = make(P, AST_CONDITIONAL, 0, n, then);
+        if (n)
+            node(P, n)->c = otherwise;
     }
+    return n;
 }
 
-void parse_logical_or_expression(parser *P)
+uint32_t parse_logical_or_expression(parser *P)
 {
-    parse_logical_and_expression(P);
+    uint32_t n = parse_logical_and_expression(P);
     while (P->current_token.ID == TOKEN_OR)
     {
         advance(P);
-        parse_logical_and_expression(P);
+        n = make(P, AST_BINARY, TOKEN_OR, n, parse_logical_and_expression(P));
     }
+    return n;
 }
 
-void parse_logical_and_expression(parser *P)
+uint32_t parse_logical_and_expression(parser *P)
 {
-    parse_bitwise_or_expression(P);
+    uint32_t n = parse_bitwise_or_expression(P);
     while (P->current_token.ID == TOKEN_AND)
     {
         advance(P);
-        parse_bitwise_or_expression(P);
+        n = make(P, AST_BINARY, TOKEN_AND, n, parse_bitwise_or_expression(P));
     }
+    return n;
 }
 
-void parse_bitwise_or_expression(parser *P)
+uint32_t parse_bitwise_or_expression(parser *P)
 {
-    parse_bitwise_and_expression(P);
+    uint32_t n = parse_bitwise_and_expression(P);
     while (P->current_token.ID == TOKEN_PIPE)
     {
         advance(P);
-        parse_bitwise_and_expression(P);
+        n = make(P, AST_BINARY, TOKEN_PIPE, n, parse_bitwise_and_expression(P));
     }
+    return n;
 }
 
-void parse_bitwise_and_expression(parser *P)
+uint32_t parse_bitwise_and_expression(parser *P)
 {
-    parse_equality_expression(P);
+    uint32_t n = parse_equality_expression(P);
     while (P->current_token.ID == TOKEN_AMPERSAND)
     {
         advance(P);
-        parse_equality_expression(P);
+        n = make(P, AST_BINARY, TOKEN_AMPERSAND, n, parse_equality_expression(P));
     }
+    return n;
 }
 
-void parse_equality_expression(parser *P)
+uint32_t parse_equality_expression(parser *P)
 {
-    parse_comparison_expression(P);
+    uint32_t n = parse_comparison_expression(P);
     while (P->current_token.ID == TOKEN_EQ || P->current_token.ID == TOKEN_NE)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_comparison_expression(P);
+        n = make(P, AST_BINARY, op, n, parse_comparison_expression(P));
     }
+    return n;
 }
 
-void parse_comparison_expression(parser *P)
+uint32_t parse_comparison_expression(parser *P)
 {
-    parse_additive_expression(P);
+    uint32_t n = parse_additive_expression(P);
     while (P->current_token.ID == TOKEN_LESS || P->current_token.ID == TOKEN_LE ||
            P->current_token.ID == TOKEN_GREATER || P->current_token.ID == TOKEN_GE)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_additive_expression(P);
+        n = make(P, AST_BINARY, op, n, parse_additive_expression(P));
     }
+    return n;
 }
 
-void parse_additive_expression(parser *P)
+uint32_t parse_additive_expression(parser *P)
 {
-    parse_multiplicative_expression(P);
+    uint32_t n = parse_multiplicative_expression(P);
     while (P->current_token.ID == TOKEN_PLUS || P->current_token.ID == TOKEN_MINUS)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_multiplicative_expression(P);
+        n = make(P, AST_BINARY, op, n, parse_multiplicative_expression(P));
     }
+    return n;
 }
 
-void parse_multiplicative_expression(parser *P)
+uint32_t parse_multiplicative_expression(parser *P)
 {
-    parse_unary_expression(P);
+    uint32_t n = parse_unary_expression(P);
     while (P->current_token.ID == TOKEN_ASTERISK || P->current_token.ID == TOKEN_SLASH ||
            P->current_token.ID == TOKEN_PERCENT)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_unary_expression(P);
+        n = make(P, AST_BINARY, op, n, parse_unary_expression(P));
     }
+    return n;
 }
 
-void parse_unary_expression(parser *P)
+uint32_t parse_unary_expression(parser *P)
 {
+    uint32_t n;
     if (P->current_token.ID == TOKEN_MINUS || P->current_token.ID == TOKEN_EXCLAMATION ||
         P->current_token.ID == TOKEN_TILDE || P->current_token.ID == TOKEN_INC ||
         P->current_token.ID == TOKEN_DEC)
     {
+        unsigned op = P->current_token.ID;
         advance(P);
-        parse_unary_expression(P);
+        nest(P);
+        n = parse_unary_expression(P);
+        n = make(P, op == TOKEN_INC || op == TOKEN_DEC ? AST_PREFIX : AST_UNARY, op, n, 0);
+        P->depth--;
     }
     else
     {
-        parse_primary_expression(P);
+        n = parse_primary_expression(P);
         if (P->current_token.ID == TOKEN_INC || P->current_token.ID == TOKEN_DEC)
         {
+            n = make(P, AST_POSTFIX, P->current_token.ID, n, 0);
             advance(P);
         }
     }
+    return n;
 }
 
-void parse_primary_expression(parser *P)
+uint32_t parse_primary_expression(parser *P)
 {
+    uint32_t n = 0;
     if (P->current_token.ID == TOKEN_INT || P->current_token.ID == TOKEN_REAL ||
         P->current_token.ID == TOKEN_STRING || P->current_token.ID == TOKEN_CHAR ||
         P->current_token.ID == TOKEN_HEX)
     {
+        n = make_literal(P);
         advance(P);
     }
     else if (P->current_token.ID == TOKEN_IDENTIFIER)
     {
+        char *callee = P->program ? identifier_text(P) : NULL;
+        unsigned call_line = callee ? current_line(P) : 0;
+        n = make(P, AST_NAME, 0, 0, 0);
+        if (n)
+            node(P, n)->name = identifier_name(P);
         advance(P);
+        if (callee && P->current_token.ID == TOKEN_LPAREN)
+        {
+            program_call(P->program, intern(callee, strlen(callee)), P->file_index, call_line);
+        }
         // First, handle all postfix operators including function calls
         while (P->current_token.ID == TOKEN_DOT || P->current_token.ID == TOKEN_LBRACKET || P->current_token.ID == TOKEN_LPAREN)
         {
@@ -647,27 +1222,31 @@ void parse_primary_expression(parser *P)
                 advance(P);
                 if (P->current_token.ID != TOKEN_IDENTIFIER)
                 {
-                    fprintf(stderr, "Parser error in file %s line %d at text %s: Expected identifier after '.'\n",
-                            P->filename, P->current_token.lineno, P->current_token.attrb);
+                    fprintf(stderr, "Parser error in file %s %s at text %s: Expected identifier after '.'\n",
+                            P->filename, position(P), error_text(P));
                     remove(P->outfilename);
                     exit(1);
                 }
+                n = make(P, AST_MEMBER, 0, n, 0);
+                if (n)
+                    node(P, n)->name = identifier_name(P);
                 advance(P);
             }
             else if (P->current_token.ID == TOKEN_LBRACKET)
             {
                 advance(P);
-                parse_assignment_expression(P);
+                n = make(P, AST_INDEX, 0, n, parse_assignment_expression(P));
                 match(P, TOKEN_RBRACKET);
             }
             else if (P->current_token.ID == TOKEN_LPAREN)
             {
+                uint32_t first = 0, last = 0;
                 advance(P);
                 if (P->current_token.ID != TOKEN_RPAREN)
                 {
                     while (true)
                     {
-                        parse_assignment_expression(P); // Parse each argument fully
+                        append_node(P, &first, &last, parse_assignment_expression(P)); // Parse each argument fully
                         if (P->current_token.ID == TOKEN_COMMA)
                         {
                             advance(P);
@@ -679,6 +1258,11 @@ void parse_primary_expression(parser *P)
                     }
                 }
                 match(P, TOKEN_RPAREN);
+                // Only a name can be called, which the IR checks: name stays 0 for anything else
+                uint32_t callee_node = n;
+                n = make(P, AST_CALL, 0, first, 0);
+                if (n && node(P, callee_node)->kind == AST_NAME)
+                    node(P, n)->name = node(P, callee_node)->name;
             }
         }
     }
@@ -687,21 +1271,25 @@ void parse_primary_expression(parser *P)
         advance(P);
         if (P->current_token.ID == TOKEN_TYPE)
         {
+            ast_type type = keyword_type(P);
             advance(P);
             match(P, TOKEN_RPAREN);
-            parse_assignment_expression(P);
+            n = make(P, AST_CAST, 0, parse_assignment_expression(P), 0);
+            if (n)
+                node(P, n)->type = type;
         }
         else
         {
-            parse_assignment_expression(P);
+            n = parse_assignment_expression(P);
             match(P, TOKEN_RPAREN);
         }
     }
     else
     {
-        fprintf(stderr, "Parser error in file %s line %d at text %s: Expected term (in an expression)\n",
-                P->filename, P->current_token.lineno, P->current_token.attrb);
+        fprintf(stderr, "Parser error in file %s %s at text %s: Expected term (in an expression)\n",
+                P->filename, position(P), error_text(P));
         remove(P->outfilename);
         exit(1);
     }
-}
\ No newline at end of file
+    return n;
+}
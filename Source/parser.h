@@ -4,18 +4,43 @@
 #define PARSER_H
 
 #include "lexer.h"
+#include "tokbin.h"
+#include "relex.h"
+#include "symindex.h"
+#include "program.h"
+#include "ir.h"
+
+// Deepest nesting of statements and expressions accepted. Each level of
+// parentheses takes a dozen stack frames of the recursive descent
+#define MAX_PARSE_DEPTH 1000
 
 typedef struct {
     lexer *L;
+    const tokbin *replay; // Tokens come from a .tokbin file instead of L when set
+    uint32_t replay_next;
+    const token_stream *stream; // Tokens come from a resident token stream when set
+    size_t stream_next;
     token current_token;
     FILE *output;
+    FILE *includes; // Tokens of included files from replay or stream, added to the output after it
     char *filename;
     char *outfilename;
     bool is_inside_function;
+    unsigned depth; // Current nesting of statements and expressions
+    symbol_list *symbols; // Declarations are also collected here when set, left as is by init_parser
+    bool decls_only; // Skip function bodies, left as is by init_parser
+    program *program; // Global declarations and calls are also recorded here when set, left as is by init_parser
+    uint32_t file_index; // Index of the file being parsed in program
+    ir_module *module; // Each declaration is also lowered into this IR module when set, left as is by init_parser
+    ast tree; // Syntax tree of the top-level declaration being parsed, built when module is set
 } parser;
 
 void init_parser(parser *P, lexer *L, FILE *output, char *infilename, char *outfilename);
 
+void init_parser_tokbin(parser *P, const tokbin *T, FILE *output, char *outfilename);
+
+void init_parser_stream(parser *P, const token_stream *S, FILE *output, char *outfilename);
+
 
 
 
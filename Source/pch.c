@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pch.h"
+#include "lexer.h"
+#include "parser.h"
+#include "hash.h"
+#include "stats.h"
+#include "mem.h"
+
+// File entries being built, their names go into the token string table
+typedef struct {
+    strtab *strings;
+    unsigned char *entries;
+    size_t count;
+    size_t capacity;
+} file_list;
+
+// Records the hash of a file the header pulls in, once however often it is included
+static void add_file_hash(void *context, const char *filename, const char *text, long size)
+{
+    file_list *F = context;
+    uint32_t name = strtab_add(F->strings, filename);
+    for (size_t i = 0; i < F->count; i++)
+    {
+        if (get_u32(F->entries + i * PCH_FILE_SIZE) == name)
+            return;
+    }
+    if (F->count == F->capacity)
+    {
+        F->capacity = F->capacity ? F->capacity * 2 : 16;
+        F->entries = mem_realloc(MEM_TOKENS, F->entries, F->capacity * PCH_FILE_SIZE);
+    }
+    uint64_t h = hash_bytes(text, size, 0);
+    unsigned char *e = F->entries + F->count++ * PCH_FILE_SIZE;
+    put_u32(e, name);
+    put_u32(e + 4, (uint32_t)h);
+    put_u32(e + 8, (uint32_t)(h >> 32));
+}
+
+// Parses header for its declarations only, the same way -2 --decls-only does
+static void parse_declarations(char *header, char *outfilename, symbol_list *symbols)
+{
+    FILE *sink = fopen("/dev/null", "w");
+    lexer L;
+    init_lexer(&L, header, NULL);
+    parser P;
+    memset(&P, 0, sizeof(P));
+    P.symbols = symbols;
+    P.decls_only = true;
+    init_parser(&P, &L, sink, header, outfilename);
+    lexer_close(&L);
+    fclose(sink);
+}
+
+// Lexes and parses header into a .pch file
+int pch_write(char *header, char *outfilename)
+{
+    tokbin_writer W;
+    memset(&W, 0, sizeof(W));
+    file_list F;
+    memset(&F, 0, sizeof(F));
+    F.strings = &W.strings;
+    uint32_t source = strtab_add(&W.strings, header);
+    unsigned end_line = tokbin_add_file(&W, header, add_file_hash, &F);
+
+    symbol_list symbols;
+    memset(&symbols, 0, sizeof(symbols));
+    parse_declarations(header, outfilename, &symbols);
+    symbols_sort(&symbols);
+    unsigned char *symbol_records = mem_alloc(MEM_TOKENS, symbols.count * SYMINDEX_RECORD_SIZE + 1);
+    for (size_t i = 0; i < symbols.count; i++)
+    {
+        unsigned char *r = symbol_records + i * SYMINDEX_RECORD_SIZE;
+        put_u32(r, strtab_add(&W.strings, symbols.symbols[i].name));
+        put_u32(r + 4, strtab_add(&W.strings, symbols.symbols[i].kind));
+        put_u32(r + 8, strtab_add(&W.strings, symbols.symbols[i].file));
+        put_u32(r + 12, symbols.symbols[i].line);
+    }
+
+    size_t tokens_size = W.count * sizeof(tokbin_record);
+    size_t symbols_offset = PCH_HEADER_SIZE + tokens_size;
+    size_t files_offset = symbols_offset + symbols.count * SYMINDEX_RECORD_SIZE;
+    size_t strings_offset = files_offset + F.count * PCH_FILE_SIZE;
+    unsigned char header_bytes[PCH_HEADER_SIZE];
+    memset(header_bytes, 0, sizeof(header_bytes));
+    memcpy(header_bytes, PCH_MAGIC, 4);
+    put_u32(header_bytes + 4, PCH_VERSION);
+    put_u32(header_bytes + 8, PCH_HEADER_SIZE);
+    put_u32(header_bytes + 12, W.count);
+    put_u32(header_bytes + 16, symbols_offset);
+    put_u32(header_bytes + 20, symbols.count);
+    put_u32(header_bytes + 24, files_offset);
+    put_u32(header_bytes + 28, F.count);
+    put_u32(header_bytes + 32, strings_offset);
+    put_u32(header_bytes + 36, W.strings.size);
+    put_u32(header_bytes + 40, source);
+    put_u32(header_bytes + 44, end_line);
+
+    int status = 0;
+    FILE *output = fopen(outfilename, "wb");
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+        status = 1;
+    }
+    else
+    {
+        fwrite(header_bytes, 1, sizeof(header_bytes), output);
+        fwrite(W.records, 1, tokens_size, output);
+        fwrite(symbol_records, 1, symbols.count * SYMINDEX_RECORD_SIZE, output);
+        fwrite(F.entries, 1, F.count * PCH_FILE_SIZE, output);
+        fwrite(W.strings.data, 1, W.strings.size, output);
+        if (fclose(output) != 0)
+        {
+            fprintf(stderr, "Error: Cannot write output file %s\n", outfilename);
+            status = 1;
+        }
+    }
+    mem_free(symbol_records);
+    mem_free(F.entries);
+    symbols_free(&symbols);
+    tokbin_writer_free(&W);
+    return status;
+}
+
+// Maps a .pch file and checks that every offset in it is in bounds
+int pch_open(pch *H, const char *filename)
+{
+    memset(H, 0, sizeof(*H));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot open precompiled header %s\n", filename);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < PCH_HEADER_SIZE)
+    {
+        fprintf(stderr, "Error: %s is not a precompiled header\n", filename);
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Cannot map precompiled header %s\n", filename);
+        return 1;
+    }
+    const unsigned char *h = map;
+    size_t size = st.st_size;
+    uint32_t header_size = get_u32(h + 8);
+    uint32_t token_count = get_u32(h + 12);
+    uint32_t symbols_offset = get_u32(h + 16);
+    uint32_t symbol_count = get_u32(h + 20);
+    uint32_t files_offset = get_u32(h + 24);
+    uint32_t file_count = get_u32(h + 28);
+    uint32_t strings_offset = get_u32(h + 32);
+    uint32_t strings_size = get_u32(h + 36);
+    bool valid = memcmp(h, PCH_MAGIC, 4) == 0 && get_u32(h + 4) == PCH_VERSION &&
+                 header_size >= PCH_HEADER_SIZE && header_size % 4 == 0 &&
+                 symbols_offset >= header_size + (size_t)token_count * sizeof(tokbin_record) &&
+                 files_offset >= symbols_offset + (size_t)symbol_count * SYMINDEX_RECORD_SIZE &&
+                 strings_offset >= files_offset + (size_t)file_count * PCH_FILE_SIZE &&
+                 strings_offset + (size_t)strings_size <= size && strings_size > 0 &&
+                 h[strings_offset + strings_size - 1] == '\0' && get_u32(h + 40) < strings_size;
+    const tokbin_record *records = (const tokbin_record *)(h + header_size);
+    for (uint32_t i = 0; i < token_count && valid; i++)
+        valid = tokbin_u32(records[i].text) < strings_size && tokbin_u32(records[i].file) < strings_size;
+    for (uint32_t i = 0; i < symbol_count && valid; i++)
+    {
+        const unsigned char *r = h + symbols_offset + (size_t)i * SYMINDEX_RECORD_SIZE;
+        valid = get_u32(r) < strings_size && get_u32(r + 4) < strings_size && get_u32(r + 8) < strings_size;
+    }
+    for (uint32_t i = 0; i < file_count && valid; i++)
+        valid = get_u32(h + files_offset + (size_t)i * PCH_FILE_SIZE) < strings_size;
+    if (!valid)
+    {
+        fprintf(stderr, "Error: %s is not a valid precompiled header\n", filename);
+        munmap(map, size);
+        return 1;
+    }
+    H->map = map;
+    H->size = size;
+    H->tokens.count = token_count;
+    H->tokens.records = records;
+    H->tokens.strings = (const char *)(h + strings_offset);
+    H->tokens.strings_size = strings_size;
+    H->tokens.source = get_u32(h + 40);
+    H->tokens.end_line = get_u32(h + 44);
+    H->symbols.count = symbol_count;
+    H->symbols.records = h + symbols_offset;
+    H->symbols.strings = H->tokens.strings;
+    H->symbols.strings_size = strings_size;
+    H->file_count = file_count;
+    H->files = h + files_offset;
+    return 0;
+}
+
+// XXH64 of the contents of filename, false if it cannot be read
+static bool hash_file(const char *filename, uint64_t *hash)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    hash_state state;
+    hash_init(&state, 0);
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        hash_update(&state, buffer, n);
+    close(fd);
+    *hash = hash_final(&state);
+    return n == 0;
+}
+
+// True if the header and everything it includes are unchanged since H was written
+bool pch_up_to_date(const pch *H)
+{
+    for (uint32_t i = 0; i < H->file_count; i++)
+    {
+        const unsigned char *e = H->files + (size_t)i * PCH_FILE_SIZE;
+        uint64_t stored = get_u32(e + 4) | (uint64_t)get_u32(e + 8) << 32;
+        uint64_t current;
+        if (!hash_file(tokbin_string(&H->tokens, get_u32(e)), &current) || current != stored)
+            return false;
+    }
+    return true;
+}
+
+void pch_close(pch *H)
+{
+    if (H->map)
+        munmap(H->map, H->size);
+    memset(H, 0, sizeof(*H));
+}
+
+/*
+Headers an #include looked for a .pch for, with the result, so that each
+.pch is mapped and checked once per run however often its header is
+included. Entries stay until exit, the token text is read from their maps.
+*/
+typedef struct {
+    char *header;
+    bool usable;
+    pch H;
+} pch_entry;
+
+static pch_entry **entries;
+static size_t entry_count, entry_capacity;
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_entries(void)
+{
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        pch_close(&entries[i]->H);
+        mem_free(entries[i]->header);
+        mem_free(entries[i]);
+    }
+    mem_free(entries);
+    entries = NULL;
+    entry_count = entry_capacity = 0;
+}
+
+// Looks for the .pch of filename next to it, named as pch_write names it by default
+static pch_entry *find_entry(char *filename)
+{
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        if (strcmp(entries[i]->header, filename) == 0)
+            return entries[i];
+    }
+    if (entry_count == 0)
+        atexit(release_entries);
+    if (entry_count == entry_capacity)
+    {
+        entry_capacity = entry_capacity ? entry_capacity * 2 : 16;
+        entries = mem_realloc(MEM_OTHER, entries, entry_capacity * sizeof(pch_entry *));
+    }
+    pch_entry *E = mem_calloc(MEM_OTHER, 1, sizeof(pch_entry));
+    E->header = mem_strdup(MEM_OTHER, filename);
+    entries[entry_count++] = E;
+
+    char *pchname = output_filename(filename, ".pch");
+    if (access(pchname, F_OK) == 0 && pch_open(&E->H, pchname) == 0)
+    {
+        // Stale or built for another name: the header is lexed as if there were no .pch
+        E->usable = strcmp(tokbin_string(&E->H.tokens, E->H.tokens.source), filename) == 0 && pch_up_to_date(&E->H);
+        if (!E->usable)
+            pch_close(&E->H);
+    }
+    mem_free(pchname);
+    return E;
+}
+
+/*
+Writes the tokens of the included file filename to output (if not NULL) in
+the -1 format from its .pch, which gives the same lines as lexing it.
+Returns false, writing nothing, when there is no up to date .pch for it.
+*/
+bool pch_include(char *filename, FILE *output)
+{
+    pthread_mutex_lock(&entries_lock);
+    pch_entry *E = find_entry(filename);
+    pthread_mutex_unlock(&entries_lock);
+    if (!E->usable)
+        return false;
+    if (!output)
+        return true;
+    const tokbin *T = &E->H.tokens;
+    stats_enter(PHASE_OUTPUT);
+    for (uint32_t i = 0; i < T->count; i++)
+    {
+        const tokbin_record *r = &T->records[i];
+        fprintf(output, "File %s Line %d Token %d Text %s\n", tokbin_string(T, tokbin_u32(r->file)),
+                tokbin_u32(r->line), tokbin_u32(r->kind), tokbin_string(T, tokbin_u32(r->text)));
+    }
+    stats_leave();
+    return true;
+}
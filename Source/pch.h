@@ -0,0 +1,50 @@
+#include <stdio.h> // For FILE type
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#ifndef PCH_H
+#define PCH_H
+
+#include "tokbin.h"
+#include "symindex.h"
+
+/*
+Precompiled header (.pch), all fields little-endian:
+  header   48 bytes, see PCH_* offsets below
+  tokens   token_count tokbin_record entries, the header's tokens with its
+           includes expanded in place, exactly as in a .tokbin
+  symbols  symbol_count records as in a .symidx, sorted by name: the
+           declarations of the header
+  files    file_count PCH_FILE_SIZE entries, one for the header and one for
+           each file it includes: string offset of the name, then the XXH64
+           of its contents as two 32-bit fields, low word first
+  strings  NUL-terminated strings shared by the sections above, deduplicated
+A .pch is only used while every one of its files still has the hash it was
+built from.
+*/
+#define PCH_MAGIC "PCHX"
+#define PCH_VERSION 1
+#define PCH_HEADER_SIZE 48
+#define PCH_FILE_SIZE 12
+
+// A .pch file mapped into memory. tokens and symbols are views into the map, not mapped themselves
+typedef struct {
+    void *map;
+    size_t size;
+    tokbin tokens;
+    symbol_index symbols;
+    uint32_t file_count;
+    const unsigned char *files;
+} pch;
+
+int pch_write(char *header, char *outfilename);
+
+int pch_open(pch *H, const char *filename);
+
+bool pch_up_to_date(const pch *H);
+
+void pch_close(pch *H);
+
+bool pch_include(char *filename, FILE *output);
+
+#endif
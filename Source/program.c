@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "program.h"
+#include "parser.h"
+#include "intern.h"
+#include "trace.h"
+#include "mem.h"
+
+// Most files parsed at once
+#define PROGRAM_MAX_JOBS 256
+
+// Next file for a worker to take
+static atomic_uint next_file;
+
+// Set while workers are parsing, see stop_parsing
+static atomic_bool parsing;
+
+void program_init(program *G, char **files, uint32_t nfiles)
+{
+    G->files = files;
+    G->nfiles = nfiles;
+    for (unsigned s = 0; s < PROGRAM_SHARDS; s++)
+    {
+        pthread_mutex_init(&G->shards[s].lock, NULL);
+        G->shards[s].symbols = NULL;
+        G->shards[s].nslots = 0;
+        G->shards[s].count = 0;
+    }
+}
+
+// Interned ids of similar names are close together, so they are spread by a multiplicative hash
+static inline uint32_t name_hash(uint32_t name)
+{
+    return name * 2654435761u;
+}
+
+static void grow_symbols(program_shard *S)
+{
+    size_t nslots = S->nslots ? S->nslots * 2 : 64;
+    program_symbol *symbols = mem_calloc(MEM_OTHER, nslots, sizeof(program_symbol));
+    for (size_t i = 0; i < S->nslots; i++)
+    {
+        if (!S->symbols[i].name)
+            continue;
+        size_t j = name_hash(S->symbols[i].name) & (nslots - 1);
+        while (symbols[j].name)
+            j = (j + 1) & (nslots - 1);
+        symbols[j] = S->symbols[i];
+    }
+    mem_free(S->symbols);
+    S->symbols = symbols;
+    S->nslots = nslots;
+}
+
+// Returns the symbol of name in its shard, which is locked, adding it the first time
+static program_symbol *find_symbol(program_shard *S, uint32_t name)
+{
+    if ((S->count + 1) * 2 > S->nslots)
+        grow_symbols(S);
+    size_t j = name_hash(name) & (S->nslots - 1);
+    while (S->symbols[j].name && S->symbols[j].name != name)
+        j = (j + 1) & (S->nslots - 1);
+    if (!S->symbols[j].name)
+    {
+        S->symbols[j].name = name;
+        S->count++;
+    }
+    return &S->symbols[j];
+}
+
+static inline program_shard *shard_of(program *G, uint32_t name)
+{
+    return &G->shards[name_hash(name) >> 26];
+}
+
+void program_declare(program *G, uint32_t name, uint32_t file, unsigned line, int kind, int arity)
+{
+    program_shard *S = shard_of(G, name);
+    pthread_mutex_lock(&S->lock);
+    program_symbol *sym = find_symbol(S, name);
+    if (sym->count == sym->capacity)
+    {
+        sym->capacity = sym->capacity ? sym->capacity * 2 : 2;
+        sym->decls = mem_realloc(MEM_OTHER, sym->decls, sym->capacity * sizeof(program_decl));
+    }
+    program_decl d = {file, line, kind, arity};
+    sym->decls[sym->count++] = d;
+    pthread_mutex_unlock(&S->lock);
+}
+
+void program_call(program *G, uint32_t name, uint32_t file, unsigned line)
+{
+    program_shard *S = shard_of(G, name);
+    pthread_mutex_lock(&S->lock);
+    program_symbol *sym = find_symbol(S, name);
+    // Only the earliest call is kept, so the report does not depend on which file was parsed first
+    if (!sym->calls || file < sym->call_file || (file == sym->call_file && line < sym->call_line))
+    {
+        sym->call_file = file;
+        sym->call_line = line;
+    }
+    sym->calls++;
+    pthread_mutex_unlock(&S->lock);
+}
+
+// Parses one file as -2 does, writing its .parser, with its globals and calls recorded in G
+static void parse_file(program *G, uint32_t i)
+{
+    char *infilename = G->files[i];
+    char *outfilename = output_filename(infilename, ".parser");
+    trace_begin("file", infilename, NULL, 0);
+    lexer L;
+    init_lexer_lines(&L, infilename, outfilename);
+    FILE *output = fopen(outfilename, "w");
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+        exit(1);
+    }
+    parser P;
+    memset(&P, 0, sizeof(P));
+    P.program = G;
+    P.file_index = i;
+    init_parser(&P, &L, output, infilename, outfilename);
+    lexer_close(&L);
+    fclose(output);
+    deferred_output_close(L.outfile, L.outfilename);
+    trace_end();
+    mem_free(outfilename);
+}
+
+static void *parse_files(void *arg)
+{
+    program *G = arg;
+    uint32_t i;
+    while ((i = atomic_fetch_add(&next_file, 1)) < G->nfiles)
+        parse_file(G, i);
+    return NULL;
+}
+
+/*
+A syntax error in one file exits from its worker while the others are
+still parsing. The exit handlers registered before this one free the
+interned names and trace buffers those workers use, so the process ends
+here instead.
+*/
+static void stop_parsing(void)
+{
+    if (atomic_load(&parsing))
+        _exit(1);
+}
+
+// Parses every file of G on up to jobs threads, the calling one included
+void program_parse(program *G, unsigned jobs)
+{
+    static bool registered;
+    if (!registered)
+    {
+        intern_start();
+        atexit(stop_parsing);
+        registered = true;
+    }
+    if (jobs > PROGRAM_MAX_JOBS)
+        jobs = PROGRAM_MAX_JOBS;
+    if (jobs > G->nfiles)
+        jobs = G->nfiles;
+    pthread_t threads[PROGRAM_MAX_JOBS];
+    unsigned nthreads = 0;
+    atomic_store(&next_file, 0);
+    atomic_store(&parsing, true);
+    while (nthreads + 1 < jobs && pthread_create(&threads[nthreads], NULL, parse_files, G) == 0)
+        nthreads++;
+    parse_files(G);
+    for (unsigned t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    atomic_store(&parsing, false);
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const program_symbol *x = *(program_symbol *const *)a, *y = *(program_symbol *const *)b;
+    return strcmp(intern_text(x->name), intern_text(y->name));
+}
+
+static int compare_decls(const void *a, const void *b)
+{
+    const program_decl *x = a, *y = b;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+// A variable and a function, or functions taking a different number of parameters
+static bool conflicts(const program_decl *a, const program_decl *b)
+{
+    if ((a->kind == PROGRAM_VARIABLE) != (b->kind == PROGRAM_VARIABLE))
+        return true;
+    return a->kind != PROGRAM_VARIABLE && a->arity != b->arity;
+}
+
+static const char *describe(const program_decl *d, char *text, size_t size)
+{
+    if (d->kind == PROGRAM_VARIABLE)
+        return "global variable";
+    snprintf(text, size, "function with %d parameter%s", d->arity, d->arity == 1 ? "" : "s");
+    return text;
+}
+
+/*
+Reports to out, in order of name and then of file and line, each
+declaration that conflicts with the first one of its name, each definition
+after the first, and the first call of each function that is never defined.
+Returns the number of problems reported.
+*/
+size_t program_check(program *G, FILE *out)
+{
+    size_t total = 0;
+    for (unsigned s = 0; s < PROGRAM_SHARDS; s++)
+        total += G->shards[s].count;
+    program_symbol **symbols = mem_alloc(MEM_OTHER, (total ? total : 1) * sizeof(program_symbol *));
+    size_t n = 0;
+    for (unsigned s = 0; s < PROGRAM_SHARDS; s++)
+    {
+        for (size_t i = 0; i < G->shards[s].nslots; i++)
+        {
+            if (G->shards[s].symbols[i].name)
+                symbols[n++] = &G->shards[s].symbols[i];
+        }
+    }
+    qsort(symbols, n, sizeof(program_symbol *), compare_symbols);
+
+    size_t problems = 0;
+    char first_text[48], text[48];
+    for (size_t k = 0; k < n; k++)
+    {
+        program_symbol *sym = symbols[k];
+        const char *name = intern_text(sym->name);
+        qsort(sym->decls, sym->count, sizeof(program_decl), compare_decls);
+        const program_decl *definition = NULL;
+        bool defined = false;
+        for (uint32_t i = 0; i < sym->count; i++)
+        {
+            const program_decl *d = &sym->decls[i];
+            if (d->kind == PROGRAM_FUNCTION)
+                defined = true;
+            if (i > 0 && conflicts(&sym->decls[0], d))
+            {
+                fprintf(out, "Program error in file %s line %u: %s declared as %s, but as %s in file %s line %u\n",
+                        G->files[d->file], d->line, name, describe(d, text, sizeof(text)),
+                        describe(&sym->decls[0], first_text, sizeof(first_text)), G->files[sym->decls[0].file], sym->decls[0].line);
+                problems++;
+                continue;
+            }
+            if (d->kind == PROGRAM_PROTOTYPE)
+                continue;
+            if (definition)
+            {
+                fprintf(out, "Program error in file %s line %u: Duplicate definition of %s %s, first defined in file %s line %u\n",
+                        G->files[d->file], d->line, d->kind == PROGRAM_VARIABLE ? "global variable" : "function", name,
+                        G->files[definition->file], definition->line);
+                problems++;
+            }
+            else
+                definition = d;
+        }
+        if (sym->calls && !defined)
+        {
+            fprintf(out, "Program error in file %s line %u: Call to undefined function %s\n",
+                    G->files[sym->call_file], sym->call_line, name);
+            problems++;
+        }
+    }
+    mem_free(symbols);
+    return problems;
+}
+
+void program_free(program *G)
+{
+    for (unsigned s = 0; s < PROGRAM_SHARDS; s++)
+    {
+        for (size_t i = 0; i < G->shards[s].nslots; i++)
+            mem_free(G->shards[s].symbols[i].decls);
+        mem_free(G->shards[s].symbols);
+        pthread_mutex_destroy(&G->shards[s].lock);
+    }
+    memset(G, 0, sizeof(*G));
+}
@@ -0,0 +1,70 @@
+#include <stdio.h> // For FILE type
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+// What a declaration recorded for the whole program is
+enum {
+    PROGRAM_PROTOTYPE, // Function declared without a body
+    PROGRAM_FUNCTION,  // Function defined with a body
+    PROGRAM_VARIABLE   // Global variable
+};
+
+// Shards of the global symbol table, each locked on its own
+#define PROGRAM_SHARDS 64
+
+// One global declaration: where it is, and what it declares
+typedef struct {
+    uint32_t file; // Index of the file in the program
+    unsigned line;
+    int kind; // One of PROGRAM_*
+    int arity; // Parameters of a function, -1 for a variable
+} program_decl;
+
+// Everything the program declares or calls by one name
+typedef struct {
+    uint32_t name; // Interned id, 0 for an empty slot
+    program_decl *decls;
+    uint32_t count;
+    uint32_t capacity;
+    unsigned long calls;
+    uint32_t call_file; // Earliest call, by file then line, when calls is not 0
+    unsigned call_line;
+} program_symbol;
+
+typedef struct {
+    pthread_mutex_t lock;
+    program_symbol *symbols; // Open addressing by name id
+    size_t nslots;
+    size_t count;
+} program_shard;
+
+/*
+Global symbol table of a set of files parsed together with -2 --program.
+The parsers of all files, running in parallel, record every global
+declaration and every function call into it. Once they are done,
+program_check reports what would not link up: a function or variable
+defined more than once, a name declared as different things, and calls
+to functions defined nowhere.
+*/
+typedef struct {
+    char **files;
+    uint32_t nfiles;
+    program_shard shards[PROGRAM_SHARDS];
+} program;
+
+void program_init(program *G, char **files, uint32_t nfiles);
+
+void program_declare(program *G, uint32_t name, uint32_t file, unsigned line, int kind, int arity);
+
+void program_call(program *G, uint32_t name, uint32_t file, unsigned line);
+
+void program_parse(program *G, unsigned jobs);
+
+size_t program_check(program *G, FILE *out);
+
+void program_free(program *G);
+
+#endif
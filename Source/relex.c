@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "relex.h"
+#include "stats.h"
+#include "mem.h"
+#include "ioload.h"
+#include "intern.h"
+
+// Reads the whole file into memory, exits if it cannot be opened
+static char *read_file(char *filename, long *size)
+{
+    char *loaded = ioload_take(filename, size);
+    if (loaded)
+        return loaded;
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Error: Cannot open input file %s\n", filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = mem_alloc(MEM_TOKENS, *size + 1);
+    if (!text || fread(text, 1, *size, f) != (size_t)*size)
+    {
+        fprintf(stderr, "Error: Cannot read input file %s\n", filename);
+        exit(1);
+    }
+    text[*size] = '\0';
+    fclose(f);
+    return text;
+}
+
+static void push_token(token_stream *S, token t)
+{
+    if (S->count == S->capacity)
+    {
+        S->capacity = S->capacity ? S->capacity * 2 : 256;
+        S->tokens = mem_realloc(MEM_TOKENS, S->tokens, S->capacity * sizeof(token));
+    }
+    S->tokens[S->count++] = t;
+}
+
+static void push_checkpoint(token_stream *S, lex_checkpoint cp)
+{
+    if (S->ncheckpoints == S->checkpoint_capacity)
+    {
+        S->checkpoint_capacity = S->checkpoint_capacity ? S->checkpoint_capacity * 2 : 16;
+        S->checkpoints = mem_realloc(MEM_TOKENS, S->checkpoints, S->checkpoint_capacity * sizeof(lex_checkpoint));
+    }
+    S->checkpoints[S->ncheckpoints++] = cp;
+}
+
+/*
+Lex S->filename from the checkpoint start, appending tokens and checkpoints
+to R. If old tokens are given, stop at the first new token past new_end that
+starts where an old token started (shifted by delta) and has the same text:
+from there on both streams are identical. Returns the index of that old token,
+or old_count if the streams never re-synchronize.
+*/
+static size_t lex_until_resync(token_stream *S, token_stream *R, lex_checkpoint start,
+                               token *old, size_t old_count, long new_end, long delta, long *line_delta)
+{
+    lexer L;
+    init_lexer_text(&L, S->filename, S->text, S->size, start.offset, start.lineno, start.mode);
+    size_t j = 0;
+    while (true)
+    {
+        getNextToken(&L);
+        if (L.current.ID == END)
+        {
+            R->end_line = L.lineno;
+            break;
+        }
+        token t = L.current;
+        t.lineno = L.lineno;
+        if (old && t.offset >= new_end)
+        {
+            while (j < old_count && old[j].offset < t.offset - delta)
+                j++;
+            if (j < old_count && old[j].offset == t.offset - delta && old[j].ID == t.ID &&
+                old[j].name == t.name && (t.name || strcmp(old[j].attrb, t.attrb) == 0))
+            {
+                *line_delta = (long)t.lineno - (long)old[j].lineno;
+                release_token(&t);
+                lexer_close(&L);
+                return j;
+            }
+        }
+        push_token(R, t);
+        if ((start.token + R->count) % LEX_CHECKPOINT_INTERVAL == 0)
+        {
+            lex_checkpoint cp = {L.pos, L.lineno, L.mode, start.token + R->count};
+            push_checkpoint(R, cp);
+        }
+    }
+    lexer_close(&L);
+    return old_count;
+}
+
+// Lex the whole file, recording a checkpoint every LEX_CHECKPOINT_INTERVAL tokens
+void stream_lex(token_stream *S, char *filename)
+{
+    memset(S, 0, sizeof(*S));
+    S->filename = filename;
+    S->text = read_file(filename, &S->size);
+    lex_checkpoint top = {0, 1, LEX_MODE_CODE, 0};
+    lex_until_resync(S, S, top, NULL, 0, 0, 0, NULL);
+}
+
+/*
+Work out how the stream has to change to match the current contents of
+S->filename, without touching S. Lexing resumes from the nearest checkpoint
+before the first changed byte and stops as soon as the token stream
+re-synchronizes with the old one, so the cost is proportional to the size
+of the edit. E->text is left NULL when the file did not change.
+*/
+void stream_diff(token_stream *S, stream_edit *E)
+{
+    memset(E, 0, sizeof(*E));
+    long new_size;
+    char *new_text = read_file(S->filename, &new_size);
+
+    // Bytes before prefix and after the last suffix bytes are unchanged
+    long prefix = 0;
+    while (prefix < S->size && prefix < new_size && S->text[prefix] == new_text[prefix])
+        prefix++;
+    if (S->text && prefix == S->size && prefix == new_size)
+    {
+        // Unchanged, e.g. only a file it includes was saved
+        mem_free(new_text);
+        return;
+    }
+    long suffix = 0;
+    while (suffix < S->size - prefix && suffix < new_size - prefix &&
+           S->text[S->size - 1 - suffix] == new_text[new_size - 1 - suffix])
+        suffix++;
+    E->text = new_text;
+    E->size = new_size;
+    E->delta = new_size - S->size;
+    long new_end = new_size - suffix;
+
+    // Last checkpoint strictly before the edit, since the lexer looks one character past a token
+    size_t lo = 0, hi = S->ncheckpoints;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (S->checkpoints[mid].offset < prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    E->kept_checkpoints = lo;
+    lex_checkpoint start = {0, 1, LEX_MODE_CODE, 0};
+    if (lo > 0)
+        start = S->checkpoints[lo - 1];
+
+    token_stream view = {.filename = S->filename, .text = new_text, .size = new_size};
+    token *old = S->tokens ? S->tokens + start.token : NULL;
+    E->resync = lex_until_resync(&view, &E->R, start, old, S->count - start.token, new_end, E->delta, &E->line_delta);
+}
+
+// Apply an edit made by stream_diff to S, returns the number of tokens that were re-lexed
+size_t stream_splice(token_stream *S, stream_edit *E)
+{
+    if (!E->text)
+        return 0;
+    mem_free(S->text);
+    S->text = E->text;
+    S->size = E->size;
+    size_t kept_checkpoints = E->kept_checkpoints;
+    lex_checkpoint start = {0, 1, LEX_MODE_CODE, 0};
+    if (kept_checkpoints > 0)
+        start = S->checkpoints[kept_checkpoints - 1];
+    token_stream R = E->R;
+    size_t resync = E->resync;
+    long delta = E->delta, line_delta = E->line_delta;
+    token *old = S->tokens + start.token;
+    size_t old_count = S->count - start.token;
+
+    // Kept prefix, re-lexed tokens, then the old tail shifted by the edit
+    for (size_t i = 0; i < resync; i++)
+        release_token(&old[i]);
+    size_t tail = old_count - resync;
+    size_t count = start.token + R.count + tail;
+    if (count > S->capacity)
+    {
+        S->capacity = count;
+        S->tokens = mem_realloc(MEM_TOKENS, S->tokens, S->capacity * sizeof(token));
+        old = S->tokens + start.token;
+    }
+    if (tail > 0)
+        memmove(S->tokens + start.token + R.count, old + resync, tail * sizeof(token));
+    if (R.count > 0)
+        memcpy(S->tokens + start.token, R.tokens, R.count * sizeof(token));
+    for (size_t i = start.token + R.count; i < count; i++)
+    {
+        S->tokens[i].offset += delta;
+        S->tokens[i].lineno += line_delta;
+    }
+    S->count = count;
+    S->end_line = resync < old_count ? S->end_line + line_delta : R.end_line;
+
+    // Same for checkpoints: old ones past the resync point move with their tokens
+    size_t first_moved = S->ncheckpoints;
+    for (size_t i = kept_checkpoints; i < S->ncheckpoints; i++)
+    {
+        if (S->checkpoints[i].token > start.token + resync)
+        {
+            first_moved = i;
+            break;
+        }
+    }
+    size_t moved = S->ncheckpoints - first_moved;
+    lex_checkpoint *checkpoints = mem_alloc(MEM_TOKENS, (kept_checkpoints + R.ncheckpoints + moved + 1) * sizeof(lex_checkpoint));
+    memcpy(checkpoints, S->checkpoints, kept_checkpoints * sizeof(lex_checkpoint));
+    if (R.ncheckpoints > 0)
+        memcpy(checkpoints + kept_checkpoints, R.checkpoints, R.ncheckpoints * sizeof(lex_checkpoint));
+    for (size_t i = 0; i < moved; i++)
+    {
+        lex_checkpoint cp = S->checkpoints[first_moved + i];
+        cp.token = cp.token - (start.token + resync) + start.token + R.count;
+        cp.offset += delta;
+        cp.lineno += line_delta;
+        checkpoints[kept_checkpoints + R.ncheckpoints + i] = cp;
+    }
+    mem_free(S->checkpoints);
+    S->checkpoints = checkpoints;
+    S->ncheckpoints = kept_checkpoints + R.ncheckpoints + moved;
+    S->checkpoint_capacity = S->ncheckpoints + 1;
+
+    mem_free(R.tokens);
+    mem_free(R.checkpoints);
+    memset(E, 0, sizeof(*E));
+    return R.count;
+}
+
+/*
+Bring the stream up to date with the current contents of S->filename.
+Returns the number of tokens that were actually re-lexed.
+*/
+size_t stream_relex(token_stream *S)
+{
+    stream_edit E;
+    stream_diff(S, &E);
+    return stream_splice(S, &E);
+}
+
+/*
+Edits are sent between processes as the new text, the fields of the edit,
+then the re-lexed tokens each followed by its text, and their checkpoints.
+Interned ids are only valid in the process that made them, so names are
+interned again on the way in.
+*/
+void stream_edit_write(FILE *f, stream_edit *E)
+{
+    long size = E->text ? E->size : -1;
+    fwrite(&size, sizeof(size), 1, f);
+    if (!E->text)
+        return;
+    fwrite(E->text, 1, E->size, f);
+    fwrite(E, sizeof(*E), 1, f);
+    for (size_t i = 0; i < E->R.count; i++)
+    {
+        size_t len = strlen(E->R.tokens[i].attrb);
+        fwrite(&E->R.tokens[i], sizeof(token), 1, f);
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(E->R.tokens[i].attrb, 1, len, f);
+    }
+    fwrite(E->R.checkpoints, sizeof(lex_checkpoint), E->R.ncheckpoints, f);
+}
+
+// Reads an edit written by stream_edit_write, returns false if it was cut short
+bool stream_edit_read(FILE *f, stream_edit *E)
+{
+    memset(E, 0, sizeof(*E));
+    long size;
+    if (fread(&size, sizeof(size), 1, f) != 1)
+        return false;
+    if (size < 0)
+        return true;
+    char *text = mem_alloc(MEM_TOKENS, size + 1);
+    if (fread(text, 1, size, f) != (size_t)size || fread(E, sizeof(*E), 1, f) != 1)
+    {
+        mem_free(text);
+        memset(E, 0, sizeof(*E));
+        return false;
+    }
+    text[size] = '\0';
+    E->text = text;
+    E->R.tokens = mem_alloc(MEM_TOKENS, (E->R.count + 1) * sizeof(token));
+    E->R.checkpoints = mem_alloc(MEM_TOKENS, (E->R.ncheckpoints + 1) * sizeof(lex_checkpoint));
+    bool ok = true;
+    size_t n = 0;
+    for (; ok && n < E->R.count; n++)
+    {
+        token *t = &E->R.tokens[n];
+        size_t len;
+        ok = fread(t, sizeof(token), 1, f) == 1 && fread(&len, sizeof(len), 1, f) == 1;
+        char *attrb = ok ? mem_alloc(MEM_LEXER_TEXT, len + 1) : NULL;
+        ok = ok && fread(attrb, 1, len, f) == len;
+        if (!ok)
+        {
+            mem_free(attrb);
+            break;
+        }
+        attrb[len] = '\0';
+        if (t->name)
+        {
+            t->name = intern(attrb, len);
+            t->attrb = (char *)intern_text(t->name);
+            mem_free(attrb);
+        }
+        else
+            t->attrb = attrb;
+    }
+    ok = ok && fread(E->R.checkpoints, sizeof(lex_checkpoint), E->R.ncheckpoints, f) == E->R.ncheckpoints;
+    if (!ok)
+    {
+        for (size_t i = 0; i < n; i++)
+            release_token(&E->R.tokens[i]);
+        mem_free(E->R.tokens);
+        mem_free(E->R.checkpoints);
+        mem_free(E->text);
+        memset(E, 0, sizeof(*E));
+    }
+    return ok;
+}
+
+// Write the stream in the -1 text format to output, the file outfilename, with the tokens of
+// included files after it as -1 writes them
+void stream_write(token_stream *S, FILE *output, const char *outfilename)
+{
+    FILE *includes = deferred_output_open();
+    for (size_t i = 0; i < S->count; i++)
+    {
+        token *t = &S->tokens[i];
+        if (t->ID != TOKEN_INCLUDE)
+        {
+            stats_enter(PHASE_OUTPUT);
+            fprintf(output, "File %s Line %d Token %d Text %s\n", S->filename, t->lineno, t->ID, t->attrb);
+            stats_leave();
+        }
+        else
+            lex_include(S->filename, t->lineno, t->attrb, includes);
+    }
+    fflush(output);
+    deferred_output_close(includes, outfilename);
+}
+
+void stream_free(token_stream *S)
+{
+    for (size_t i = 0; i < S->count; i++)
+        release_token(&S->tokens[i]);
+    mem_free(S->tokens);
+    mem_free(S->checkpoints);
+    mem_free(S->text);
+    memset(S, 0, sizeof(*S));
+}
@@ -0,0 +1,61 @@
+#include <stdio.h> // For FILE type
+#include <stddef.h>
+#include <stdbool.h>
+#ifndef RELEX_H
+#define RELEX_H
+
+#include "lexer.h"
+
+// Number of tokens between two lexer checkpoints
+#define LEX_CHECKPOINT_INTERVAL 64
+
+// Lexer state right after a token, from which lexing can be restarted
+typedef struct {
+    long offset;   // Byte offset of the next character after the token
+    unsigned lineno;
+    int mode;      // One of LEX_MODE_*
+    size_t token;  // Number of tokens lexed before the checkpoint
+} lex_checkpoint;
+
+// Every token of one file, kept in memory so it can be re-lexed after an edit
+typedef struct {
+    char *filename;
+    char *text; // Contents the tokens were lexed from
+    long size;
+    unsigned end_line; // Line of the END token
+    token *tokens;
+    size_t count;
+    size_t capacity;
+    lex_checkpoint *checkpoints;
+    size_t ncheckpoints;
+    size_t checkpoint_capacity;
+} token_stream;
+
+// How a stream changes after an edit of its file, see stream_diff
+typedef struct {
+    char *text;              // New contents, NULL if the file did not change
+    long size;
+    long delta;              // Change in size, which shifts the offsets of the old tail
+    long line_delta;         // Same for its line numbers
+    size_t kept_checkpoints; // Checkpoints before the edit, lexing restarted from the last one
+    size_t resync;           // Old tokens from there on that the re-lexed ones replace
+    token_stream R;          // The re-lexed tokens and checkpoints
+} stream_edit;
+
+void stream_lex(token_stream *S, char *filename);
+
+void stream_diff(token_stream *S, stream_edit *E);
+
+size_t stream_splice(token_stream *S, stream_edit *E);
+
+size_t stream_relex(token_stream *S);
+
+void stream_edit_write(FILE *f, stream_edit *E);
+
+bool stream_edit_read(FILE *f, stream_edit *E);
+
+void stream_write(token_stream *S, FILE *output, const char *outfilename);
+
+void stream_free(token_stream *S);
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+#include "lexer.h"
+#include "intern.h"
+
+compile_stats stats;
+
+static const char *phase_names[PHASE_COUNT] = {"open", "lex", "include", "parse", "output"};
+
+static const struct {
+    unsigned id;
+    const char *name;
+} token_names[] = {
+    {END, "END"}, {TOKEN_TYPE, "TOKEN_TYPE"}, {TOKEN_CHAR, "TOKEN_CHAR"}, {TOKEN_INT, "TOKEN_INT"},
+    {TOKEN_REAL, "TOKEN_REAL"}, {TOKEN_STRING, "TOKEN_STRING"}, {TOKEN_IDENTIFIER, "TOKEN_IDENTIFIER"},
+    {TOKEN_HEX, "TOKEN_HEX"}, {TOKEN_EXCLAMATION, "TOKEN_EXCLAMATION"}, {TOKEN_PERCENT, "TOKEN_PERCENT"},
+    {TOKEN_AMPERSAND, "TOKEN_AMPERSAND"}, {TOKEN_LPAREN, "TOKEN_LPAREN"}, {TOKEN_RPAREN, "TOKEN_RPAREN"},
+    {TOKEN_ASTERISK, "TOKEN_ASTERISK"}, {TOKEN_PLUS, "TOKEN_PLUS"}, {TOKEN_COMMA, "TOKEN_COMMA"},
+    {TOKEN_MINUS, "TOKEN_MINUS"}, {TOKEN_DOT, "TOKEN_DOT"}, {TOKEN_SLASH, "TOKEN_SLASH"},
+    {TOKEN_COLON, "TOKEN_COLON"}, {TOKEN_SEMICOLON, "TOKEN_SEMICOLON"}, {TOKEN_LESS, "TOKEN_LESS"},
+    {TOKEN_EQUAL, "TOKEN_EQUAL"}, {TOKEN_GREATER, "TOKEN_GREATER"}, {TOKEN_QUESTION, "TOKEN_QUESTION"},
+    {TOKEN_LBRACKET, "TOKEN_LBRACKET"}, {TOKEN_RBRACKET, "TOKEN_RBRACKET"}, {TOKEN_LBRACE, "TOKEN_LBRACE"},
+    {TOKEN_PIPE, "TOKEN_PIPE"}, {TOKEN_RBRACE, "TOKEN_RBRACE"}, {TOKEN_TILDE, "TOKEN_TILDE"},
+    {TOKEN_CONST, "TOKEN_CONST"}, {TOKEN_STRUCT, "TOKEN_STRUCT"}, {TOKEN_FOR, "TOKEN_FOR"},
+    {TOKEN_WHILE, "TOKEN_WHILE"}, {TOKEN_DO, "TOKEN_DO"}, {TOKEN_IF, "TOKEN_IF"}, {TOKEN_ELSE, "TOKEN_ELSE"},
+    {TOKEN_BREAK, "TOKEN_BREAK"}, {TOKEN_CONTINUE, "TOKEN_CONTINUE"}, {TOKEN_RETURN, "TOKEN_RETURN"},
+    {TOKEN_SWITCH, "TOKEN_SWITCH"}, {TOKEN_CASE, "TOKEN_CASE"}, {TOKEN_DEFAULT, "TOKEN_DEFAULT"},
+    {TOKEN_EQ, "TOKEN_EQ"}, {TOKEN_NE, "TOKEN_NE"}, {TOKEN_GE, "TOKEN_GE"}, {TOKEN_LE, "TOKEN_LE"},
+    {TOKEN_INC, "TOKEN_INC"}, {TOKEN_DEC, "TOKEN_DEC"}, {TOKEN_OR, "TOKEN_OR"}, {TOKEN_AND, "TOKEN_AND"},
+    {TOKEN_ADD_ASSIGN, "TOKEN_ADD_ASSIGN"}, {TOKEN_SUB_ASSIGN, "TOKEN_SUB_ASSIGN"},
+    {TOKEN_MUL_ASSIGN, "TOKEN_MUL_ASSIGN"}, {TOKEN_DIV_ASSIGN, "TOKEN_DIV_ASSIGN"},
+    {TOKEN_INCLUDE, "TOKEN_INCLUDE"}};
+
+// Phases currently entered, innermost last. Deeper nesting than this, as in
+// long include chains, keeps charging the innermost phase that fits
+#define PHASE_STACK_SIZE 64
+static int phase_stack[PHASE_STACK_SIZE];
+static int phase_depth;
+static double last_wall, start_wall, start_cpu;
+
+/*
+Reading the CPU clock is a system call, too slow to do on every token. It
+is sampled at most once per CPU_SAMPLE_INTERVAL of wall time instead, and
+the CPU time since the last sample is split across the phases by the wall
+time each of them had in between.
+*/
+#define CPU_SAMPLE_INTERVAL 1e-3
+static double sample_wall, sample_cpu;
+static double pending_wall[PHASE_COUNT];
+
+static double clock_seconds(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void take_cpu_sample(double wall)
+{
+    double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    double elapsed = wall - sample_wall;
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        if (elapsed > 0)
+            stats.cpu[p] += (cpu - sample_cpu) * pending_wall[p] / elapsed;
+        pending_wall[p] = 0;
+    }
+    sample_wall = wall;
+    sample_cpu = cpu;
+}
+
+// Charges the time since the last phase change to the innermost phase
+static void charge(void)
+{
+    double wall = clock_seconds(CLOCK_MONOTONIC);
+    if (phase_depth > 0)
+    {
+        int phase = phase_stack[(phase_depth < PHASE_STACK_SIZE ? phase_depth : PHASE_STACK_SIZE) - 1];
+        stats.wall[phase] += wall - last_wall;
+        pending_wall[phase] += wall - last_wall;
+    }
+    last_wall = wall;
+    if (wall - sample_wall >= CPU_SAMPLE_INTERVAL)
+        take_cpu_sample(wall);
+}
+
+void stats_start(void)
+{
+    stats.enabled = true;
+    start_wall = last_wall = sample_wall = clock_seconds(CLOCK_MONOTONIC);
+    start_cpu = sample_cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void stats_push(int phase)
+{
+    charge();
+    if (phase_depth < PHASE_STACK_SIZE)
+        phase_stack[phase_depth] = phase;
+    phase_depth++;
+}
+
+void stats_pop(void)
+{
+    charge();
+    phase_depth--;
+}
+
+static bool is_keyword(unsigned id)
+{
+    return id == TOKEN_TYPE || (id >= TOKEN_CONST && id <= TOKEN_DEFAULT);
+}
+
+static const char *token_name(unsigned id)
+{
+    for (size_t i = 0; i < sizeof(token_names) / sizeof(token_names[0]); i++)
+    {
+        if (token_names[i].id == id)
+            return token_names[i].name;
+    }
+    return "TOKEN_UNKNOWN";
+}
+
+// Prints everything collected since stats_start, as text or as one JSON object
+void stats_print(FILE *out, bool json)
+{
+    charge();
+    take_cpu_sample(last_wall);
+    double total_wall = clock_seconds(CLOCK_MONOTONIC) - start_wall;
+    double total_cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+    unsigned long long tokens = 0, keywords = 0;
+    for (unsigned id = 0; id < STATS_MAX_TOKEN; id++)
+    {
+        tokens += stats.tokens[id];
+        if (is_keyword(id))
+            keywords += stats.tokens[id];
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long peak_rss = usage.ru_maxrss; // Kilobytes on Linux
+
+    if (json)
+    {
+        fprintf(out, "{\"phases\": {");
+        for (int p = 0; p < PHASE_COUNT; p++)
+            fprintf(out, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", p ? ", " : "", phase_names[p], stats.wall[p], stats.cpu[p]);
+        fprintf(out, "}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f}, ", total_wall, total_cpu);
+        fprintf(out, "\"bytes_read\": %llu, \"tokens\": %llu, \"tokens_by_kind\": {", stats.bytes_read, tokens);
+        bool first = true;
+        for (unsigned id = 0; id < STATS_MAX_TOKEN; id++)
+        {
+            if (!stats.tokens[id])
+                continue;
+            fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", token_name(id), stats.tokens[id]);
+            first = false;
+        }
+        fprintf(out, "}, \"identifiers\": %llu, \"keywords\": %llu, \"distinct_names\": %zu, \"string_bytes\": %llu, ",
+                stats.tokens[TOKEN_IDENTIFIER], keywords, intern_count(), stats.string_bytes);
+        fprintf(out, "\"strdup_calls\": %llu, \"free_calls\": %llu, \"max_parser_depth\": %u, \"peak_rss_kb\": %ld}\n",
+                stats.strdups, stats.frees, stats.max_depth, peak_rss);
+        return;
+    }
+
+    fprintf(out, "%-10s %12s %12s\n", "Phase", "Wall (ms)", "CPU (ms)");
+    for (int p = 0; p < PHASE_COUNT; p++)
+        fprintf(out, "%-10s %12.3f %12.3f\n", phase_names[p], stats.wall[p] * 1e3, stats.cpu[p] * 1e3);
+    fprintf(out, "%-10s %12.3f %12.3f\n", "total", total_wall * 1e3, total_cpu * 1e3);
+    fprintf(out, "Bytes read: %llu\n", stats.bytes_read);
+    fprintf(out, "Tokens: %llu (%llu identifiers, %llu keywords)\n", tokens, stats.tokens[TOKEN_IDENTIFIER], keywords);
+    for (unsigned id = 0; id < STATS_MAX_TOKEN; id++)
+    {
+        if (stats.tokens[id])
+            fprintf(out, "  %-20s %llu\n", token_name(id), stats.tokens[id]);
+    }
+    fprintf(out, "Distinct names: %zu\n", intern_count());
+    fprintf(out, "String bytes: %llu\n", stats.string_bytes);
+    fprintf(out, "strdup calls: %llu, free calls: %llu\n", stats.strdups, stats.frees);
+    fprintf(out, "Max parser depth: %u\n", stats.max_depth);
+    fprintf(out, "Peak RSS: %ld KB\n", peak_rss);
+}
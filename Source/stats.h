@@ -0,0 +1,82 @@
+#include <stdio.h> // For FILE type
+#include <stdbool.h>
+#include <string.h>
+#ifndef STATS_H
+#define STATS_H
+
+#include "mem.h"
+
+// Phases time is charged to. A phase entered inside another one pauses it,
+// so each time is exclusive of the phases nested in it
+enum {
+    PHASE_OPEN,
+    PHASE_LEX,
+    PHASE_INCLUDE,
+    PHASE_PARSE,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
+
+// Token IDs are all below this
+#define STATS_MAX_TOKEN 512
+
+typedef struct {
+    bool enabled; // Set by stats_start, nothing is timed or counted per token before
+    double wall[PHASE_COUNT];
+    double cpu[PHASE_COUNT];
+    unsigned long long bytes_read;
+    unsigned long long tokens[STATS_MAX_TOKEN]; // Number of tokens of each ID
+    unsigned long long string_bytes;
+    unsigned long long strdups;
+    unsigned long long frees;
+    unsigned max_depth; // Deepest nesting of parser statements and expressions
+} compile_stats;
+
+extern compile_stats stats;
+
+void stats_start(void);
+
+void stats_push(int phase);
+
+void stats_pop(void);
+
+void stats_print(FILE *out, bool json);
+
+static inline void stats_enter(int phase)
+{
+    if (stats.enabled)
+        stats_push(phase);
+}
+
+static inline void stats_leave(void)
+{
+    if (stats.enabled)
+        stats_pop();
+}
+
+// Counted versions of the calls that copy and release token text
+static inline char *stats_strdup(int subsystem, const char *s)
+{
+    if (stats.enabled)
+        stats.strdups++;
+    return mem_strdup(subsystem, s);
+}
+
+static inline char *stats_strndup(int subsystem, const char *s, size_t n)
+{
+    if (stats.enabled)
+        stats.strdups++;
+    char *copy = mem_alloc(subsystem, n + 1);
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+static inline void stats_free(void *p)
+{
+    if (stats.enabled)
+        stats.frees++;
+    mem_free(p);
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "strtab.h"
+#include "mem.h"
+
+static uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void grow_slots(strtab *S)
+{
+    size_t nslots = S->nslots ? S->nslots * 2 : 1024;
+    uint32_t *slots = mem_calloc(MEM_TOKENS, nslots, sizeof(uint32_t));
+    for (size_t i = 0; i < S->nslots; i++)
+    {
+        if (!S->slots[i])
+            continue;
+        size_t j = hash_string(S->data + S->slots[i] - 1) & (nslots - 1);
+        while (slots[j])
+            j = (j + 1) & (nslots - 1);
+        slots[j] = S->slots[i];
+    }
+    mem_free(S->slots);
+    S->slots = slots;
+    S->nslots = nslots;
+}
+
+// Returns the offset of s, adding it the first time it is seen
+uint32_t strtab_add(strtab *S, const char *s)
+{
+    if ((S->count + 1) * 2 > S->nslots)
+        grow_slots(S);
+    size_t j = hash_string(s) & (S->nslots - 1);
+    while (S->slots[j])
+    {
+        if (strcmp(S->data + S->slots[j] - 1, s) == 0)
+            return S->slots[j] - 1;
+        j = (j + 1) & (S->nslots - 1);
+    }
+    size_t len = strlen(s) + 1;
+    while (S->size + len > S->capacity)
+    {
+        S->capacity = S->capacity ? S->capacity * 2 : 4096;
+        S->data = mem_realloc(MEM_TOKENS, S->data, S->capacity);
+    }
+    uint32_t offset = S->size;
+    memcpy(S->data + offset, s, len);
+    S->size += len;
+    S->slots[j] = offset + 1;
+    S->count++;
+    return offset;
+}
+
+// Returns true if s was added before, without adding it
+bool strtab_contains(const strtab *S, const char *s)
+{
+    if (!S->nslots)
+        return false;
+    size_t j = hash_string(s) & (S->nslots - 1);
+    while (S->slots[j])
+    {
+        if (strcmp(S->data + S->slots[j] - 1, s) == 0)
+            return true;
+        j = (j + 1) & (S->nslots - 1);
+    }
+    return false;
+}
+
+void strtab_free(strtab *S)
+{
+    mem_free(S->data);
+    mem_free(S->slots);
+    memset(S, 0, sizeof(*S));
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#ifndef STRTAB_H
+#define STRTAB_H
+
+// Deduplicated table of NUL-terminated strings for the on-disk formats
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint32_t *slots; // Open addressing table of string offsets + 1, 0 is empty
+    size_t nslots;
+    size_t count;
+} strtab;
+
+uint32_t strtab_add(strtab *S, const char *s);
+
+bool strtab_contains(const strtab *S, const char *s);
+
+void strtab_free(strtab *S);
+
+// Little-endian field access, used for every on-disk integer
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#endif
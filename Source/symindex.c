@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symindex.h"
+#include "strtab.h"
+#include "mem.h"
+
+void symbols_add(symbol_list *S, const char *name, const char *kind, const char *file, unsigned line)
+{
+    if (S->count == S->capacity)
+    {
+        S->capacity = S->capacity ? S->capacity * 2 : 256;
+        S->symbols = mem_realloc(MEM_OTHER, S->symbols, S->capacity * sizeof(symbol));
+    }
+    symbol *s = &S->symbols[S->count++];
+    s->name = mem_strdup(MEM_OTHER, name);
+    s->kind = mem_strdup(MEM_OTHER, kind);
+    s->file = mem_strdup(MEM_OTHER, file);
+    s->line = line;
+}
+
+void symbols_free(symbol_list *S)
+{
+    for (size_t i = 0; i < S->count; i++)
+    {
+        mem_free(S->symbols[i].name);
+        mem_free(S->symbols[i].kind);
+        mem_free(S->symbols[i].file);
+    }
+    mem_free(S->symbols);
+    memset(S, 0, sizeof(*S));
+}
+
+/*
+Checks that the index image at h, of at most size bytes, has every offset
+in bounds, and points X at its records and strings. The image ends with
+its strings, which a segment of an update log is followed by the next one.
+*/
+static bool read_image(symbol_index *X, const unsigned char *h, size_t size)
+{
+    if (size < SYMINDEX_HEADER_SIZE)
+        return false;
+    uint32_t header_size = get_u32(h + 8);
+    uint32_t count = get_u32(h + 12);
+    uint32_t strings_offset = get_u32(h + 16);
+    uint32_t strings_size = get_u32(h + 20);
+    bool valid = memcmp(h, SYMINDEX_MAGIC, 4) == 0 && get_u32(h + 4) == SYMINDEX_VERSION &&
+                 header_size >= SYMINDEX_HEADER_SIZE &&
+                 strings_offset >= header_size + (size_t)count * SYMINDEX_RECORD_SIZE &&
+                 strings_offset + (size_t)strings_size <= size && strings_size > 0 &&
+                 h[strings_offset + strings_size - 1] == '\0' && get_u32(h + 24) < strings_size;
+    for (uint32_t i = 0; i < count && valid; i++)
+    {
+        const unsigned char *r = h + header_size + (size_t)i * SYMINDEX_RECORD_SIZE;
+        valid = get_u32(r) < strings_size && get_u32(r + 4) < strings_size && get_u32(r + 8) < strings_size;
+    }
+    if (!valid)
+        return false;
+    X->count = count;
+    X->records = h + header_size;
+    X->strings = (const char *)(h + strings_offset);
+    X->strings_size = strings_size;
+    return true;
+}
+
+// Maps a file of filename, an index or an update log, giving NULL if it is empty or cannot be read
+static void *map_file(const char *filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    return map;
+}
+
+// Maps an index file and checks that every offset in it is in bounds
+int symindex_open(symbol_index *X, const char *filename)
+{
+    memset(X, 0, sizeof(*X));
+    if (access(filename, F_OK) != 0)
+    {
+        fprintf(stderr, "Error: Cannot open symbol index %s\n", filename);
+        return 1;
+    }
+    size_t size = 0;
+    void *map = map_file(filename, &size);
+    if (!map || !read_image(X, map, size))
+    {
+        fprintf(stderr, "Error: %s is not a valid symbol index\n", filename);
+        if (map)
+            munmap(map, size);
+        memset(X, 0, sizeof(*X));
+        return 1;
+    }
+    X->map = map;
+    X->size = size;
+    return 0;
+}
+
+void symindex_close(symbol_index *X)
+{
+    if (X->map)
+        munmap(X->map, X->size);
+    memset(X, 0, sizeof(*X));
+}
+
+// The i-th record, with strings pointing into the mapped file
+symbol symindex_get(const symbol_index *X, size_t i)
+{
+    const unsigned char *r = X->records + i * SYMINDEX_RECORD_SIZE;
+    symbol s;
+    s.name = (char *)X->strings + get_u32(r);
+    s.kind = (char *)X->strings + get_u32(r + 4);
+    s.file = (char *)X->strings + get_u32(r + 8);
+    s.line = get_u32(r + 12);
+    return s;
+}
+
+// Binary search for name, returns the number of records and sets *first to the first one
+size_t symindex_lookup(const symbol_index *X, const char *name, size_t *first)
+{
+    size_t lo = 0, hi = X->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(X->strings + get_u32(X->records + mid * SYMINDEX_RECORD_SIZE), name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t end = lo;
+    while (end < X->count && strcmp(X->strings + get_u32(X->records + end * SYMINDEX_RECORD_SIZE), name) == 0)
+        end++;
+    *first = lo;
+    return end - lo;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const symbol *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    if (c == 0)
+        c = strcmp(x->file, y->file);
+    if (c == 0)
+        c = (x->line > y->line) - (x->line < y->line);
+    if (c == 0)
+        c = strcmp(x->kind, y->kind);
+    return c;
+}
+
+// Sorts by name, then file, line and kind, the order of index records
+void symbols_sort(symbol_list *S)
+{
+    qsort(S->symbols, S->count, sizeof(symbol), compare_symbols);
+}
+
+/*
+Sorts the symbols and lays them out as an index image, of *size bytes.
+replaced_file, which a segment of an update log names, goes in the header
+and the strings; NULL leaves that field 0.
+*/
+static unsigned char *make_image(symbol_list *S, const char *replaced_file, size_t *size)
+{
+    symbols_sort(S);
+    strtab strings;
+    memset(&strings, 0, sizeof(strings));
+    unsigned char *records = mem_alloc(MEM_OTHER, S->count * SYMINDEX_RECORD_SIZE + 1);
+    size_t count = 0;
+    for (size_t i = 0; i < S->count; i++)
+    {
+        if (i > 0 && compare_symbols(&S->symbols[i - 1], &S->symbols[i]) == 0)
+            continue; // Same declaration indexed twice
+        unsigned char *r = records + count++ * SYMINDEX_RECORD_SIZE;
+        put_u32(r, strtab_add(&strings, S->symbols[i].name));
+        put_u32(r + 4, strtab_add(&strings, S->symbols[i].kind));
+        put_u32(r + 8, strtab_add(&strings, S->symbols[i].file));
+        put_u32(r + 12, S->symbols[i].line);
+    }
+    uint32_t replaced = replaced_file ? strtab_add(&strings, replaced_file) : 0;
+    if (strings.size == 0)
+        strtab_add(&strings, "");
+
+    size_t strings_offset = SYMINDEX_HEADER_SIZE + count * SYMINDEX_RECORD_SIZE;
+    *size = strings_offset + strings.size;
+    unsigned char *image = mem_alloc(MEM_OTHER, *size);
+    memset(image, 0, SYMINDEX_HEADER_SIZE);
+    memcpy(image, SYMINDEX_MAGIC, 4);
+    put_u32(image + 4, SYMINDEX_VERSION);
+    put_u32(image + 8, SYMINDEX_HEADER_SIZE);
+    put_u32(image + 12, count);
+    put_u32(image + 16, strings_offset);
+    put_u32(image + 20, strings.size);
+    put_u32(image + 24, replaced);
+    memcpy(image + SYMINDEX_HEADER_SIZE, records, count * SYMINDEX_RECORD_SIZE);
+    memcpy(image + strings_offset, strings.data, strings.size);
+    mem_free(records);
+    strtab_free(&strings);
+    return image;
+}
+
+// Sorts the symbols and writes them to filename through a temporary file
+static int write_index(const char *filename, symbol_list *S)
+{
+    size_t size;
+    unsigned char *image = make_image(S, NULL, &size);
+    char *tmpfilename = mem_alloc(MEM_OTHER, strlen(filename) + 8);
+    sprintf(tmpfilename, "%s.tmp", filename);
+    FILE *output = fopen(tmpfilename, "wb");
+    int status = 0;
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open symbol index %s\n", tmpfilename);
+        status = 1;
+    }
+    else
+    {
+        fwrite(image, 1, size, output);
+        if (fclose(output) != 0 || rename(tmpfilename, filename) != 0)
+        {
+            fprintf(stderr, "Error: Cannot write symbol index %s\n", filename);
+            status = 1;
+        }
+    }
+    mem_free(tmpfilename);
+    mem_free(image);
+    return status;
+}
+
+// Adds every record of X except those of the files in skip_files
+static void add_records(symbol_list *S, const symbol_index *X, const strtab *skip_files)
+{
+    for (size_t i = 0; i < X->count; i++)
+    {
+        symbol s = symindex_get(X, i);
+        if (!skip_files || !strtab_contains(skip_files, s.file))
+            symbols_add(S, s.name, s.kind, s.file, s.line);
+    }
+}
+
+// The update log of the index at filename
+static char *log_filename(const char *filename)
+{
+    char *logfilename = mem_alloc(MEM_OTHER, strlen(filename) + 8);
+    sprintf(logfilename, "%s.log", filename);
+    return logfilename;
+}
+
+// A segment of an update log, with the file it replaces the declarations of
+typedef struct {
+    symbol_index X;
+    const char *file;
+} segment;
+
+/*
+Adds the declarations of the index at filename as its update log leaves
+them. Each segment of the log replaces everything indexed before for its
+file, so the segments are taken from the last one back, each only if no
+later one is for the same file, and then the records of the index whose
+files no segment is for. Either file may be missing, but not both.
+*/
+static int load_index(symbol_list *S, const char *filename)
+{
+    char *logfilename = log_filename(filename);
+    size_t log_size = 0;
+    unsigned char *log = map_file(logfilename, &log_size);
+    bool has_log = access(logfilename, F_OK) == 0;
+    strtab replaced;
+    memset(&replaced, 0, sizeof(replaced));
+    segment *segments = NULL;
+    size_t nsegments = 0, capacity = 0;
+    int status = 0;
+    for (size_t at = 0; log && at < log_size; nsegments++)
+    {
+        if (nsegments == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            segments = mem_realloc(MEM_OTHER, segments, capacity * sizeof(segment));
+        }
+        segment *g = &segments[nsegments];
+        memset(&g->X, 0, sizeof(g->X));
+        if (!read_image(&g->X, log + at, log_size - at))
+        {
+            fprintf(stderr, "Error: %s is not a valid symbol index log\n", logfilename);
+            status = 1;
+            break;
+        }
+        g->file = g->X.strings + get_u32(log + at + 24);
+        at = (size_t)((const unsigned char *)g->X.strings - log) + g->X.strings_size;
+    }
+    for (size_t k = nsegments; status == 0 && k-- > 0;)
+    {
+        if (strtab_contains(&replaced, segments[k].file))
+            continue;
+        add_records(S, &segments[k].X, NULL);
+        strtab_add(&replaced, segments[k].file);
+    }
+    if (status == 0 && (access(filename, F_OK) == 0 || !has_log))
+    {
+        symbol_index X;
+        status = symindex_open(&X, filename);
+        if (status == 0)
+            add_records(S, &X, &replaced);
+        symindex_close(&X);
+    }
+    if (log)
+        munmap(log, log_size);
+    mem_free(segments);
+    mem_free(logfilename);
+    strtab_free(&replaced);
+    return status;
+}
+
+// Serializes read-modify-write cycles of concurrent batch runs on the same index
+static int lock_index(const char *filename)
+{
+    char *lockfilename = mem_alloc(MEM_OTHER, strlen(filename) + 8);
+    sprintf(lockfilename, "%s.lock", filename);
+    int fd = open(lockfilename, O_RDWR | O_CREAT, 0644);
+    mem_free(lockfilename);
+    if (fd >= 0)
+        flock(fd, LOCK_EX);
+    return fd;
+}
+
+static void unlock_index(int fd)
+{
+    if (fd >= 0)
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+/*
+Add the declarations of S to the index at filename, replacing those
+previously indexed for replaced_file, so re-indexing a file does not leave
+stale entries behind. They are appended to the index's update log as one
+segment, which only takes the lock for as long as writing it does, so
+indexing N files costs O(N) however many run at once; symindex_compact
+folds the log into the index.
+*/
+int symindex_update(const char *filename, symbol_list *S, const char *replaced_file)
+{
+    size_t size;
+    unsigned char *image = make_image(S, replaced_file, &size);
+    char *logfilename = log_filename(filename);
+    int lock = lock_index(filename);
+    int fd = open(logfilename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    int status = 0;
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot open symbol index log %s\n", logfilename);
+        status = 1;
+    }
+    else
+    {
+        if (write(fd, image, size) != (ssize_t)size)
+        {
+            fprintf(stderr, "Error: Cannot write symbol index log %s\n", logfilename);
+            status = 1;
+        }
+        close(fd);
+    }
+    unlock_index(lock);
+    mem_free(logfilename);
+    mem_free(image);
+    return status;
+}
+
+// Rewrites the index at filename with its update log folded in, and removes the log, if there is one
+int symindex_compact(const char *filename)
+{
+    char *logfilename = log_filename(filename);
+    int lock = lock_index(filename);
+    int status = 0;
+    if (access(logfilename, F_OK) == 0)
+    {
+        symbol_list all;
+        memset(&all, 0, sizeof(all));
+        status = load_index(&all, filename);
+        if (status == 0)
+            status = write_index(filename, &all);
+        if (status == 0)
+            unlink(logfilename);
+        symbols_free(&all);
+    }
+    unlock_index(lock);
+    mem_free(logfilename);
+    return status;
+}
+
+// Write the union of the input indexes, with their update logs, to filename
+int symindex_merge(const char *filename, char **inputs, int ninputs)
+{
+    int lock = lock_index(filename);
+    symbol_list all;
+    memset(&all, 0, sizeof(all));
+    int status = 0;
+    for (int i = 0; i < ninputs && status == 0; i++)
+        status = load_index(&all, inputs[i]);
+    if (status == 0)
+        status = write_index(filename, &all);
+    if (status == 0)
+    {
+        char *logfilename = log_filename(filename);
+        unlink(logfilename); // Its updates are older than the merged index
+        mem_free(logfilename);
+    }
+    symbols_free(&all);
+    unlock_index(lock);
+    return status;
+}
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stddef.h>
+#ifndef SYMINDEX_H
+#define SYMINDEX_H
+
+/*
+Symbol index (.symidx), all fields little-endian:
+  header   32 bytes, see SYMINDEX_* offsets below
+  records  count SYMINDEX_RECORD_SIZE entries sorted by name, file and line
+  strings  NUL-terminated names, kinds and file names, deduplicated
+Each record is four 32-bit fields: name, kind and file string offsets, then line.
+
+Updates are appended to <index>.log, one segment per indexed file laid out
+like an index of its own, whose header also has at offset 24 the string
+offset of the file it replaces the declarations of. The next lookup folds
+the log into the index.
+*/
+#define SYMINDEX_MAGIC "SYMX"
+#define SYMINDEX_VERSION 1
+#define SYMINDEX_HEADER_SIZE 32
+#define SYMINDEX_RECORD_SIZE 16
+#define SYMINDEX_DEFAULT "mycc.symidx"
+
+// One declaration, as written to the -2 output
+typedef struct {
+    char *name;
+    char *kind; // e.g. "function", "global variable", "parameter"
+    char *file;
+    unsigned line;
+} symbol;
+
+// Declarations collected in memory before they are written to an index
+typedef struct {
+    symbol *symbols;
+    size_t count;
+    size_t capacity;
+} symbol_list;
+
+// An index file mapped into memory
+typedef struct {
+    void *map;
+    size_t size;
+    uint32_t count;
+    const unsigned char *records;
+    const char *strings;
+    uint32_t strings_size;
+} symbol_index;
+
+void symbols_add(symbol_list *S, const char *name, const char *kind, const char *file, unsigned line);
+
+void symbols_sort(symbol_list *S);
+
+void symbols_free(symbol_list *S);
+
+int symindex_open(symbol_index *X, const char *filename);
+
+void symindex_close(symbol_index *X);
+
+symbol symindex_get(const symbol_index *X, size_t i);
+
+size_t symindex_lookup(const symbol_index *X, const char *name, size_t *first);
+
+int symindex_update(const char *filename, symbol_list *S, const char *replaced_file);
+
+int symindex_compact(const char *filename);
+
+int symindex_merge(const char *filename, char **inputs, int ninputs);
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tokbin.h"
+#include "relex.h"
+#include "strtab.h"
+#include "mem.h"
+
+static void add_record(tokbin_writer *W, unsigned kind, unsigned line, const char *text, const char *file)
+{
+    if (W->count == W->capacity)
+    {
+        W->capacity = W->capacity ? W->capacity * 2 : 1024;
+        W->records = mem_realloc(MEM_TOKENS, W->records, W->capacity * sizeof(tokbin_record));
+    }
+    unsigned char *r = W->records + W->count * sizeof(tokbin_record);
+    put_u32(r, kind);
+    put_u32(r + 4, line);
+    put_u32(r + 8, strtab_add(&W->strings, text));
+    put_u32(r + 12, strtab_add(&W->strings, file));
+    W->count++;
+}
+
+static unsigned add_file(tokbin_writer *W, char *filename, unsigned depth, tokbin_visit visit, void *context)
+{
+    token_stream S;
+    stream_lex(&S, filename);
+    if (visit)
+        visit(context, filename, S.text, S.size);
+    for (size_t i = 0; i < S.count; i++)
+    {
+        token *t = &S.tokens[i];
+        if (t->ID != TOKEN_INCLUDE)
+        {
+            add_record(W, t->ID, t->lineno, t->attrb, filename);
+            continue;
+        }
+        if (depth >= MAX_INCLUDE_DEPTH)
+        {
+            fprintf(stderr, "Lexer error in file %s line %d at text %s: #include nested too deeply\n", filename, t->lineno, t->attrb);
+            exit(1);
+        }
+        FILE *incFile = fopen(t->attrb, "r");
+        if (!incFile)
+        {
+            fprintf(stderr, "Lexer error in file %s line %d at text %s: Cannot open include file\n", filename, t->lineno, t->attrb);
+            exit(1);
+        }
+        fclose(incFile);
+        add_file(W, t->attrb, depth + 1, visit, context);
+    }
+    unsigned end_line = S.end_line;
+    stream_free(&S);
+    return end_line;
+}
+
+// Adds every token of filename, expanding #include directives in place. Returns the line of its END token
+unsigned tokbin_add_file(tokbin_writer *W, char *filename, tokbin_visit visit, void *context)
+{
+    return add_file(W, filename, 0, visit, context);
+}
+
+void tokbin_writer_free(tokbin_writer *W)
+{
+    mem_free(W->records);
+    strtab_free(&W->strings);
+    memset(W, 0, sizeof(*W));
+}
+
+// Lexes infilename into a .tokbin file
+int tokbin_write(char *infilename, char *outfilename)
+{
+    tokbin_writer W;
+    memset(&W, 0, sizeof(W));
+    uint32_t source = strtab_add(&W.strings, infilename);
+    unsigned end_line = tokbin_add_file(&W, infilename, NULL, NULL);
+
+    unsigned char header[TOKBIN_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    size_t records_size = W.count * sizeof(tokbin_record);
+    memcpy(header, TOKBIN_MAGIC, 4);
+    put_u32(header + 4, TOKBIN_VERSION);
+    put_u32(header + 8, TOKBIN_HEADER_SIZE);
+    put_u32(header + 12, W.count);
+    put_u32(header + 16, TOKBIN_HEADER_SIZE + records_size);
+    put_u32(header + 20, W.strings.size);
+    put_u32(header + 24, source);
+    put_u32(header + 28, end_line);
+
+    FILE *output = fopen(outfilename, "wb");
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outfilename);
+        return 1;
+    }
+    fwrite(header, 1, sizeof(header), output);
+    fwrite(W.records, 1, records_size, output);
+    fwrite(W.strings.data, 1, W.strings.size, output);
+    fclose(output);
+    tokbin_writer_free(&W);
+    return 0;
+}
+
+// Maps a .tokbin file and checks that every offset in it is in bounds
+int tokbin_open(tokbin *T, const char *filename)
+{
+    memset(T, 0, sizeof(*T));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Cannot open token file %s\n", filename);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < TOKBIN_HEADER_SIZE)
+    {
+        fprintf(stderr, "Error: %s is not a token file\n", filename);
+        close(fd);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Cannot map token file %s\n", filename);
+        return 1;
+    }
+    const unsigned char *h = map;
+    size_t size = st.st_size;
+    uint32_t header_size = get_u32(h + 8);
+    uint32_t count = get_u32(h + 12);
+    uint32_t strings_offset = get_u32(h + 16);
+    uint32_t strings_size = get_u32(h + 20);
+    if (memcmp(h, TOKBIN_MAGIC, 4) != 0 || get_u32(h + 4) != TOKBIN_VERSION ||
+        header_size < TOKBIN_HEADER_SIZE || header_size % 4 != 0 ||
+        strings_offset < header_size + (size_t)count * sizeof(tokbin_record) ||
+        strings_offset + (size_t)strings_size > size || strings_size == 0 ||
+        h[strings_offset + strings_size - 1] != '\0')
+    {
+        fprintf(stderr, "Error: %s is not a valid token file\n", filename);
+        munmap(map, size);
+        return 1;
+    }
+    T->map = map;
+    T->size = size;
+    T->count = count;
+    T->records = (const tokbin_record *)(h + header_size);
+    T->strings = (const char *)(h + strings_offset);
+    T->strings_size = strings_size;
+    T->source = get_u32(h + 24);
+    T->end_line = get_u32(h + 28);
+    bool valid = T->source < strings_size;
+    for (uint32_t i = 0; i < count && valid; i++)
+        valid = tokbin_u32(T->records[i].text) < strings_size && tokbin_u32(T->records[i].file) < strings_size;
+    if (!valid)
+    {
+        fprintf(stderr, "Error: %s is not a valid token file\n", filename);
+        tokbin_close(T);
+        return 1;
+    }
+    return 0;
+}
+
+void tokbin_close(tokbin *T)
+{
+    if (T->map)
+        munmap(T->map, T->size);
+    memset(T, 0, sizeof(*T));
+}
@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <stddef.h>
+#ifndef TOKBIN_H
+#define TOKBIN_H
+
+#include "strtab.h"
+
+/*
+Binary token stream (.tokbin), all fields little-endian:
+  header   32 bytes, see TOKBIN_* offsets below
+  records  token_count fixed-width tokbin_record entries
+  strings  NUL-terminated token texts and file names, deduplicated
+*/
+#define TOKBIN_MAGIC "TOKB"
+#define TOKBIN_VERSION 1
+#define TOKBIN_HEADER_SIZE 32
+
+typedef struct {
+    uint32_t kind; // Token ID
+    uint32_t line;
+    uint32_t text; // String table offset of the token text
+    uint32_t file; // String table offset of the file the token came from
+} tokbin_record;
+
+// A .tokbin file mapped into memory, records and strings are read in place
+typedef struct {
+    void *map;
+    size_t size;
+    uint32_t count;
+    const tokbin_record *records;
+    const char *strings;
+    uint32_t strings_size;
+    uint32_t source;   // String table offset of the lexed file name, host byte order
+    uint32_t end_line; // Line of the END token, host byte order
+} tokbin;
+
+// Records and string table being built for one output file
+typedef struct {
+    unsigned char *records;
+    size_t count;
+    size_t capacity;
+    strtab strings;
+} tokbin_writer;
+
+// Called with the name and contents of each file tokbin_add_file lexes
+typedef void (*tokbin_visit)(void *context, const char *filename, const char *text, long size);
+
+unsigned tokbin_add_file(tokbin_writer *W, char *filename, tokbin_visit visit, void *context);
+
+void tokbin_writer_free(tokbin_writer *W);
+
+int tokbin_write(char *infilename, char *outfilename);
+
+int tokbin_open(tokbin *T, const char *filename);
+
+void tokbin_close(tokbin *T);
+
+// Converts a stored field to host byte order
+static inline uint32_t tokbin_u32(uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(v);
+#else
+    return v;
+#endif
+}
+
+// Text at a host byte order string table offset, e.g. tokbin_u32(record->text)
+static inline const char *tokbin_string(const tokbin *T, uint32_t offset)
+{
+    return T->strings + offset;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "mem.h"
+
+/*
+Every thread records its spans into a buffer of its own, so tracing takes
+no lock per span. The buffers are registered once, under a lock, and are
+all written out together when the process exits.
+*/
+
+typedef struct {
+    const char *category;
+    char *name; // NULL until named, by trace_set_name or at the end of the span
+    char *file;
+    unsigned line;
+    double start; // Microseconds
+    double duration;
+} trace_event;
+
+typedef struct trace_buffer {
+    long tid;
+    trace_event *events;
+    size_t count;
+    size_t capacity;
+    size_t *open; // Indexes of the events that have begun but not ended, innermost last
+    size_t nopen;
+    size_t open_capacity;
+    struct trace_buffer *next;
+} trace_buffer;
+
+bool trace_enabled;
+
+static char *trace_filename;
+static double trace_epoch;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer *buffers;
+static _Thread_local trace_buffer *thread_buffer;
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static trace_buffer *get_buffer(void)
+{
+    if (thread_buffer)
+        return thread_buffer;
+    trace_buffer *B = mem_calloc(MEM_TRACE, 1, sizeof(trace_buffer));
+    B->tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&buffers_lock);
+    B->next = buffers;
+    buffers = B;
+    pthread_mutex_unlock(&buffers_lock);
+    thread_buffer = B;
+    return B;
+}
+
+void trace_push(const char *category, const char *name, const char *file, unsigned line)
+{
+    trace_buffer *B = get_buffer();
+    if (B->count == B->capacity)
+    {
+        B->capacity = B->capacity ? B->capacity * 2 : 1024;
+        B->events = mem_realloc(MEM_TRACE, B->events, B->capacity * sizeof(trace_event));
+    }
+    if (B->nopen == B->open_capacity)
+    {
+        B->open_capacity = B->open_capacity ? B->open_capacity * 2 : 16;
+        B->open = mem_realloc(MEM_TRACE, B->open, B->open_capacity * sizeof(size_t));
+    }
+    trace_event *E = &B->events[B->count];
+    E->category = category;
+    E->name = name ? mem_strdup(MEM_TRACE, name) : NULL;
+    E->file = file ? mem_strdup(MEM_TRACE, file) : NULL;
+    E->line = line;
+    E->duration = 0;
+    B->open[B->nopen++] = B->count++;
+    E->start = now_us() - trace_epoch;
+}
+
+void trace_pop(void)
+{
+    double end = now_us() - trace_epoch;
+    trace_buffer *B = get_buffer();
+    if (B->nopen == 0)
+        return;
+    trace_event *E = &B->events[B->open[--B->nopen]];
+    E->duration = end - E->start;
+}
+
+void trace_set_name(const char *name)
+{
+    trace_buffer *B = get_buffer();
+    if (B->nopen == 0)
+        return;
+    trace_event *E = &B->events[B->open[B->nopen - 1]];
+    if (!E->name)
+        E->name = mem_strdup(MEM_TRACE, name);
+}
+
+static void write_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Releases every buffer, once the trace is written
+static void free_buffers(void)
+{
+    while (buffers)
+    {
+        trace_buffer *B = buffers;
+        buffers = B->next;
+        for (size_t i = 0; i < B->count; i++)
+        {
+            mem_free(B->events[i].name);
+            mem_free(B->events[i].file);
+        }
+        mem_free(B->events);
+        mem_free(B->open);
+        mem_free(B);
+    }
+    thread_buffer = NULL;
+    mem_free(trace_filename);
+    trace_filename = NULL;
+    trace_enabled = false;
+}
+
+// Writes every buffer as one JSON array; spans still open at exit end now
+static void write_trace(void)
+{
+    FILE *out = fopen(trace_filename, "w");
+    if (!out)
+    {
+        fprintf(stderr, "Error: Cannot open trace file %s\n", trace_filename);
+        pthread_mutex_lock(&buffers_lock);
+        free_buffers();
+        pthread_mutex_unlock(&buffers_lock);
+        return;
+    }
+    double end = now_us() - trace_epoch;
+    long pid = getpid();
+    bool first = true;
+    fprintf(out, "{\"traceEvents\": [\n");
+    pthread_mutex_lock(&buffers_lock);
+    for (trace_buffer *B = buffers; B; B = B->next)
+    {
+        while (B->nopen > 0)
+        {
+            trace_event *E = &B->events[B->open[--B->nopen]];
+            E->duration = end - E->start;
+        }
+        for (size_t i = 0; i < B->count; i++)
+        {
+            trace_event *E = &B->events[i];
+            fprintf(out, "%s{\"name\": ", first ? "" : ",\n");
+            write_json_string(out, E->name ? E->name : E->category);
+            fprintf(out, ", \"cat\": ");
+            write_json_string(out, E->category);
+            fprintf(out, ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %ld",
+                    E->start, E->duration, pid, B->tid);
+            if (E->file)
+            {
+                fprintf(out, ", \"args\": {\"file\": ");
+                write_json_string(out, E->file);
+                fprintf(out, ", \"line\": %u}", E->line);
+            }
+            fprintf(out, "}");
+            first = false;
+        }
+    }
+    free_buffers();
+    pthread_mutex_unlock(&buffers_lock);
+    fprintf(out, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(out);
+}
+
+// Starts recording spans, written to filename when the process exits
+void trace_open(const char *filename)
+{
+    trace_filename = mem_strdup(MEM_TRACE, filename);
+    trace_epoch = now_us();
+    trace_enabled = true;
+    atexit(write_trace);
+}
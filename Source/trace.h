@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#ifndef TRACE_H
+#define TRACE_H
+
+// Set by trace_open; every other trace call does nothing until then
+extern bool trace_enabled;
+
+void trace_open(const char *filename);
+
+void trace_push(const char *category, const char *name, const char *file, unsigned line);
+
+void trace_pop(void);
+
+void trace_set_name(const char *name);
+
+/*
+Spans of work for --trace, written as Chrome trace events. A span begun
+inside another one nests under it in the viewer. file and line are shown
+as arguments of the span when file is not NULL.
+*/
+static inline void trace_begin(const char *category, const char *name, const char *file, unsigned line)
+{
+    if (trace_enabled)
+        trace_push(category, name, file, line);
+}
+
+static inline void trace_end(void)
+{
+    if (trace_enabled)
+        trace_pop();
+}
+
+// Names the innermost open span if it was begun without a name
+static inline void trace_name(const char *name)
+{
+    if (trace_enabled)
+        trace_set_name(name);
+}
+
+#endif
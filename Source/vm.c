@@ -0,0 +1,1012 @@
+#define _GNU_SOURCE // For RTLD_DEFAULT
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "intern.h"
+#include "mem.h"
+
+// Dispatch jumps straight from one instruction's code to the next where the compiler can take label addresses
+#ifdef __GNUC__
+#define VM_THREADED
+#endif
+
+#define VM_REGISTERS (1u << 21) // Registers of all the frames of calls in progress
+#define VM_MEMORY (16u << 20)   // Bytes of arrays and structs of those frames
+#define VM_CALLS (1u << 18)     // Calls in progress
+#define VM_NATIVE_ARGS 14       // Arguments of a call of the C library, in registers
+
+/*
+Instructions and their operands. Registers are numbered from the start of
+the frame: parameters first, then the constants, then every other value.
+Targets of jumps are instruction indexes.
+*/
+#define VM_OPS(X)                                                                                                 \
+    X(MOVE)    /* a = b */                                                                                        \
+    X(ADD)     /* a = b op c, in ints */                                                                          \
+    X(SUB)                                                                                                        \
+    X(MUL)                                                                                                        \
+    X(DIV)                                                                                                        \
+    X(MOD)                                                                                                        \
+    X(AND)                                                                                                        \
+    X(OR)                                                                                                         \
+    X(ADDK)    /* a = b + the constant c | d << 32 */                                                             \
+    X(FADD)    /* a = b op c, in floats */                                                                        \
+    X(FSUB)                                                                                                       \
+    X(FMUL)                                                                                                       \
+    X(FDIV)                                                                                                       \
+    X(EQ)      /* a = b cmp c, in ints */                                                                         \
+    X(NE)                                                                                                         \
+    X(LT)                                                                                                         \
+    X(LE)                                                                                                         \
+    X(GT)                                                                                                         \
+    X(GE)                                                                                                         \
+    X(FEQ)     /* a = b cmp c, in floats */                                                                       \
+    X(FNE)                                                                                                        \
+    X(FLT)                                                                                                        \
+    X(FLE)                                                                                                        \
+    X(FGT)                                                                                                        \
+    X(FGE)                                                                                                        \
+    X(NEG)     /* a = op b */                                                                                     \
+    X(FNEG)                                                                                                       \
+    X(NOT)                                                                                                        \
+    X(ITOF)                                                                                                       \
+    X(FTOI)                                                                                                       \
+    X(LOAD)    /* a = *b */                                                                                       \
+    X(STORE)   /* *a = b */                                                                                       \
+    X(LOADX)   /* a = *(b + c * d) */                                                                             \
+    X(STOREX)  /* *(a + b * d) = c */                                                                             \
+    X(FRAME)   /* a = address of b bytes into the frame */                                                        \
+    X(JUMP)    /* To a */                                                                                         \
+    X(JNZ)     /* To a if b is not 0 */                                                                           \
+    X(JZ)      /* To a if b is 0 */                                                                               \
+    X(BEQ)     /* To a if b cmp c, in ints */                                                                     \
+    X(BNE)                                                                                                        \
+    X(BLT)                                                                                                        \
+    X(BLE)                                                                                                        \
+    X(BGT)                                                                                                        \
+    X(BGE)                                                                                                        \
+    X(FBEQ)    /* To a if b cmp c, in floats */                                                                   \
+    X(FBNE)                                                                                                       \
+    X(FBLT)                                                                                                       \
+    X(FBLE)                                                                                                       \
+    X(FBGT)                                                                                                       \
+    X(FBGE)                                                                                                       \
+    X(SWITCH)  /* To the c targets listed from d in the function's targets by b, or to a if b is not below c */   \
+    X(CALL)    /* a = function b with the d registers listed from c in the function's args */                     \
+    X(NATIVE)  /* a = native b, likewise */                                                                       \
+    X(RET)     /* Returns a */                                                                                    \
+    X(RETVOID)
+
+#define VM_ENUM(name) VM_##name,
+enum {
+    VM_OPS(VM_ENUM)
+    VM_OP_COUNT
+};
+
+typedef struct {
+    union {
+        uintptr_t op;
+        const void *handler; // Once threaded
+    };
+    uint32_t a, b, c, d;
+} vm_inst;
+
+typedef struct {
+    uint32_t name;
+    uint8_t type;
+    uint32_t nparams;
+    uint32_t nregs;
+    vm_value *constants; // Copied to the registers after the parameters by each call
+    uint32_t nconstants;
+    uint32_t constants_capacity;
+    vm_inst *code;
+    uint32_t ncode;
+    uint32_t code_capacity;
+    uint32_t *args; // Registers of call arguments
+    uint8_t *arg_types;
+    uint32_t nargs;
+    uint32_t args_capacity;
+    uint32_t *targets; // Of switches
+    uint32_t ntargets;
+    uint32_t targets_capacity;
+    uint32_t frame; // Bytes of arrays and structs
+} vm_function;
+
+typedef struct {
+    ir_module *M;
+    vm_function *functions; // Indexed like M->functions, defined ones only
+    char **globals;
+    vm_native *natives;
+    uint32_t *native_names;
+    uint8_t *native_types; // Of their results
+    uint32_t nnatives;
+    uint32_t natives_capacity;
+} vm_program;
+
+typedef struct {
+    const vm_inst *pc; // The call
+    vm_value *regs;
+    const vm_function *fn;
+    char *frame;
+} vm_call;
+
+void vm_error(const char *format, ...)
+{
+    fflush(stdout);
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Run error: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+static void *reserve(void *items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    return mem_realloc(MEM_IR, items, (size_t)*capacity * size);
+}
+
+// Globals and natives
+
+char **vm_globals(const ir_module *M)
+{
+    char **globals = mem_alloc(MEM_IR, (M->nglobals + 1) * sizeof(char *));
+    for (uint32_t g = 0; g < M->nglobals; g++)
+    {
+        const ir_global *G = &M->globals[g];
+        globals[g] = mem_calloc(MEM_IR, G->size, 1);
+        if (G->type != IR_VOID)
+            memcpy(globals[g], &G->init, IR_SCALAR_SIZE);
+    }
+    return globals;
+}
+
+void vm_globals_free(const ir_module *M, char **globals)
+{
+    for (uint32_t g = 0; g < M->nglobals; g++)
+        mem_free(globals[g]);
+    mem_free(globals);
+}
+
+vm_native vm_find_native(uint32_t name)
+{
+    vm_native fn;
+    // dlsym gives an object pointer, which ISO C does not convert to a function pointer
+    *(void **)&fn = dlsym(RTLD_DEFAULT, intern_text(name));
+    return fn;
+}
+
+/*
+Ints and addresses go in the six integer argument registers and floats in
+the eight vector ones whatever their order, and a variadic call says how
+many vector registers it uses, so one variadic call with every register
+filled suits any C function with up to that many arguments, printf
+included. This only holds for the System V x86-64 convention.
+*/
+vm_value vm_call_native(vm_native fn, uint32_t name, const vm_value *args, const uint8_t *types, uint32_t count, unsigned type)
+{
+    vm_value result = {0};
+    if (!fn)
+        vm_error("Function %s is neither defined nor in the C library", intern_text(name));
+#if defined(__x86_64__) && !defined(_WIN32)
+    int64_t i[6] = {0};
+    double d[8] = {0};
+    unsigned ni = 0, nd = 0;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (types[k] == IR_FLOAT ? nd == 8 : ni == 6)
+            vm_error("Too many arguments in a call of %s", intern_text(name));
+        if (types[k] == IR_FLOAT)
+            d[nd++] = args[k].d;
+        else
+            i[ni++] = args[k].i;
+    }
+    if (type == IR_FLOAT)
+        result.d = ((double (*)(int64_t, ...))fn)(i[0], i[1], i[2], i[3], i[4], i[5], d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+    else
+        result.i = ((int64_t (*)(int64_t, ...))fn)(i[0], i[1], i[2], i[3], i[4], i[5], d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]);
+#else
+    (void)args;
+    (void)types;
+    (void)count;
+    (void)type;
+    vm_error("Calling %s needs the System V x86-64 calling convention", intern_text(name));
+#endif
+    return result;
+}
+
+static uint32_t native_index(vm_program *P, uint32_t name, unsigned type)
+{
+    for (uint32_t k = 0; k < P->nnatives; k++)
+    {
+        if (P->native_names[k] == name)
+            return k;
+    }
+    uint32_t capacity = P->natives_capacity;
+    P->natives = reserve(P->natives, P->nnatives, &capacity, sizeof(vm_native));
+    capacity = P->natives_capacity;
+    P->native_types = reserve(P->native_types, P->nnatives, &capacity, sizeof(uint8_t));
+    P->native_names = reserve(P->native_names, P->nnatives, &P->natives_capacity, sizeof(uint32_t));
+    P->natives[P->nnatives] = vm_find_native(name);
+    P->native_names[P->nnatives] = name;
+    P->native_types[P->nnatives] = type;
+    return P->nnatives++;
+}
+
+// Compiling
+
+typedef struct {
+    vm_program *P;
+    ir_function *F;
+    vm_function *V;
+    uint32_t *reg; // Of each value
+    uint32_t *uses;
+    uint32_t *user; // Of a value with a single use
+    bool *fused; // Computed by its user
+    uint32_t *start; // First instruction of each block
+    uint32_t *fixups; // Instructions whose target is still a block
+    uint32_t nfixups;
+    uint32_t fixups_capacity;
+    uint32_t scratch; // Register for breaking cycles of moves
+} compiler;
+
+static vm_inst *emit(compiler *C, unsigned op, uint32_t a, uint32_t b, uint32_t c)
+{
+    vm_function *V = C->V;
+    V->code = reserve(V->code, V->ncode, &V->code_capacity, sizeof(vm_inst));
+    vm_inst *x = &V->code[V->ncode++];
+    x->op = op;
+    x->a = a;
+    x->b = b;
+    x->c = c;
+    x->d = 0;
+    return x;
+}
+
+// A jump to block, whose start is filled in once every block has one
+static vm_inst *emit_jump(compiler *C, unsigned op, uint32_t block, uint32_t b, uint32_t c)
+{
+    C->fixups = reserve(C->fixups, C->nfixups, &C->fixups_capacity, sizeof(uint32_t));
+    C->fixups[C->nfixups++] = C->V->ncode;
+    return emit(C, op, block, b, c);
+}
+
+static bool is_compare(unsigned op)
+{
+    return op >= IR_EQ && op <= IR_GE;
+}
+
+static bool has_phis(const ir_function *F, uint32_t block)
+{
+    uint32_t first = F->blocks[block].first;
+    return first && F->insts[first].op == IR_PHI;
+}
+
+static uint32_t next_block(const ir_function *F, uint32_t block)
+{
+    for (uint32_t b = block + 1; b < F->nblocks; b++)
+    {
+        if (!F->blocks[b].dead)
+            return b;
+    }
+    return F->nblocks;
+}
+
+static uint32_t add_constant(compiler *C, vm_value value)
+{
+    vm_function *V = C->V;
+    V->constants = reserve(V->constants, V->nconstants, &V->constants_capacity, sizeof(vm_value));
+    V->constants[V->nconstants] = value;
+    return V->nparams + V->nconstants++;
+}
+
+// Whether v is an int constant that fits the scale of a LOADX or a STOREX
+static bool is_scale(const ir_function *F, uint32_t v)
+{
+    const ir_inst *I = &F->insts[v];
+    return I->op == IR_CONST && I->type == IR_INT && I->value.i > 0 && I->value.i <= UINT32_MAX;
+}
+
+// Whether v is computed only for user, in its block, so that user can compute it instead
+static bool fusable(const compiler *C, uint32_t v, uint32_t user, unsigned op)
+{
+    const ir_inst *I = &C->F->insts[v];
+    return I->op == op && C->uses[v] == 1 && C->user[v] == user && I->block == C->F->insts[user].block;
+}
+
+/*
+Decides what runs as part of something else: comparisons that only feed
+the branch of their block, and the additions and multiplications by a
+constant that only compute the address of a load or a store. Registers go
+to the values that are left.
+*/
+static void prepare(compiler *C)
+{
+    ir_function *F = C->F;
+    vm_function *V = C->V;
+    C->reg = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    C->uses = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    C->user = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    C->fused = mem_calloc(MEM_IR, F->ninsts, sizeof(bool));
+    C->start = mem_calloc(MEM_IR, F->nblocks + 1, sizeof(uint32_t));
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            for (uint32_t k = 0; k < ir_operand_count(I); k++)
+            {
+                uint32_t u = *ir_operand(F, I, k);
+                C->uses[u]++;
+                C->user[u] = i;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->op == IR_BRANCH && is_compare(F->insts[I->a].op) && fusable(C, I->a, i, F->insts[I->a].op))
+                C->fused[I->a] = true;
+            if ((I->op == IR_LOAD || I->op == IR_STORE) && fusable(C, I->a, i, IR_ADD))
+            {
+                const ir_inst *A = &F->insts[I->a];
+                C->fused[I->a] = true;
+                if (fusable(C, A->b, I->a, IR_MUL) && is_scale(F, F->insts[A->b].b))
+                    C->fused[A->b] = true;
+                else if (fusable(C, A->a, I->a, IR_MUL) && is_scale(F, F->insts[A->a].b))
+                    C->fused[A->a] = true;
+            }
+        }
+    }
+    uint32_t values = 0;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            vm_value value;
+            memcpy(&value, &I->value, sizeof(value));
+            switch (I->op)
+            {
+            case IR_PARAM:
+                C->reg[i] = (uint32_t)I->value.i;
+                break;
+            case IR_CONST:
+                C->reg[i] = add_constant(C, value);
+                break;
+            case IR_GLOBAL:
+                value.i = (int64_t)(intptr_t)C->P->globals[ir_find_global(C->P->M, I->name) - C->P->M->globals];
+                C->reg[i] = add_constant(C, value);
+                break;
+            case IR_STRING:
+                value.i = (int64_t)(intptr_t)intern_text(I->name);
+                C->reg[i] = add_constant(C, value);
+                break;
+            default:
+                if (I->type != IR_VOID && !C->fused[i])
+                    C->reg[i] = values++;
+                break;
+            }
+        }
+    }
+    // Constants were numbered after the parameters as they came, and the other values go after both
+    uint32_t base = V->nparams + V->nconstants;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            unsigned op = F->insts[i].op;
+            if (op != IR_PARAM && op != IR_CONST && op != IR_GLOBAL && op != IR_STRING && F->insts[i].type != IR_VOID && !C->fused[i])
+                C->reg[i] = base + C->reg[i];
+        }
+    }
+    C->scratch = base + values;
+    V->nregs = C->scratch + 1;
+}
+
+/*
+The phis of the successor by edge k of block all take their value at
+once, so the moves are ordered for none to overwrite a register a later
+one reads, and a cycle of them is broken by moving one value aside to
+the scratch register.
+*/
+static void edge_moves(compiler *C, uint32_t block, uint32_t k)
+{
+    ir_function *F = C->F;
+    uint32_t s = ir_list_at(F, F->blocks[block].succs)[k];
+    uint32_t operand = ir_edge_operand(F, block, k);
+    uint32_t count = 0;
+    for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+        count++;
+    uint32_t *dst = mem_alloc(MEM_IR, (count + 1) * 2 * sizeof(uint32_t));
+    uint32_t *src = dst + count + 1;
+    uint32_t n = 0;
+    for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+    {
+        uint32_t from = C->reg[F->pool[F->insts[i].a + operand]];
+        if (C->uses[i] && from != C->reg[i])
+        {
+            dst[n] = C->reg[i];
+            src[n++] = from;
+        }
+    }
+    while (n)
+    {
+        bool moved = false;
+        for (uint32_t j = 0; j < n; j++)
+        {
+            bool read = false;
+            for (uint32_t k2 = 0; k2 < n && !read; k2++)
+                read = k2 != j && src[k2] == dst[j];
+            if (read)
+                continue;
+            emit(C, VM_MOVE, dst[j], src[j], 0);
+            dst[j] = dst[n - 1];
+            src[j] = src[n - 1];
+            n--;
+            moved = true;
+            break;
+        }
+        if (moved)
+            continue;
+        emit(C, VM_MOVE, C->scratch, dst[0], 0);
+        for (uint32_t j = 0; j < n; j++)
+        {
+            if (src[j] == dst[0])
+                src[j] = C->scratch;
+        }
+    }
+    mem_free(dst);
+}
+
+static unsigned compare_op(unsigned ir_op, unsigned type, bool branch)
+{
+    unsigned op = (branch ? VM_BEQ : VM_EQ) + (ir_op - IR_EQ);
+    return type == IR_FLOAT ? op + (VM_FEQ - VM_EQ) : op;
+}
+
+// The branch taken when the one given is not, for ints. For floats only == and != are each other's inverse
+static bool invert_branch(unsigned *op)
+{
+    static const uint8_t inverses[] = {VM_BNE, VM_BEQ, VM_BGE, VM_BGT, VM_BLE, VM_BLT};
+    if (*op >= VM_BEQ && *op <= VM_BGE)
+        *op = inverses[*op - VM_BEQ];
+    else if (*op == VM_FBEQ || *op == VM_FBNE)
+        *op = *op == VM_FBEQ ? VM_FBNE : VM_FBEQ;
+    else
+        return false;
+    return true;
+}
+
+static void compile_branch(compiler *C, uint32_t i)
+{
+    ir_function *F = C->F;
+    const ir_inst *I = &F->insts[i];
+    const uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+    uint32_t then = succs[0], otherwise = succs[1], next = next_block(F, I->block);
+    unsigned op = VM_JNZ;
+    uint32_t b = C->reg[I->a], c = 0;
+    if (C->fused[I->a])
+    {
+        const ir_inst *cmp = &F->insts[I->a];
+        op = compare_op(cmp->op, F->insts[cmp->a].type, true);
+        b = C->reg[cmp->a];
+        c = C->reg[cmp->b];
+    }
+    if (then == next && !has_phis(F, then) && !has_phis(F, otherwise))
+    {
+        if (op == VM_JNZ)
+        {
+            emit_jump(C, VM_JZ, otherwise, b, c);
+            return;
+        }
+        if (invert_branch(&op))
+        {
+            emit_jump(C, op, otherwise, b, c);
+            return;
+        }
+    }
+    // An edge with moves gets code of its own after the block
+    bool trampoline = has_phis(F, then);
+    uint32_t taken = C->V->ncode;
+    if (trampoline)
+        emit(C, op, 0, b, c);
+    else
+        emit_jump(C, op, then, b, c);
+    edge_moves(C, I->block, 1);
+    if (otherwise != next || trampoline)
+        emit_jump(C, VM_JUMP, otherwise, 0, 0);
+    if (trampoline)
+    {
+        C->V->code[taken].a = C->V->ncode;
+        edge_moves(C, I->block, 0);
+        if (then != next)
+            emit_jump(C, VM_JUMP, then, 0, 0);
+    }
+}
+
+/*
+The value less the lowest case picks the target, so that a value below it
+wraps around to above the table. The successors have no phis, so the
+targets are their blocks, filled in like those of jumps.
+*/
+static void compile_switch(compiler *C, uint32_t i)
+{
+    ir_function *F = C->F;
+    vm_function *V = C->V;
+    const ir_inst *I = &F->insts[i];
+    const uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+    uint32_t value = C->reg[I->a];
+    if (I->value.i)
+    {
+        uint64_t constant = 0 - (uint64_t)I->value.i;
+        emit(C, VM_ADDK, C->scratch, value, (uint32_t)constant)->d = (uint32_t)(constant >> 32);
+        value = C->scratch;
+    }
+    emit_jump(C, VM_SWITCH, succs[0], value, I->b)->d = V->ntargets;
+    for (uint32_t k = 0; k < I->b; k++)
+    {
+        V->targets = reserve(V->targets, V->ntargets, &V->targets_capacity, sizeof(uint32_t));
+        V->targets[V->ntargets++] = succs[F->pool[I->name + k]];
+    }
+}
+
+// Registers of the operands of a call, listed in the function's args
+static uint32_t call_args(compiler *C, const ir_inst *I)
+{
+    vm_function *V = C->V;
+    uint32_t first = V->nargs;
+    for (uint32_t k = 0; k < I->b; k++)
+    {
+        uint32_t capacity = V->args_capacity;
+        V->arg_types = reserve(V->arg_types, V->nargs, &capacity, sizeof(uint8_t));
+        V->args = reserve(V->args, V->nargs, &V->args_capacity, sizeof(uint32_t));
+        uint32_t v = C->F->pool[I->a + k];
+        V->args[V->nargs] = C->reg[v];
+        V->arg_types[V->nargs++] = C->F->insts[v].type;
+    }
+    return first;
+}
+
+// The base, index and scale of the address of a load or a store
+static void address(compiler *C, uint32_t v, uint32_t *base, uint32_t *index, uint32_t *scale)
+{
+    const ir_function *F = C->F;
+    const ir_inst *A = &F->insts[v];
+    *scale = 1;
+    if (!C->fused[v])
+    {
+        *base = C->reg[v];
+        *index = C->reg[v];
+        *scale = 0;
+        return;
+    }
+    uint32_t b = A->a, i = A->b;
+    if (C->fused[A->a] && F->insts[A->a].op == IR_MUL)
+    {
+        b = A->b;
+        i = A->a;
+    }
+    *base = C->reg[b];
+    if (C->fused[i])
+    {
+        *index = C->reg[F->insts[i].a];
+        *scale = (uint32_t)F->insts[F->insts[i].b].value.i;
+    }
+    else
+        *index = C->reg[i];
+}
+
+// Compiles the int addition or subtraction i as an ADDK if one operand is a constant
+static bool compile_addk(compiler *C, uint32_t i)
+{
+    const ir_function *F = C->F;
+    const ir_inst *I = &F->insts[i];
+    uint32_t operand = I->b, other = I->a;
+    if (I->op == IR_ADD && F->insts[I->a].op == IR_CONST)
+    {
+        operand = I->a;
+        other = I->b;
+    }
+    if (I->type != IR_INT || F->insts[operand].op != IR_CONST)
+        return false;
+    int64_t k = F->insts[operand].value.i;
+    uint64_t constant = I->op == IR_ADD ? (uint64_t)k : 0 - (uint64_t)k;
+    vm_inst *x = emit(C, VM_ADDK, C->reg[i], C->reg[other], (uint32_t)constant);
+    x->d = (uint32_t)(constant >> 32);
+    return true;
+}
+
+static void compile_inst(compiler *C, uint32_t i, int64_t *frame)
+{
+    static const uint8_t int_ops[] = {
+        [IR_ADD] = VM_ADD, [IR_SUB] = VM_SUB, [IR_MUL] = VM_MUL, [IR_DIV] = VM_DIV,
+        [IR_MOD] = VM_MOD, [IR_AND] = VM_AND, [IR_OR] = VM_OR
+    };
+    static const uint8_t float_ops[] = {
+        [IR_ADD] = VM_FADD, [IR_SUB] = VM_FSUB, [IR_MUL] = VM_FMUL, [IR_DIV] = VM_FDIV
+    };
+    ir_function *F = C->F;
+    const ir_inst *I = &F->insts[i];
+    if (C->fused[i])
+        return;
+    // Calls and phis keep their operands in the pool, which their own cases read
+    bool direct = I->op != IR_CALL && I->op != IR_PHI;
+    uint32_t count = ir_operand_count(I);
+    uint32_t a = C->reg[i], b = direct && count > 0 ? C->reg[I->a] : 0, c = direct && count > 1 ? C->reg[I->b] : 0;
+    uint32_t base, index, scale;
+    vm_inst *x;
+    switch (I->op)
+    {
+    case IR_ADD:
+    case IR_SUB:
+        // Adding a constant takes it from the instruction
+        if (compile_addk(C, i))
+            break;
+        // Fall through
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+        emit(C, I->type == IR_FLOAT ? float_ops[I->op] : int_ops[I->op], a, b, c);
+        break;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+        emit(C, compare_op(I->op, F->insts[I->a].type, false), a, b, c);
+        break;
+    case IR_NEG:
+        emit(C, I->type == IR_FLOAT ? VM_FNEG : VM_NEG, a, b, 0);
+        break;
+    case IR_NOT:
+        emit(C, VM_NOT, a, b, 0);
+        break;
+    case IR_ITOF:
+        emit(C, VM_ITOF, a, b, 0);
+        break;
+    case IR_FTOI:
+        emit(C, VM_FTOI, a, b, 0);
+        break;
+    case IR_SLOT:
+        emit(C, VM_FRAME, a, (uint32_t)*frame, 0);
+        *frame += (I->value.i + 7) & ~(int64_t)7;
+        if (*frame > UINT32_MAX)
+            vm_error("The arrays and structs of function %s are too large", intern_text(F->name));
+        break;
+    case IR_LOAD:
+        address(C, I->a, &base, &index, &scale);
+        if (scale)
+            emit(C, VM_LOADX, a, base, index)->d = scale;
+        else
+            emit(C, VM_LOAD, a, base, 0);
+        break;
+    case IR_STORE:
+        address(C, I->a, &base, &index, &scale);
+        if (scale)
+            emit(C, VM_STOREX, base, index, c)->d = scale;
+        else
+            emit(C, VM_STORE, base, c, 0);
+        break;
+    case IR_CALL:
+    {
+        const ir_function *callee = ir_find_function(C->P->M, I->name);
+        uint32_t first = call_args(C, I);
+        // Results nobody gets still need a register to go to
+        if (I->type == IR_VOID)
+            a = C->scratch;
+        if (callee && callee->defined)
+            x = emit(C, VM_CALL, a, (uint32_t)(callee - C->P->M->functions), first);
+        else
+            x = emit(C, VM_NATIVE, a, native_index(C->P, I->name, I->type), first);
+        x->d = I->b;
+        break;
+    }
+    case IR_JUMP:
+    {
+        uint32_t s = ir_list_at(F, F->blocks[I->block].succs)[0];
+        edge_moves(C, I->block, 0);
+        if (s != next_block(F, I->block))
+            emit_jump(C, VM_JUMP, s, 0, 0);
+        break;
+    }
+    case IR_BRANCH:
+        compile_branch(C, i);
+        break;
+    case IR_SWITCH:
+        compile_switch(C, i);
+        break;
+    case IR_RETURN:
+        if (I->a)
+            emit(C, VM_RET, b, 0, 0);
+        else
+            emit(C, VM_RETVOID, 0, 0, 0);
+        break;
+    }
+}
+
+static void compile_function(vm_program *P, uint32_t f)
+{
+    compiler C;
+    memset(&C, 0, sizeof(C));
+    C.P = P;
+    C.F = &P->M->functions[f];
+    C.V = &P->functions[f];
+    ir_function *F = C.F;
+    vm_function *V = C.V;
+    V->name = F->name;
+    V->type = F->type;
+    V->nparams = F->params.count;
+    prepare(&C);
+    int64_t frame = 0;
+    for (uint32_t b = 0; b < F->nblocks; b++)
+    {
+        if (F->blocks[b].dead)
+            continue;
+        C.start[b] = V->ncode;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            compile_inst(&C, i, &frame);
+    }
+    for (uint32_t k = 0; k < C.nfixups; k++)
+        V->code[C.fixups[k]].a = C.start[V->code[C.fixups[k]].a];
+    for (uint32_t k = 0; k < V->ntargets; k++)
+        V->targets[k] = C.start[V->targets[k]];
+    // Frames stay 16-byte aligned, like the machine's
+    V->frame = (uint32_t)((frame + 15) & ~(int64_t)15);
+    mem_free(C.reg);
+    mem_free(C.uses);
+    mem_free(C.user);
+    mem_free(C.fused);
+    mem_free(C.start);
+    mem_free(C.fixups);
+}
+
+// Running
+
+#define INT_OP(name, expr) CASE(name) R[pc->a].i = (expr); NEXT();
+#define FLOAT_OP(name, expr) CASE(name) R[pc->a].d = (expr); NEXT();
+#define BRANCH(name, cond) CASE(name) if (cond) { pc = code + pc->a; DISPATCH(); } NEXT();
+
+#ifdef VM_THREADED
+#define CASE(name) op_##name:
+#define DISPATCH() goto *pc->handler
+#define VM_HANDLER(name) &&op_##name,
+#else
+#define CASE(name) case VM_##name:
+#define DISPATCH() continue
+#endif
+#define NEXT() { pc++; DISPATCH(); }
+
+static int64_t wrapped(uint64_t value)
+{
+    return (int64_t)value;
+}
+
+static int64_t divide(int64_t a, int64_t b, bool remainder)
+{
+    if (b == 0)
+        vm_error("Division by zero");
+    // The one quotient that does not fit wraps around, as in the IR's folding
+    if (b == -1)
+        return remainder ? 0 : wrapped(0 - (uint64_t)a);
+    return remainder ? a % b : a / b;
+}
+
+static int64_t to_int(double d)
+{
+    // Out of range conversions give what cvttsd2si does
+    if (!(d > -9223372036854775808.0 && d < 9223372036854775808.0))
+        return INT64_MIN;
+    return (int64_t)d;
+}
+
+/*
+Runs function entry of P. Each call takes its registers from the top of one
+stack of them, right after its caller's, and its arrays and structs from
+another; calls in progress are kept in a third, so that a call or a return
+is a jump like the others instead of a call of this function.
+*/
+#ifdef VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+static int64_t execute(vm_program *P, uint32_t entry)
+{
+#ifdef VM_THREADED
+    static const void *const handlers[VM_OP_COUNT] = {VM_OPS(VM_HANDLER)};
+    for (uint32_t f = 0; f < P->M->nfunctions; f++)
+    {
+        vm_function *V = &P->functions[f];
+        for (uint32_t k = 0; k < V->ncode; k++)
+            V->code[k].handler = handlers[V->code[k].op];
+    }
+#endif
+    vm_value *stack = mem_alloc(MEM_IR, VM_REGISTERS * sizeof(vm_value));
+    char *memory = mem_alloc(MEM_IR, VM_MEMORY);
+    vm_call *calls = mem_alloc(MEM_IR, VM_CALLS * sizeof(vm_call));
+    uint32_t depth = 0;
+    const vm_function *fn = &P->functions[entry];
+    vm_value *R = stack;
+    vm_value result = {0};
+    char *frame = memory, *top = memory + fn->frame;
+    const vm_inst *code = fn->code, *pc = code;
+    if (fn->nregs > VM_REGISTERS || fn->frame > VM_MEMORY)
+        vm_error("Stack overflow in %s", intern_text(fn->name));
+    memset(R, 0, fn->nparams * sizeof(vm_value));
+    memcpy(R + fn->nparams, fn->constants, fn->nconstants * sizeof(vm_value));
+
+#ifdef VM_THREADED
+    DISPATCH();
+#else
+    for (;;)
+    switch (pc->op)
+    {
+#endif
+    CASE(MOVE) R[pc->a] = R[pc->b]; NEXT();
+    INT_OP(ADD, wrapped((uint64_t)R[pc->b].i + (uint64_t)R[pc->c].i))
+    INT_OP(SUB, wrapped((uint64_t)R[pc->b].i - (uint64_t)R[pc->c].i))
+    INT_OP(MUL, wrapped((uint64_t)R[pc->b].i * (uint64_t)R[pc->c].i))
+    INT_OP(DIV, divide(R[pc->b].i, R[pc->c].i, false))
+    INT_OP(MOD, divide(R[pc->b].i, R[pc->c].i, true))
+    INT_OP(AND, R[pc->b].i & R[pc->c].i)
+    INT_OP(OR, R[pc->b].i | R[pc->c].i)
+    INT_OP(ADDK, wrapped((uint64_t)R[pc->b].i + (pc->c | (uint64_t)pc->d << 32)))
+    FLOAT_OP(FADD, R[pc->b].d + R[pc->c].d)
+    FLOAT_OP(FSUB, R[pc->b].d - R[pc->c].d)
+    FLOAT_OP(FMUL, R[pc->b].d * R[pc->c].d)
+    FLOAT_OP(FDIV, R[pc->b].d / R[pc->c].d)
+    INT_OP(EQ, R[pc->b].i == R[pc->c].i)
+    INT_OP(NE, R[pc->b].i != R[pc->c].i)
+    INT_OP(LT, R[pc->b].i < R[pc->c].i)
+    INT_OP(LE, R[pc->b].i <= R[pc->c].i)
+    INT_OP(GT, R[pc->b].i > R[pc->c].i)
+    INT_OP(GE, R[pc->b].i >= R[pc->c].i)
+    INT_OP(FEQ, R[pc->b].d == R[pc->c].d)
+    INT_OP(FNE, R[pc->b].d != R[pc->c].d)
+    INT_OP(FLT, R[pc->b].d < R[pc->c].d)
+    INT_OP(FLE, R[pc->b].d <= R[pc->c].d)
+    INT_OP(FGT, R[pc->b].d > R[pc->c].d)
+    INT_OP(FGE, R[pc->b].d >= R[pc->c].d)
+    INT_OP(NEG, wrapped(0 - (uint64_t)R[pc->b].i))
+    FLOAT_OP(FNEG, -R[pc->b].d)
+    INT_OP(NOT, ~R[pc->b].i)
+    FLOAT_OP(ITOF, (double)R[pc->b].i)
+    INT_OP(FTOI, to_int(R[pc->b].d))
+    CASE(LOAD) memcpy(&R[pc->a], (char *)(intptr_t)R[pc->b].i, sizeof(vm_value)); NEXT();
+    CASE(STORE) memcpy((char *)(intptr_t)R[pc->a].i, &R[pc->b], sizeof(vm_value)); NEXT();
+    CASE(LOADX) memcpy(&R[pc->a], (char *)(intptr_t)R[pc->b].i + R[pc->c].i * (int64_t)pc->d, sizeof(vm_value)); NEXT();
+    CASE(STOREX) memcpy((char *)(intptr_t)R[pc->a].i + R[pc->b].i * (int64_t)pc->d, &R[pc->c], sizeof(vm_value)); NEXT();
+    INT_OP(FRAME, (int64_t)(intptr_t)(frame + pc->b))
+    CASE(JUMP) pc = code + pc->a; DISPATCH();
+    BRANCH(JNZ, R[pc->b].i != 0)
+    BRANCH(JZ, R[pc->b].i == 0)
+    BRANCH(BEQ, R[pc->b].i == R[pc->c].i)
+    BRANCH(BNE, R[pc->b].i != R[pc->c].i)
+    BRANCH(BLT, R[pc->b].i < R[pc->c].i)
+    BRANCH(BLE, R[pc->b].i <= R[pc->c].i)
+    BRANCH(BGT, R[pc->b].i > R[pc->c].i)
+    BRANCH(BGE, R[pc->b].i >= R[pc->c].i)
+    BRANCH(FBEQ, R[pc->b].d == R[pc->c].d)
+    BRANCH(FBNE, R[pc->b].d != R[pc->c].d)
+    BRANCH(FBLT, R[pc->b].d < R[pc->c].d)
+    BRANCH(FBLE, R[pc->b].d <= R[pc->c].d)
+    BRANCH(FBGT, R[pc->b].d > R[pc->c].d)
+    BRANCH(FBGE, R[pc->b].d >= R[pc->c].d)
+    CASE(SWITCH)
+    {
+        uint64_t k = (uint64_t)R[pc->b].i;
+        pc = code + (k < pc->c ? fn->targets[pc->d + k] : pc->a);
+        DISPATCH();
+    }
+    CASE(CALL)
+    {
+        const vm_function *callee = &P->functions[pc->b];
+        vm_value *next = R + fn->nregs;
+        if (depth == VM_CALLS || next + callee->nregs > stack + VM_REGISTERS || top + callee->frame > memory + VM_MEMORY)
+            vm_error("Stack overflow in %s", intern_text(callee->name));
+        const uint32_t *args = fn->args + pc->c;
+        for (uint32_t k = 0; k < pc->d; k++)
+            next[k] = R[args[k]];
+        memcpy(next + callee->nparams, callee->constants, callee->nconstants * sizeof(vm_value));
+        calls[depth++] = (vm_call){pc, R, fn, frame};
+        R = next;
+        fn = callee;
+        frame = top;
+        top += callee->frame;
+        code = pc = callee->code;
+        DISPATCH();
+    }
+    CASE(NATIVE)
+    {
+        vm_value args[VM_NATIVE_ARGS];
+        if (pc->d > VM_NATIVE_ARGS)
+            vm_error("Too many arguments in a call of %s", intern_text(P->native_names[pc->b]));
+        for (uint32_t k = 0; k < pc->d; k++)
+            args[k] = R[fn->args[pc->c + k]];
+        R[pc->a] = vm_call_native(P->natives[pc->b], P->native_names[pc->b], args, fn->arg_types + pc->c, pc->d,
+                                  P->native_types[pc->b]);
+        NEXT();
+    }
+    CASE(RETVOID)
+    CASE(RET)
+    {
+        vm_value value = R[pc->a];
+        if (!depth)
+        {
+            result = value;
+            goto done;
+        }
+        const vm_call *caller = &calls[--depth];
+        top = frame;
+        frame = caller->frame;
+        R = caller->regs;
+        fn = caller->fn;
+        code = fn->code;
+        pc = caller->pc;
+        R[pc->a] = value;
+        NEXT();
+    }
+#ifndef VM_THREADED
+    }
+#endif
+done:
+    mem_free(stack);
+    mem_free(memory);
+    mem_free(calls);
+    return fn->type == IR_FLOAT ? to_int(result.d) : result.i;
+}
+#ifdef VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+int64_t vm_run(ir_module *M)
+{
+    ir_function *main = ir_find_function(M, intern("main", 4));
+    if (!main || !main->defined)
+        vm_error("No function main");
+    vm_program P;
+    memset(&P, 0, sizeof(P));
+    P.M = M;
+    P.functions = mem_calloc(MEM_IR, M->nfunctions + 1, sizeof(vm_function));
+    P.globals = vm_globals(M);
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        if (M->functions[f].defined)
+            compile_function(&P, f);
+    }
+    int64_t result = execute(&P, (uint32_t)(main - M->functions));
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        mem_free(P.functions[f].constants);
+        mem_free(P.functions[f].code);
+        mem_free(P.functions[f].args);
+        mem_free(P.functions[f].arg_types);
+        mem_free(P.functions[f].targets);
+    }
+    mem_free(P.functions);
+    mem_free(P.natives);
+    mem_free(P.native_names);
+    mem_free(P.native_types);
+    vm_globals_free(M, P.globals);
+    return result;
+}
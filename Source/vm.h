@@ -0,0 +1,42 @@
+#include <stdint.h>
+#ifndef VM_H
+#define VM_H
+
+#include "ir.h"
+
+/*
+Runs programs without an assembler or a linker. Each function of the
+optimized IR is compiled to register-based bytecode, where every SSA value
+has a register of the function's frame and instructions name their
+operands by register, and the bytecode is run with threaded dispatch.
+Pairs that come up all the time run as one instruction: a comparison with
+the branch on it, and a load or store with the address arithmetic before
+it. Memory is the process's own, so that addresses are pointers and
+functions that are only declared, such as printf, are called in the C
+library.
+*/
+typedef union {
+    int64_t i;
+    double d;
+} vm_value;
+
+// Runs main, giving what it returns
+int64_t vm_run(ir_module *M);
+
+// Memory for the globals of M, with their initial values, indexed like M->globals
+char **vm_globals(const ir_module *M);
+
+void vm_globals_free(const ir_module *M, char **globals);
+
+typedef void (*vm_native)(void);
+
+// The C library function name, or NULL
+vm_native vm_find_native(uint32_t name);
+
+// Calls fn, the C library function name, with args of the IR types given, giving its result of type
+vm_value vm_call_native(vm_native fn, uint32_t name, const vm_value *args, const uint8_t *types, uint32_t count, unsigned type);
+
+// Reports an error of the running program and exits
+void vm_error(const char *format, ...);
+
+#endif
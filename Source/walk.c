@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "walk.h"
+#include "vm.h"
+#include "lexer.h"
+#include "intern.h"
+#include "mem.h"
+
+#define WALK_MEMORY (16u << 20) // Bytes of the variables of calls in progress
+#define WALK_CALLS 5000 // Calls in progress, each of which takes C stack
+
+typedef struct {
+    uint8_t type; // IR_VOID, IR_INT or IR_FLOAT
+    vm_value v;
+} value;
+
+typedef struct {
+    uint32_t name;
+    ast_type type;
+    int64_t length; // 0 for a scalar, -1 for an array parameter
+    char *address; // Of the scalar, or of the array or the struct
+} variable;
+
+// Where an lvalue lives
+typedef struct {
+    char *address;
+    ast_type type;
+    int64_t length;
+} place;
+
+// How a statement ends
+enum {
+    FLOW_NEXT,
+    FLOW_BREAK,
+    FLOW_CONTINUE,
+    FLOW_RETURN
+};
+
+typedef struct {
+    ir_module *M;
+    char **globals;
+    const ast *T; // Of the function running
+    variable *vars;
+    uint32_t nvars;
+    uint32_t vars_capacity;
+    uint32_t scope; // First variable of the function running
+    char *memory;
+    size_t top;
+    unsigned depth;
+    unsigned type; // That the function running returns
+    value result; // Of the return that ended a call
+    uint32_t seek; // Label a switch is going to, 0 when statements run
+} walker;
+
+static value eval(walker *W, uint32_t n);
+
+static value int_value(int64_t i)
+{
+    value x = {IR_INT, {.i = i}};
+    return x;
+}
+
+static value float_value(double d)
+{
+    value x = {IR_FLOAT, {.d = d}};
+    return x;
+}
+
+static unsigned value_type(ast_type type)
+{
+    if (type.base == AST_TYPE_VOID)
+        return IR_VOID;
+    return type.base == AST_TYPE_FLOAT ? IR_FLOAT : IR_INT;
+}
+
+static value convert(value x, unsigned type)
+{
+    if (type == IR_FLOAT && x.type == IR_INT)
+        return float_value((double)x.v.i);
+    if (type == IR_INT && x.type == IR_FLOAT)
+    {
+        double d = x.v.d;
+        return int_value(d > -9223372036854775808.0 && d < 9223372036854775808.0 ? (int64_t)d : INT64_MIN);
+    }
+    return x;
+}
+
+static bool truth(value x)
+{
+    return x.type == IR_FLOAT ? x.v.d != 0 : x.v.i != 0;
+}
+
+static char *allocate(walker *W, int64_t size)
+{
+    size = (size + 7) & ~(int64_t)7;
+    if (W->top + size > WALK_MEMORY)
+        vm_error("Stack overflow");
+    char *p = W->memory + W->top;
+    W->top += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static int64_t object_size(const walker *W, ast_type type, int64_t length)
+{
+    int64_t size = type.base == AST_TYPE_STRUCT ? ir_find_struct(W->M, type.name)->size : IR_SCALAR_SIZE;
+    return length > 0 ? size * length : size;
+}
+
+static void add_variable(walker *W, const ast_node *decl, char *address)
+{
+    if (W->nvars == W->vars_capacity)
+    {
+        W->vars_capacity = W->vars_capacity ? W->vars_capacity * 2 : 64;
+        W->vars = mem_realloc(MEM_IR, W->vars, W->vars_capacity * sizeof(variable));
+    }
+    W->vars[W->nvars++] = (variable){decl->name, decl->type, decl->value.i, address};
+}
+
+static bool is_aggregate(ast_type type, int64_t length)
+{
+    return length || type.base == AST_TYPE_STRUCT;
+}
+
+// Finds name among the variables of the function running, innermost first, then among the globals
+static place find_variable(const walker *W, uint32_t name)
+{
+    for (uint32_t i = W->nvars; i > W->scope; i--)
+    {
+        const variable *v = &W->vars[i - 1];
+        if (v->name == name)
+            return (place){v->address, v->type, v->length};
+    }
+    const ir_global *G = ir_find_global(W->M, name);
+    return (place){W->globals[G - W->M->globals], G->decl, G->length};
+}
+
+static const ir_member *find_member(const walker *W, ast_type type, uint32_t name)
+{
+    const ir_struct *S = ir_find_struct(W->M, type.name);
+    for (uint32_t i = S->first; i < S->first + S->count; i++)
+    {
+        if (W->M->members[i].name == name)
+            return &W->M->members[i];
+    }
+    return NULL;
+}
+
+static place eval_place(walker *W, uint32_t n)
+{
+    const ast_node *x = ast_at(W->T, n);
+    place p;
+    if (x->kind == AST_NAME)
+        return find_variable(W, x->name);
+    p = eval_place(W, x->a);
+    if (x->kind == AST_INDEX)
+    {
+        value index = eval(W, x->b);
+        p.address += index.v.i * object_size(W, p.type, 0);
+        p.length = 0;
+        return p;
+    }
+    const ir_member *m = find_member(W, p.type, x->name);
+    p.address += m->offset;
+    p.type = m->type;
+    p.length = m->length;
+    return p;
+}
+
+// The type of the place n, without evaluating it
+static place place_type(const walker *W, uint32_t n)
+{
+    const ast_node *x = ast_at(W->T, n);
+    if (x->kind == AST_NAME)
+        return find_variable(W, x->name);
+    place p = place_type(W, x->a);
+    if (x->kind == AST_INDEX)
+    {
+        p.length = 0;
+        return p;
+    }
+    const ir_member *m = find_member(W, p.type, x->name);
+    p.type = m->type;
+    p.length = m->length;
+    return p;
+}
+
+static value load(place p)
+{
+    if (is_aggregate(p.type, p.length))
+        return int_value((int64_t)(intptr_t)p.address);
+    value x;
+    x.type = value_type(p.type);
+    memcpy(&x.v, p.address, sizeof(x.v));
+    return x;
+}
+
+// Stores x at p, giving the value as stored
+static value store(place p, value x)
+{
+    x = convert(x, value_type(p.type));
+    memcpy(p.address, &x.v, sizeof(x.v));
+    return x;
+}
+
+static int64_t wrapped(uint64_t v)
+{
+    return (int64_t)v;
+}
+
+// a op b, in floats when either is one
+static value arithmetic(unsigned op, value a, value b)
+{
+    if (a.type == IR_FLOAT || b.type == IR_FLOAT)
+    {
+        double x = convert(a, IR_FLOAT).v.d, y = convert(b, IR_FLOAT).v.d;
+        switch (op)
+        {
+        case TOKEN_PLUS:
+        case TOKEN_ADD_ASSIGN:
+        case TOKEN_INC:
+            return float_value(x + y);
+        case TOKEN_MINUS:
+        case TOKEN_SUB_ASSIGN:
+        case TOKEN_DEC:
+            return float_value(x - y);
+        case TOKEN_ASTERISK:
+        case TOKEN_MUL_ASSIGN:
+            return float_value(x * y);
+        case TOKEN_SLASH:
+        case TOKEN_DIV_ASSIGN:
+            return float_value(x / y);
+        case TOKEN_EQ:
+            return int_value(x == y);
+        case TOKEN_NE:
+            return int_value(x != y);
+        case TOKEN_LESS:
+            return int_value(x < y);
+        case TOKEN_LE:
+            return int_value(x <= y);
+        case TOKEN_GREATER:
+            return int_value(x > y);
+        default:
+            return int_value(x >= y);
+        }
+    }
+    int64_t x = a.v.i, y = b.v.i;
+    switch (op)
+    {
+    case TOKEN_PLUS:
+    case TOKEN_ADD_ASSIGN:
+    case TOKEN_INC:
+        return int_value(wrapped((uint64_t)x + (uint64_t)y));
+    case TOKEN_MINUS:
+    case TOKEN_SUB_ASSIGN:
+    case TOKEN_DEC:
+        return int_value(wrapped((uint64_t)x - (uint64_t)y));
+    case TOKEN_ASTERISK:
+    case TOKEN_MUL_ASSIGN:
+        return int_value(wrapped((uint64_t)x * (uint64_t)y));
+    case TOKEN_SLASH:
+    case TOKEN_DIV_ASSIGN:
+    case TOKEN_PERCENT:
+        if (y == 0)
+            vm_error("Division by zero");
+        if (y == -1)
+            return int_value(op == TOKEN_PERCENT ? 0 : wrapped(0 - (uint64_t)x));
+        return int_value(op == TOKEN_PERCENT ? x % y : x / y);
+    case TOKEN_AMPERSAND:
+        return int_value(x & y);
+    case TOKEN_PIPE:
+        return int_value(x | y);
+    case TOKEN_EQ:
+        return int_value(x == y);
+    case TOKEN_NE:
+        return int_value(x != y);
+    case TOKEN_LESS:
+        return int_value(x < y);
+    case TOKEN_LE:
+        return int_value(x <= y);
+    case TOKEN_GREATER:
+        return int_value(x > y);
+    default:
+        return int_value(x >= y);
+    }
+}
+
+// Type of what n evaluates to, without evaluating it, for the arm of ?: not taken
+static unsigned static_type(const walker *W, uint32_t n)
+{
+    const ast_node *x = ast_at(W->T, n);
+    unsigned a, b;
+    place p;
+    switch (x->kind)
+    {
+    case AST_FLOAT:
+        return IR_FLOAT;
+    case AST_NAME:
+    case AST_INDEX:
+    case AST_MEMBER:
+    case AST_ASSIGN:
+    case AST_PREFIX:
+    case AST_POSTFIX:
+        p = place_type(W, x->kind == AST_NAME || x->kind == AST_INDEX || x->kind == AST_MEMBER ? n : x->a);
+        return is_aggregate(p.type, p.length) ? IR_INT : value_type(p.type);
+    case AST_UNARY:
+        return x->op == TOKEN_EXCLAMATION ? IR_INT : static_type(W, x->a);
+    case AST_BINARY:
+        if (x->op == TOKEN_AND || x->op == TOKEN_OR || x->op == TOKEN_EQ || x->op == TOKEN_NE ||
+            x->op == TOKEN_LESS || x->op == TOKEN_LE || x->op == TOKEN_GREATER || x->op == TOKEN_GE)
+            return IR_INT;
+        a = static_type(W, x->a);
+        b = static_type(W, x->b);
+        return a == IR_FLOAT || b == IR_FLOAT ? IR_FLOAT : IR_INT;
+    case AST_CONDITIONAL:
+        a = static_type(W, x->b);
+        b = static_type(W, x->c);
+        return a == IR_FLOAT || b == IR_FLOAT ? IR_FLOAT : a;
+    case AST_CALL:
+    {
+        const ir_function *callee = ir_find_function(W->M, x->name);
+        return callee ? callee->type : IR_INT;
+    }
+    case AST_CAST:
+        return value_type(x->type) == IR_VOID ? static_type(W, x->a) : value_type(x->type);
+    default:
+        return IR_INT;
+    }
+}
+
+static unsigned execute_statements(walker *W, uint32_t first);
+
+static value call(walker *W, const ast_node *x)
+{
+    const ir_function *callee = ir_find_function(W->M, x->name);
+    uint32_t count = 0;
+    for (uint32_t arg = x->a; arg; arg = ast_at(W->T, arg)->next)
+        count++;
+    // main is called without arguments, so its parameters, if any, are 0
+    uint32_t size = callee && callee->params.count > count ? callee->params.count : count;
+    vm_value *args = mem_calloc(MEM_IR, size + 1, sizeof(vm_value));
+    uint8_t *types = mem_calloc(MEM_IR, size + 1, 1);
+    uint32_t i = 0;
+    for (uint32_t arg = x->a; arg; arg = ast_at(W->T, arg)->next, i++)
+    {
+        value v = eval(W, arg);
+        if (callee)
+            v = convert(v, ir_list_at(callee, callee->params)[i]);
+        args[i] = v.v;
+        types[i] = v.type;
+    }
+    value result = {callee ? callee->type : IR_INT, {0}};
+    if (!callee || !callee->defined)
+    {
+        result.v = vm_call_native(vm_find_native(x->name), x->name, args, types, count, result.type);
+        mem_free(args);
+        mem_free(types);
+        return result;
+    }
+    if (W->depth == WALK_CALLS)
+        vm_error("Stack overflow in %s", intern_text(callee->name));
+    const ast *caller = W->T;
+    unsigned type = W->type;
+    uint32_t scope = W->scope, nvars = W->nvars;
+    size_t top = W->top;
+    W->depth++;
+    W->T = &callee->tree;
+    W->type = callee->type;
+    W->scope = W->nvars;
+    i = 0;
+    for (uint32_t p = callee->tree_params; p; p = ast_at(W->T, p)->next, i++)
+    {
+        const ast_node *decl = ast_at(W->T, p);
+        // Arrays and structs are passed by address, and a struct is copied so that writes stay the callee's own
+        if (decl->value.i)
+        {
+            add_variable(W, decl, (char *)(intptr_t)args[i].i);
+            continue;
+        }
+        if (decl->type.base == AST_TYPE_STRUCT)
+        {
+            int64_t bytes = object_size(W, decl->type, 0);
+            char *address = allocate(W, bytes);
+            memcpy(address, (char *)(intptr_t)args[i].i, bytes);
+            add_variable(W, decl, address);
+            continue;
+        }
+        char *address = allocate(W, IR_SCALAR_SIZE);
+        memcpy(address, &args[i], sizeof(vm_value));
+        add_variable(W, decl, address);
+    }
+    mem_free(args);
+    mem_free(types);
+    if (execute_statements(W, ast_at(W->T, callee->tree_body)->a) == FLOW_RETURN)
+        result = W->result;
+    W->T = caller;
+    W->type = type;
+    W->scope = scope;
+    W->nvars = nvars;
+    W->top = top;
+    W->depth--;
+    return result;
+}
+
+static value eval(walker *W, uint32_t n)
+{
+    const ast_node *x = ast_at(W->T, n);
+    value a, b;
+    place p;
+    switch (x->kind)
+    {
+    case AST_INT:
+        return int_value(x->value.i);
+    case AST_FLOAT:
+        return float_value(x->value.d);
+    case AST_STRING:
+        return int_value((int64_t)(intptr_t)intern_text(x->name));
+    case AST_NAME:
+    case AST_INDEX:
+    case AST_MEMBER:
+        return load(eval_place(W, n));
+    case AST_UNARY:
+        a = eval(W, x->a);
+        if (x->op == TOKEN_EXCLAMATION)
+            return arithmetic(TOKEN_EQ, a, int_value(0));
+        if (x->op == TOKEN_TILDE)
+            return int_value(~a.v.i);
+        return a.type == IR_FLOAT ? float_value(-a.v.d) : int_value(wrapped(0 - (uint64_t)a.v.i));
+    case AST_PREFIX:
+    case AST_POSTFIX:
+        p = eval_place(W, x->a);
+        a = load(p);
+        b = store(p, arithmetic(x->op, a, a.type == IR_FLOAT ? float_value(1) : int_value(1)));
+        return x->kind == AST_PREFIX ? b : a;
+    case AST_BINARY:
+        a = eval(W, x->a);
+        if (x->op == TOKEN_AND || x->op == TOKEN_OR)
+        {
+            if (truth(a) != (x->op == TOKEN_AND))
+                return int_value(x->op == TOKEN_OR);
+            return arithmetic(TOKEN_NE, eval(W, x->b), int_value(0));
+        }
+        b = eval(W, x->b);
+        return arithmetic(x->op, a, b);
+    case AST_ASSIGN:
+        p = eval_place(W, x->a);
+        if (x->op == TOKEN_EQUAL)
+            return store(p, eval(W, x->b));
+        a = load(p);
+        return store(p, arithmetic(x->op, a, eval(W, x->b)));
+    case AST_CONDITIONAL:
+    {
+        bool then = truth(eval(W, x->a));
+        a = eval(W, then ? x->b : x->c);
+        unsigned other = static_type(W, then ? x->c : x->b);
+        unsigned first = then ? a.type : other;
+        unsigned type = a.type == IR_FLOAT || other == IR_FLOAT ? IR_FLOAT : first;
+        return type == IR_VOID ? a : convert(a, type);
+    }
+    case AST_CALL:
+        return call(W, x);
+    case AST_CAST:
+        return convert(eval(W, x->a), value_type(x->type));
+    }
+    return int_value(0);
+}
+
+static void declare(walker *W, const ast_node *x)
+{
+    if (is_aggregate(x->type, x->value.i))
+    {
+        add_variable(W, x, allocate(W, object_size(W, x->type, x->value.i)));
+        return;
+    }
+    add_variable(W, x, allocate(W, IR_SCALAR_SIZE));
+    // The variable is in scope in its own initializer, as in the IR. A switch can jump past it
+    if (x->a && !W->seek)
+        store(find_variable(W, x->name), eval(W, x->a));
+}
+
+static unsigned execute(walker *W, uint32_t n);
+
+// Runs a list of statements, whose variables go out of scope at its end
+static unsigned execute_statements(walker *W, uint32_t first)
+{
+    uint32_t nvars = W->nvars;
+    size_t top = W->top;
+    unsigned flow = FLOW_NEXT;
+    for (uint32_t s = first; s && flow == FLOW_NEXT; s = ast_at(W->T, s)->next)
+        flow = execute(W, s);
+    W->nvars = nvars;
+    W->top = top;
+    return flow;
+}
+
+// Runs a loop body, telling whether the loop goes on
+static bool iterate(walker *W, uint32_t body, unsigned *flow)
+{
+    *flow = execute(W, body);
+    if (*flow == FLOW_BREAK || *flow == FLOW_RETURN)
+    {
+        if (*flow == FLOW_BREAK)
+            *flow = FLOW_NEXT;
+        return false;
+    }
+    *flow = FLOW_NEXT;
+    return true;
+}
+
+// The case label of the switch body n that value matches, or 0, and the default label in *otherwise
+static uint32_t find_label(walker *W, uint32_t n, int64_t value, uint32_t *otherwise)
+{
+    const ast_node *x = ast_at(W->T, n);
+    uint32_t label = 0;
+    switch (x->kind)
+    {
+    case AST_BLOCK:
+        for (uint32_t s = x->a; s && !label; s = ast_at(W->T, s)->next)
+            label = find_label(W, s, value, otherwise);
+        return label;
+    case AST_IF:
+        label = find_label(W, x->b, value, otherwise);
+        return label || !x->c ? label : find_label(W, x->c, value, otherwise);
+    case AST_WHILE:
+    case AST_DO:
+        return find_label(W, x->b, value, otherwise);
+    case AST_FOR:
+        return find_label(W, x->d, value, otherwise);
+    case AST_CASE:
+    case AST_DEFAULT:
+        for (uint32_t l = n; l; l = l == n ? x->c : ast_at(W->T, l)->next)
+        {
+            const ast_node *y = ast_at(W->T, l);
+            if (y->kind == AST_DEFAULT)
+                *otherwise = l;
+            else if (eval(W, y->a).v.i == value)
+                return l;
+        }
+        return x->b ? find_label(W, x->b, value, otherwise) : 0;
+    }
+    return 0;
+}
+
+static unsigned execute(walker *W, uint32_t n)
+{
+    const ast_node *x = ast_at(W->T, n);
+    unsigned flow = FLOW_NEXT;
+    value v;
+    // Going to the label of a switch, statements are passed over up to it
+    if (W->seek && (x->kind == AST_EXPRESSION || x->kind == AST_SWITCH || x->kind == AST_BREAK ||
+                    x->kind == AST_CONTINUE || x->kind == AST_RETURN))
+        return FLOW_NEXT;
+    switch (x->kind)
+    {
+    case AST_EXPRESSION:
+        eval(W, x->a);
+        break;
+    case AST_DECL:
+        declare(W, x);
+        break;
+    case AST_BLOCK:
+        return execute_statements(W, x->a);
+    case AST_IF:
+        if (W->seek)
+        {
+            flow = execute(W, x->b);
+            return W->seek && x->c ? execute(W, x->c) : flow;
+        }
+        if (truth(eval(W, x->a)))
+            return execute(W, x->b);
+        if (x->c)
+            return execute(W, x->c);
+        break;
+    // A loop a switch jumps into goes on from its label as if it had got there
+    case AST_WHILE:
+        if (W->seek && (!iterate(W, x->b, &flow) || W->seek))
+            break;
+        while (truth(eval(W, x->a)) && iterate(W, x->b, &flow))
+            ;
+        break;
+    case AST_DO:
+        while (iterate(W, x->b, &flow) && !W->seek && truth(eval(W, x->a)))
+            ;
+        break;
+    case AST_FOR:
+        if (x->a && !W->seek)
+            eval(W, x->a);
+        for (; W->seek || !x->b || truth(eval(W, x->b)); )
+        {
+            if (!iterate(W, x->d, &flow) || W->seek)
+                break;
+            if (x->c)
+                eval(W, x->c);
+        }
+        break;
+    case AST_SWITCH:
+    {
+        uint32_t otherwise = 0;
+        uint32_t label = find_label(W, x->b, eval(W, x->a).v.i, &otherwise);
+        W->seek = label ? label : otherwise;
+        if (!W->seek)
+            break;
+        flow = execute(W, x->b);
+        return flow == FLOW_BREAK ? FLOW_NEXT : flow;
+    }
+    case AST_CASE:
+    case AST_DEFAULT:
+        for (uint32_t l = n; l && W->seek; l = l == n ? x->c : ast_at(W->T, l)->next)
+        {
+            if (W->seek == l)
+                W->seek = 0;
+        }
+        return x->b ? execute(W, x->b) : FLOW_NEXT;
+    case AST_BREAK:
+        return FLOW_BREAK;
+    case AST_CONTINUE:
+        return FLOW_CONTINUE;
+    case AST_RETURN:
+        v = W->type == IR_FLOAT ? float_value(0) : int_value(0);
+        if (x->a)
+            v = convert(eval(W, x->a), W->type);
+        W->result = v;
+        return FLOW_RETURN;
+    }
+    return flow;
+}
+
+int64_t walk_run(ir_module *M)
+{
+    ir_function *main = ir_find_function(M, intern("main", 4));
+    if (!main || !main->defined)
+        vm_error("No function main");
+    walker W;
+    memset(&W, 0, sizeof(W));
+    W.M = M;
+    W.globals = vm_globals(M);
+    W.memory = mem_alloc(MEM_IR, WALK_MEMORY);
+    ast_node node;
+    memset(&node, 0, sizeof(node));
+    node.kind = AST_CALL;
+    node.name = main->name;
+    value result = call(&W, &node);
+    mem_free(W.vars);
+    mem_free(W.memory);
+    vm_globals_free(M, W.globals);
+    return result.type == IR_FLOAT ? convert(result, IR_INT).v.i : result.v.i;
+}
@@ -0,0 +1,16 @@
+#include <stdint.h>
+#ifndef WALK_H
+#define WALK_H
+
+#include "ir.h"
+
+/*
+Runs a program by walking the syntax trees the module keeps, the baseline
+the bytecode interpreter is measured against. Expressions are evaluated
+by recursion over their nodes, with every variable in memory and looked up
+by name when it is used, and the value of each node tagged with its type.
+It computes what the IR does, from the same trees.
+*/
+int64_t walk_run(ir_module *M);
+
+#endif
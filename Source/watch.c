@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "watch.h"
+#include "parser.h"
+#include "relex.h"
+#include "depscan.h"
+#include "strtab.h"
+#include "mem.h"
+
+/*
+Watch mode keeps the token stream of every source in memory. When a source
+or one of the files it includes changes, the source is re-lexed from the
+nearest checkpoint (see stream_diff) and parsed again from the stream.
+
+Changes are reported by inotify on the directories of the watched files,
+so editors that save by renaming a new file over the old one are seen too.
+Each rebuild runs in a child process, since lexer and parser errors exit.
+The child lexes the change with stream_diff and sends the edit back through
+a pipe before it parses, so the resident stream is spliced without lexing
+the file a second time, and only once lexing worked.
+*/
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM)
+
+typedef struct {
+    char *filename; // As given, or directory argument + name
+    char *outfilename;
+    token_stream S;
+    bool lexed;     // S holds the tokens of the last version that could be lexed
+    dep_list deps;  // Real paths of the file and of everything it includes
+} watched_source;
+
+typedef struct {
+    int wd;
+    char *path; // Real path of the directory
+    char *name; // Prefix for sources found in it, NULL unless it was given as an argument
+} watched_dir;
+
+typedef struct {
+    int fd;
+    bool decls_only;
+    watched_source *sources;
+    size_t count;
+    size_t capacity;
+    strtab known; // Real paths of every source
+    watched_dir *dirs;
+    size_t ndirs;
+    size_t dir_capacity;
+} watcher;
+
+// Absolute path of path, which may not exist yet as long as its directory does
+static char *resolve(const char *path)
+{
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved))
+        return mem_strdup(MEM_OTHER, resolved);
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == path)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    if (!realpath(dir, resolved))
+        return NULL;
+    char *full = mem_alloc(MEM_OTHER, strlen(resolved) + strlen(path) + 2);
+    sprintf(full, "%s/%s", resolved, slash ? slash + 1 : path);
+    return full;
+}
+
+static bool is_source(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 2 && strcmp(name + len - 2, ".c") == 0;
+}
+
+// Watches the directory at dirpath, name is set when sources appearing in it should be picked up
+static void watch_dir(watcher *W, const char *dirpath, const char *name)
+{
+    int wd = inotify_add_watch(W->fd, dirpath, WATCH_EVENTS);
+    if (wd < 0)
+    {
+        fprintf(stderr, "Warning: Cannot watch directory %s\n", dirpath);
+        return;
+    }
+    for (size_t i = 0; i < W->ndirs; i++)
+    {
+        if (W->dirs[i].wd == wd)
+        {
+            if (name && !W->dirs[i].name)
+                W->dirs[i].name = mem_strdup(MEM_OTHER, name);
+            return;
+        }
+    }
+    if (W->ndirs == W->dir_capacity)
+    {
+        W->dir_capacity = W->dir_capacity ? W->dir_capacity * 2 : 16;
+        W->dirs = mem_realloc(MEM_OTHER, W->dirs, W->dir_capacity * sizeof(watched_dir));
+    }
+    char *path = resolve(dirpath);
+    W->dirs[W->ndirs].wd = wd;
+    W->dirs[W->ndirs].path = path ? path : mem_strdup(MEM_OTHER, dirpath);
+    W->dirs[W->ndirs].name = name ? mem_strdup(MEM_OTHER, name) : NULL;
+    W->ndirs++;
+}
+
+// Watches the directory a file is in
+static void watch_parent(watcher *W, const char *realfile)
+{
+    const char *slash = strrchr(realfile, '/');
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", slash == realfile ? 1 : (int)(slash - realfile), realfile);
+    watch_dir(W, dir, NULL);
+}
+
+static void add_dep(watcher *W, watched_source *src, const char *file)
+{
+    char *real = resolve(file);
+    if (!real)
+        return;
+    size_t before = src->deps.visited.count;
+    strtab_add(&src->deps.visited, real);
+    if (src->deps.visited.count != before)
+    {
+        if (src->deps.count == src->deps.capacity)
+        {
+            src->deps.capacity = src->deps.capacity ? src->deps.capacity * 2 : 16;
+            src->deps.files = mem_realloc(MEM_OTHER, src->deps.files, src->deps.capacity * sizeof(char *));
+        }
+        src->deps.files[src->deps.count++] = real;
+        watch_parent(W, real);
+    }
+    else
+        mem_free(real);
+}
+
+// Recomputes what src depends on: the includes the lexer found, and whatever those include
+static void update_deps(watcher *W, watched_source *src)
+{
+    dep_list_free(&src->deps);
+    add_dep(W, src, src->filename);
+    for (size_t i = 0; i < src->S.count; i++)
+    {
+        token *t = &src->S.tokens[i];
+        if (t->ID != TOKEN_INCLUDE)
+            continue;
+        add_dep(W, src, t->attrb);
+        dep_list D;
+        memset(&D, 0, sizeof(D));
+        D.keep_going = true;
+        scan_dependencies(t->attrb, &D);
+        for (size_t j = 0; j < D.count; j++)
+            add_dep(W, src, D.files[j]);
+        dep_list_free(&D);
+    }
+}
+
+static int parse_source(watcher *W, watched_source *src)
+{
+    FILE *output = fopen(src->outfilename, "w");
+    if (!output)
+    {
+        fprintf(stderr, "Error: Cannot open output file %s\n", src->outfilename);
+        return 1;
+    }
+    parser P;
+    memset(&P, 0, sizeof(P));
+    P.decls_only = W->decls_only;
+    init_parser_stream(&P, &src->S, output, src->outfilename);
+    fclose(output);
+    printf("Completed parsing. Check %s for details\n", src->outfilename);
+    return 0;
+}
+
+// Re-lexes and re-parses src in a child process, which sends the edit of the stream back once lexing worked
+static void rebuild(watcher *W, watched_source *src)
+{
+    fflush(stdout);
+    fflush(stderr);
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        stream_edit E;
+        stream_diff(&src->S, &E);
+        FILE *edit = fdopen(fds[1], "w");
+        if (!edit)
+            exit(1);
+        stream_edit_write(edit, &E);
+        if (fclose(edit) != 0)
+            exit(1);
+        stream_splice(&src->S, &E);
+        exit(parse_source(W, src));
+    }
+    close(fds[1]);
+    FILE *edit = fdopen(fds[0], "r");
+    stream_edit E;
+    bool ok = edit && stream_edit_read(edit, &E);
+    if (edit)
+        fclose(edit);
+    else
+        close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!ok)
+        return;
+    bool first = !src->lexed;
+    size_t relexed = stream_splice(&src->S, &E);
+    src->lexed = true;
+    if (!first)
+        printf("Re-lexed %zu of %zu tokens of %s\n", relexed, src->S.count, src->filename);
+    fflush(stdout);
+    update_deps(W, src);
+}
+
+static watched_source *add_source(watcher *W, const char *filename)
+{
+    char *real = resolve(filename);
+    if (!real || strtab_contains(&W->known, real))
+    {
+        mem_free(real);
+        return NULL;
+    }
+    strtab_add(&W->known, real);
+    mem_free(real);
+    if (W->count == W->capacity)
+    {
+        W->capacity = W->capacity ? W->capacity * 2 : 16;
+        W->sources = mem_realloc(MEM_OTHER, W->sources, W->capacity * sizeof(watched_source));
+    }
+    watched_source *src = &W->sources[W->count++];
+    memset(src, 0, sizeof(*src));
+    src->filename = mem_strdup(MEM_OTHER, filename);
+    src->S.filename = src->filename;
+    src->outfilename = output_filename(src->filename, ".parser");
+    return src;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    char *path = mem_alloc(MEM_OTHER, len + strlen(name) + 2);
+    sprintf(path, len && dir[len - 1] == '/' ? "%s%s" : "%s/%s", dir, name);
+    return path;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds every source in a directory given as an argument, in name order
+static void add_directory(watcher *W, const char *dirname)
+{
+    watch_dir(W, dirname, dirname);
+    DIR *dir = opendir(dirname);
+    if (!dir)
+        return;
+    char **names = NULL;
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!is_source(entry->d_name))
+            continue;
+        names = mem_realloc(MEM_OTHER, names, (count + 1) * sizeof(char *));
+        names[count++] = join_path(dirname, entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < count; i++)
+    {
+        add_source(W, names[i]);
+        mem_free(names[i]);
+    }
+    mem_free(names);
+}
+
+/*
+Reads the pending inotify events into changed (real paths), and new sources
+in watched directories into added (display names).
+*/
+static void read_events(watcher *W, dep_list *changed, dep_list *added)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(W->fd, buffer, sizeof(buffer));
+    for (char *p = buffer; len > 0 && p < buffer + len;)
+    {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (!event->len)
+            continue;
+        for (size_t i = 0; i < W->ndirs; i++)
+        {
+            if (W->dirs[i].wd != event->wd)
+                continue;
+            char *path = join_path(W->dirs[i].path, event->name);
+            if (strtab_contains(&W->known, path) || !W->dirs[i].name || !is_source(event->name))
+                strtab_add(&changed->visited, path);
+            else if (!(event->mask & (IN_DELETE | IN_MOVED_FROM)))
+            {
+                char *name = join_path(W->dirs[i].name, event->name);
+                size_t seen = added->visited.count;
+                strtab_add(&added->visited, name);
+                if (added->visited.count != seen)
+                {
+                    added->files = mem_realloc(MEM_OTHER, added->files, (added->count + 1) * sizeof(char *));
+                    added->files[added->count++] = name;
+                }
+                else
+                    mem_free(name);
+            }
+            mem_free(path);
+            break;
+        }
+    }
+}
+
+static bool depends_on(watched_source *src, dep_list *changed)
+{
+    for (size_t i = 0; i < src->deps.count; i++)
+    {
+        if (strtab_contains(&changed->visited, src->deps.files[i]))
+            return true;
+    }
+    return false;
+}
+
+// Builds every source, then rebuilds the affected ones whenever a file changes
+int watch_files(char **paths, int npaths, bool decls_only)
+{
+    watcher W;
+    memset(&W, 0, sizeof(W));
+    W.decls_only = decls_only;
+    W.fd = inotify_init1(IN_CLOEXEC);
+    if (W.fd < 0)
+    {
+        perror("inotify_init1");
+        return 1;
+    }
+    for (int i = 0; i < npaths; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0)
+        {
+            fprintf(stderr, "Error: No such input file %s\n", paths[i]);
+            return 1;
+        }
+        if (S_ISDIR(st.st_mode))
+            add_directory(&W, paths[i]);
+        else
+            add_source(&W, paths[i]);
+    }
+    if (W.count == 0)
+    {
+        fprintf(stderr, "Error: No source files to watch\n");
+        return 1;
+    }
+    for (size_t i = 0; i < W.count; i++)
+    {
+        add_dep(&W, &W.sources[i], W.sources[i].filename);
+        rebuild(&W, &W.sources[i]);
+    }
+    printf("Watching %zu files for changes\n", W.count);
+    fflush(stdout);
+
+    while (true)
+    {
+        struct pollfd pfd = {W.fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0)
+            continue;
+        dep_list changed, added;
+        memset(&changed, 0, sizeof(changed));
+        memset(&added, 0, sizeof(added));
+        read_events(&W, &changed, &added);
+        // Keep collecting until nothing happened for a whole debounce window
+        while (poll(&pfd, 1, WATCH_DEBOUNCE_MS) > 0)
+            read_events(&W, &changed, &added);
+
+        size_t existing = W.count;
+        for (size_t i = 0; i < added.count; i++)
+        {
+            if (access(added.files[i], R_OK) == 0)
+                add_source(&W, added.files[i]);
+        }
+        for (size_t i = 0; i < W.count; i++)
+        {
+            if (i >= existing || depends_on(&W.sources[i], &changed))
+                rebuild(&W, &W.sources[i]);
+        }
+        dep_list_free(&changed);
+        dep_list_free(&added);
+    }
+}
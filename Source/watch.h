@@ -0,0 +1,10 @@
+#include <stdbool.h>
+#ifndef WATCH_H
+#define WATCH_H
+
+// How long to wait for further changes after one is seen, so a burst of saves causes one rebuild
+#define WATCH_DEBOUNCE_MS 100
+
+int watch_files(char **paths, int npaths, bool decls_only);
+
+#endif
@@ -0,0 +1,1957 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "x86.h"
+#include "intern.h"
+#include "mem.h"
+
+#define NO_RANK UINT32_MAX
+
+// General purpose registers, in encoding order
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+static const char *const gpr_names[] = {
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+    "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"
+};
+
+static const int int_args[] = {RDI, RSI, RDX, RCX, R8, R9};
+#define INT_ARGS 6
+#define FLOAT_ARGS 8
+
+/*
+Registers values can be given. rax, rdx and r11 never are: division needs
+rax and rdx, and an operand or a result in memory goes through rax or r11.
+The caller-saved registers come first, so that a function only saves the
+callee-saved ones it needs for values that live across a call.
+*/
+static const int gpr_pool[] = {RSI, RDI, R8, R9, R10, RCX, RBX, R12, R13, R14, R15};
+#define GPR_POOL 11
+#define GPR_CALLER_SAVED 6
+static const bool callee_saved[16] = {[RBX] = true, [R12] = true, [R13] = true, [R14] = true, [R15] = true};
+
+// xmm0 to xmm13 can be given to values, and every one is caller-saved
+#define XMM_POOL 14
+#define XMM_SCRATCH 14 // An operand in memory that has to be in a register
+#define XMM_TEMP 15 // A result bound for memory, or a value taken out of a cycle of moves
+
+enum {
+    LOC_NONE,
+    LOC_GPR,
+    LOC_XMM,
+    LOC_MEM,    // offset bytes from the base register reg
+    LOC_IMM,    // An int constant that fits an instruction
+    LOC_FCONST, // A float constant, in the read-only data of instruction offset
+    LOC_STRING, // The string literal named imm, for leaq
+    LOC_SYMBOL, // The global named imm, for leaq
+    LOC_SIGN,   // The mask of the sign bit of a double, for xorpd
+    LOC_TABLE   // The jump table of the switch instruction offset, for leaq
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t reg;
+    int32_t offset;
+    int64_t imm;
+} location;
+
+// Condition codes, each next to its inverse
+enum {
+    CC_E, CC_NE,
+    CC_L, CC_GE,
+    CC_LE, CC_G,
+    CC_A, CC_BE,
+    CC_AE, CC_B,
+    CC_P, CC_NP
+};
+
+static const char *const cc_names[] = {"e", "ne", "l", "ge", "le", "g", "a", "be", "ae", "b", "p", "np"};
+static const uint8_t cc_codes[] = {0x4, 0x5, 0xC, 0xD, 0xE, 0xF, 0x7, 0x6, 0x3, 0x2, 0xA, 0xB};
+
+// Instructions with operands of their own
+enum {
+    X_MOVQ, X_MOVABSQ, X_LEAQ, X_PUSHQ,
+    X_ADDQ, X_SUBQ, X_ANDQ, X_ORQ, X_CMPQ, X_TESTQ, X_IMULQ,
+    X_NEGQ, X_NOTQ, X_IDIVQ, X_SHLQ, X_SARQ, X_SHRQ,
+    X_MOVSD, X_MOVAPD, X_ADDSD, X_SUBSD, X_MULSD, X_DIVSD, X_UCOMISD, X_XORPD,
+    X_CVTSI2SDQ, X_CVTTSD2SIQ
+};
+
+static const char *const mnemonics[] = {
+    "movq", "movabsq", "leaq", "pushq",
+    "addq", "subq", "andq", "orq", "cmpq", "testq", "imulq",
+    "negq", "notq", "idivq", "shlq", "sarq", "shrq",
+    "movsd", "movapd", "addsd", "subsd", "mulsd", "divsd", "ucomisd", "xorpd",
+    "cvtsi2sdq", "cvttsd2siq"
+};
+
+#define CC_INVERSE(cc) ((cc) ^ 1)
+
+typedef struct {
+    location dst, src;
+    uint8_t type;
+} move;
+
+typedef struct {
+    ir_module *M;
+    FILE *out; // NULL when writing machine code
+    const x86_links *links; // For machine code
+    uint8_t *code; // Machine code of the function being compiled
+    size_t ncode;
+    size_t code_capacity;
+    bool naive;
+    x86_stats *stats;
+    uint32_t *strings; // Literals to write once every function is, with repeats
+    uint32_t nstrings;
+    uint32_t strings_capacity;
+    bool sign_mask; // A float was negated
+} writer;
+
+// A 4-byte field at offset at in the code, to hold the offset of label from base
+typedef struct {
+    size_t at;
+    size_t base; // The end of the field for a rel32, the start of the table for an entry of a jump table
+    uint32_t label;
+} fixup;
+
+/*
+One function. Blocks are laid out in reverse postorder and every
+instruction gets a position in that order, two apart so that a block has
+positions of its own at both ends. A value's live interval is the range of
+positions from its definition to its last use, taken over the whole layout
+without holes, and linear scan hands out registers by walking the intervals
+by start.
+*/
+typedef struct {
+    writer *W;
+    ir_function *F;
+    uint32_t index; // Of the function in the module, for its labels
+    uint32_t *order; // Reachable blocks in layout order
+    uint32_t norder;
+    uint32_t *rank; // Index of each block in order
+    uint32_t *from, *to; // Positions of the ends of each block
+    uint32_t *pos; // Position of each instruction
+    uint32_t *start, *end; // Live interval of each value
+    uint32_t *uses;
+    bool *fused; // Comparisons left to the branch right after them
+    bool *placed; // Values that need a register or a stack slot
+    location *locs;
+    uint32_t *calls; // Positions of the calls, in order
+    uint32_t ncalls;
+    int64_t frame; // Bytes of the frame below rbp
+    int32_t *slots; // Frame offset of each slot
+    bool saved[16];
+    int32_t save_offset[16];
+    int cond; // Condition code of the last fused comparison
+    int64_t *labels; // For machine code, the offset of each label in the code, or -1
+    fixup *fixups; // And the rel32 fields to point at them
+    uint32_t nfixups;
+    uint32_t fixups_capacity;
+    bool sign_mask; // The function negates a float
+} emitter;
+
+static void *grow(void *items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    return mem_realloc(MEM_IR, items, (size_t)*capacity * size);
+}
+
+static location gpr(int reg)
+{
+    return (location){LOC_GPR, reg, 0, 0};
+}
+
+static location xmm(int reg)
+{
+    return (location){LOC_XMM, reg, 0, 0};
+}
+
+static location memory(int base, int32_t offset)
+{
+    return (location){LOC_MEM, base, offset, 0};
+}
+
+static bool same_place(location a, location b)
+{
+    if (a.kind != b.kind)
+        return false;
+    switch (a.kind)
+    {
+    case LOC_GPR:
+    case LOC_XMM:
+        return a.reg == b.reg;
+    case LOC_MEM:
+        return a.reg == b.reg && a.offset == b.offset;
+    case LOC_IMM:
+        return a.imm == b.imm;
+    case LOC_FCONST:
+        return a.offset == b.offset;
+    default:
+        return true;
+    }
+}
+
+static location immediate(int64_t value)
+{
+    return (location){LOC_IMM, 0, 0, value};
+}
+
+// Labels: the blocks, then the edges into phis, two per block, then the float constants and the jump
+// tables by instruction, then the sign mask
+static uint32_t edge_label(const emitter *E, uint32_t block, uint32_t k)
+{
+    return E->F->nblocks + 2 * block + k;
+}
+
+static uint32_t constant_label(const emitter *E, uint32_t inst)
+{
+    return 3 * E->F->nblocks + inst;
+}
+
+static uint32_t sign_label(const emitter *E)
+{
+    return 3 * E->F->nblocks + E->F->ninsts;
+}
+
+static void put_label(emitter *E, uint32_t label)
+{
+    uint32_t nblocks = E->F->nblocks;
+    if (label < nblocks)
+        fprintf(E->W->out, ".Lb%u_%u", E->index, label);
+    else
+        fprintf(E->W->out, ".Le%u_%u_%u", E->index, (label - nblocks) / 2, (label - nblocks) % 2);
+}
+
+static void put(emitter *E, location L)
+{
+    FILE *out = E->W->out;
+    switch (L.kind)
+    {
+    case LOC_GPR:
+        fputs(gpr_names[L.reg], out);
+        break;
+    case LOC_XMM:
+        fprintf(out, "%%xmm%u", L.reg);
+        break;
+    case LOC_MEM:
+        if (L.offset)
+            fprintf(out, "%d", L.offset);
+        fprintf(out, "(%s)", gpr_names[L.reg]);
+        break;
+    case LOC_IMM:
+        fprintf(out, "$%lld", (long long)L.imm);
+        break;
+    case LOC_FCONST:
+        fprintf(out, ".Lf%u_%d(%%rip)", E->index, L.offset);
+        break;
+    case LOC_STRING:
+        fprintf(out, ".Ls%u(%%rip)", (uint32_t)L.imm);
+        break;
+    case LOC_SYMBOL:
+        fprintf(out, "%s(%%rip)", intern_text((uint32_t)L.imm));
+        break;
+    case LOC_SIGN:
+        fputs(".Lsign(%rip)", out);
+        break;
+    case LOC_TABLE:
+        fprintf(out, ".Lt%u_%d(%%rip)", E->index, L.offset);
+        break;
+    }
+}
+
+// Machine code
+
+static void code_byte(emitter *E, uint8_t b)
+{
+    writer *W = E->W;
+    if (W->ncode == W->code_capacity)
+    {
+        W->code_capacity = W->code_capacity ? W->code_capacity * 2 : 4096;
+        W->code = mem_realloc(MEM_IR, W->code, W->code_capacity);
+    }
+    W->code[W->ncode++] = b;
+}
+
+static void code_bytes(emitter *E, const char *bytes, size_t count)
+{
+    for (size_t k = 0; k < count; k++)
+        code_byte(E, (uint8_t)bytes[k]);
+}
+
+static void code_int(emitter *E, uint64_t value, unsigned size)
+{
+    for (unsigned k = 0; k < size; k++)
+        code_byte(E, (uint8_t)(value >> 8 * k));
+}
+
+// A 4-byte field to hold the offset of label from base once every label has its place
+static void code_offset(emitter *E, uint32_t label, size_t base)
+{
+    E->fixups = grow(E->fixups, E->nfixups, &E->fixups_capacity, sizeof(fixup));
+    E->fixups[E->nfixups++] = (fixup){E->W->ncode, base, label};
+    code_int(E, 0, 4);
+}
+
+// A rel32 field to point at label
+static void code_fixup(emitter *E, uint32_t label)
+{
+    code_offset(E, label, E->W->ncode + 4);
+}
+
+/*
+An instruction with a ModRM byte: prefix (0x66, 0xF2 or none), REX if
+needed, the opcode (0x0Fxx for two bytes), then reg and the register or
+memory operand rm. Memory relative to rsp or r12 needs a SIB byte, and to
+rbp or r13 a displacement even when it is 0. Constants are addressed
+relative to rip, which only instructions without an immediate do, as the
+displacement has to come last.
+*/
+static void encode_rm(emitter *E, uint8_t prefix, bool wide, unsigned opcode, unsigned reg, location rm)
+{
+    unsigned base = rm.kind == LOC_GPR || rm.kind == LOC_XMM || rm.kind == LOC_MEM ? rm.reg : 0;
+    if (prefix)
+        code_byte(E, prefix);
+    uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+    if (rex != 0x40)
+        code_byte(E, rex);
+    if (opcode > 0xFF)
+        code_byte(E, 0x0F);
+    code_byte(E, opcode & 0xFF);
+    reg &= 7;
+    switch (rm.kind)
+    {
+    case LOC_GPR:
+    case LOC_XMM:
+        code_byte(E, 0xC0 | reg << 3 | (base & 7));
+        break;
+    case LOC_MEM:
+    {
+        unsigned mod = rm.offset == 0 && (base & 7) != RBP ? 0 : rm.offset >= -128 && rm.offset <= 127 ? 1 : 2;
+        code_byte(E, mod << 6 | reg << 3 | (base & 7));
+        if ((base & 7) == RSP)
+            code_byte(E, 0x24);
+        if (mod)
+            code_int(E, (uint64_t)(int64_t)rm.offset, mod == 1 ? 1 : 4);
+        break;
+    }
+    default:
+        code_byte(E, reg << 3 | 5);
+        code_fixup(E, rm.kind == LOC_SIGN ? sign_label(E) : constant_label(E, (uint32_t)rm.offset));
+        break;
+    }
+}
+
+// The address of a string literal or a global, which is known, and need not be near the code
+static uint64_t absolute_address(emitter *E, location L)
+{
+    if (L.kind == LOC_STRING)
+        return (uint64_t)(uintptr_t)intern_text((uint32_t)L.imm);
+    const ir_module *M = E->W->M;
+    return (uint64_t)(uintptr_t)E->W->links->globals[ir_find_global(M, (uint32_t)L.imm) - M->globals];
+}
+
+static void encode(emitter *E, unsigned op, location src, location dst)
+{
+    static const uint8_t alu_opcodes[] = {[X_ADDQ] = 0x01, [X_ORQ] = 0x09, [X_ANDQ] = 0x21, [X_SUBQ] = 0x29, [X_CMPQ] = 0x39};
+    static const uint8_t digits[] = {
+        [X_ADDQ] = 0, [X_ORQ] = 1, [X_ANDQ] = 4, [X_SUBQ] = 5, [X_CMPQ] = 7,
+        [X_NOTQ] = 2, [X_NEGQ] = 3, [X_IDIVQ] = 7, [X_SHLQ] = 4, [X_SHRQ] = 5, [X_SARQ] = 7
+    };
+    static const uint16_t sse_opcodes[] = {
+        [X_MOVAPD] = 0x0F28, [X_ADDSD] = 0x0F58, [X_MULSD] = 0x0F59, [X_SUBSD] = 0x0F5C, [X_DIVSD] = 0x0F5E,
+        [X_UCOMISD] = 0x0F2E, [X_XORPD] = 0x0F57, [X_CVTSI2SDQ] = 0x0F2A, [X_CVTTSD2SIQ] = 0x0F2C
+    };
+    switch (op)
+    {
+    case X_MOVQ:
+        if (src.kind == LOC_IMM)
+        {
+            encode_rm(E, 0, true, 0xC7, 0, dst);
+            code_int(E, (uint64_t)src.imm, 4);
+        }
+        else if (src.kind == LOC_GPR)
+            encode_rm(E, 0, true, 0x89, src.reg, dst);
+        else
+            encode_rm(E, 0, true, 0x8B, dst.reg, src);
+        break;
+    case X_MOVABSQ:
+        code_byte(E, 0x48 | dst.reg >> 3);
+        code_byte(E, 0xB8 + (dst.reg & 7));
+        code_int(E, (uint64_t)src.imm, 8);
+        break;
+    case X_LEAQ:
+        if (src.kind == LOC_STRING || src.kind == LOC_SYMBOL)
+            encode(E, X_MOVABSQ, immediate((int64_t)absolute_address(E, src)), dst);
+        else
+            encode_rm(E, 0, true, 0x8D, dst.reg, src);
+        break;
+    case X_PUSHQ:
+        if (src.kind == LOC_GPR)
+        {
+            if (src.reg >= 8)
+                code_byte(E, 0x41);
+            code_byte(E, 0x50 + (src.reg & 7));
+        }
+        else if (src.kind == LOC_IMM)
+        {
+            code_byte(E, 0x68);
+            code_int(E, (uint64_t)src.imm, 4);
+        }
+        else
+            encode_rm(E, 0, false, 0xFF, 6, src);
+        break;
+    case X_ADDQ:
+    case X_SUBQ:
+    case X_ANDQ:
+    case X_ORQ:
+    case X_CMPQ:
+        if (src.kind == LOC_IMM && src.imm >= -128 && src.imm <= 127)
+        {
+            encode_rm(E, 0, true, 0x83, digits[op], dst);
+            code_byte(E, (uint8_t)src.imm);
+        }
+        else if (src.kind == LOC_IMM)
+        {
+            encode_rm(E, 0, true, 0x81, digits[op], dst);
+            code_int(E, (uint64_t)src.imm, 4);
+        }
+        else if (src.kind == LOC_GPR)
+            encode_rm(E, 0, true, alu_opcodes[op], src.reg, dst);
+        else
+            encode_rm(E, 0, true, alu_opcodes[op] + 2, dst.reg, src);
+        break;
+    case X_TESTQ:
+        encode_rm(E, 0, true, 0x85, src.reg, dst);
+        break;
+    case X_IMULQ:
+        if (src.kind == LOC_IMM)
+        {
+            encode_rm(E, 0, true, 0x69, dst.reg, dst);
+            code_int(E, (uint64_t)src.imm, 4);
+        }
+        else
+            encode_rm(E, 0, true, 0x0FAF, dst.reg, src);
+        break;
+    case X_NEGQ:
+    case X_NOTQ:
+    case X_IDIVQ:
+        encode_rm(E, 0, true, 0xF7, digits[op], dst);
+        break;
+    case X_SHLQ:
+    case X_SARQ:
+    case X_SHRQ:
+        encode_rm(E, 0, true, 0xC1, digits[op], dst);
+        code_byte(E, (uint8_t)src.imm);
+        break;
+    case X_MOVSD:
+        if (dst.kind == LOC_XMM)
+            encode_rm(E, 0xF2, false, 0x0F10, dst.reg, src);
+        else
+            encode_rm(E, 0xF2, false, 0x0F11, src.reg, dst);
+        break;
+    case X_CVTSI2SDQ:
+    case X_CVTTSD2SIQ:
+        encode_rm(E, 0xF2, true, sse_opcodes[op], dst.reg, src);
+        break;
+    default:
+        encode_rm(E, op == X_MOVAPD || op == X_UCOMISD || op == X_XORPD ? 0x66 : 0xF2, false, sse_opcodes[op], dst.reg, src);
+        break;
+    }
+}
+
+// Output, as assembly or machine code
+
+static void ins1(emitter *E, unsigned op, location a)
+{
+    if (!E->W->out)
+    {
+        encode(E, op, a, a);
+        return;
+    }
+    fprintf(E->W->out, "\t%s ", mnemonics[op]);
+    put(E, a);
+    fputc('\n', E->W->out);
+}
+
+static void ins2(emitter *E, unsigned op, location src, location dst)
+{
+    if (!E->W->out)
+    {
+        encode(E, op, src, dst);
+        return;
+    }
+    fprintf(E->W->out, "\t%s ", mnemonics[op]);
+    put(E, src);
+    fputs(", ", E->W->out);
+    put(E, dst);
+    fputc('\n', E->W->out);
+}
+
+// An instruction without operands of its own, as text or as the bytes of its code
+static void fixed(emitter *E, const char *text, const char *code, size_t size)
+{
+    if (E->W->out)
+        fputs(text, E->W->out);
+    else
+        code_bytes(E, code, size);
+}
+
+// Sets the byte register al or dl to whether cc holds
+static void set_byte(emitter *E, int cc, int reg)
+{
+    if (E->W->out)
+    {
+        fprintf(E->W->out, "\tset%s %%%s\n", cc_names[cc], reg == RAX ? "al" : "dl");
+        return;
+    }
+    code_byte(E, 0x0F);
+    code_byte(E, 0x90 + cc_codes[cc]);
+    code_byte(E, 0xC0 | reg);
+}
+
+// Jumps to label, unconditionally when cc is negative
+static void jump_label(emitter *E, int cc, uint32_t label)
+{
+    if (E->W->out)
+    {
+        fprintf(E->W->out, "\tj%s ", cc < 0 ? "mp" : cc_names[cc]);
+        put_label(E, label);
+        fputc('\n', E->W->out);
+        return;
+    }
+    if (cc < 0)
+        code_byte(E, 0xE9);
+    else
+    {
+        code_byte(E, 0x0F);
+        code_byte(E, 0x80 + cc_codes[cc]);
+    }
+    code_fixup(E, label);
+}
+
+static void place_label(emitter *E, uint32_t label)
+{
+    if (!E->W->out)
+    {
+        E->labels[label] = (int64_t)E->W->ncode;
+        return;
+    }
+    put_label(E, label);
+    fputs(":\n", E->W->out);
+}
+
+// Copies a value of type from src to dst, through a scratch register between two places in memory
+static void copy(emitter *E, uint8_t type, location dst, location src)
+{
+    if (same_place(dst, src))
+        return;
+    if (type == IR_FLOAT)
+    {
+        if (dst.kind == LOC_XMM)
+            ins2(E, src.kind == LOC_XMM ? X_MOVAPD : X_MOVSD, src, dst);
+        else if (src.kind == LOC_XMM)
+            ins2(E, X_MOVSD, src, dst);
+        else
+        {
+            ins2(E, X_MOVSD, src, xmm(XMM_SCRATCH));
+            ins2(E, X_MOVSD, xmm(XMM_SCRATCH), dst);
+        }
+        return;
+    }
+    if (dst.kind == LOC_GPR || src.kind != LOC_MEM)
+        ins2(E, X_MOVQ, src, dst);
+    else
+    {
+        ins2(E, X_MOVQ, src, gpr(R11));
+        ins2(E, X_MOVQ, gpr(R11), dst);
+    }
+}
+
+/*
+Moves that all read their sources before any writes its destination, as
+for the phis of a block or the arguments of a call. A move goes once no
+other move still reads its destination. When none can go, the rest are
+cycles, and one source is taken out of the way to a temporary register.
+*/
+static void parallel_copy(emitter *E, move *moves, uint32_t count)
+{
+    uint32_t n = 0;
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (!same_place(moves[k].dst, moves[k].src))
+            moves[n++] = moves[k];
+    }
+    while (n)
+    {
+        bool progress = false;
+        for (uint32_t k = 0; k < n; k++)
+        {
+            bool blocked = false;
+            for (uint32_t j = 0; j < n && !blocked; j++)
+                blocked = j != k && same_place(moves[j].src, moves[k].dst);
+            if (blocked)
+                continue;
+            copy(E, moves[k].type, moves[k].dst, moves[k].src);
+            moves[k--] = moves[--n];
+            progress = true;
+        }
+        if (progress)
+            continue;
+        location src = moves[0].src;
+        location temp = moves[0].type == IR_FLOAT ? xmm(XMM_TEMP) : gpr(RAX);
+        copy(E, moves[0].type, temp, src);
+        for (uint32_t j = 0; j < n; j++)
+        {
+            if (same_place(moves[j].src, src))
+                moves[j].src = temp;
+        }
+    }
+}
+
+// Layout
+
+static void layout(emitter *E)
+{
+    ir_function *F = E->F;
+    uint32_t *stack = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    uint32_t *next = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    bool *seen = mem_calloc(MEM_IR, F->nblocks, sizeof(bool));
+    uint32_t *post = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    uint32_t npost = 0, n = 1;
+    stack[0] = 0;
+    next[0] = 0;
+    seen[0] = true;
+    while (n)
+    {
+        ir_block *B = &F->blocks[stack[n - 1]];
+        if (next[n - 1] < B->succs.count)
+        {
+            // Later successors first, so that the first is laid out right after the block
+            uint32_t s = ir_list_at(F, B->succs)[B->succs.count - 1 - next[n - 1]++];
+            if (!seen[s])
+            {
+                seen[s] = true;
+                stack[n] = s;
+                next[n++] = 0;
+            }
+            continue;
+        }
+        post[npost++] = stack[--n];
+    }
+    E->order = mem_alloc(MEM_IR, npost * sizeof(uint32_t));
+    E->rank = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    for (uint32_t b = 0; b < F->nblocks; b++)
+        E->rank[b] = NO_RANK;
+    for (uint32_t k = 0; k < npost; k++)
+    {
+        E->order[k] = post[npost - 1 - k];
+        E->rank[E->order[k]] = k;
+    }
+    E->norder = npost;
+    mem_free(stack);
+    mem_free(next);
+    mem_free(seen);
+    mem_free(post);
+}
+
+static bool has_phis(const ir_function *F, uint32_t block)
+{
+    uint32_t first = F->blocks[block].first;
+    return first && F->insts[first].op == IR_PHI;
+}
+
+static bool is_compare(unsigned op)
+{
+    return op >= IR_EQ && op <= IR_GE;
+}
+
+/*
+Counts uses, fuses each comparison that only feeds the branch right after
+it, and decides which values need a place: int constants that fit in 32
+bits are immediates, and float constants are read from memory where used.
+*/
+static void prepare(emitter *E)
+{
+    ir_function *F = E->F;
+    E->uses = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    E->fused = mem_calloc(MEM_IR, F->ninsts, sizeof(bool));
+    E->placed = mem_calloc(MEM_IR, F->ninsts, sizeof(bool));
+    E->locs = mem_calloc(MEM_IR, F->ninsts, sizeof(location));
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        for (uint32_t i = F->blocks[E->order[k]].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            for (uint32_t j = 0; j < ir_operand_count(I); j++)
+                E->uses[*ir_operand(F, I, j)]++;
+        }
+    }
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        for (uint32_t i = F->blocks[E->order[k]].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->op == IR_BRANCH)
+            {
+                // Float equality needs the parity flag as well, so it is not fused
+                ir_inst *C = &F->insts[I->a];
+                if (is_compare(C->op) && E->uses[I->a] == 1 && C->next == i &&
+                    !(F->insts[C->a].type == IR_FLOAT && (C->op == IR_EQ || C->op == IR_NE)))
+                    E->fused[I->a] = true;
+            }
+            if (I->op == IR_CONST && I->type == IR_FLOAT)
+                E->locs[i] = (location){LOC_FCONST, 0, (int32_t)i, 0};
+            else if (I->op == IR_CONST && I->value.i >= INT32_MIN && I->value.i <= INT32_MAX)
+                E->locs[i] = (location){LOC_IMM, 0, 0, I->value.i};
+            else
+                E->placed[i] = I->type != IR_VOID && E->uses[i] > 0;
+        }
+    }
+    for (uint32_t i = 0; i < F->ninsts; i++)
+    {
+        if (E->fused[i])
+            E->placed[i] = false;
+    }
+}
+
+#define SET_HAS(set, i) ((set)[(i) >> 6] >> ((i) & 63) & 1)
+#define SET_ADD(set, i) ((set)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+
+static void extend(emitter *E, uint32_t value, uint32_t at)
+{
+    if (at < E->start[value])
+        E->start[value] = at;
+    if (at > E->end[value])
+        E->end[value] = at;
+}
+
+/*
+Live intervals from the sets of values live into and out of each block,
+found by iterating to a fixpoint backwards over the layout. A phi reads its
+operand at the end of the predecessor it came by, and is written there, so
+the interval of a phi covers the ends of its predecessors too. Parameters
+are written before the first instruction, at position 0.
+*/
+static void intervals(emitter *E)
+{
+    ir_function *F = E->F;
+    uint32_t words = (F->ninsts + 63) / 64;
+    uint64_t *sets = mem_calloc(MEM_IR, (size_t)E->norder * 4 * words, sizeof(uint64_t));
+    uint64_t *gen = sets, *kill = sets + (size_t)E->norder * words;
+    uint64_t *live_in = kill + (size_t)E->norder * words, *live_out = live_in + (size_t)E->norder * words;
+    E->pos = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    E->from = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    E->to = mem_alloc(MEM_IR, F->nblocks * sizeof(uint32_t));
+    uint32_t at = 2, calls_capacity = 0;
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        uint32_t b = E->order[k];
+        uint64_t *g = gen + (size_t)k * words, *d = kill + (size_t)k * words;
+        E->from[b] = at;
+        at += 2;
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            E->pos[i] = at;
+            at += 2;
+            if (I->op == IR_CALL)
+            {
+                E->calls = grow(E->calls, E->ncalls, &calls_capacity, sizeof(uint32_t));
+                E->calls[E->ncalls++] = E->pos[i];
+            }
+            if (I->op != IR_PHI)
+            {
+                for (uint32_t j = 0; j < ir_operand_count(I); j++)
+                {
+                    uint32_t u = *ir_operand(F, I, j);
+                    if (E->placed[u] && !SET_HAS(d, u))
+                        SET_ADD(g, u);
+                }
+            }
+            if (E->placed[i])
+                SET_ADD(d, i);
+        }
+        E->to[b] = at;
+        at += 2;
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (uint32_t k = E->norder; k-- > 0;)
+        {
+            uint32_t b = E->order[k];
+            ir_block *B = &F->blocks[b];
+            uint64_t *out = live_out + (size_t)k * words, *in = live_in + (size_t)k * words;
+            for (uint32_t j = 0; j < B->succs.count; j++)
+            {
+                uint32_t s = ir_list_at(F, B->succs)[j];
+                uint64_t *s_in = live_in + (size_t)E->rank[s] * words;
+                for (uint32_t w = 0; w < words; w++)
+                    out[w] |= s_in[w];
+                uint32_t operand = ir_edge_operand(F, b, j);
+                for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+                {
+                    uint32_t u = F->pool[F->insts[i].a + operand];
+                    if (E->placed[u])
+                        SET_ADD(out, u);
+                }
+            }
+            uint64_t *g = gen + (size_t)k * words, *d = kill + (size_t)k * words;
+            for (uint32_t w = 0; w < words; w++)
+            {
+                uint64_t value = g[w] | (out[w] & ~d[w]);
+                if (value != in[w])
+                {
+                    in[w] = value;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    E->start = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    E->end = mem_calloc(MEM_IR, F->ninsts, sizeof(uint32_t));
+    for (uint32_t i = 0; i < F->ninsts; i++)
+        E->start[i] = UINT32_MAX;
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        uint32_t b = E->order[k];
+        uint64_t *in = live_in + (size_t)k * words, *out = live_out + (size_t)k * words;
+        for (uint32_t w = 0; w < words; w++)
+        {
+            for (uint64_t bits = in[w]; bits; bits &= bits - 1)
+                extend(E, w * 64 + __builtin_ctzll(bits), E->from[b]);
+            for (uint64_t bits = out[w]; bits; bits &= bits - 1)
+                extend(E, w * 64 + __builtin_ctzll(bits), E->to[b]);
+        }
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (E->placed[i])
+                extend(E, i, I->op == IR_PARAM ? 0 : E->pos[i]);
+            if (I->op == IR_PHI)
+            {
+                ir_block *B = &F->blocks[b];
+                for (uint32_t j = 0; j < B->preds.count; j++)
+                {
+                    uint32_t p = ir_list_at(F, B->preds)[j];
+                    if (E->placed[i] && E->rank[p] != NO_RANK)
+                        extend(E, i, E->to[p]);
+                }
+                continue;
+            }
+            for (uint32_t j = 0; j < ir_operand_count(I); j++)
+            {
+                uint32_t u = *ir_operand(F, I, j);
+                if (E->placed[u])
+                    extend(E, u, E->pos[i]);
+            }
+        }
+    }
+    mem_free(sets);
+}
+
+// Allocation
+
+static bool crosses_call(const emitter *E, uint32_t value)
+{
+    uint32_t low = 0, high = E->ncalls;
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+        if (E->calls[mid] <= E->start[value])
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < E->ncalls && E->calls[low] < E->end[value];
+}
+
+static void spill(emitter *E, uint32_t value)
+{
+    E->frame += IR_SCALAR_SIZE;
+    E->locs[value] = memory(RBP, (int32_t)-E->frame);
+}
+
+typedef struct {
+    uint32_t start;
+    uint32_t value;
+} interval;
+
+static int by_start(const void *a, const void *b)
+{
+    const interval *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+// Index in its pool of a register location, or -1
+static int pool_index_of(location L)
+{
+    if (L.kind == LOC_XMM)
+        return L.reg;
+    for (int r = 0; L.kind == LOC_GPR && r < GPR_POOL; r++)
+    {
+        if (gpr_pool[r] == L.reg)
+            return r;
+    }
+    return -1;
+}
+
+/*
+The register that saves a move if it is still free: the one a parameter
+arrives in, the one of an operand of a phi, or for arithmetic, the one of
+its first operand, which the instruction overwrites in place.
+*/
+static int hint(const emitter *E, uint32_t value)
+{
+    const ir_function *F = E->F;
+    const ir_inst *I = &F->insts[value];
+    if (I->op == IR_PARAM)
+    {
+        uint32_t ints = 0, floats = 0;
+        for (int64_t p = 0; p < I->value.i; p++)
+        {
+            if (ir_list_at(F, F->params)[p] == IR_FLOAT)
+                floats++;
+            else
+                ints++;
+        }
+        if (I->type == IR_FLOAT)
+            return floats < FLOAT_ARGS ? (int)floats : -1;
+        return ints < INT_ARGS ? pool_index_of(gpr(int_args[ints])) : -1;
+    }
+    if (I->op == IR_PHI)
+    {
+        for (uint32_t k = 0; k < I->b; k++)
+        {
+            location L = E->locs[F->pool[I->a + k]];
+            if (L.kind == LOC_GPR || L.kind == LOC_XMM)
+                return pool_index_of(L);
+        }
+        return -1;
+    }
+    if ((I->op >= IR_ADD && I->op <= IR_OR && I->op != IR_DIV && I->op != IR_MOD) || I->op == IR_NEG || I->op == IR_NOT)
+        return pool_index_of(E->locs[I->a]);
+    return -1;
+}
+
+/*
+Poletto and Sarkar's linear scan. Intervals are taken by start, the ones
+that ended free their registers, and a value that lives across a call only
+gets a callee-saved register. When no register is free, the interval that
+ends last, among the current one and the active ones holding a register
+the current one could have, goes to the stack.
+*/
+static void allocate(emitter *E)
+{
+    ir_function *F = E->F;
+    interval *todo = mem_alloc(MEM_IR, F->ninsts * sizeof(interval));
+    uint32_t *active = mem_alloc(MEM_IR, F->ninsts * sizeof(uint32_t));
+    uint32_t ntodo = 0, nactive = 0;
+    for (uint32_t i = 0; i < F->ninsts; i++)
+    {
+        if (E->placed[i])
+            todo[ntodo++] = (interval){E->start[i], i};
+    }
+    qsort(todo, ntodo, sizeof(interval), by_start);
+    bool gpr_free[GPR_POOL], xmm_free[XMM_POOL];
+    for (int r = 0; r < GPR_POOL; r++)
+        gpr_free[r] = true;
+    for (int r = 0; r < XMM_POOL; r++)
+        xmm_free[r] = true;
+    uint8_t *pool_index = mem_alloc(MEM_IR, F->ninsts);
+
+    for (uint32_t t = 0; t < ntodo; t++)
+    {
+        uint32_t v = todo[t].value;
+        bool is_float = F->insts[v].type == IR_FLOAT;
+        E->W->stats->values++;
+        if (E->W->naive)
+        {
+            spill(E, v);
+            E->W->stats->spilled++;
+            continue;
+        }
+        for (uint32_t k = 0; k < nactive; k++)
+        {
+            uint32_t a = active[k];
+            if (E->end[a] > E->start[v])
+                continue;
+            if (F->insts[a].type == IR_FLOAT)
+                xmm_free[pool_index[a]] = true;
+            else
+                gpr_free[pool_index[a]] = true;
+            active[k--] = active[--nactive];
+        }
+        bool across = crosses_call(E, v);
+        int low = is_float ? 0 : across ? GPR_CALLER_SAVED : 0;
+        int high = is_float ? (across ? 0 : XMM_POOL) : GPR_POOL;
+        bool *available = is_float ? xmm_free : gpr_free;
+        int chosen = -1, preferred = hint(E, v);
+        if (preferred >= low && preferred < high && available[preferred])
+            chosen = preferred;
+        for (int r = low; r < high && chosen < 0; r++)
+        {
+            if (available[r])
+                chosen = r;
+        }
+        if (chosen < 0)
+        {
+            uint32_t victim = v;
+            for (uint32_t k = 0; k < nactive; k++)
+            {
+                uint32_t a = active[k];
+                if ((F->insts[a].type == IR_FLOAT) == is_float && pool_index[a] >= low && pool_index[a] < high &&
+                    E->end[a] > E->end[victim])
+                    victim = a;
+            }
+            E->W->stats->spilled++;
+            spill(E, victim);
+            if (victim == v)
+                continue;
+            E->W->stats->in_registers--;
+            chosen = pool_index[victim];
+            for (uint32_t k = 0; k < nactive; k++)
+            {
+                if (active[k] == victim)
+                    active[k] = active[--nactive];
+            }
+        }
+        available[chosen] = false;
+        pool_index[v] = (uint8_t)chosen;
+        active[nactive++] = v;
+        E->W->stats->in_registers++;
+        if (is_float)
+            E->locs[v] = xmm(chosen);
+        else
+        {
+            E->locs[v] = gpr(gpr_pool[chosen]);
+            if (callee_saved[gpr_pool[chosen]])
+                E->saved[gpr_pool[chosen]] = true;
+        }
+    }
+    mem_free(todo);
+    mem_free(active);
+    mem_free(pool_index);
+}
+
+// Instructions
+
+static location int_result(location D)
+{
+    return D.kind == LOC_GPR ? D : gpr(RAX);
+}
+
+static location float_result(location D)
+{
+    return D.kind == LOC_XMM ? D : xmm(XMM_TEMP);
+}
+
+// An address operand as memory to load from or store to, through r11 unless it is in a register
+static location address(emitter *E, uint32_t value)
+{
+    location A = E->locs[value];
+    if (A.kind != LOC_GPR)
+    {
+        copy(E, IR_INT, gpr(R11), A);
+        A = gpr(R11);
+    }
+    return memory(A.reg, 0);
+}
+
+static int mirror(int op)
+{
+    switch (op)
+    {
+    case IR_LT:
+        return IR_GT;
+    case IR_LE:
+        return IR_GE;
+    case IR_GT:
+        return IR_LT;
+    case IR_GE:
+        return IR_LE;
+    default:
+        return op;
+    }
+}
+
+// Sets the flags for comparison I, giving the condition under which it holds
+static int compare(emitter *E, const ir_inst *I)
+{
+    static const uint8_t int_cc[] = {CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE};
+    location A = E->locs[I->a], B = E->locs[I->b];
+    int op = I->op;
+    if (E->F->insts[I->a].type == IR_FLOAT)
+    {
+        // ucomisd compares its register operand with the other, and only
+        // the above conditions leave out unordered, so less is swapped to greater
+        if (op == IR_LT || op == IR_LE)
+        {
+            location swap = A;
+            A = B;
+            B = swap;
+            op = mirror(op);
+        }
+        if (A.kind != LOC_XMM)
+        {
+            copy(E, IR_FLOAT, xmm(XMM_TEMP), A);
+            A = xmm(XMM_TEMP);
+        }
+        ins2(E, X_UCOMISD, B, A);
+        return op == IR_GT ? CC_A : op == IR_GE ? CC_AE : op == IR_EQ ? CC_E : CC_NE;
+    }
+    if (A.kind == LOC_IMM && B.kind != LOC_IMM)
+    {
+        location swap = A;
+        A = B;
+        B = swap;
+        op = mirror(op);
+    }
+    if (A.kind == LOC_IMM || (A.kind == LOC_MEM && B.kind == LOC_MEM))
+    {
+        copy(E, IR_INT, gpr(RAX), A);
+        A = gpr(RAX);
+    }
+    if (B.kind == LOC_IMM && B.imm == 0 && A.kind == LOC_GPR)
+        ins2(E, X_TESTQ, A, A);
+    else
+        ins2(E, X_CMPQ, B, A);
+    return int_cc[op - IR_EQ];
+}
+
+static void emit_compare(emitter *E, const ir_inst *I, location D)
+{
+    int cc = compare(E, I);
+    set_byte(E, cc, RAX);
+    // Unordered sets the parity flag, and is neither equal nor not not equal
+    if (E->F->insts[I->a].type == IR_FLOAT && I->op == IR_EQ)
+    {
+        set_byte(E, CC_NP, RDX);
+        fixed(E, "\tandb %dl, %al\n", "\x20\xD0", 2);
+    }
+    else if (E->F->insts[I->a].type == IR_FLOAT && I->op == IR_NE)
+    {
+        set_byte(E, CC_P, RDX);
+        fixed(E, "\torb %dl, %al\n", "\x08\xD0", 2);
+    }
+    location R = int_result(D);
+    if (E->W->out)
+        fprintf(E->W->out, "\tmovzbq %%al, %s\n", gpr_names[R.reg]);
+    else
+        encode_rm(E, 0, true, 0x0FB6, R.reg, gpr(RAX));
+    copy(E, IR_INT, D, R);
+}
+
+// k when value is 2^k for k from 1 to 31, else 0
+static int power_of_two(int64_t value)
+{
+    if (value < 2 || value > INT32_MAX || (value & (value - 1)))
+        return 0;
+    return __builtin_ctzll(value);
+}
+
+// A short jump with opcode to a place not yet known, giving where its offset goes once land is called there
+static size_t short_jump(emitter *E, uint8_t opcode)
+{
+    code_byte(E, opcode);
+    code_byte(E, 0);
+    return E->W->ncode;
+}
+
+static void land(emitter *E, size_t jump)
+{
+    E->W->code[jump - 1] = (uint8_t)(E->W->ncode - jump);
+}
+
+/*
+idivq B in machine code, made to match the bytecode interpreter where
+idivq would trap: a divisor of 0 is the same run error, called through the
+links with the stack aligned, as it does not return, and a divisor of -1
+wraps around, giving 0 - rax as the quotient and 0 as the remainder.
+*/
+static void checked_divide(emitter *E, unsigned op, location B)
+{
+    ins2(E, X_CMPQ, immediate(0), B);
+    size_t nonzero = short_jump(E, 0x75); // jne
+    ins2(E, X_ANDQ, immediate(-16), gpr(RSP));
+    ins2(E, X_MOVABSQ, immediate((int64_t)(uintptr_t)E->W->links->division_by_zero), gpr(R11));
+    code_bytes(E, "\x41\xFF\xD3", 3); // call *%r11
+    land(E, nonzero);
+    ins2(E, X_CMPQ, immediate(-1), B);
+    size_t divide = short_jump(E, 0x75);
+    if (op == IR_DIV)
+        ins1(E, X_NEGQ, gpr(RAX));
+    else
+        code_bytes(E, "\x31\xD2", 2); // xorl %edx, %edx
+    size_t done = short_jump(E, 0xEB); // jmp
+    land(E, divide);
+    ins1(E, X_IDIVQ, B);
+    land(E, done);
+}
+
+static void emit_int_arithmetic(emitter *E, const ir_inst *I, location D)
+{
+    static const uint8_t ops[] = {[IR_ADD] = X_ADDQ, [IR_SUB] = X_SUBQ, [IR_MUL] = X_IMULQ, [IR_AND] = X_ANDQ, [IR_OR] = X_ORQ};
+    location A = E->locs[I->a], B = E->locs[I->b];
+    int shift = B.kind == LOC_IMM ? power_of_two(B.imm) : 0;
+    if ((I->op == IR_DIV || I->op == IR_MOD) && shift)
+    {
+        // Rounding toward zero adds 2^shift - 1 to negative dividends before shifting them
+        copy(E, IR_INT, gpr(RAX), A);
+        ins2(E, X_MOVQ, gpr(RAX), gpr(R11));
+        ins2(E, X_SARQ, immediate(63), gpr(R11));
+        ins2(E, X_SHRQ, immediate(64 - shift), gpr(R11));
+        ins2(E, X_ADDQ, gpr(R11), gpr(RAX));
+        if (I->op == IR_DIV)
+            ins2(E, X_SARQ, immediate(shift), gpr(RAX));
+        else
+        {
+            ins2(E, X_ANDQ, immediate(-B.imm), gpr(RAX));
+            ins1(E, X_NEGQ, gpr(RAX));
+            ins2(E, X_ADDQ, A, gpr(RAX));
+        }
+        copy(E, IR_INT, D, gpr(RAX));
+        return;
+    }
+    if (I->op == IR_DIV || I->op == IR_MOD)
+    {
+        copy(E, IR_INT, gpr(RAX), A);
+        fixed(E, "\tcqto\n", "\x48\x99", 2);
+        if (B.kind == LOC_IMM)
+        {
+            copy(E, IR_INT, gpr(R11), B);
+            B = gpr(R11);
+        }
+        if (E->W->out)
+            ins1(E, X_IDIVQ, B);
+        else
+            checked_divide(E, I->op, B);
+        copy(E, IR_INT, D, gpr(I->op == IR_DIV ? RAX : RDX));
+        return;
+    }
+    location R = int_result(D);
+    if (B.kind == LOC_GPR && B.reg == R.reg && !(A.kind == LOC_GPR && A.reg == R.reg))
+    {
+        if (I->op == IR_SUB)
+        {
+            copy(E, IR_INT, gpr(R11), B);
+            B = gpr(R11);
+        }
+        else
+        {
+            location swap = A;
+            A = B;
+            B = swap;
+        }
+    }
+    copy(E, IR_INT, R, A);
+    if (I->op == IR_MUL && shift)
+        ins2(E, X_SHLQ, immediate(shift), R);
+    else
+        ins2(E, ops[I->op], B, R);
+    copy(E, IR_INT, D, R);
+}
+
+static void emit_float_arithmetic(emitter *E, const ir_inst *I, location D)
+{
+    static const uint8_t ops[] = {[IR_ADD] = X_ADDSD, [IR_SUB] = X_SUBSD, [IR_MUL] = X_MULSD, [IR_DIV] = X_DIVSD};
+    location A = E->locs[I->a], B = E->locs[I->b];
+    location R = float_result(D);
+    if (B.kind == LOC_XMM && B.reg == R.reg && !(A.kind == LOC_XMM && A.reg == R.reg))
+    {
+        if (I->op == IR_SUB || I->op == IR_DIV)
+        {
+            copy(E, IR_FLOAT, xmm(XMM_SCRATCH), B);
+            B = xmm(XMM_SCRATCH);
+        }
+        else
+        {
+            location swap = A;
+            A = B;
+            B = swap;
+        }
+    }
+    copy(E, IR_FLOAT, R, A);
+    ins2(E, ops[I->op], B, R);
+    copy(E, IR_FLOAT, D, R);
+}
+
+// Restores the callee-saved registers and returns
+static void emit_epilogue(emitter *E)
+{
+    for (int r = 0; r < 16; r++)
+    {
+        if (E->saved[r])
+            ins2(E, X_MOVQ, memory(RBP, E->save_offset[r]), gpr(r));
+    }
+    fixed(E, "\tleave\n\tret\n", "\xC9\xC3", 2);
+}
+
+/*
+System V calls: the first six int arguments go in registers, the first
+eight floats in xmm registers, and the rest on the stack, pushed last to
+first with rsp kept 16-byte aligned. al holds the number of xmm registers
+used, which variadic functions such as printf need.
+*/
+static void emit_call(emitter *E, uint32_t i, location D)
+{
+    ir_function *F = E->F;
+    ir_inst *I = &F->insts[i];
+    move *moves = mem_alloc(MEM_IR, (I->b + 1) * sizeof(move));
+    bool *on_stack = mem_calloc(MEM_IR, I->b + 1, sizeof(bool));
+    uint32_t nmoves = 0, ints = 0, floats = 0, pushed = 0;
+    for (uint32_t k = 0; k < I->b; k++)
+    {
+        uint32_t arg = F->pool[I->a + k];
+        uint8_t type = F->insts[arg].type;
+        if (type == IR_FLOAT && floats < FLOAT_ARGS)
+            moves[nmoves++] = (move){xmm(floats++), E->locs[arg], type};
+        else if (type != IR_FLOAT && ints < INT_ARGS)
+            moves[nmoves++] = (move){gpr(int_args[ints++]), E->locs[arg], type};
+        else
+        {
+            on_stack[k] = true;
+            pushed++;
+        }
+    }
+    if (pushed % 2)
+        ins2(E, X_SUBQ, immediate(8), gpr(RSP));
+    for (uint32_t k = I->b; k-- > 0;)
+    {
+        if (!on_stack[k])
+            continue;
+        location A = E->locs[F->pool[I->a + k]];
+        if (A.kind == LOC_XMM)
+        {
+            ins2(E, X_SUBQ, immediate(8), gpr(RSP));
+            ins2(E, X_MOVSD, A, memory(RSP, 0));
+        }
+        else
+            ins1(E, X_PUSHQ, A);
+    }
+    parallel_copy(E, moves, nmoves);
+    if (floats && E->W->out)
+        fprintf(E->W->out, "\tmovl $%u, %%eax\n", floats);
+    else if (floats)
+    {
+        code_byte(E, 0xB8);
+        code_int(E, floats, 4);
+    }
+    else
+        fixed(E, "\txorl %eax, %eax\n", "\x31\xC0", 2);
+    if (E->W->out)
+    {
+        ir_function *callee = ir_find_function(E->W->M, I->name);
+        fprintf(E->W->out, "\tcall %s%s\n", intern_text(I->name), callee && callee->defined ? "" : "@PLT");
+    }
+    else
+    {
+        // Through the function's entry in the table of the caller of x86_encode: movabsq $entry, %r11; call *(%r11)
+        const x86_links *L = E->W->links;
+        ins2(E, X_MOVABSQ, immediate((int64_t)(uintptr_t)L->entry(L->context, I->name)), gpr(R11));
+        code_bytes(E, "\x41\xFF\x13", 3);
+    }
+    if (pushed)
+        ins2(E, X_ADDQ, immediate((pushed + pushed % 2) * 8), gpr(RSP));
+    if (D.kind != LOC_NONE)
+        copy(E, I->type, D, I->type == IR_FLOAT ? xmm(0) : gpr(RAX));
+    mem_free(moves);
+    mem_free(on_stack);
+}
+
+// Writes the phis of the successor by edge k of block to their places
+static void edge_copies(emitter *E, uint32_t block, uint32_t k)
+{
+    ir_function *F = E->F;
+    uint32_t s = ir_list_at(F, F->blocks[block].succs)[k];
+    uint32_t operand = ir_edge_operand(F, block, k), n = 0;
+    for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+        n++;
+    move *moves = mem_alloc(MEM_IR, (n + 1) * sizeof(move));
+    n = 0;
+    for (uint32_t i = F->blocks[s].first; i && F->insts[i].op == IR_PHI; i = F->insts[i].next)
+    {
+        if (E->locs[i].kind != LOC_NONE)
+            moves[n++] = (move){E->locs[i], E->locs[F->pool[F->insts[i].a + operand]], F->insts[i].type};
+    }
+    parallel_copy(E, moves, n);
+    mem_free(moves);
+}
+
+// Whether a jump to block can be left out, when it is laid out next
+static bool falls_to(const emitter *E, uint32_t block, uint32_t to)
+{
+    uint32_t k = E->rank[block] + 1;
+    return k < E->norder && E->order[k] == to;
+}
+
+// Jumps by edge k of block, unconditionally when cc is negative
+static void jump(emitter *E, int cc, uint32_t block, uint32_t k)
+{
+    uint32_t s = ir_list_at(E->F, E->F->blocks[block].succs)[k];
+    // An edge into phis goes through copies of its own
+    jump_label(E, cc, has_phis(E->F, s) ? edge_label(E, block, k) : s);
+}
+
+static void jump_to(emitter *E, uint32_t block)
+{
+    jump_label(E, -1, block);
+}
+
+/*
+The conditional jump takes one edge and the other follows it in line. When
+only one edge has phis to copy, it is the one in line, and when neither
+has, the one whose block comes next in the layout, by falling through to
+it. The copies of an edge taken by the jump go after the branch.
+*/
+static void emit_branch(emitter *E, uint32_t i)
+{
+    ir_function *F = E->F;
+    ir_inst *I = &F->insts[i];
+    uint32_t b = I->block;
+    int cc = CC_NE;
+    if (E->fused[I->a])
+        cc = E->cond;
+    else
+    {
+        location A = E->locs[I->a];
+        if (A.kind == LOC_GPR)
+            ins2(E, X_TESTQ, A, A);
+        else if (A.kind == LOC_MEM)
+            ins2(E, X_CMPQ, immediate(0), A);
+        else
+        {
+            copy(E, IR_INT, gpr(RAX), A);
+            ins2(E, X_TESTQ, gpr(RAX), gpr(RAX));
+        }
+    }
+    const uint32_t *succs = ir_list_at(F, F->blocks[b].succs);
+    bool phis[2] = {has_phis(F, succs[0]), has_phis(F, succs[1])};
+    uint32_t taken = 0;
+    if ((phis[0] && !phis[1]) || (!phis[0] && !phis[1] && falls_to(E, b, succs[0])))
+    {
+        taken = 1;
+        cc = CC_INVERSE(cc);
+    }
+    uint32_t other = 1 - taken;
+    jump(E, cc, b, taken);
+    edge_copies(E, b, other);
+    if (phis[taken] || !falls_to(E, b, succs[other]))
+        jump_to(E, succs[other]);
+    if (phis[taken])
+    {
+        place_label(E, edge_label(E, b, taken));
+        edge_copies(E, b, taken);
+        if (!falls_to(E, b, succs[taken]))
+            jump_to(E, succs[taken]);
+    }
+}
+
+/*
+A switch indexes a table of the offsets of its cases from the table, after
+checking the index is in it, as position-independent code does. Its
+successors have no phis, so the table points at their blocks.
+*/
+static void emit_switch(emitter *E, uint32_t i)
+{
+    ir_function *F = E->F;
+    ir_inst *I = &F->insts[i];
+    copy(E, IR_INT, gpr(RAX), E->locs[I->a]);
+    if (I->value.i >= INT32_MIN && I->value.i <= INT32_MAX)
+    {
+        if (I->value.i)
+            ins2(E, X_SUBQ, immediate(I->value.i), gpr(RAX));
+    }
+    else
+    {
+        ins2(E, X_MOVABSQ, immediate(I->value.i), gpr(R11));
+        ins2(E, X_SUBQ, gpr(R11), gpr(RAX));
+    }
+    ins2(E, X_CMPQ, immediate(I->b), gpr(RAX));
+    jump_label(E, CC_AE, ir_list_at(F, F->blocks[I->block].succs)[0]);
+    ins2(E, X_LEAQ, (location){LOC_TABLE, 0, (int32_t)i, 0}, gpr(R11));
+    fixed(E, "\tmovslq (%r11,%rax,4), %rax\n", "\x49\x63\x04\x83", 4);
+    ins2(E, X_ADDQ, gpr(R11), gpr(RAX));
+    fixed(E, "\tjmp *%rax\n", "\xFF\xE0", 2);
+}
+
+// The tables of the switches of the function, after its float constants, if it has any
+static void emit_tables(emitter *E, bool constants)
+{
+    ir_function *F = E->F;
+    FILE *out = E->W->out;
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        uint32_t i = F->blocks[E->order[k]].last;
+        if (F->insts[i].op != IR_SWITCH)
+            continue;
+        const ir_inst *I = &F->insts[i];
+        const uint32_t *succs = ir_list_at(F, F->blocks[I->block].succs);
+        if (!out)
+        {
+            while (E->W->ncode % 4)
+                code_byte(E, 0);
+            size_t table = E->W->ncode;
+            E->labels[constant_label(E, i)] = (int64_t)table;
+            for (uint32_t j = 0; j < I->b; j++)
+                code_offset(E, succs[F->pool[I->name + j]], table);
+            continue;
+        }
+        if (!constants)
+            fputs("\t.section .rodata\n", out);
+        constants = true;
+        fprintf(out, "\t.align 4\n.Lt%u_%u:\n", E->index, i);
+        for (uint32_t j = 0; j < I->b; j++)
+        {
+            fputs("\t.long ", out);
+            put_label(E, succs[F->pool[I->name + j]]);
+            fprintf(out, "-.Lt%u_%u\n", E->index, i);
+        }
+    }
+}
+
+static void emit_inst(emitter *E, uint32_t i)
+{
+    ir_function *F = E->F;
+    ir_inst *I = &F->insts[i];
+    location D = E->locs[i], R;
+    if (E->fused[i])
+    {
+        E->cond = compare(E, I);
+        return;
+    }
+    // Constants that are immediates or in memory have no code, nor values nobody uses
+    if (!E->placed[i] && !ir_has_effect(I->op))
+        return;
+    switch (I->op)
+    {
+    case IR_CONST:
+        // Only ints that do not fit 32 bits have a place
+        R = int_result(D);
+        ins2(E, X_MOVABSQ, immediate(I->value.i), R);
+        copy(E, IR_INT, D, R);
+        break;
+    case IR_STRING:
+        R = int_result(D);
+        ins2(E, X_LEAQ, (location){LOC_STRING, 0, 0, I->name}, R);
+        copy(E, IR_INT, D, R);
+        E->W->strings = grow(E->W->strings, E->W->nstrings, &E->W->strings_capacity, sizeof(uint32_t));
+        E->W->strings[E->W->nstrings++] = I->name;
+        break;
+    case IR_GLOBAL:
+        R = int_result(D);
+        ins2(E, X_LEAQ, (location){LOC_SYMBOL, 0, 0, I->name}, R);
+        copy(E, IR_INT, D, R);
+        break;
+    case IR_SLOT:
+        R = int_result(D);
+        ins2(E, X_LEAQ, memory(RBP, E->slots[i]), R);
+        copy(E, IR_INT, D, R);
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+        if (I->type == IR_FLOAT)
+            emit_float_arithmetic(E, I, D);
+        else
+            emit_int_arithmetic(E, I, D);
+        break;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+        emit_compare(E, I, D);
+        break;
+    case IR_NEG:
+        if (I->type == IR_FLOAT)
+        {
+            R = float_result(D);
+            copy(E, IR_FLOAT, R, E->locs[I->a]);
+            ins2(E, X_XORPD, (location){LOC_SIGN, 0, 0, 0}, R);
+            copy(E, IR_FLOAT, D, R);
+            E->W->sign_mask = true;
+            E->sign_mask = true;
+            break;
+        }
+        // Fall through
+    case IR_NOT:
+        R = int_result(D);
+        copy(E, IR_INT, R, E->locs[I->a]);
+        ins1(E, I->op == IR_NEG ? X_NEGQ : X_NOTQ, R);
+        copy(E, IR_INT, D, R);
+        break;
+    case IR_ITOF:
+        R = float_result(D);
+        if (E->locs[I->a].kind == LOC_IMM)
+        {
+            copy(E, IR_INT, gpr(RAX), E->locs[I->a]);
+            ins2(E, X_CVTSI2SDQ, gpr(RAX), R);
+        }
+        else
+            ins2(E, X_CVTSI2SDQ, E->locs[I->a], R);
+        copy(E, IR_FLOAT, D, R);
+        break;
+    case IR_FTOI:
+        R = int_result(D);
+        ins2(E, X_CVTTSD2SIQ, E->locs[I->a], R);
+        copy(E, IR_INT, D, R);
+        break;
+    case IR_LOAD:
+    {
+        location A = address(E, I->a);
+        R = I->type == IR_FLOAT ? float_result(D) : int_result(D);
+        ins2(E, I->type == IR_FLOAT ? X_MOVSD : X_MOVQ, A, R);
+        copy(E, I->type, D, R);
+        break;
+    }
+    case IR_STORE:
+    {
+        location A = address(E, I->a), V = E->locs[I->b];
+        if (F->insts[I->b].type == IR_FLOAT)
+        {
+            if (V.kind != LOC_XMM)
+            {
+                copy(E, IR_FLOAT, xmm(XMM_TEMP), V);
+                V = xmm(XMM_TEMP);
+            }
+            ins2(E, X_MOVSD, V, A);
+        }
+        else
+        {
+            if (V.kind == LOC_MEM)
+            {
+                copy(E, IR_INT, gpr(RAX), V);
+                V = gpr(RAX);
+            }
+            ins2(E, X_MOVQ, V, A);
+        }
+        break;
+    }
+    case IR_CALL:
+        emit_call(E, i, D);
+        break;
+    case IR_JUMP:
+    {
+        uint32_t s = ir_list_at(F, F->blocks[I->block].succs)[0];
+        edge_copies(E, I->block, 0);
+        if (!falls_to(E, I->block, s))
+            jump_to(E, s);
+        break;
+    }
+    case IR_BRANCH:
+        emit_branch(E, i);
+        break;
+    case IR_SWITCH:
+        emit_switch(E, i);
+        break;
+    case IR_RETURN:
+        if (I->a)
+            copy(E, F->type, F->type == IR_FLOAT ? xmm(0) : gpr(RAX), E->locs[I->a]);
+        emit_epilogue(E);
+        break;
+    default:
+        // Phis are written by the edges into their block and parameters by the prologue
+        break;
+    }
+}
+
+/*
+The frame below rbp holds the spilled values, then the callee-saved
+registers in use, then the arrays and structs of the slots. Slots get
+their offsets here.
+*/
+static void lay_out_frame(emitter *E)
+{
+    ir_function *F = E->F;
+    E->slots = mem_calloc(MEM_IR, F->ninsts, sizeof(int32_t));
+    for (int r = 0; r < 16; r++)
+    {
+        if (!E->saved[r])
+            continue;
+        E->frame += 8;
+        E->save_offset[r] = (int32_t)-E->frame;
+    }
+    for (uint32_t k = 0; k < E->norder; k++)
+    {
+        for (uint32_t i = F->blocks[E->order[k]].first; i; i = F->insts[i].next)
+        {
+            ir_inst *I = &F->insts[i];
+            if (I->op != IR_SLOT)
+                continue;
+            E->frame += (I->value.i + 7) & ~(int64_t)7;
+            if (E->frame > INT32_MAX / 2)
+            {
+                fprintf(stderr, "Error: The frame of function %s is too large\n", intern_text(F->name));
+                exit(1);
+            }
+            E->slots[i] = (int32_t)-E->frame;
+        }
+    }
+    E->frame = (E->frame + 15) & ~(int64_t)15;
+}
+
+// Parameters arrive in the registers and stack slots of the calling convention, and move to their places
+static void emit_parameters(emitter *E)
+{
+    ir_function *F = E->F;
+    uint32_t nparams = F->params.count;
+    location *from = mem_alloc(MEM_IR, (nparams + 1) * sizeof(location));
+    uint32_t ints = 0, floats = 0, stacked = 0;
+    for (uint32_t p = 0; p < nparams; p++)
+    {
+        if (ir_list_at(F, F->params)[p] == IR_FLOAT && floats < FLOAT_ARGS)
+            from[p] = xmm(floats++);
+        else if (ir_list_at(F, F->params)[p] != IR_FLOAT && ints < INT_ARGS)
+            from[p] = gpr(int_args[ints++]);
+        else
+            from[p] = memory(RBP, 16 + 8 * stacked++);
+    }
+    move *moves = mem_alloc(MEM_IR, (nparams + 1) * sizeof(move));
+    uint32_t n = 0;
+    for (uint32_t i = F->blocks[0].first; i; i = F->insts[i].next)
+    {
+        ir_inst *I = &F->insts[i];
+        if (I->op == IR_PARAM && E->locs[i].kind != LOC_NONE)
+            moves[n++] = (move){E->locs[i], from[I->value.i], I->type};
+    }
+    parallel_copy(E, moves, n);
+    mem_free(moves);
+    mem_free(from);
+}
+
+// Places the sign mask after the constants if the code needs it, and points the fixups at their labels
+static void finish_code(emitter *E)
+{
+    writer *W = E->W;
+    if (E->sign_mask)
+    {
+        while (W->ncode % 16)
+            code_byte(E, 0);
+        E->labels[sign_label(E)] = (int64_t)W->ncode;
+        code_int(E, 0x8000000000000000u, 8);
+        code_int(E, 0, 8);
+    }
+    for (uint32_t k = 0; k < E->nfixups; k++)
+    {
+        const fixup *x = &E->fixups[k];
+        uint32_t rel = (uint32_t)(int32_t)(E->labels[x->label] - (int64_t)x->base);
+        for (unsigned b = 0; b < 4; b++)
+            W->code[x->at + b] = (uint8_t)(rel >> 8 * b);
+    }
+}
+
+/*
+Stops the run when the frame just made takes rsp below the limit of the
+links, before anything is written to it, with the run error of the
+bytecode interpreter. The call, which does not return, runs on the stack
+of the caller, which was above the limit, aligned.
+*/
+static void check_stack(emitter *E)
+{
+    const x86_links *L = E->W->links;
+    ins2(E, X_MOVABSQ, immediate((int64_t)L->stack_limit), gpr(R11));
+    ins2(E, X_CMPQ, gpr(R11), gpr(RSP));
+    size_t ok = short_jump(E, 0x77); // ja
+    code_byte(E, 0xBF); // movl $name, %edi
+    code_int(E, E->F->name, 4);
+    ins2(E, X_MOVQ, gpr(RBP), gpr(RSP));
+    ins2(E, X_ANDQ, immediate(-16), gpr(RSP));
+    ins2(E, X_MOVABSQ, immediate((int64_t)(uintptr_t)L->stack_overflow), gpr(R11));
+    code_bytes(E, "\x41\xFF\xD3", 3); // call *%r11
+    land(E, ok);
+}
+
+static void emit_function(writer *W, uint32_t index)
+{
+    ir_function *F = &W->M->functions[index];
+    emitter E;
+    memset(&E, 0, sizeof(E));
+    E.W = W;
+    E.F = F;
+    E.index = index;
+    unsigned values = W->stats->values, in_registers = W->stats->in_registers;
+    layout(&E);
+    prepare(&E);
+    intervals(&E);
+    allocate(&E);
+    lay_out_frame(&E);
+
+    FILE *out = W->out;
+    const char *name = intern_text(F->name);
+    if (out)
+    {
+        fprintf(out, "\n# %s: %u values, %u in registers\n", name, W->stats->values - values,
+                W->stats->in_registers - in_registers);
+        fprintf(out, "\t.text\n\t.globl %s\n\t.type %s, @function\n%s:\n", name, name, name);
+    }
+    else
+    {
+        E.labels = mem_alloc(MEM_IR, (sign_label(&E) + 1) * sizeof(int64_t));
+        for (uint32_t l = 0; l <= sign_label(&E); l++)
+            E.labels[l] = -1;
+    }
+    ins1(&E, X_PUSHQ, gpr(RBP));
+    ins2(&E, X_MOVQ, gpr(RSP), gpr(RBP));
+    if (E.frame)
+        ins2(&E, X_SUBQ, immediate(E.frame), gpr(RSP));
+    if (!out && W->links->stack_limit)
+        check_stack(&E);
+    for (int r = 0; r < 16; r++)
+    {
+        if (E.saved[r])
+            ins2(&E, X_MOVQ, gpr(r), memory(RBP, E.save_offset[r]));
+    }
+    emit_parameters(&E);
+    for (uint32_t k = 0; k < E.norder; k++)
+    {
+        uint32_t b = E.order[k];
+        place_label(&E, b);
+        for (uint32_t i = F->blocks[b].first; i; i = F->insts[i].next)
+            emit_inst(&E, i);
+    }
+    if (out)
+        fprintf(out, "\t.size %s, .-%s\n", name, name);
+
+    bool constants = false;
+    for (uint32_t i = 1; i < F->ninsts; i++)
+    {
+        if (E.locs[i].kind != LOC_FCONST || !E.uses[i])
+            continue;
+        uint64_t bits;
+        memcpy(&bits, &F->insts[i].value.d, sizeof(bits));
+        if (!out)
+        {
+            // Constants follow the code, 8-byte aligned
+            while (W->ncode % 8)
+                code_byte(&E, 0);
+            E.labels[constant_label(&E, i)] = (int64_t)W->ncode;
+            code_int(&E, bits, 8);
+            continue;
+        }
+        if (!constants)
+            fputs("\t.section .rodata\n\t.align 8\n", out);
+        constants = true;
+        fprintf(out, ".Lf%u_%u:\n\t.quad %llu\n", index, i, (unsigned long long)bits);
+    }
+    emit_tables(&E, constants);
+    if (!out)
+        finish_code(&E);
+
+    mem_free(E.order);
+    mem_free(E.rank);
+    mem_free(E.from);
+    mem_free(E.to);
+    mem_free(E.pos);
+    mem_free(E.start);
+    mem_free(E.end);
+    mem_free(E.uses);
+    mem_free(E.fused);
+    mem_free(E.placed);
+    mem_free(E.locs);
+    mem_free(E.calls);
+    mem_free(E.slots);
+    mem_free(E.labels);
+    mem_free(E.fixups);
+}
+
+static void emit_globals(writer *W)
+{
+    ir_module *M = W->M;
+    for (uint32_t g = 0; g < M->nglobals; g++)
+    {
+        ir_global *G = &M->globals[g];
+        const char *name = intern_text(G->name);
+        fprintf(W->out, "\t%s\n\t.globl %s\n\t.align 8\n%s:\n", G->type == IR_VOID ? ".bss" : ".data", name, name);
+        if (G->type == IR_VOID)
+            fprintf(W->out, "\t.zero %u\n", G->size);
+        else
+        {
+            uint64_t bits;
+            memcpy(&bits, &G->init, sizeof(bits));
+            fprintf(W->out, "\t.quad %llu\n", (unsigned long long)bits);
+        }
+    }
+}
+
+static int by_id(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void emit_strings(writer *W)
+{
+    if (W->nstrings)
+        qsort(W->strings, W->nstrings, sizeof(uint32_t), by_id);
+    for (uint32_t k = 0; k < W->nstrings; k++)
+    {
+        if (k && W->strings[k] == W->strings[k - 1])
+            continue;
+        const unsigned char *text = (const unsigned char *)intern_text(W->strings[k]);
+        size_t length = intern_length(W->strings[k]);
+        fprintf(W->out, "\t.section .rodata\n.Ls%u:\n\t.string \"", W->strings[k]);
+        for (size_t c = 0; c < length; c++)
+        {
+            if (text[c] < 32 || text[c] > 126 || text[c] == '"' || text[c] == '\\')
+                fprintf(W->out, "\\%03o", text[c]);
+            else
+                fputc(text[c], W->out);
+        }
+        fputs("\"\n", W->out);
+    }
+}
+
+void x86_emit(ir_module *M, FILE *out, bool naive, x86_stats *stats)
+{
+    writer W;
+    memset(&W, 0, sizeof(W));
+    W.M = M;
+    W.out = out;
+    W.naive = naive;
+    W.stats = stats;
+    memset(stats, 0, sizeof(*stats));
+    fprintf(out, "# %s, %s\n", M->filename, naive ? "every value in the frame" : "linear scan register allocation");
+    emit_globals(&W);
+    for (uint32_t f = 0; f < M->nfunctions; f++)
+    {
+        if (!M->functions[f].defined)
+            continue;
+        emit_function(&W, f);
+        stats->functions++;
+    }
+    emit_strings(&W);
+    if (W.sign_mask)
+        fputs("\t.section .rodata\n\t.align 16\n.Lsign:\n\t.quad 0x8000000000000000, 0\n", out);
+    fputs("\t.section .note.GNU-stack,\"\",@progbits\n", out);
+    mem_free(W.strings);
+}
+
+uint8_t *x86_encode(ir_module *M, uint32_t index, const x86_links *links, x86_stats *stats, size_t *size)
+{
+    writer W;
+    memset(&W, 0, sizeof(W));
+    W.M = M;
+    W.links = links;
+    W.stats = stats;
+    emit_function(&W, index);
+    stats->functions++;
+    mem_free(W.strings);
+    *size = W.ncode;
+    return W.code;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h> // For FILE type
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifndef X86_H
+#define X86_H
+
+#include "ir.h"
+
+/*
+x86-64 assembly for the System V ABI, in the GNU assembler's syntax, from
+the optimized IR of a module. Values get registers by linear scan over
+their live intervals, and the rest stack slots. Ints are 64 bits and
+floats are doubles, so calls to C functions such as printf work as long as
+they take ints (%ld), doubles and strings.
+*/
+typedef struct {
+    unsigned functions;
+    unsigned values; // Values that needed a place to live
+    unsigned in_registers;
+    unsigned spilled;
+} x86_stats;
+
+// Writes M to out. naive keeps every value in the stack frame, as the baseline the allocator is measured against
+void x86_emit(ir_module *M, FILE *out, bool naive, x86_stats *stats);
+
+// What machine code refers to outside of itself, as its addresses are known
+typedef struct {
+    char **globals; // Memory of each global, indexed like the module's globals
+    // The pointer a call of the function name jumps through
+    void **(*entry)(void *context, uint32_t name);
+    void *context;
+    void (*division_by_zero)(void); // Reports an integer division by zero, never to return
+    uintptr_t stack_limit; // Lowest rsp a function may leave its prologue with, unchecked when 0
+    void (*stack_overflow)(uint32_t name); // Reports function name going below it, never to return
+} x86_links;
+
+/*
+Machine code for function index of M, as x86_emit would write it, for
+running in this process, but with integer division and the depth of the
+stack checked the way the bytecode interpreter does it. It only refers to itself relative to rip, so it
+can go anywhere. Returns it in memory of its own, of size bytes, and adds
+to stats.
+*/
+uint8_t *x86_encode(ir_module *M, uint32_t index, const x86_links *links, x86_stats *stats, size_t *size);
+
+#endif